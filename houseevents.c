@@ -0,0 +1,710 @@
+/* houseevents - A tool to read the HouseSaga log files.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * houseevents.c - Print log records with a user-friendly timestamp.
+ *
+ * This tool replaces the original events.tcl script. The syntax is:
+ *
+ *    houseevents [-e|-s|-t|-m] [-root=PATH] [-host=NAME] [-app=NAME]
+ *                [-level=NAME] [-from=TIME] [-to=TIME] [-threads=N]
+ *                [year [month [day]]]
+ *
+ * The log files of each day are read in memory (mapped if not compressed),
+ * converted and filtered by worker threads, one day per thread at a time.
+ * The main thread prints the result of each day in chronological order.
+ *
+ * The conversion of a timestamp to the local date and time uses a cache
+ * of the start of the current day, so that the C library is only called
+ * once per day. This cache is not used on the days when the UTC offset
+ * changes (daylight saving time).
+ *
+ * A compressed file (e.g. event.csv.gz) is read if the uncompressed file
+ * is not present.
+ *
+ * When the traces are split into one file per level, the traces from all
+ * the files of the same day are merged in chronological order.
+ */
+
+#define _GNU_SOURCE // For memmem() and tm_gmtoff.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <zlib.h>
+
+#define DAYS_AHEAD 4 // How many days each thread may run ahead of output.
+
+static const char *LogRoot = "/var/lib/house/log";
+
+static const char *FileType = "event.csv";
+static int FileIsPrefix = 0; // For the split trace files: trace*.csv.
+static int FileIsJson = 0;   // metrics.json: one JSON object per line.
+
+static const char *FilterHost = 0;
+static const char *FilterApp = 0;
+static const char *FilterLevel = 0;
+
+#define TIME_NONE      0
+#define TIME_OF_DAY    1 // Seconds since midnight, every day.
+#define TIME_ABSOLUTE  2 // UNIX time.
+
+static int  FilterFromType = TIME_NONE;
+static long FilterFrom = 0;
+static int  FilterToType = TIME_NONE;
+static long FilterTo = 0;
+
+// The list of days to print, and the output of each day.
+//
+struct DayOutput {
+    char  path[1024];
+    char *text;
+    size_t length;
+    size_t size;
+    int   done;
+};
+
+static struct DayOutput *Days = 0;
+static int DaysCount = 0;
+static int DaysSize = 0;
+
+static int DayNext = 0;    // Next day to process.
+static int DayPrinted = 0; // Next day to print.
+static pthread_mutex_t DayLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  DayChanged = PTHREAD_COND_INITIALIZER;
+
+// The per-thread timestamp conversion cache.
+//
+struct DayCache {
+    time_t start; // Local midnight.
+    time_t end;   // Next local midnight.
+    int uniform;  // No UTC offset change during that day.
+    char date[16];
+};
+
+static void houseevents_output (struct DayOutput *day,
+                                const char *data, size_t length) {
+    if (day->length + length + 1 > day->size) {
+        day->size = day->length + length + 65536;
+        day->text = realloc (day->text, day->size);
+    }
+    memcpy (day->text + day->length, data, length);
+    day->length += length;
+}
+
+static void houseevents_cache (struct DayCache *cache, time_t timestamp) {
+
+    struct tm local;
+    localtime_r (&timestamp, &local);
+    long offset = local.tm_gmtoff;
+
+    strftime (cache->date, sizeof(cache->date), "%m/%d/%Y", &local);
+    local.tm_hour = local.tm_min = local.tm_sec = 0;
+    local.tm_isdst = -1;
+    cache->start = mktime (&local);
+    local.tm_mday += 1;
+    local.tm_isdst = -1;
+    cache->end = mktime (&local);
+
+    struct tm last;
+    time_t before = cache->end - 1;
+    localtime_r (&before, &last);
+    localtime_r (&(cache->start), &local);
+    cache->uniform = (local.tm_gmtoff == offset) && (last.tm_gmtoff == offset);
+}
+
+/* Format the date and time of a timestamp in the MM/DD/YYYY HH:MM:SS format.
+ * Return the number of seconds since midnight.
+ */
+static long houseevents_localtime (struct DayCache *cache, time_t timestamp,
+                                   char *buffer, int size) {
+
+    if ((timestamp < cache->start) || (timestamp >= cache->end)) {
+        houseevents_cache (cache, timestamp);
+    }
+    if (!cache->uniform) {
+        struct tm local;
+        localtime_r (&timestamp, &local);
+        strftime (buffer, size, "%m/%d/%Y %T", &local);
+        return (local.tm_hour * 60 + local.tm_min) * 60 + local.tm_sec;
+    }
+    long seconds = (long)(timestamp - cache->start);
+    snprintf (buffer, size, "%s %02ld:%02ld:%02ld", cache->date,
+              seconds / 3600, (seconds / 60) % 60, seconds % 60);
+    return seconds;
+}
+
+static int houseevents_intime (time_t timestamp, long timeofday) {
+
+    switch (FilterFromType) {
+        case TIME_OF_DAY: if (timeofday < FilterFrom) return 0; break;
+        case TIME_ABSOLUTE: if (timestamp < FilterFrom) return 0; break;
+    }
+    switch (FilterToType) {
+        case TIME_OF_DAY: if (timeofday > FilterTo) return 0; break;
+        case TIME_ABSOLUTE: if (timestamp > FilterTo) return 0; break;
+    }
+    return 1;
+}
+
+/* Return true if the CSV field at the specified index matches the value.
+ */
+static int houseevents_field (const char *line, const char *eol,
+                              int index, const char *value) {
+    while (index > 0) {
+        line = memchr (line, ',', eol - line);
+        if (!line) return 0;
+        line += 1;
+        index -= 1;
+    }
+    const char *end = memchr (line, ',', eol - line);
+    if (!end) end = eol;
+    if (*line == '"') {
+        line += 1;
+        if ((end > line) && (end[-1] == '"')) end -= 1;
+    }
+    size_t length = strlen (value);
+    return ((end - line) == length) && (!strncasecmp (line, value, length));
+}
+
+/* Return the value of the specified JSON item, or null if not found.
+ * This is a light scan, the metrics objects are not fully decoded.
+ */
+static const char *houseevents_jsonitem (const char *line, const char *eol,
+                                         const char *name) {
+    char pattern[128];
+    int length = snprintf (pattern, sizeof(pattern), "\"%s\"", name);
+    const char *cursor = line;
+    while (cursor < eol) {
+        cursor = memmem (cursor, eol - cursor, pattern, length);
+        if (!cursor) return 0;
+        cursor += length;
+        while ((cursor < eol) && isspace((unsigned char)(*cursor))) cursor += 1;
+        if ((cursor >= eol) || (*cursor != ':')) continue; // Not a name.
+        cursor += 1;
+        while ((cursor < eol) && isspace((unsigned char)(*cursor))) cursor += 1;
+        return cursor;
+    }
+    return 0;
+}
+
+/* Return true if the JSON text contains the item with the specified value.
+ */
+static int houseevents_json (const char *line, const char *eol,
+                             const char *name, const char *value) {
+    const char *cursor = houseevents_jsonitem (line, eol, name);
+    if ((!cursor) || (*cursor != '"')) return 0;
+    cursor += 1;
+    size_t length = strlen (value);
+    return (eol - cursor > length) &&
+           (!strncmp (cursor, value, length)) && (cursor[length] == '"');
+}
+
+static void houseevents_csvline (struct DayOutput *day, struct DayCache *cache,
+                                 int istrace,
+                                 const char *line, const char *eol) {
+
+    if (!isdigit((unsigned char)(*line))) return; // Header.
+
+    if (FilterHost && (!houseevents_field (line, eol, 1, FilterHost))) return;
+    if (FilterApp && (!houseevents_field (line, eol, 2, FilterApp))) return;
+    if (FilterLevel) {
+        if (!istrace) return;
+        if (!houseevents_field (line, eol, 5, FilterLevel)) return;
+    }
+
+    time_t timestamp = 0;
+    const char *cursor = line;
+    while (isdigit((unsigned char)(*cursor)))
+        timestamp = timestamp * 10 + *(cursor++) - '0';
+    const char *fraction = 0;
+    if (*cursor == '.') {
+        fraction = ++cursor;
+        while (isdigit((unsigned char)(*cursor))) cursor += 1;
+    }
+    if (*cursor != ',') return; // Not a valid timestamp.
+
+    char date[64];
+    long timeofday = houseevents_localtime (cache, timestamp, date, sizeof(date));
+    if (!houseevents_intime (timestamp, timeofday)) return;
+
+    houseevents_output (day, date, strlen(date));
+    if (fraction) houseevents_output (day, fraction - 1, cursor - fraction + 1);
+    houseevents_output (day, cursor, eol - cursor);
+    houseevents_output (day, "\n", 1);
+}
+
+static void houseevents_jsonline (struct DayOutput *day, struct DayCache *cache,
+                                  const char *line, const char *eol) {
+
+    if (*line != '{') return;
+    if (FilterHost && (!houseevents_json (line, eol, "host", FilterHost))) return;
+    if (FilterApp && (!houseevents_json (line, eol, "app", FilterApp))) return;
+    if (FilterLevel) return;
+
+    const char *cursor = houseevents_jsonitem (line, eol, "timestamp");
+    if ((!cursor) || (!isdigit((unsigned char)(*cursor)))) return;
+    time_t timestamp = atoll (cursor);
+    if (timestamp > 100000000000LL) timestamp /= 1000; // Milliseconds.
+
+    char date[64];
+    long timeofday = houseevents_localtime (cache, timestamp, date, sizeof(date));
+    if (!houseevents_intime (timestamp, timeofday)) return;
+
+    houseevents_output (day, date, strlen(date));
+    houseevents_output (day, ",", 1);
+    houseevents_output (day, line, eol - line);
+    houseevents_output (day, "\n", 1);
+}
+
+/* Read a whole compressed file into memory.
+ */
+static char *houseevents_gunzip (const char *path, size_t *length) {
+
+    gzFile gz = gzopen (path, "r");
+    if (!gz) return 0;
+
+    size_t size = 0;
+    char *data = 0;
+    *length = 0;
+    for (;;) {
+        if (*length + 65536 > size) {
+            size = *length + 1024 * 1024;
+            data = realloc (data, size);
+        }
+        int read = gzread (gz, data + *length, size - *length);
+        if (read <= 0) break;
+        *length += read;
+    }
+    gzclose (gz);
+    return data;
+}
+
+static void houseevents_file (struct DayOutput *day, struct DayCache *cache,
+                              const char *path, int compressed, int istrace) {
+
+    size_t length = 0;
+    char *data = 0;
+    int mapped = 0;
+
+    if (compressed) {
+        data = houseevents_gunzip (path, &length);
+    } else {
+        int fd = open (path, O_RDONLY);
+        if (fd < 0) return;
+        struct stat info;
+        if ((!fstat (fd, &info)) && (info.st_size > 0)) {
+            length = info.st_size;
+            data = mmap (0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) data = 0;
+            else {
+                madvise (data, length, MADV_SEQUENTIAL);
+                mapped = 1;
+            }
+        }
+        close (fd);
+    }
+    if (!data) return;
+
+    const char *cursor = data;
+    const char *end = data + length;
+    while (cursor < end) {
+        const char *eol = memchr (cursor, '\n', end - cursor);
+        if (!eol) eol = end;
+        if (FileIsJson)
+            houseevents_jsonline (day, cache, cursor, eol);
+        else
+            houseevents_csvline (day, cache, istrace, cursor, eol);
+        cursor = eol + 1;
+    }
+    if (mapped) munmap (data, length);
+    else free (data);
+}
+
+static int houseevents_select (const char *name, int *compressed) {
+
+    int length = strlen (name);
+    *compressed = 0;
+    if ((length > 3) && (!strcmp (name + length - 3, ".gz"))) {
+        *compressed = 1;
+        length -= 3;
+    }
+    if (FileIsPrefix) {
+        // trace.csv, trace-info.csv, etc.
+        int prefix = strlen (FileType);
+        return (length >= prefix + 4) &&
+               (!strncmp (name, FileType, prefix)) &&
+               (!strncmp (name + length - 4, ".csv", 4));
+    }
+    return (length == strlen(FileType)) && (!strncmp (name, FileType, length));
+}
+
+static int houseevents_alphasort (const struct dirent **a,
+                                  const struct dirent **b) {
+    return strcmp ((*a)->d_name, (*b)->d_name);
+}
+
+struct DayLine {
+    const char *text;
+    size_t length;
+    int index;
+};
+
+static int houseevents_linecmp (const void *a, const void *b) {
+    const struct DayLine *la = (const struct DayLine *)a;
+    const struct DayLine *lb = (const struct DayLine *)b;
+    // All lines start with the same date, the time is fixed width.
+    size_t length = (la->length < lb->length) ? la->length : lb->length;
+    const char *ca = memchr (la->text, ',', la->length);
+    const char *cb = memchr (lb->text, ',', lb->length);
+    if (ca && cb) {
+        size_t ta = ca - la->text;
+        size_t tb = cb - lb->text;
+        length = (ta < tb) ? ta : tb;
+        int delta = memcmp (la->text, lb->text, length);
+        if (delta) return delta;
+        if (ta != tb) return (ta < tb) ? -1 : 1;
+    } else {
+        int delta = memcmp (la->text, lb->text, length);
+        if (delta) return delta;
+    }
+    return la->index - lb->index;
+}
+
+/* Merge the output from multiple files in chronological order.
+ */
+static void houseevents_sortday (struct DayOutput *day) {
+
+    int count = 0;
+    int size = 0;
+    struct DayLine *lines = 0;
+    const char *cursor = day->text;
+    const char *end = day->text + day->length;
+
+    while (cursor < end) {
+        const char *eol = memchr (cursor, '\n', end - cursor);
+        if (!eol) eol = end - 1;
+        if (count >= size) {
+            size += 4096;
+            lines = realloc (lines, size * sizeof(struct DayLine));
+        }
+        lines[count].text = cursor;
+        lines[count].length = eol - cursor + 1;
+        lines[count].index = count;
+        count += 1;
+        cursor = eol + 1;
+    }
+    qsort (lines, count, sizeof(struct DayLine), houseevents_linecmp);
+
+    char *sorted = malloc (day->size);
+    size_t length = 0;
+    int i;
+    for (i = 0; i < count; ++i) {
+        memcpy (sorted + length, lines[i].text, lines[i].length);
+        length += lines[i].length;
+    }
+    free (lines);
+    free (day->text);
+    day->text = sorted;
+}
+
+static void houseevents_day (struct DayOutput *day, struct DayCache *cache) {
+
+    struct dirent **list;
+    int count = scandir (day->path, &list, 0, houseevents_alphasort);
+    if (count < 0) return;
+
+    int i;
+    int files = 0;
+    for (i = 0; i < count; ++i) {
+        int compressed;
+        const char *name = list[i]->d_name;
+        if (houseevents_select (name, &compressed)) {
+            // Do not read a file twice when both forms are present.
+            if (compressed && (i > 0)) {
+                int length = strlen (name) - 3;
+                const char *previous = list[i-1]->d_name;
+                if ((strlen (previous) == length) &&
+                    (!strncmp (previous, name, length))) continue;
+            }
+            char path[1300];
+            snprintf (path, sizeof(path), "%s/%s", day->path, name);
+            houseevents_file (day, cache, path, compressed, FileIsPrefix);
+            files += 1;
+        }
+    }
+    for (i = 0; i < count; ++i) free (list[i]);
+    free (list);
+
+    if ((files > 1) && (day->length > 0)) houseevents_sortday (day);
+}
+
+static void *houseevents_worker (void *context) {
+
+    struct DayCache cache = {0, 0, 0, ""};
+
+    for (;;) {
+        pthread_mutex_lock (&DayLock);
+        while ((DayNext < DaysCount) && (DayNext >= DayPrinted + DAYS_AHEAD))
+            pthread_cond_wait (&DayChanged, &DayLock);
+        int index = DayNext++;
+        pthread_mutex_unlock (&DayLock);
+
+        if (index >= DaysCount) break;
+        houseevents_day (Days + index, &cache);
+
+        pthread_mutex_lock (&DayLock);
+        Days[index].done = 1;
+        pthread_cond_broadcast (&DayChanged);
+        pthread_mutex_unlock (&DayLock);
+    }
+    return 0;
+}
+
+static void houseevents_add (const char *path) {
+    if (DaysCount >= DaysSize) {
+        DaysSize += 64;
+        Days = realloc (Days, DaysSize * sizeof(struct DayOutput));
+    }
+    struct DayOutput *day = Days + DaysCount++;
+    memset (day, 0, sizeof(*day));
+    snprintf (day->path, sizeof(day->path), "%s", path);
+}
+
+static int houseevents_isnumber (const struct dirent *entry) {
+    const char *name = entry->d_name;
+    if (!*name) return 0;
+    for (; *name; ++name) if (!isdigit((unsigned char)(*name))) return 0;
+    return 1;
+}
+
+/* Build the list of day folders below the specified path, in order.
+ * The depth is the number of levels of folders below that path.
+ */
+static void houseevents_walk (const char *path, int depth) {
+
+    if (depth <= 0) {
+        houseevents_add (path);
+        return;
+    }
+    struct dirent **list;
+    int count = scandir (path, &list, houseevents_isnumber, houseevents_alphasort);
+    if (count < 0) return;
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        char subpath[1024];
+        snprintf (subpath, sizeof(subpath), "%s/%s", path, list[i]->d_name);
+        houseevents_walk (subpath, depth - 1);
+        free (list[i]);
+    }
+    free (list);
+}
+
+/* A personal convention is to store the logs on a large secondary storage
+ * (as <mount point>/house/log) when running on a Raspberry Pi, where the
+ * boot storage is a Micro SD that should not be continuously written to.
+ * Only use that location if it has the data being looked for.
+ */
+static void houseevents_search (char *path, int size, const char *local) {
+
+    snprintf (path, size, "%s/%s", LogRoot, local);
+
+    FILE *mounts = fopen ("/proc/mounts", "r");
+    if (!mounts) return;
+
+    char line[1024];
+    while (fgets (line, sizeof(line), mounts)) {
+        char device[256];
+        char mount[512];
+        char type[64];
+        if (sscanf (line, "%255s %511s %63s", device, mount, type) != 3) continue;
+        if ((!strcmp (type, "tmpfs")) || (!strcmp (type, "devtmpfs"))) continue;
+
+        char candidate[1024];
+        snprintf (candidate, sizeof(candidate), "%s%shouse/log/%s", mount,
+                  (mount[strlen(mount)-1] == '/') ? "" : "/", local);
+        struct stat info;
+        if ((!stat (candidate, &info)) && S_ISDIR(info.st_mode)) {
+            snprintf (path, size, "%s", candidate);
+            break;
+        }
+    }
+    fclose (mounts);
+}
+
+static int houseevents_time (const char *text, long *value) {
+
+    int year, month, day, hour = 0, minute = 0, second = 0;
+
+    if (sscanf (text, "%d-%d-%d%*[ T]%d:%d:%d",
+                &year, &month, &day, &hour, &minute, &second) >= 3) {
+        struct tm local = {0};
+        local.tm_year = year - 1900;
+        local.tm_mon = month - 1;
+        local.tm_mday = day;
+        local.tm_hour = hour;
+        local.tm_min = minute;
+        local.tm_sec = second;
+        local.tm_isdst = -1;
+        *value = (long) mktime (&local);
+        return TIME_ABSOLUTE;
+    }
+    if (sscanf (text, "%d:%d:%d", &hour, &minute, &second) >= 2) {
+        *value = (hour * 60 + minute) * 60 + second;
+        return TIME_OF_DAY;
+    }
+    fprintf (stderr, "invalid time %s\n", text);
+    exit (1);
+}
+
+static void houseevents_help (const char *name) {
+    printf ("%s [-e|-s|-t|-m] [options] [year [month [day]]]\n", name);
+    printf ("  -e              Show events (default)\n");
+    printf ("  -s              Show sensor data\n");
+    printf ("  -t              Show traces\n");
+    printf ("  -m              Show metrics\n");
+    printf ("  -root=PATH      Root of the log tree\n");
+    printf ("  -host=NAME      Only show records from this host\n");
+    printf ("  -app=NAME       Only show records from this application\n");
+    printf ("  -level=NAME     Only show traces of this level\n");
+    printf ("  -from=TIME      Only show records at or after this time\n");
+    printf ("  -to=TIME        Only show records at or before this time\n");
+    printf ("  -threads=N      Number of days processed in parallel\n");
+    printf ("TIME is either HH:MM[:SS] (every day) or YYYY-MM-DD[ HH:MM[:SS]]\n");
+}
+
+int main (int argc, const char **argv) {
+
+    int i;
+    int dates[3];
+    int datecount = 0;
+    int threads = sysconf (_SC_NPROCESSORS_ONLN);
+    int searchmounts = 1;
+
+    for (i = 1; i < argc; ++i) {
+        const char *option = argv[i];
+        if (!strcmp (option, "-h")) {
+            houseevents_help (argv[0]);
+            return 0;
+        }
+        if (!strcmp (option, "-e")) {
+            FileType = "event.csv";
+            FileIsPrefix = FileIsJson = 0;
+        } else if (!strcmp (option, "-s")) {
+            FileType = "sensor.csv";
+            FileIsPrefix = FileIsJson = 0;
+        } else if (!strcmp (option, "-t")) {
+            FileType = "trace";
+            FileIsPrefix = 1;
+            FileIsJson = 0;
+        } else if (!strcmp (option, "-m")) {
+            FileType = "metrics.json";
+            FileIsPrefix = 0;
+            FileIsJson = 1;
+        } else if (!strncmp (option, "-root=", 6)) {
+            LogRoot = option + 6;
+            searchmounts = 0;
+        } else if (!strncmp (option, "-host=", 6)) {
+            FilterHost = option + 6;
+        } else if (!strncmp (option, "-app=", 5)) {
+            FilterApp = option + 5;
+        } else if (!strncmp (option, "-level=", 7)) {
+            FilterLevel = option + 7;
+        } else if (!strncmp (option, "-from=", 6)) {
+            FilterFromType = houseevents_time (option + 6, &FilterFrom);
+        } else if (!strncmp (option, "-to=", 4)) {
+            FilterToType = houseevents_time (option + 4, &FilterTo);
+        } else if (!strncmp (option, "-threads=", 9)) {
+            threads = atoi (option + 9);
+        } else if (isdigit((unsigned char)(option[0]))) {
+            if (datecount < 3) dates[datecount++] = atoi (option);
+        }
+    }
+    if (threads < 1) threads = 1;
+
+    char local[64];
+    int depth = 0;
+    if (datecount <= 0) {
+        time_t now = time(0);
+        struct tm today;
+        localtime_r (&now, &today);
+        snprintf (local, sizeof(local), "%04d/%02d/%02d",
+                  today.tm_year + 1900, today.tm_mon + 1, today.tm_mday);
+    } else if (datecount == 1) {
+        snprintf (local, sizeof(local), "%04d", dates[0]);
+        depth = 2;
+    } else if (datecount == 2) {
+        snprintf (local, sizeof(local), "%04d/%02d", dates[0], dates[1]);
+        depth = 1;
+    } else {
+        snprintf (local, sizeof(local), "%04d/%02d/%02d",
+                  dates[0], dates[1], dates[2]);
+    }
+
+    char path[1024];
+    if (searchmounts)
+        houseevents_search (path, sizeof(path), local);
+    else
+        snprintf (path, sizeof(path), "%s/%s", LogRoot, local);
+
+    houseevents_walk (path, depth);
+    if (DaysCount <= 0) return 0;
+    if (threads > DaysCount) threads = DaysCount;
+
+    pthread_t *workers = calloc (threads, sizeof(pthread_t));
+    for (i = 0; i < threads; ++i) {
+        pthread_create (workers + i, 0, houseevents_worker, 0);
+    }
+
+    for (i = 0; i < DaysCount; ++i) {
+        pthread_mutex_lock (&DayLock);
+        while (!Days[i].done) pthread_cond_wait (&DayChanged, &DayLock);
+        pthread_mutex_unlock (&DayLock);
+
+        if (Days[i].length > 0) {
+            if (fwrite (Days[i].text, 1, Days[i].length, stdout) < Days[i].length)
+                exit (0); // The output was closed, e.g. piped to head.
+        }
+        free (Days[i].text);
+        Days[i].text = 0;
+
+        pthread_mutex_lock (&DayLock);
+        DayPrinted = i + 1;
+        pthread_cond_broadcast (&DayChanged);
+        pthread_mutex_unlock (&DayLock);
+    }
+    for (i = 0; i < threads; ++i) pthread_join (workers[i], 0);
+    free (workers);
+    fflush (stdout);
+    return 0;
+}
+
@@ -22,10 +22,25 @@
  *
  * SYNOPSYS:
  *
+ * void housesaga_schedule (time_t deadline, housesaga_scheduled *action);
+ *
+ *    Request the action to be called at the specified time, or soon after.
+ *    An action is scheduled only once: if it was already scheduled, it will
+ *    be called at the earliest of the two deadlines. A deadline in the past
+ *    means the next second. An action that must run periodically must
+ *    schedule itself again each time it is called.
+ *
+ * NOTE:
+ *
+ *    The scheduled actions are stored in a timer wheel, with one slot per
+ *    second. A deadline beyond the wheel's span stays in its slot until
+ *    the wheel comes around enough times. Each tick only visits the slots
+ *    for the elapsed seconds, so that an idle service does almost nothing.
  */
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
@@ -43,12 +58,122 @@
 #include "houselog.h"
 #include "houseconfig.h"
 
+#include "housesaga.h"
 #include "housesaga_storage.h"
+#include "housesaga_latency.h"
 #include "housesaga_trace.h"
+#include "housesaga_index.h"
 #include "housesaga_sensor.h"
+#include "housesaga_series.h"
 #include "housesaga_event.h"
 #include "housesaga_metrics.h"
 #include "housesaga_traffic.h"
+#include "housesaga_source.h"
+#include "housesaga_parser.h"
+#include "housesaga_bulk.h"
+#include "housesaga_udp.h"
+#include "housesaga_dedup.h"
+#include "housesaga_digest.h"
+#include "housesaga_fanin.h"
+#include "housesaga_import.h"
+#include "housesaga_finalize.h"
+
+#define SCHEDULE_WHEEL 64 // Seconds.
+#define SCHEDULE_MAX   16
+
+struct ScheduledAction {
+    housesaga_scheduled *action;
+    time_t deadline; // 0 if not scheduled.
+    int next;        // Next action in the same wheel slot, -1 if last.
+};
+
+static struct ScheduledAction ScheduleActions[SCHEDULE_MAX];
+static int ScheduleCount = 0;
+
+static int ScheduleWheel[SCHEDULE_WHEEL];
+static time_t ScheduleNow = 0;
+
+static void housesaga_schedule_unlink (int index) {
+
+    int *link = ScheduleWheel
+                    + (ScheduleActions[index].deadline % SCHEDULE_WHEEL);
+    while (*link >= 0) {
+        if (*link == index) {
+            *link = ScheduleActions[index].next;
+            break;
+        }
+        link = &(ScheduleActions[*link].next);
+    }
+    ScheduleActions[index].deadline = 0;
+}
+
+void housesaga_schedule (time_t deadline, housesaga_scheduled *action) {
+
+    int i;
+    if (!ScheduleCount) {
+        for (i = 0; i < SCHEDULE_WHEEL; ++i) ScheduleWheel[i] = -1;
+    }
+
+    for (i = 0; i < ScheduleCount; ++i) {
+        if (ScheduleActions[i].action == action) break;
+    }
+    if (i >= ScheduleCount) {
+        if (ScheduleCount >= SCHEDULE_MAX) return; // Should never happen.
+        ScheduleActions[i].action = action;
+        ScheduleActions[i].deadline = 0;
+        ScheduleCount += 1;
+    }
+    struct ScheduledAction *scheduled = ScheduleActions + i;
+
+    if (deadline <= ScheduleNow) deadline = ScheduleNow + 1;
+
+    if (scheduled->deadline) {
+        if (scheduled->deadline <= deadline) return; // Already sooner.
+        housesaga_schedule_unlink (i);
+    }
+    int slot = (int)(deadline % SCHEDULE_WHEEL);
+    scheduled->deadline = deadline;
+    scheduled->next = ScheduleWheel[slot];
+    ScheduleWheel[slot] = i;
+}
+
+/* Call all the actions that are due. The actions are called in the order
+ * they were first scheduled, after the wheel has been advanced, so that
+ * an action may schedule itself again.
+ */
+static void housesaga_schedule_run (time_t now) {
+
+    if (now <= ScheduleNow) return;
+    if (!ScheduleCount) {
+        ScheduleNow = now;
+        return;
+    }
+
+    long elapsed = (long)(now - ScheduleNow);
+    if (elapsed > SCHEDULE_WHEEL) elapsed = SCHEDULE_WHEEL;
+
+    int due[SCHEDULE_MAX];
+    memset (due, 0, sizeof(due));
+
+    long t;
+    for (t = (long)now - elapsed + 1; t <= (long)now; ++t) {
+        int index = ScheduleWheel[t % SCHEDULE_WHEEL];
+        while (index >= 0) {
+            int next = ScheduleActions[index].next;
+            if (ScheduleActions[index].deadline <= now) {
+                housesaga_schedule_unlink (index);
+                due[index] = 1;
+            }
+            index = next;
+        }
+    }
+    ScheduleNow = now;
+
+    int i;
+    for (i = 0; i < ScheduleCount; ++i) {
+        if (due[i]) ScheduleActions[i].action (now);
+    }
+}
 
 static void housesaga_background (int fd, int mode) {
 
@@ -59,9 +184,8 @@ static void housesaga_background (int fd, int mode) {
     LastFlush = now;
 
     houseportal_background (now);
-    housesaga_event_background (now);
-    housesaga_sensor_background (now);
-    housesaga_traffic_background (now);
+    housesaga_traffic_background (now); // First: the other modules count.
+    housesaga_schedule_run (now);
 }
 
 static void housesaga_protect (const char *method, const char *uri) {
@@ -75,6 +199,40 @@ const char *housesaga_host (void) {
     return LocalHost;
 }
 
+/* Report the state of the live buffers and the storage I/O statistics.
+ */
+static const char *housesaga_health (const char *method, const char *uri,
+                                     const char *data, int length) {
+
+    static char buffer[65537];
+    static ParserToken token[1024];
+    static char pool[65537];
+
+    ParserContext context = echttp_json_start (token, 1024, pool, sizeof(pool));
+
+    int root = echttp_json_add_object (context, 0, 0);
+    echttp_json_add_string (context, root, "host", housesaga_host());
+    echttp_json_add_integer (context, root, "timestamp", (long long)time(0));
+    int top = echttp_json_add_object (context, root, "saga");
+
+    int buffers = echttp_json_add_array (context, top, "buffers");
+    housesaga_event_health (context, buffers);
+    housesaga_sensor_health (context, buffers);
+    housesaga_trace_health (context, buffers);
+    housesaga_metrics_health (context, buffers);
+
+    int storage = echttp_json_add_array (context, top, "storage");
+    housesaga_storage_health (context, storage);
+
+    const char *error = echttp_json_export (context, buffer, sizeof(buffer));
+    if (error) {
+        echttp_error (500, error);
+        return "";
+    }
+    echttp_content_type_json ();
+    return buffer;
+}
+
 const static char *HousePortal = 0;
 
 const char *housesaga_portal (void) {
@@ -95,6 +253,12 @@ int main (int argc, const char **argv) {
 
     signal(SIGPIPE, SIG_IGN);
 
+    if ((argc > 1) && (!strcmp (argv[1], "import"))) {
+        return housesaga_import_main (argc, argv);
+    }
+
+    housesaga_storage_configure (argc, argv); // Before the live buffers.
+
     echttp_default ("-http-service=dynamic");
 
     echttp_open (argc, argv);
@@ -110,12 +274,38 @@ int main (int argc, const char **argv) {
     echttp_cors_allow_method("GET");
     echttp_protect (0, housesaga_protect);
 
+    housesaga_latency_initialize (argc, argv);
     housesaga_trace_initialize (argc, argv);
     housesaga_event_initialize (argc, argv);
     housesaga_sensor_initialize (argc, argv);
+    housesaga_series_initialize (argc, argv);
     housesaga_metrics_initialize (argc, argv);
     housesaga_storage_initialize (argc, argv);
+    housesaga_index_initialize (argc, argv);
+    housesaga_finalize_initialize (argc, argv);
     housesaga_traffic_initialize (argc, argv);
+    housesaga_source_initialize (argc, argv);
+    housesaga_dedup_initialize (argc, argv);
+    housesaga_parser_initialize (argc, argv);
+    housesaga_bulk_initialize (argc, argv);
+    housesaga_udp_initialize (argc, argv);
+    housesaga_digest_initialize (argc, argv);
+    housesaga_fanin_initialize (argc, argv);
+
+    // Each module schedules its own next run when called.
+    time_t now = time(0);
+    housesaga_schedule (now, housesaga_trace_background);
+    housesaga_schedule (now, housesaga_event_background);
+    housesaga_schedule (now, housesaga_sensor_background);
+    housesaga_schedule (now, housesaga_series_background);
+    housesaga_schedule (now, housesaga_metrics_background);
+    housesaga_schedule (now, housesaga_storage_background);
+    housesaga_schedule (now, housesaga_index_background);
+    housesaga_schedule (now, housesaga_finalize_background);
+    housesaga_schedule (now, housesaga_dedup_background);
+
+    housesaga_latency_route ("/saga/log/health", housesaga_health);
+    housesaga_latency_route ("/log/health", housesaga_health);
 
     echttp_static_route ("/", "/usr/local/share/house/public");
     echttp_background (&housesaga_background);
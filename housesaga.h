@@ -24,3 +24,6 @@
 const char *housesaga_host (void);
 const char *housesaga_portal (void);
 
+typedef void housesaga_scheduled (time_t now);
+void housesaga_schedule (time_t deadline, housesaga_scheduled *action);
+
@@ -0,0 +1,209 @@
+/* housesaga - A log consolidation and storage service.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesaga_bench.c - Compare the cost of decoding JSON and MessagePack.
+ *
+ * This small tool builds the same batch of sensor records in both
+ * formats, and then decodes each one many times through the parser
+ * module, the same way as the web API does.
+ *
+ * SYNOPSYS:
+ *
+ *    housesagabench [-records=N] [-iterations=N]
+ *
+ *    The default is 100 records per batch and 20000 iterations.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+
+#include "housesaga.h"
+#include "housesaga_parser.h"
+
+static long long BenchRecords = 0;
+static long long BenchChecksum = 0;
+static long long BenchErrors = 0;   // Records decoded with a wrong field.
+static int BenchFailed = 0;
+
+const char *housesaga_host (void) {
+    return "bench";
+}
+
+void houselog_trace (const char *file, int line, const char *level,
+                     const char *object, const char *format, ...) {
+}
+
+static int housesaga_bench_is (const char *value, const char *expected) {
+    return value && (!strcmp (value, expected));
+}
+
+/* Count the records, and check that the fields were decoded correctly,
+ * so that a decoder regression fails the benchmark.
+ */
+static void housesaga_bench_apply (const struct HouseSagaBatch *batch) {
+    int i;
+    int valid = housesaga_bench_is (batch->host, "bench") &&
+                housesaga_bench_is (batch->app, "weather");
+    for (i = 0; i < batch->count; ++i) {
+        const struct HouseSagaRecord *record = batch->record + i;
+        BenchRecords += 1;
+        BenchChecksum += record->timestamp.tv_sec;
+        if ((!valid) ||
+            (!housesaga_bench_is (record->text[1], "outside")) ||
+            (!housesaga_bench_is (record->text[2], "temperature")) ||
+            (!housesaga_bench_is (record->text[4], "C")))
+            BenchErrors += 1;
+    }
+}
+
+static int housesaga_bench_json (char *buffer, int size, int records) {
+
+    int length = snprintf (buffer, size,
+                           "{\"host\":\"bench\",\"apps\":[\"weather\"],"
+                           "\"weather\":{\"sensor\":[");
+    int i;
+    for (i = 0; i < records; ++i) {
+        length += snprintf (buffer + length, size - length,
+                            "%s[%lld,\"outside\",\"temperature\",\"%d.%d\",\"C\"]",
+                            i ? "," : "", 1700000000000LL + i * 1000,
+                            15 + (i % 10), i % 10);
+    }
+    length += snprintf (buffer + length, size - length, "]}}");
+    return length;
+}
+
+static int housesaga_bench_msgpack_string (unsigned char *buffer,
+                                           const char *s) {
+    int length = strlen(s);
+    buffer[0] = 0xa0 | length; // fixstr: all strings here are short.
+    memcpy (buffer + 1, s, length);
+    return length + 1;
+}
+
+static int housesaga_bench_msgpack (unsigned char *buffer, int records) {
+
+    int length = 0;
+    int i, j;
+    char value[16];
+
+    buffer[length++] = 0x83; // fixmap, 3 items.
+    length += housesaga_bench_msgpack_string (buffer + length, "host");
+    length += housesaga_bench_msgpack_string (buffer + length, "bench");
+    length += housesaga_bench_msgpack_string (buffer + length, "app");
+    length += housesaga_bench_msgpack_string (buffer + length, "weather");
+    length += housesaga_bench_msgpack_string (buffer + length, "sensor");
+    buffer[length++] = 0xdd; // array 32.
+    for (j = 3; j >= 0; --j) buffer[length++] = (records >> (j * 8)) & 0xff;
+
+    for (i = 0; i < records; ++i) {
+        long long timestamp = 1700000000000LL + i * 1000;
+        buffer[length++] = 0x95; // fixarray, 5 items.
+        buffer[length++] = 0xcf; // uint 64.
+        for (j = 7; j >= 0; --j) buffer[length++] = (timestamp >> (j * 8)) & 0xff;
+        length += housesaga_bench_msgpack_string (buffer + length, "outside");
+        length += housesaga_bench_msgpack_string (buffer + length, "temperature");
+        snprintf (value, sizeof(value), "%d.%d", 15 + (i % 10), i % 10);
+        length += housesaga_bench_msgpack_string (buffer + length, value);
+        length += housesaga_bench_msgpack_string (buffer + length, "C");
+    }
+    return length;
+}
+
+static double housesaga_bench_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec / 1000000000.0);
+}
+
+static void housesaga_bench_run (int type, int format, const char *name,
+                                 const char *data, int length,
+                                 int records, int iterations) {
+
+    BenchRecords = 0;
+    BenchErrors = 0;
+    double start = housesaga_bench_now ();
+    int i;
+    for (i = 0; i < iterations; ++i) {
+        housesaga_parser_submit_format (type, format, data, length);
+    }
+    double elapsed = housesaga_bench_now () - start;
+
+    if (BenchRecords != (long long)records * iterations) {
+        printf ("%-12s decoded %lld records, expected %lld\n",
+                name, BenchRecords, (long long)records * iterations);
+        BenchFailed = 1;
+        return;
+    }
+    if (BenchErrors) {
+        printf ("%-12s decoded %lld records with invalid fields\n",
+                name, BenchErrors);
+        BenchFailed = 1;
+        return;
+    }
+    printf ("%-12s %8d bytes %10.2f us/batch %8.1f ns/record %12.0f records/s\n",
+            name, length,
+            elapsed * 1000000.0 / iterations,
+            elapsed * 1000000000.0 / BenchRecords,
+            BenchRecords / elapsed);
+}
+
+int main (int argc, const char **argv) {
+
+    int i;
+    const char *value;
+    int records = 100;
+    int iterations = 20000;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-records=", argv[i], &value)) {
+            records = atoi (value);
+        } else if (echttp_option_match ("-iterations=", argv[i], &value)) {
+            iterations = atoi (value);
+        }
+    }
+    if (records <= 0) records = 1;
+    if (iterations <= 0) iterations = 1;
+
+    int type = housesaga_parser_register ("parse:sensor", "sensor",
+                                          housesaga_bench_apply);
+
+    int size = records * 96 + 256;
+    char *json = malloc (size);
+    int jsonlength = housesaga_bench_json (json, size, records);
+    unsigned char *msgpack = malloc (size);
+    int msgpacklength = housesaga_bench_msgpack (msgpack, records);
+
+    printf ("%d records per batch, %d iterations\n", records, iterations);
+    housesaga_bench_run (type, HOUSESAGA_PARSER_JSON, "JSON",
+                         json, jsonlength, records, iterations);
+    housesaga_bench_run (type, HOUSESAGA_PARSER_MSGPACK, "MessagePack",
+                         (const char *)msgpack, msgpacklength,
+                         records, iterations);
+    return (BenchChecksum && (!BenchFailed)) ? 0 : 1;
+}
+
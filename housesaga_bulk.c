@@ -0,0 +1,273 @@
+/* housesaga - A log consolidation and storage service.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesaga_bulk.c - Bulk ingestion of newline-delimited records.
+ *
+ * This module accepts a stream of JSON records, one per line, of any
+ * type and from any source, optionally compressed using gzip.
+ *
+ * SYNOPSYS:
+ *
+ * void housesaga_bulk_initialize (int argc, const char **argv);
+ *
+ *    Register the bulk ingestion web API.
+ *
+ * NOTE:
+ *
+ *    Each line is a JSON object with the following items:
+ *      type:   the record type, i.e. "events", "sensor" or "traces".
+ *      host:   the name of the host that produced the record.
+ *      app:    the name of the application that produced the record.
+ *      record: the record itself, as an array, same as in the standard
+ *              envelope used by the individual endpoints.
+ *
+ *    The stream is decoded one line at a time, using a small token array.
+ *    The consecutive lines with the same type, host and app are applied
+ *    as one batch. The lines are copied to an arena that is reused
+ *    once full: the decoded strings point to that arena.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include <zlib.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+#include "houselog.h"
+
+#include "housesaga.h"
+#include "housesaga_bulk.h"
+#include "housesaga_parser.h"
+#include "housesaga_traffic.h"
+#include "housesaga_latency.h"
+
+#define BULK_ARENA   262144
+#define BULK_LINE    16384 // The longest line accepted.
+#define BULK_RECORDS 256
+#define BULK_TOKENS  64
+
+static char BulkArena[BULK_ARENA];
+static int  BulkArenaUsed = 0;
+
+static struct HouseSagaRecord BulkRecords[BULK_RECORDS];
+static struct HouseSagaBatch  BulkBatch;
+
+// A line that spans two chunks of decompressed data.
+static char BulkLine[BULK_LINE];
+static int  BulkLineLength = 0;
+static int  BulkLineOverflow = 0;
+
+static long BulkAccepted = 0; // Current request only.
+static long BulkRejected = 0; // Current request only.
+
+static int TrafficBulkAccepted = -1;
+static int TrafficBulkRejected = -1;
+
+static void housesaga_bulk_flush (void) {
+    if (BulkBatch.count > 0) housesaga_parser_deliver (&BulkBatch);
+    BulkBatch.count = 0;
+}
+
+static void housesaga_bulk_reject (void) {
+    BulkRejected += 1;
+    housesaga_traffic_increment (TrafficBulkRejected);
+}
+
+static const char *housesaga_bulk_string (const ParserToken *token,
+                                          const char *path) {
+    int item = echttp_json_search (token, path);
+    if ((item < 0) || (token[item].type != PARSER_STRING)) return 0;
+    return token[item].value.string;
+}
+
+static void housesaga_bulk_line (const char *line, int length) {
+
+    while ((length > 0) && isspace(line[length-1])) length -= 1;
+    if (length <= 0) return; // Empty lines are ignored.
+
+    if (length >= BULK_LINE) {
+        housesaga_bulk_reject ();
+        return;
+    }
+    if ((BulkArenaUsed + length + 1 > BULK_ARENA) ||
+        (BulkBatch.count >= BULK_RECORDS)) {
+        housesaga_bulk_flush ();
+        BulkArenaUsed = 0;
+    }
+    char *copy = BulkArena + BulkArenaUsed;
+    memcpy (copy, line, length);
+    copy[length] = 0;
+
+    ParserToken token[BULK_TOKENS];
+    int count = BULK_TOKENS;
+    if (echttp_json_parse (copy, token, &count)) {
+        housesaga_bulk_reject ();
+        return;
+    }
+
+    const char *key = housesaga_bulk_string (token, ".type");
+    const char *host = housesaga_bulk_string (token, ".host");
+    const char *app = housesaga_bulk_string (token, ".app");
+    int record = echttp_json_search (token, ".record");
+    int type = key ? housesaga_parser_find (key) : -1;
+    if ((type < 0) || (!host) || (!app) ||
+        (record < 0) || (token[record].type != PARSER_ARRAY)) {
+        housesaga_bulk_reject ();
+        return;
+    }
+
+    if ((BulkBatch.count > 0) &&
+        ((type != BulkBatch.type) ||
+         strcmp (host, BulkBatch.host) || strcmp (app, BulkBatch.app))) {
+        // The previous batch is applied, but its lines remain in the arena
+        // until it is full, since the current line is stored after them.
+        housesaga_bulk_flush ();
+    }
+    BulkArenaUsed += length + 1;
+
+    BulkBatch.type = type;
+    BulkBatch.host = host;
+    BulkBatch.app = app;
+    housesaga_parser_record (token + record, BulkRecords + BulkBatch.count);
+    BulkBatch.count += 1;
+
+    BulkAccepted += 1;
+    housesaga_traffic_increment (TrafficBulkAccepted);
+}
+
+/* Split the data into lines. A line may span several chunks.
+ */
+static void housesaga_bulk_feed (const char *data, int length) {
+
+    while (length > 0) {
+        const char *eol = memchr (data, '\n', length);
+        int size = eol ? (int)(eol - data) : length;
+
+        if (BulkLineLength + size < BULK_LINE) {
+            if (BulkLineLength > 0 || !eol) {
+                memcpy (BulkLine + BulkLineLength, data, size);
+                BulkLineLength += size;
+            }
+        } else {
+            BulkLineOverflow = 1;
+        }
+        if (!eol) return; // The rest of the line is in the next chunk.
+
+        if (BulkLineOverflow) {
+            housesaga_bulk_reject ();
+        } else if (BulkLineLength > 0) {
+            housesaga_bulk_line (BulkLine, BulkLineLength);
+        } else {
+            housesaga_bulk_line (data, size); // The most common case.
+        }
+        BulkLineLength = 0;
+        BulkLineOverflow = 0;
+        data += size + 1;
+        length -= size + 1;
+    }
+}
+
+static const char *housesaga_bulk_inflate (const char *data, int length) {
+
+    static char chunk[65536];
+    z_stream stream;
+
+    memset (&stream, 0, sizeof(stream));
+    if (inflateInit2 (&stream, 16 + MAX_WBITS) != Z_OK)
+        return "cannot initialize gzip decoder";
+
+    stream.next_in = (Bytef *)data;
+    stream.avail_in = length;
+    int status;
+    do {
+        stream.next_out = (Bytef *)chunk;
+        stream.avail_out = sizeof(chunk);
+        status = inflate (&stream, Z_NO_FLUSH);
+        if ((status != Z_OK) && (status != Z_STREAM_END)) break;
+        housesaga_bulk_feed (chunk, sizeof(chunk) - stream.avail_out);
+    } while ((status == Z_OK) && (stream.avail_in > 0 || stream.avail_out == 0));
+
+    inflateEnd (&stream);
+    if (status != Z_STREAM_END) return "invalid gzip data";
+    return 0;
+}
+
+static const char *housesaga_bulk_post (const char *method, const char *uri,
+                                        const char *data, int length) {
+
+    static char buffer[256];
+
+    if (strcmp (method, "POST")) return ""; // Only POST is supported.
+
+    BulkAccepted = BulkRejected = 0;
+    BulkLineLength = BulkLineOverflow = 0;
+    BulkBatch.record = BulkRecords;
+    BulkBatch.count = 0;
+    BulkArenaUsed = 0;
+
+    const char *error = 0;
+    const char *encoding = echttp_attribute_get ("Content-Encoding");
+    if (encoding && (!strcasecmp (encoding, "gzip"))) {
+        error = housesaga_bulk_inflate (data, length);
+    } else if (encoding && strcasecmp (encoding, "identity")) {
+        echttp_error (415, "Unsupported content encoding");
+        return "";
+    } else {
+        housesaga_bulk_feed (data, length);
+    }
+    if (BulkLineOverflow) {
+        housesaga_bulk_reject ();
+    } else if (BulkLineLength > 0) {
+        housesaga_bulk_line (BulkLine, BulkLineLength); // No final newline.
+    }
+    housesaga_bulk_flush ();
+
+    if (error) {
+        echttp_error (400, error);
+        return "";
+    }
+    snprintf (buffer, sizeof(buffer),
+              "{\"host\":\"%s\",\"timestamp\":%lld,"
+              "\"accepted\":%ld,\"rejected\":%ld}",
+              housesaga_host(), (long long)time(0), BulkAccepted, BulkRejected);
+    echttp_content_type_json ();
+    return buffer;
+}
+
+void housesaga_bulk_initialize (int argc, const char **argv) {
+
+    TrafficBulkAccepted = housesaga_traffic_register ("BulkAccepted");
+    TrafficBulkRejected = housesaga_traffic_register ("BulkRejected");
+
+    housesaga_latency_route ("/saga/log/bulk", housesaga_bulk_post);
+
+    // Alternate path for application-independent web pages.
+    // (The log files are stored at the same place for all applications.)
+    //
+    housesaga_latency_route ("/log/bulk", housesaga_bulk_post);
+}
+
@@ -0,0 +1,187 @@
+/* housesaga - A log consolidation and storage service.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesaga_dedup.c - Detect records that were received twice.
+ *
+ * Clients retry when a request times out, and may resend their buffered
+ * records after a restart. This module remembers the records received
+ * recently, so that the duplicates can be ignored.
+ *
+ * SYNOPSYS:
+ *
+ * void housesaga_dedup_initialize (int argc, const char **argv);
+ *
+ *    Set the duplicate detection window, from the -dedup-window=N option
+ *    (in seconds). The default is 600 seconds. A window of 0 disables
+ *    duplicate detection.
+ *
+ * housesaga_dedup_key housesaga_dedup_start (const char *kind,
+ *                                            const struct timeval *timestamp,
+ *                                            const char *host, const char *app);
+ *
+ *    Start the calculation of the key for a new record. The kind
+ *    separates the record types, e.g. an event and a trace never match.
+ *
+ * housesaga_dedup_key housesaga_dedup_text (housesaga_dedup_key key,
+ *                                           const char *text);
+ *
+ * housesaga_dedup_key housesaga_dedup_integer (housesaga_dedup_key key,
+ *                                              long long value);
+ *
+ *    Add one field of the record to the key.
+ *
+ * int housesaga_dedup_seen (housesaga_dedup_key key);
+ *
+ *    Return 1 if the same record was received recently, 0 otherwise.
+ *    A new record is remembered.
+ *
+ * void housesaga_dedup_background (time_t now);
+ *
+ *    Forget the oldest records once the window has elapsed.
+ *
+ * NOTE:
+ *
+ *    The records are remembered as 64 bit hashes in two fixed size hash
+ *    tables: the current generation, where new records are added, and
+ *    the previous generation. When the window has elapsed, or when the
+ *    current table is half full, the previous generation is cleared and
+ *    becomes the current one. A record is thus remembered for at least
+ *    one window, unless the traffic fills a table faster. The memory used
+ *    never grows, and each search only visits a few consecutive slots.
+ *
+ *    Two different records could have the same hash, but the probability
+ *    is negligible with 64 bits and a few thousand records.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "echttp.h"
+
+#include "housesaga.h"
+#include "housesaga_dedup.h"
+
+#define DEDUP_SIZE 32768 // Must be a power of 2.
+#define DEDUP_LOAD (DEDUP_SIZE / 2)
+
+#define DEDUP_FNV_BASIS 14695981039346656037ULL
+#define DEDUP_FNV_PRIME 1099511628211ULL
+
+static housesaga_dedup_key DedupSet[2][DEDUP_SIZE];
+static int DedupCount[2];
+static int DedupCurrent = 0;
+
+static int DedupWindow = 600;
+static time_t DedupRotated = 0;
+
+static housesaga_dedup_key housesaga_dedup_bytes (housesaga_dedup_key key,
+                                                  const void *data, int size) {
+    const unsigned char *byte = (const unsigned char *)data;
+    while (size-- > 0) {
+        key ^= *(byte++);
+        key *= DEDUP_FNV_PRIME;
+    }
+    return key;
+}
+
+housesaga_dedup_key housesaga_dedup_text (housesaga_dedup_key key,
+                                          const char *text) {
+    // Include the terminating null, so that ("ab", "c") != ("a", "bc").
+    if (!text) return housesaga_dedup_bytes (key, "\377", 1);
+    return housesaga_dedup_bytes (key, text, strlen(text) + 1);
+}
+
+housesaga_dedup_key housesaga_dedup_integer (housesaga_dedup_key key,
+                                             long long value) {
+    return housesaga_dedup_bytes (key, &value, sizeof(value));
+}
+
+housesaga_dedup_key housesaga_dedup_start (const char *kind,
+                                           const struct timeval *timestamp,
+                                           const char *host, const char *app) {
+    housesaga_dedup_key key = housesaga_dedup_text (DEDUP_FNV_BASIS, kind);
+    key = housesaga_dedup_integer (key, (long long)(timestamp->tv_sec));
+    key = housesaga_dedup_integer (key, (long long)(timestamp->tv_usec));
+    key = housesaga_dedup_text (key, host);
+    return housesaga_dedup_text (key, app);
+}
+
+static void housesaga_dedup_rotate (time_t now) {
+    DedupCurrent ^= 1;
+    memset (DedupSet[DedupCurrent], 0, sizeof(DedupSet[DedupCurrent]));
+    DedupCount[DedupCurrent] = 0;
+    DedupRotated = now;
+}
+
+/* Search for the key in one generation. Return the slot where the key
+ * was found, or else the empty slot where it could be added.
+ */
+static int housesaga_dedup_search (const housesaga_dedup_key *set,
+                                   housesaga_dedup_key key) {
+    int i = (int)(key & (DEDUP_SIZE - 1));
+    while (set[i] && (set[i] != key)) i = (i + 1) & (DEDUP_SIZE - 1);
+    return i;
+}
+
+int housesaga_dedup_seen (housesaga_dedup_key key) {
+
+    if (DedupWindow <= 0) return 0;
+    if (!key) key = 1; // 0 marks an empty slot.
+
+    housesaga_dedup_key *previous = DedupSet[DedupCurrent ^ 1];
+    if (previous[housesaga_dedup_search (previous, key)]) return 1;
+
+    housesaga_dedup_key *current = DedupSet[DedupCurrent];
+    int i = housesaga_dedup_search (current, key);
+    if (current[i]) return 1;
+
+    current[i] = key;
+    if (++DedupCount[DedupCurrent] >= DEDUP_LOAD)
+        housesaga_dedup_rotate (time(0));
+    return 0;
+}
+
+void housesaga_dedup_background (time_t now) {
+
+    if (DedupWindow <= 0) return;
+
+    if (now >= DedupRotated + DedupWindow) housesaga_dedup_rotate (now);
+    housesaga_schedule (DedupRotated + DedupWindow,
+                        housesaga_dedup_background);
+}
+
+void housesaga_dedup_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *window;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-dedup-window=", argv[i], &window)) {
+            DedupWindow = atoi (window);
+            continue;
+        }
+    }
+    DedupRotated = time(0);
+}
+
@@ -0,0 +1,36 @@
+/* housesaga - A log consolidation and storage service.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * housesaga_dedup.h - Detect records that were received twice.
+ */
+typedef unsigned long long housesaga_dedup_key;
+
+void housesaga_dedup_initialize (int argc, const char **argv);
+
+housesaga_dedup_key housesaga_dedup_start (const char *kind,
+                                           const struct timeval *timestamp,
+                                           const char *host, const char *app);
+housesaga_dedup_key housesaga_dedup_text (housesaga_dedup_key key,
+                                          const char *text);
+housesaga_dedup_key housesaga_dedup_integer (housesaga_dedup_key key,
+                                             long long value);
+int  housesaga_dedup_seen (housesaga_dedup_key key);
+
+void housesaga_dedup_background (time_t now);
+
@@ -0,0 +1,1005 @@
+/* housesaga - A log consolidation and storage service.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesaga_digest.c - Compare and repair the log files between instances.
+ *
+ * The clients send their logs to every HouseSaga instance, but an
+ * instance that was stopped for a while misses the records sent during
+ * that time. This module finds and recovers these missing records from
+ * another instance (a peer), without transferring whole log files.
+ *
+ * SYNOPSYS:
+ *
+ * void housesaga_digest_initialize (int argc, const char **argv);
+ *
+ *    Register the digest and sync web API.
+ *
+ * void housesaga_digest_saved (const char *logtype,
+ *                              int year, int month, int day,
+ *                              time_t timestamp, const char *record,
+ *                              int written);
+ *
+ *    Account for a record that was just written to a log file. Written is
+ *    the number of bytes added to the file, including the header, if any.
+ *    This is called by the storage module.
+ *
+ * NOTE:
+ *
+ *    Each CSV log file of a day is divided in 15 minutes buckets, based on
+ *    each record's timestamp. The digest of a bucket is the number of
+ *    records and the sum of the 64 bit hashes of these records (the whole
+ *    CSV line). A sum does not depend on the order of the records, so two
+ *    files that contain the same records in different orders still have
+ *    the same digest. The digest of the file is a hash of the digests of
+ *    all its buckets.
+ *
+ *    Comparing two instances goes from the top down: first compare the
+ *    file digests for a day, then the bucket digests for each file that
+ *    differs, then transfer the records of each bucket that differs.
+ *    The records that are not present locally are appended to the local
+ *    log file. Recent buckets are not compared, since their records may
+ *    still be in memory, waiting to be saved.
+ *
+ *    The digests of the recently used files are kept in a small cache.
+ *    A cached digest is updated when records are saved to its file. If
+ *    the file grew otherwise, only the records added are read. The digest
+ *    is rebuilt only when the file was replaced, truncated or deleted.
+ *
+ *    Only one sync operation runs at a time. The requests to the peer are
+ *    asynchronous and sent one at a time. The local files are read in the
+ *    background, one file per second, so that a sync does not delay the
+ *    web requests.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <time.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+#include "echttp_libc.h"
+#include "houselog.h"
+
+#include "housesaga.h"
+#include "housesaga_digest.h"
+#include "housesaga_storage.h"
+#include "housesaga_latency.h"
+
+#define DIGEST_PERIOD  900 // 15 minutes per bucket.
+#define DIGEST_BUCKETS 100 // Up to 25 hours, for daylight saving time.
+#define DIGEST_CACHE   32
+#define DIGEST_TYPES   32
+#define DIGEST_SETTLE  600 // Do not repair buckets more recent than this.
+
+#define DIGEST_FNV_BASIS 14695981039346656037ULL
+#define DIGEST_FNV_PRIME 1099511628211ULL
+
+struct DigestBucket {
+    long long count;
+    unsigned long long sum;
+};
+
+struct DigestFile {
+    int date; // YYYYMMDD, 0 if this cache entry is not used.
+    char type[32];
+    time_t midnight;
+    long long size; // Expected size of the log file.
+    long long inode;
+    time_t used;
+    struct DigestBucket bucket[DIGEST_BUCKETS];
+};
+
+static struct DigestFile DigestCache[DIGEST_CACHE];
+
+// The state of the current (or last) sync operation.
+//
+struct SyncLine {
+    int bucket;
+    int matched;
+    unsigned long long hash;
+};
+
+static char SyncPeer[256];
+static char SyncDate[16];
+static int  SyncYear, SyncMonth, SyncDay;
+static int  SyncActive = 0;
+static const char *SyncError = 0;
+static time_t SyncStarted = 0;
+static time_t SyncEnded = 0;
+
+static char SyncTypes[DIGEST_TYPES][32];
+static int  SyncTypesCount = 0;
+static int  SyncTypesCursor = 0;
+
+// The peer's digests, waiting to be compared with the local files.
+static char SyncCandidates[DIGEST_TYPES][32];
+static char SyncCandidateDigests[DIGEST_TYPES][20];
+static int  SyncCandidatesCount = 0;
+static int  SyncCandidatesCursor = 0;
+
+static struct DigestBucket SyncRemote[DIGEST_BUCKETS];
+static int  SyncRemoteCount = 0;
+
+#define SYNC_IDLE    0
+#define SYNC_FILES   1 // Compare the file digests.
+#define SYNC_BUCKETS 2 // Compare the bucket digests of one file.
+static int  SyncStage = SYNC_IDLE;
+
+static int  SyncBuckets[DIGEST_BUCKETS];
+static int  SyncBucketsCount = 0;
+static int  SyncBucketsCursor = 0;
+
+static struct SyncLine *SyncLocal = 0;
+static int SyncLocalCount = 0;
+static int SyncLocalSize = 0;
+
+static long SyncRequests = 0;
+static long long SyncBytes = 0;
+static long SyncCompared = 0; // Files compared.
+static long SyncPulled = 0;   // Buckets transferred.
+static long long SyncAdded = 0;
+
+static unsigned long long housesaga_digest_hash (const char *line, int length) {
+    unsigned long long hash = DIGEST_FNV_BASIS;
+    while (length-- > 0) {
+        hash ^= (unsigned char)(*(line++));
+        hash *= DIGEST_FNV_PRIME;
+    }
+    return hash;
+}
+
+/* Return the timestamp of a CSV record, or -1 if this is not a record
+ * (e.g. the header line).
+ */
+static time_t housesaga_digest_timestamp (const char *line) {
+    if (!isdigit((unsigned char)(line[0]))) return -1;
+    return (time_t)atoll (line);
+}
+
+static time_t housesaga_digest_midnight (int year, int month, int day) {
+    struct tm local;
+    memset (&local, 0, sizeof(local));
+    local.tm_year = year - 1900;
+    local.tm_mon = month - 1;
+    local.tm_mday = day;
+    local.tm_isdst = -1;
+    return mktime (&local);
+}
+
+static int housesaga_digest_slot (time_t midnight, time_t timestamp) {
+    long slot = (long)(timestamp - midnight) / DIGEST_PERIOD;
+    if (slot < 0) return 0;
+    if (slot >= DIGEST_BUCKETS) return DIGEST_BUCKETS - 1;
+    return (int)slot;
+}
+
+static void housesaga_digest_path (char *buffer, int size,
+                                   int year, int month, int day,
+                                   const char *type) {
+    int length = housesaga_storage_daypath (buffer, size, year, month, day);
+    snprintf (buffer + length, size - length, "/%s.csv", type);
+}
+
+/* Only accept type names that match the log file names generated
+ * by HouseSaga: this is used to build a file path.
+ */
+static int housesaga_digest_validtype (const char *type) {
+    if ((!type) || (!type[0]) || (strlen(type) >= 32)) return 0;
+    for (; *type; ++type) {
+        if ((!isalnum((unsigned char)(*type))) && (*type != '-')) return 0;
+    }
+    return 1;
+}
+
+static unsigned long long housesaga_digest_root (const struct DigestFile *file) {
+    unsigned long long hash = DIGEST_FNV_BASIS;
+    int i;
+    for (i = 0; i < DIGEST_BUCKETS; ++i) {
+        const struct DigestBucket *bucket = file->bucket + i;
+        const unsigned char *p = (const unsigned char *)bucket;
+        int j;
+        for (j = 0; j < sizeof(*bucket); ++j) {
+            hash ^= p[j];
+            hash *= DIGEST_FNV_PRIME;
+        }
+    }
+    return hash;
+}
+
+static long long housesaga_digest_records (const struct DigestFile *file) {
+    long long count = 0;
+    int i;
+    for (i = 0; i < DIGEST_BUCKETS; ++i) count += file->bucket[i].count;
+    return count;
+}
+
+/* Read a log file from the specified offset, calling the visitor for each
+ * record. Return the size of the file.
+ */
+typedef void housesaga_digest_visitor (time_t timestamp,
+                                       const char *line, int length);
+
+static long long housesaga_digest_read (const char *path, long long offset,
+                                        housesaga_digest_visitor *visitor) {
+
+    FILE *csv = fopen (path, "r");
+    if (!csv) return 0;
+    if (offset && fseeko (csv, (off_t)offset, SEEK_SET)) {
+        fclose (csv);
+        return 0;
+    }
+
+    char *line = 0;
+    size_t size = 0;
+    ssize_t length;
+    while ((length = getline (&line, &size, csv)) > 0) {
+        if (line[length-1] == '\n') line[--length] = 0;
+        time_t timestamp = housesaga_digest_timestamp (line);
+        if (timestamp < 0) continue;
+        visitor (timestamp, line, length);
+    }
+    long long total = (long long)ftello (csv);
+    free (line);
+    fclose (csv);
+    return total;
+}
+
+static struct DigestFile *DigestLoading = 0;
+
+static void housesaga_digest_add (struct DigestFile *file,
+                                  time_t timestamp,
+                                  const char *line, int length) {
+    struct DigestBucket *bucket =
+        file->bucket + housesaga_digest_slot (file->midnight, timestamp);
+    bucket->count += 1;
+    bucket->sum += housesaga_digest_hash (line, length);
+}
+
+static void housesaga_digest_loadline (time_t timestamp,
+                                       const char *line, int length) {
+    housesaga_digest_add (DigestLoading, timestamp, line, length);
+}
+
+static struct DigestFile *housesaga_digest_search (const char *type, int date) {
+    int i;
+    for (i = 0; i < DIGEST_CACHE; ++i) {
+        struct DigestFile *file = DigestCache + i;
+        if ((file->date == date) && (!strcmp (file->type, type))) return file;
+    }
+    return 0;
+}
+
+/* Return the digest of a log file, from the cache if still valid.
+ */
+static struct DigestFile *housesaga_digest_load (const char *type,
+                                                 int year, int month, int day) {
+    char path[1024];
+    struct stat info;
+
+    housesaga_storage_flush (); // Make sure the files are complete.
+
+    housesaga_digest_path (path, sizeof(path), year, month, day, type);
+    long long size = 0;
+    long long inode = 0;
+    if (!stat (path, &info)) {
+        size = (long long)(info.st_size);
+        inode = (long long)(info.st_ino);
+    }
+
+    int date = (year * 100 + month) * 100 + day;
+    struct DigestFile *file = housesaga_digest_search (type, date);
+    if (file && (file->inode == inode) && (file->size <= size)) {
+        file->used = time(0);
+        if (file->size < size) {
+            // Records were appended: only read these.
+            DigestLoading = file;
+            file->size = housesaga_digest_read (path, file->size,
+                                                housesaga_digest_loadline);
+            DigestLoading = 0;
+        }
+        return file;
+    }
+
+    if (!file) { // Reuse the least recently used entry.
+        int i;
+        file = DigestCache;
+        for (i = 1; i < DIGEST_CACHE; ++i) {
+            if (DigestCache[i].used < file->used) file = DigestCache + i;
+        }
+    }
+    memset (file, 0, sizeof(*file));
+    file->date = date;
+    snprintf (file->type, sizeof(file->type), "%s", type);
+    file->midnight = housesaga_digest_midnight (year, month, day);
+    file->used = time(0);
+    file->inode = inode;
+
+    DigestLoading = file;
+    file->size = housesaga_digest_read (path, 0, housesaga_digest_loadline);
+    DigestLoading = 0;
+    return file;
+}
+
+void housesaga_digest_saved (const char *logtype,
+                             int year, int month, int day,
+                             time_t timestamp, const char *record, int written) {
+
+    int date = (year * 100 + month) * 100 + day;
+    struct DigestFile *file = housesaga_digest_search (logtype, date);
+    if (!file) return; // Not cached: will be calculated when needed.
+
+    housesaga_digest_add (file, timestamp, record, strlen(record));
+    file->size += written;
+}
+
+static int housesaga_digest_getdate (const char *text,
+                                     int *year, int *month, int *day) {
+    if ((!text) || (sscanf (text, "%d-%d-%d", year, month, day) != 3)) {
+        echttp_error (400, "Invalid date");
+        return 0;
+    }
+    return 1;
+}
+
+static void housesaga_digest_hex (char *buffer, int size,
+                                  unsigned long long value) {
+    snprintf (buffer, size, "%016llx", value);
+}
+
+static const char *housesaga_digest_webdigest (const char *method,
+                                               const char *uri,
+                                               const char *data, int length) {
+
+    static char buffer[DIGEST_TYPES * 256 + DIGEST_BUCKETS * 64];
+    static ParserToken token[DIGEST_TYPES * 8 + DIGEST_BUCKETS * 4];
+    static char pool[DIGEST_TYPES * 128 + DIGEST_BUCKETS * 32];
+    static char hex[DIGEST_TYPES + DIGEST_BUCKETS][20];
+
+    if (strcmp (method, "GET")) return ""; // Only GET is supported.
+
+    int year, month, day;
+    if (!housesaga_digest_getdate (echttp_parameter_get("date"),
+                                   &year, &month, &day)) return "";
+    const char *type = echttp_parameter_get("type");
+    if (type && (!housesaga_digest_validtype (type))) {
+        echttp_error (400, "Invalid type");
+        return "";
+    }
+
+    // List the log files of that day, unless one specific type was
+    // requested: only that type's bucket digests are returned.
+    //
+    char types[DIGEST_TYPES][32];
+    int count = 0;
+    if (type) {
+        snprintf (types[count++], sizeof(types[0]), "%s", type);
+    } else {
+        char path[1024];
+        housesaga_storage_daypath (path, sizeof(path), year, month, day);
+        DIR *dir = opendir (path);
+        if (dir) {
+            struct dirent *p;
+            while ((p = readdir (dir)) && (count < DIGEST_TYPES)) {
+                if (p->d_name[0] == '.') continue;
+                char *dot = strrchr (p->d_name, '.');
+                if ((!dot) || strcmp (dot, ".csv")) continue;
+                *dot = 0;
+                if (housesaga_digest_validtype (p->d_name))
+                    strtcpy (types[count++], p->d_name, sizeof(types[0]));
+            }
+            closedir (dir);
+        }
+    }
+
+    ParserContext context = echttp_json_start (token, sizeof(token)/sizeof(token[0]),
+                                               pool, sizeof(pool));
+
+    int root = echttp_json_add_object (context, 0, 0);
+    echttp_json_add_string (context, root, "host", housesaga_host());
+    echttp_json_add_integer (context, root, "timestamp", (long long)time(0));
+    int top = echttp_json_add_object (context, root, "saga");
+    int digest = echttp_json_add_object (context, top, "digest");
+    char date[16];
+    snprintf (date, sizeof(date), "%04d-%02d-%02d", year, month, day);
+    echttp_json_add_string (context, digest, "date", date);
+    echttp_json_add_integer (context, digest, "period", DIGEST_PERIOD);
+    int container = echttp_json_add_array (context, digest, "files");
+
+    int i, j;
+    int hexused = 0;
+    for (i = 0; i < count; ++i) {
+        const struct DigestFile *file =
+            housesaga_digest_load (types[i], year, month, day);
+
+        int item = echttp_json_add_object (context, container, 0);
+        echttp_json_add_string (context, item, "type", types[i]);
+        echttp_json_add_integer (context, item, "records",
+                                 housesaga_digest_records (file));
+        housesaga_digest_hex (hex[hexused], sizeof(hex[0]),
+                              housesaga_digest_root (file));
+        echttp_json_add_string (context, item, "digest", hex[hexused++]);
+
+        if (!type) continue;
+
+        int list = echttp_json_add_array (context, item, "buckets");
+        for (j = 0; j < DIGEST_BUCKETS; ++j) {
+            const struct DigestBucket *bucket = file->bucket + j;
+            int pair = echttp_json_add_array (context, list, 0);
+            echttp_json_add_integer (context, pair, 0, bucket->count);
+            housesaga_digest_hex (hex[hexused], sizeof(hex[0]), bucket->sum);
+            echttp_json_add_string (context, pair, 0, hex[hexused++]);
+        }
+    }
+
+    const char *error = echttp_json_export (context, buffer, sizeof(buffer));
+    if (error) {
+        echttp_error (500, error);
+        return "";
+    }
+    echttp_content_type_json ();
+    return buffer;
+}
+
+static char *WebBucketBuffer = 0;
+static int   WebBucketSize = 0;
+static int   WebBucketLength = 0;
+static int   WebBucketSlot = 0;
+static time_t WebBucketMidnight = 0;
+
+static void housesaga_digest_output (const char *line, int length) {
+
+    if (WebBucketLength + length + 2 > WebBucketSize) {
+        WebBucketSize += length + 65536;
+        WebBucketBuffer = realloc (WebBucketBuffer, WebBucketSize);
+    }
+    memcpy (WebBucketBuffer + WebBucketLength, line, length);
+    WebBucketLength += length;
+    WebBucketBuffer[WebBucketLength++] = '\n';
+    WebBucketBuffer[WebBucketLength] = 0;
+}
+
+static void housesaga_digest_bucketline (time_t timestamp,
+                                         const char *line, int length) {
+    if (housesaga_digest_slot (WebBucketMidnight, timestamp) == WebBucketSlot)
+        housesaga_digest_output (line, length);
+}
+
+static const char *housesaga_digest_webbucket (const char *method,
+                                               const char *uri,
+                                               const char *data, int length) {
+
+    if (strcmp (method, "GET")) return ""; // Only GET is supported.
+
+    int year, month, day;
+    if (!housesaga_digest_getdate (echttp_parameter_get("date"),
+                                   &year, &month, &day)) return "";
+    const char *type = echttp_parameter_get("type");
+    if (!housesaga_digest_validtype (type)) {
+        echttp_error (400, "Invalid type");
+        return "";
+    }
+    const char *slot = echttp_parameter_get("bucket");
+    WebBucketSlot = slot ? atoi(slot) : -1;
+    if ((WebBucketSlot < 0) || (WebBucketSlot >= DIGEST_BUCKETS)) {
+        echttp_error (400, "Invalid bucket");
+        return "";
+    }
+
+    char path[1024];
+    housesaga_storage_flush ();
+    housesaga_digest_path (path, sizeof(path), year, month, day, type);
+
+    // The first line of the file is returned as is when it is a header,
+    // so that the peer can create the file if missing.
+    //
+    WebBucketLength = 0;
+    if (!WebBucketBuffer) {
+        WebBucketSize = 65536;
+        WebBucketBuffer = malloc (WebBucketSize);
+    }
+    WebBucketBuffer[0] = 0;
+    FILE *csv = fopen (path, "r");
+    if (csv) {
+        char header[1024];
+        if (fgets (header, sizeof(header), csv) &&
+            (housesaga_digest_timestamp (header) < 0)) {
+            housesaga_digest_output (header, strcspn (header, "\n"));
+        }
+        fclose (csv);
+    }
+    WebBucketMidnight = housesaga_digest_midnight (year, month, day);
+    housesaga_digest_read (path, 0, housesaga_digest_bucketline);
+
+    echttp_content_type_set ("text/csv");
+    return WebBucketBuffer;
+}
+
+// The sync client. Each response handler sends the next request.
+//
+static void housesaga_digest_nexttype (void);
+static void housesaga_digest_nextbucket (void);
+static void housesaga_digest_background (time_t now);
+
+static void housesaga_digest_end (const char *error) {
+    SyncError = error;
+    SyncActive = 0;
+    SyncStage = SYNC_IDLE;
+    SyncEnded = time(0);
+    if (error) {
+        houselog_trace (HOUSE_FAILURE, "SYNC", "%s %s: %s",
+                        SyncPeer, SyncDate, error);
+    } else {
+        houselog_trace (HOUSE_INFO, "SYNC",
+                        "%s %s: %lld records added (%ld buckets, %lld bytes)",
+                        SyncPeer, SyncDate, SyncAdded, SyncPulled, SyncBytes);
+    }
+}
+
+static void housesaga_digest_request (const char *url,
+                                      echttp_response *response) {
+
+    const char *error = echttp_client ("GET", url);
+    if (error) {
+        housesaga_digest_end (error);
+        return;
+    }
+    SyncRequests += 1;
+    echttp_submit (0, 0, response, 0);
+}
+
+/* Check a peer's response, and return a null-terminated copy, or 0 when
+ * the sync must stop. The copy must be freed by the caller.
+ */
+static char *housesaga_digest_response (int status, const char *data,
+                                        int length,
+                                        echttp_response *response) {
+    if (status == 302) {
+        status = echttp_redirected("GET");
+        if (!status) {
+            SyncRequests += 1;
+            echttp_submit (0, 0, response, 0);
+            return 0;
+        }
+    }
+    if (status != 200) {
+        housesaga_digest_end ("peer request failed");
+        return 0;
+    }
+    SyncBytes += length;
+    char *copy = malloc (length + 1);
+    memcpy (copy, data, length);
+    copy[length] = 0;
+    return copy;
+}
+
+static ParserToken *housesaga_digest_json (char *json, int *count) {
+    *count = echttp_json_estimate (json);
+    ParserToken *token = calloc (*count, sizeof(ParserToken));
+    if (echttp_json_parse (json, token, count)) {
+        free (token);
+        return 0;
+    }
+    return token;
+}
+
+static const char *housesaga_digest_string (const ParserToken *token,
+                                            const char *path) {
+    int item = echttp_json_search (token, path);
+    if ((item < 0) || (token[item].type != PARSER_STRING)) return 0;
+    return token[item].value.string;
+}
+
+static void housesaga_digest_onfiles (void *origin,
+                                      int status, char *data, int length) {
+
+    char *json = housesaga_digest_response (status, data, length,
+                                            housesaga_digest_onfiles);
+    if (!json) return;
+
+    int count;
+    ParserToken *token = housesaga_digest_json (json, &count);
+    int files = token ? echttp_json_search (token, ".saga.digest.files") : -1;
+    if ((files < 0) || (token[files].type != PARSER_ARRAY)) {
+        if (token) free (token);
+        free (json);
+        housesaga_digest_end ("invalid peer digest");
+        return;
+    }
+
+    // The local digests are compared later, one file per second.
+    //
+    int i;
+    char path[32];
+    SyncTypesCount = SyncTypesCursor = 0;
+    SyncCandidatesCount = SyncCandidatesCursor = 0;
+    for (i = 0; i < token[files].length; ++i) {
+        snprintf (path, sizeof(path), "[%d]", i);
+        int item = echttp_json_search (token + files, path);
+        if (item < 0) break;
+        const ParserToken *file = token + files + item;
+        const char *type = housesaga_digest_string (file, ".type");
+        const char *digest = housesaga_digest_string (file, ".digest");
+        if ((!digest) || (!housesaga_digest_validtype (type))) continue;
+        if (SyncCandidatesCount >= DIGEST_TYPES) break;
+
+        strtcpy (SyncCandidates[SyncCandidatesCount], type,
+                 sizeof(SyncCandidates[0]));
+        strtcpy (SyncCandidateDigests[SyncCandidatesCount], digest,
+                 sizeof(SyncCandidateDigests[0]));
+        SyncCandidatesCount += 1;
+    }
+    free (token);
+    free (json);
+    SyncStage = SYNC_FILES;
+    housesaga_schedule (time(0), housesaga_digest_background);
+}
+
+/* Compare the digest of one local file with the peer's digest.
+ */
+static void housesaga_digest_checkfile (void) {
+
+    char hex[20];
+
+    if (SyncCandidatesCursor >= SyncCandidatesCount) {
+        SyncStage = SYNC_IDLE;
+        housesaga_digest_nexttype ();
+        return;
+    }
+    const char *type = SyncCandidates[SyncCandidatesCursor];
+    const char *digest = SyncCandidateDigests[SyncCandidatesCursor];
+    SyncCandidatesCursor += 1;
+
+    SyncCompared += 1;
+    const struct DigestFile *local =
+        housesaga_digest_load (type, SyncYear, SyncMonth, SyncDay);
+    housesaga_digest_hex (hex, sizeof(hex), housesaga_digest_root (local));
+    if (!strcmp (hex, digest)) return; // Same content.
+    strtcpy (SyncTypes[SyncTypesCount++], type, sizeof(SyncTypes[0]));
+}
+
+static void housesaga_digest_localline (time_t timestamp,
+                                        const char *line, int length) {
+    int slot = housesaga_digest_slot (DigestLoading->midnight, timestamp);
+    int i;
+    for (i = 0; i < SyncBucketsCount; ++i) {
+        if (SyncBuckets[i] == slot) break;
+    }
+    if (i >= SyncBucketsCount) return; // Not a bucket to repair.
+
+    if (SyncLocalCount >= SyncLocalSize) {
+        SyncLocalSize += 1024;
+        SyncLocal = realloc (SyncLocal, SyncLocalSize * sizeof(SyncLocal[0]));
+    }
+    struct SyncLine *local = SyncLocal + (SyncLocalCount++);
+    local->bucket = slot;
+    local->matched = 0;
+    local->hash = housesaga_digest_hash (line, length);
+}
+
+static int housesaga_digest_compare (const void *a, const void *b) {
+    const struct SyncLine *la = (const struct SyncLine *)a;
+    const struct SyncLine *lb = (const struct SyncLine *)b;
+    if (la->bucket != lb->bucket) return la->bucket - lb->bucket;
+    if (la->hash < lb->hash) return -1;
+    if (la->hash > lb->hash) return 1;
+    return 0;
+}
+
+static void housesaga_digest_onbuckets (void *origin,
+                                        int status, char *data, int length) {
+
+    char *json = housesaga_digest_response (status, data, length,
+                                            housesaga_digest_onbuckets);
+    if (!json) return;
+
+    int count;
+    ParserToken *token = housesaga_digest_json (json, &count);
+    int list = token ?
+        echttp_json_search (token, ".saga.digest.files[0].buckets") : -1;
+    if ((list < 0) || (token[list].type != PARSER_ARRAY)) {
+        if (token) free (token);
+        free (json);
+        housesaga_digest_end ("invalid peer buckets");
+        return;
+    }
+
+    // The local file is read later, in the background.
+    //
+    int i;
+    char path[32];
+    memset (SyncRemote, 0, sizeof(SyncRemote));
+    SyncRemoteCount = 0;
+    for (i = 0; (i < token[list].length) && (i < DIGEST_BUCKETS); ++i) {
+        SyncRemoteCount = i + 1;
+        snprintf (path, sizeof(path), "[%d][0]", i);
+        int item = echttp_json_search (token + list, path);
+        if ((item < 0) || (token[list+item].type != PARSER_INTEGER)) continue;
+        long long records = token[list+item].value.integer;
+        snprintf (path, sizeof(path), "[%d][1]", i);
+        const char *sum = housesaga_digest_string (token + list, path);
+        if ((!sum) || (records <= 0)) continue; // Nothing to pull.
+
+        SyncRemote[i].count = records;
+        SyncRemote[i].sum = strtoull (sum, 0, 16);
+    }
+    free (token);
+    free (json);
+    SyncStage = SYNC_BUCKETS;
+    housesaga_schedule (time(0), housesaga_digest_background);
+}
+
+/* Compare the bucket digests of the local file with the peer's, then
+ * collect the hashes of the local records in the buckets to repair.
+ */
+static void housesaga_digest_checkbuckets (void) {
+
+    const char *type = SyncTypes[SyncTypesCursor];
+    struct DigestFile *local =
+        housesaga_digest_load (type, SyncYear, SyncMonth, SyncDay);
+    time_t settled = time(0) - DIGEST_SETTLE;
+
+    int i;
+    SyncBucketsCount = SyncBucketsCursor = 0;
+    for (i = 0; i < SyncRemoteCount; ++i) {
+        if (SyncRemote[i].count <= 0) continue; // Nothing to pull.
+        if (local->midnight + (i + 1) * DIGEST_PERIOD > settled) continue;
+        if ((SyncRemote[i].count == local->bucket[i].count) &&
+            (SyncRemote[i].sum == local->bucket[i].sum)) continue;
+        SyncBuckets[SyncBucketsCount++] = i;
+    }
+
+    // Collect the hashes of the local records in the buckets to repair,
+    // reading the local file only once.
+    //
+    SyncLocalCount = 0;
+    if (SyncBucketsCount > 0) {
+        char filepath[1024];
+        housesaga_digest_path (filepath, sizeof(filepath),
+                               SyncYear, SyncMonth, SyncDay, type);
+        DigestLoading = local;
+        housesaga_digest_read (filepath, 0, housesaga_digest_localline);
+        DigestLoading = 0;
+        qsort (SyncLocal, SyncLocalCount, sizeof(SyncLocal[0]),
+               housesaga_digest_compare);
+    }
+    housesaga_digest_nextbucket ();
+}
+
+/* Return 1 if this record is present locally. Each local record matches
+ * only one remote record, so that duplicate lines are accounted for.
+ */
+static int housesaga_digest_present (int bucket, unsigned long long hash) {
+
+    struct SyncLine key;
+    key.bucket = bucket;
+    key.hash = hash;
+
+    int low = 0;
+    int high = SyncLocalCount;
+    while (low < high) { // Find the first entry not lower than key.
+        int middle = (low + high) / 2;
+        if (housesaga_digest_compare (SyncLocal + middle, &key) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    for (; low < SyncLocalCount; ++low) {
+        struct SyncLine *local = SyncLocal + low;
+        if (housesaga_digest_compare (local, &key)) break;
+        if (!local->matched) {
+            local->matched = 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void housesaga_digest_onlines (void *origin,
+                                      int status, char *data, int length) {
+
+    char *text = housesaga_digest_response (status, data, length,
+                                            housesaga_digest_onlines);
+    if (!text) return;
+
+    const char *type = SyncTypes[SyncTypesCursor];
+    int bucket = SyncBuckets[SyncBucketsCursor];
+    time_t midnight = housesaga_digest_midnight (SyncYear, SyncMonth, SyncDay);
+    const char *header = 0;
+
+    char *line = text;
+    while (*line) {
+        char *eol = strchr (line, '\n');
+        if (eol) *eol = 0;
+        time_t timestamp = housesaga_digest_timestamp (line);
+        if (timestamp < 0) {
+            if (line == text) header = line;
+        } else if (housesaga_digest_slot (midnight, timestamp) == bucket) {
+            unsigned long long hash = housesaga_digest_hash (line, strlen(line));
+            if (!housesaga_digest_present (bucket, hash)) {
+                housesaga_storage_save (type, timestamp, header, line);
+                SyncAdded += 1;
+            }
+        }
+        if (!eol) break;
+        line = eol + 1;
+    }
+    housesaga_storage_flush ();
+    free (text);
+
+    SyncPulled += 1;
+    SyncBucketsCursor += 1;
+    housesaga_digest_nextbucket ();
+}
+
+static void housesaga_digest_nextbucket (void) {
+
+    char url[512];
+
+    if (SyncBucketsCursor >= SyncBucketsCount) {
+        SyncTypesCursor += 1;
+        housesaga_digest_nexttype ();
+        return;
+    }
+    snprintf (url, sizeof(url),
+              "http://%s/saga/log/digest/bucket?date=%s&type=%s&bucket=%d",
+              SyncPeer, SyncDate, SyncTypes[SyncTypesCursor],
+              SyncBuckets[SyncBucketsCursor]);
+    housesaga_digest_request (url, housesaga_digest_onlines);
+}
+
+static void housesaga_digest_nexttype (void) {
+
+    char url[512];
+
+    if (SyncTypesCursor >= SyncTypesCount) {
+        housesaga_digest_end (0);
+        return;
+    }
+    snprintf (url, sizeof(url), "http://%s/saga/log/digest?date=%s&type=%s",
+              SyncPeer, SyncDate, SyncTypes[SyncTypesCursor]);
+    housesaga_digest_request (url, housesaga_digest_onbuckets);
+}
+
+static void housesaga_digest_background (time_t now) {
+
+    if (!SyncActive) return;
+
+    switch (SyncStage) {
+        case SYNC_FILES:
+            housesaga_digest_checkfile ();
+            break;
+        case SYNC_BUCKETS:
+            SyncStage = SYNC_IDLE;
+            housesaga_digest_checkbuckets ();
+            return;
+        default:
+            return;
+    }
+    if (SyncStage != SYNC_IDLE)
+        housesaga_schedule (now + 1, housesaga_digest_background);
+}
+
+static const char *housesaga_digest_websync (const char *method,
+                                             const char *uri,
+                                             const char *data, int length) {
+
+    static char buffer[2048];
+    static ParserToken token[32];
+    static char pool[1024];
+
+    if (!strcmp (method, "POST")) {
+        if (SyncActive) {
+            echttp_error (409, "A sync is already active");
+            return "";
+        }
+        const char *peer = echttp_parameter_get("peer");
+        if ((!peer) || (!peer[0])) {
+            echttp_error (400, "Missing peer");
+            return "";
+        }
+        if (!strncmp (peer, "http://", 7)) peer += 7;
+
+        const char *date = echttp_parameter_get("date");
+        int year, month, day;
+        if (date) {
+            if (!housesaga_digest_getdate (date, &year, &month, &day))
+                return "";
+        } else {
+            time_t now = time(0);
+            struct tm local = *localtime (&now);
+            year = local.tm_year + 1900;
+            month = local.tm_mon + 1;
+            day = local.tm_mday;
+        }
+        snprintf (SyncPeer, sizeof(SyncPeer), "%s", peer);
+        snprintf (SyncDate, sizeof(SyncDate), "%04d-%02d-%02d",
+                  year, month, day);
+        SyncYear = year;
+        SyncMonth = month;
+        SyncDay = day;
+        SyncActive = 1;
+        SyncError = 0;
+        SyncStarted = time(0);
+        SyncEnded = 0;
+        SyncRequests = SyncCompared = SyncPulled = 0;
+        SyncBytes = SyncAdded = 0;
+        SyncTypesCount = SyncTypesCursor = 0;
+
+        char url[512];
+        snprintf (url, sizeof(url), "http://%s/saga/log/digest?date=%s",
+                  SyncPeer, SyncDate);
+        housesaga_digest_request (url, housesaga_digest_onfiles);
+
+    } else if (strcmp (method, "GET")) {
+        return "";
+    }
+
+    ParserContext context = echttp_json_start (token, sizeof(token)/sizeof(token[0]),
+                                               pool, sizeof(pool));
+
+    int root = echttp_json_add_object (context, 0, 0);
+    echttp_json_add_string (context, root, "host", housesaga_host());
+    echttp_json_add_integer (context, root, "timestamp", (long long)time(0));
+    int top = echttp_json_add_object (context, root, "saga");
+    int sync = echttp_json_add_object (context, top, "sync");
+    echttp_json_add_string (context, sync, "peer", SyncPeer);
+    echttp_json_add_string (context, sync, "date", SyncDate);
+    echttp_json_add_bool (context, sync, "active", SyncActive);
+    echttp_json_add_integer (context, sync, "started", (long long)SyncStarted);
+    echttp_json_add_integer (context, sync, "ended", (long long)SyncEnded);
+    echttp_json_add_string (context, sync, "error", SyncError ? SyncError : "");
+    echttp_json_add_integer (context, sync, "requests", SyncRequests);
+    echttp_json_add_integer (context, sync, "bytes", SyncBytes);
+    echttp_json_add_integer (context, sync, "files", SyncCompared);
+    echttp_json_add_integer (context, sync, "differ", SyncTypesCount);
+    echttp_json_add_integer (context, sync, "buckets", SyncPulled);
+    echttp_json_add_integer (context, sync, "added", SyncAdded);
+
+    const char *error = echttp_json_export (context, buffer, sizeof(buffer));
+    if (error) {
+        echttp_error (500, error);
+        return "";
+    }
+    echttp_content_type_json ();
+    return buffer;
+}
+
+void housesaga_digest_initialize (int argc, const char **argv) {
+
+    housesaga_latency_route ("/saga/log/digest", housesaga_digest_webdigest);
+    housesaga_latency_route ("/saga/log/digest/bucket",
+                             housesaga_digest_webbucket);
+    housesaga_latency_route ("/saga/log/sync", housesaga_digest_websync);
+
+    // Alternate paths for application-independent web pages.
+    // (The log files are stored at the same place for all applications.)
+    //
+    housesaga_latency_route ("/log/digest", housesaga_digest_webdigest);
+    housesaga_latency_route ("/log/digest/bucket", housesaga_digest_webbucket);
+    housesaga_latency_route ("/log/sync", housesaga_digest_websync);
+}
+
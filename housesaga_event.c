@@ -26,6 +26,9 @@
  *  - the buffer is full and the oldest item was not saved to storage.
  *  - there is at least one unsaved item and last save was N seconds ago.
  *
+ * The live buffer is kept in a memory mapped file (see housesaga_live.c),
+ * so that the latest events, saved or not, survive a restart.
+ *
  * The origin of events are source clients, which report their new, unreported
  * events on their own.
  *
@@ -73,10 +76,17 @@
  *
  * -- end of houselog.c clone --
  *
+ * void housesaga_event_health (ParserContext context, int parent);
+ *
+ *    Add the state of the live buffer to a JSON array: depth, number of
+ *    records used and not yet saved, number of saves forced because the
+ *    buffer was full, and number of late records saved out of order.
+ *
  * void housesaga_event_background (time_t now);
  *
- *    This function must be called a regular intervals for background
- *    processing, e.g. cleanup of expired resources, storage backup, etc.
+ *    Save the events that are due. This is a scheduled action (see
+ *    housesaga_schedule()): it runs when the oldest unsaved event becomes
+ *    older than the save delay.
  */
 
 #include <unistd.h>
@@ -102,13 +112,20 @@
 #include "housesaga.h"
 #include "housesaga_event.h"
 #include "housesaga_storage.h"
+#include "housesaga_live.h"
 #include "housesaga_traffic.h"
+#include "housesaga_latency.h"
+#include "housesaga_source.h"
+#include "housesaga_parser.h"
+#include "housesaga_dedup.h"
+#include "housesaga_fanin.h"
 
 static const char  LogAppName[] = "saga";
 
 struct EventRecord {
     struct timeval timestamp;
     long long id;
+    long long arrival; // Monotonic time, see housesaga_latency_now().
     int    unsaved;
     char   host[128];
     char   app[128];
@@ -120,13 +137,26 @@ struct EventRecord {
 
 #define HISTORY_DEPTH 256
 
-static struct EventRecord EventHistory[HISTORY_DEPTH];
+#define EVENT_SAVE_DELAY 6 // Time given to the sources to flush their data.
+
+static struct EventRecord *EventHistory = 0; // See housesaga_event_live().
+static struct HouseSagaLive *EventLive = 0;
+static int EventRestored = 0;
 static int EventCursor = 0;
 static long long EventLatestId = 0;
 
 static echttp_sorted_list EventChronology;
 static time_t EventLastSaved = 0;
 static time_t EventSaveLimit = 0;
+static time_t EventSaveNext = 0;  // Oldest unsaved record not yet due.
+
+static long EventForcedSaves = 0; // Buffer full: saved without delay.
+static long EventRewinds = 0;     // Late records, saved out of order.
+
+static int TrafficEventsReceived = -1;
+static int TrafficEventsDuplicate = -1;
+static int ParserEvents = -1;
+static int LatencyEventResidency = -1;
 
 
 static void safecpy (char *d, const char *s, int size) {
@@ -148,7 +178,10 @@ static int housesaga_saveaction (void *data) {
     if (cursor->unsaved) {
         char buffer[1024];
 
-        if (cursor->timestamp.tv_sec > EventSaveLimit) return 0;
+        if (cursor->timestamp.tv_sec > EventSaveLimit) {
+            EventSaveNext = cursor->timestamp.tv_sec;
+            return 0;
+        }
 
         snprintf (buffer, sizeof(buffer), "%lld.%03d,%s,%s,%s,%s,%s,\"%s\"",
                   (long long)(cursor->timestamp.tv_sec),
@@ -161,6 +194,7 @@ static int housesaga_saveaction (void *data) {
                   cursor->description);
         housesaga_storage_save ("event", cursor->timestamp.tv_sec,
                                 EventHeader, buffer);
+        housesaga_latency_record (LatencyEventResidency, cursor->arrival);
         cursor->unsaved = 0;
     }
     return 1;
@@ -177,7 +211,8 @@ static void housesaga_event_save (int full) {
     // This delay does not apply when the event buffer is full: in that
     // case, we must save events at all cost.
     //
-    EventSaveLimit = full ? now + 2 : now - 6;
+    EventSaveLimit = full ? now + 2 : now - EVENT_SAVE_DELAY;
+    EventSaveNext = 0;
 
     if (EventLastSaved) {
         echttp_sorted_ascending_from (EventChronology,
@@ -190,6 +225,57 @@ static void housesaga_event_save (int full) {
     EventLastSaved = full ? now : EventSaveLimit;
 }
 
+/* Free the slot at the cursor, where the next record will be stored.
+ */
+static void housesaga_event_release (void) {
+
+    struct EventRecord *cursor = EventHistory + EventCursor;
+    if (cursor->timestamp.tv_sec) {
+        if (cursor->unsaved) {
+            housesaga_event_save(1); // Save before erased.
+            EventForcedSaves += 1;
+        }
+
+        echttp_sorted_remove (EventChronology,
+                              housesaga_timestamp2key (&(cursor->timestamp)),
+                              (void *)((long)EventCursor));
+        cursor->timestamp.tv_sec = 0;
+    }
+}
+
+/* Map the live buffer and restore the records from the previous run.
+ * This is called on the first use, which may happen before this module
+ * is initialized.
+ */
+static void housesaga_event_live (void) {
+
+    int i;
+    int latest = -1;
+
+    EventHistory = housesaga_live_map ("event", sizeof(struct EventRecord),
+                                       HISTORY_DEPTH, &EventLive);
+    if (!EventChronology) EventChronology = echttp_sorted_new();
+
+    for (i = 0; i < HISTORY_DEPTH; ++i) {
+        struct EventRecord *cursor = EventHistory + i;
+        if (!cursor->timestamp.tv_sec) continue;
+        cursor->arrival = housesaga_latency_now();
+        echttp_sorted_add (EventChronology,
+                           housesaga_timestamp2key (&(cursor->timestamp)),
+                           (void *)((long)i));
+        if (cursor->id > EventLatestId) {
+            EventLatestId = cursor->id;
+            latest = i;
+        }
+        EventRestored += 1;
+    }
+    if (latest < 0) return; // Nothing restored.
+
+    EventCursor = latest + 1;
+    if (EventCursor >= HISTORY_DEPTH) EventCursor = 0;
+    housesaga_event_release ();
+}
+
 /* Record a new event to the live buffer.
  * Such an event might have been received from a client service,
  * or may be of a local  origin (see function houselog_event() below).
@@ -202,9 +288,20 @@ static void housesaga_event_new (const struct timeval *timestamp,
                                  const char *action,
                                  const char *text, int propagate) {
 
-    struct EventRecord *cursor = EventHistory + EventCursor;
+    housesaga_dedup_key key =
+        housesaga_dedup_start ("event", timestamp, host, app);
+    key = housesaga_dedup_text (key, category);
+    key = housesaga_dedup_text (key, object);
+    key = housesaga_dedup_text (key, action);
+    key = housesaga_dedup_text (key, text);
+    if (housesaga_dedup_seen (key)) {
+        housesaga_traffic_increment (TrafficEventsDuplicate);
+        return;
+    }
 
-    if (!EventChronology) EventChronology = echttp_sorted_new();
+    if (!EventHistory) housesaga_event_live ();
+
+    struct EventRecord *cursor = EventHistory + EventCursor;
 
     if (EventLatestId == 0) {
         // Seed the latest event ID based on the first event's time.
@@ -214,8 +311,10 @@ static void housesaga_event_new (const struct timeval *timestamp,
     }
     EventLatestId += 1;
 
+    housesaga_live_begin (EventLive, EventCursor);
     cursor->timestamp = *timestamp;
     cursor->id = EventLatestId;
+    cursor->arrival = housesaga_latency_now();
     safecpy (cursor->host, host, sizeof(cursor->host));
     safecpy (cursor->app, app, sizeof(cursor->app));
     safecpy (cursor->category, category, sizeof(cursor->category));
@@ -223,6 +322,10 @@ static void housesaga_event_new (const struct timeval *timestamp,
     safecpy (cursor->action, action, sizeof(cursor->action));
     safecpy (cursor->description, text, sizeof(cursor->description));
     cursor->unsaved = propagate;
+    housesaga_live_end (EventLive);
+    if (propagate)
+        housesaga_schedule (timestamp->tv_sec + EVENT_SAVE_DELAY,
+                            housesaga_event_background);
 
     echttp_sorted_add (EventChronology,
                        housesaga_timestamp2key (&(cursor->timestamp)),
@@ -232,20 +335,13 @@ static void housesaga_event_new (const struct timeval *timestamp,
         // Hoops: we got a late event from a distant past. We need
         // to make sure it will be saved, even if out of order.
         EventLastSaved = timestamp->tv_sec;
+        EventRewinds += 1;
     }
 
     EventCursor += 1;
     if (EventCursor >= HISTORY_DEPTH) EventCursor = 0;
 
-    cursor = EventHistory + EventCursor;
-    if (cursor->timestamp.tv_sec) {
-        if (cursor->unsaved) housesaga_event_save(1); // Save before erased.
-
-        echttp_sorted_remove (EventChronology,
-                              housesaga_timestamp2key (&(cursor->timestamp)),
-                              (void *)((long)EventCursor));
-        cursor->timestamp.tv_sec = 0;
-    }
+    housesaga_event_release ();
 }
 
 /* Local clone for the houselog.c API.
@@ -368,8 +464,11 @@ static const char *housesaga_weblatest (const char *method, const char *uri,
 
 static const char *housesaga_webget (void) {
 
+    // The latest ID is local: it does not tell if the peers have new events.
+    int fanin = housesaga_fanin_requested ();
+
     const char *known = echttp_parameter_get("known");
-    if (known && (atoll (known) == EventLatestId)) {
+    if (known && (!fanin) && (atoll (known) == EventLatestId)) {
         echttp_error (304, "Not Modified");
         return "";
     }
@@ -397,6 +496,7 @@ static const char *housesaga_webget (void) {
     echttp_sorted_descending(EventChronology, housesaga_webaction);
     snprintf (WebFormatBuffer+WebFormatLength,
               sizeof(WebFormatBuffer)-WebFormatLength, "]}}");
+    if (fanin) return housesaga_fanin_events (WebFormatBuffer);
     return WebFormatBuffer;
 }
 
@@ -405,74 +505,32 @@ static const char *housesaga_webget (void) {
  * by these sources. Sharing the same format reduces the amount of
  * code on the source side.
  */
-static const char *housesaga_getjsonstring (ParserToken *parsed,
-                                            const char *path) {
-    int item = echttp_json_search(parsed, path);
-    if (item < 0) return 0;
-    if (parsed[item].type != PARSER_STRING) return 0;
-    return parsed[item].value.string;
-}
-
-static struct timeval housesaga_getjsontime (ParserToken *parsed,
-                                             const char *path) {
-    struct timeval result = {0, 0};
-    int item = echttp_json_search(parsed, path);
-    if (item < 0) return result;
-    if (parsed[item].type != PARSER_INTEGER) return result;
-    result.tv_sec = parsed[item].value.integer / 1000;
-    result.tv_usec = (parsed[item].value.integer % 1000) * 1000;
-    return result;
-}
-
-static const char *housesaga_webpost (const char *data, int length) {
-
-    static ParserToken *EventParsed = 0;
-    static int   EventTokenAllocated = 0;
-    static char *EventBuffer = 0;
-
-    echttp_content_type_json ();
-
-    if (EventBuffer) free (EventBuffer);
-    EventBuffer = strdup (data);
-
-    int count = echttp_json_estimate(data);
-    if (count > EventTokenAllocated) {
-        if (EventParsed) free (EventParsed);
-        EventTokenAllocated = count;
-        EventParsed = calloc (count, sizeof(ParserToken));
-    }
-    const char *error = echttp_json_parse (EventBuffer, EventParsed, &count);
-    if (error) return ""; // Ignore bad data from applications.
-
-    // TBD: decode JSON, register events.
-    const char *host = housesaga_getjsonstring (EventParsed, ".host");
-    const char *app = housesaga_getjsonstring (EventParsed, ".apps[0]");
+static void housesaga_event_apply (const struct HouseSagaBatch *batch) {
 
-    char path[128];
-    snprintf (path, sizeof(path), ".%s.events", app);
-    int events = echttp_json_search(EventParsed, path);
-    if (EventParsed[events].type != PARSER_ARRAY) return "";
+    int source = housesaga_source_batch
+                     (batch->host, batch->app, HOUSESAGA_SOURCE_EVENT);
 
     int i;
-    for (i = 0; i < EventParsed[events].length; ++i) {
-        char path[128];
-        snprintf (path, sizeof(path), "[%d]", i);
-        int event = echttp_json_search(EventParsed+events, path);
-        if (event < 0) return "";
-        event += events;
-        struct timeval timestamp = housesaga_getjsontime (EventParsed+event, "[0]");
-        const char *category = housesaga_getjsonstring (EventParsed+event, "[1]");
-        const char *object = housesaga_getjsonstring (EventParsed+event, "[2]");
-        const char *action = housesaga_getjsonstring (EventParsed+event, "[3]");
-        const char *description = housesaga_getjsonstring (EventParsed+event, "[4]");
-        if ((timestamp.tv_sec > 0) &&
-            host && app && category && object && action && description) {
-            housesaga_event_new (&timestamp, host, app,
+    for (i = 0; i < batch->count; ++i) {
+        const struct HouseSagaRecord *record = batch->record + i;
+        const char *category = record->text[1];
+        const char *object = record->text[2];
+        const char *action = record->text[3];
+        const char *description = record->text[4];
+        if ((record->timestamp.tv_sec > 0) &&
+            category && object && action && description) {
+            housesaga_event_new (&(record->timestamp), batch->host, batch->app,
                                  category, object, action, description, 1);
-            housesaga_traffic_increment ("EventsReceived");
+            housesaga_traffic_increment (TrafficEventsReceived);
+            housesaga_source_record (source, &(record->timestamp));
         }
     }
+}
+
+static const char *housesaga_webpost (const char *data, int length) {
 
+    echttp_content_type_json ();
+    housesaga_parser_submit (ParserEvents, data, length);
     return "";
 }
 
@@ -488,26 +546,53 @@ static const char *housesaga_webevents (const char *method, const char *uri,
 
 void housesaga_event_initialize (int argc, const char **argv) {
 
-    if (!EventChronology) EventChronology = echttp_sorted_new();
+    TrafficEventsReceived = housesaga_traffic_register ("EventsReceived");
+    TrafficEventsDuplicate = housesaga_traffic_register ("EventsDuplicate");
+    ParserEvents = housesaga_parser_register
+                       ("parse:event", "events", housesaga_event_apply);
+    LatencyEventResidency = housesaga_latency_register ("residency:event");
+
+    if (!EventHistory) housesaga_event_live ();
 
-    echttp_route_uri ("/saga/log/events", housesaga_webevents);
-    echttp_route_uri ("/saga/log/latest", housesaga_weblatest); // Deprecated
+    housesaga_latency_route ("/saga/log/events", housesaga_webevents);
+    housesaga_latency_route ("/saga/log/latest", housesaga_weblatest); // Deprecated
 
     // Alternate paths for application-independent web pages.
     // (The log files are stored at the same place for all applications.)
     //
-    echttp_route_uri ("/log/events", housesaga_webevents);
-    echttp_route_uri ("/log/latest", housesaga_weblatest); // Deprecated.
+    housesaga_latency_route ("/log/events", housesaga_webevents);
+    housesaga_latency_route ("/log/latest", housesaga_weblatest); // Deprecated.
 
     housesaga_event_background (time(0)); // Initial state.
 }
 
-void housesaga_event_background (time_t now) {
+void housesaga_event_health (ParserContext context, int parent) {
+
+    int i;
+    int used = 0;
+    int unsaved = 0;
+    for (i = 0; i < HISTORY_DEPTH; ++i) {
+        if (!EventHistory[i].timestamp.tv_sec) continue;
+        used += 1;
+        if (EventHistory[i].unsaved) unsaved += 1;
+    }
+    int item = echttp_json_add_object (context, parent, 0);
+    echttp_json_add_string (context, item, "name", "event");
+    echttp_json_add_integer (context, item, "depth", HISTORY_DEPTH);
+    echttp_json_add_integer (context, item, "used", used);
+    echttp_json_add_integer (context, item, "unsaved", unsaved);
+    echttp_json_add_integer (context, item, "forced", EventForcedSaves);
+    echttp_json_add_integer (context, item, "rewinds", EventRewinds);
+    echttp_json_add_integer (context, item, "restored", EventRestored);
+    echttp_json_add_bool (context, item, "persistent", EventLive->persistent);
+    echttp_json_add_integer (context, item, "memory", HISTORY_DEPTH * sizeof(struct EventRecord));
+}
 
-    static time_t LastCall = 0;
-    if (now + 6 < LastCall) return;
-    LastCall = now;
+void housesaga_event_background (time_t now) {
 
     housesaga_event_save (0);
+    if (EventSaveNext)
+        housesaga_schedule (EventSaveNext + EVENT_SAVE_DELAY,
+                            housesaga_event_background);
 }
 
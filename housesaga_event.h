@@ -23,5 +23,7 @@
 
 void housesaga_event_initialize (int argc, const char **argv);
 
+void housesaga_event_health (ParserContext context, int parent);
+
 void housesaga_event_background (time_t now);
 
@@ -0,0 +1,759 @@
+/* housesaga - A log consolidation and storage service.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesaga_fanin.c - Merge the logs from several HouseSaga instances.
+ *
+ * Each HouseSaga instance may miss some records, e.g. while it was
+ * stopped. This module queries all the peer instances, merges their
+ * answers with the local data and removes the duplicates, so that the
+ * client gets the most complete history in one response.
+ *
+ * SYNOPSYS:
+ *
+ * void housesaga_fanin_initialize (int argc, const char **argv);
+ *
+ *    Read the list of peers from the -peers=HOST:PORT[,HOST:PORT..]
+ *    option, and the latency budget (milliseconds) from the
+ *    -fanin-budget=N option. Register the merged archive web API.
+ *
+ * int housesaga_fanin_requested (void);
+ *
+ *    Return true if the current web request asks for a fan-in, i.e. has
+ *    the "fanin" parameter, and there are peers.
+ *
+ * const char *housesaga_fanin_events (const char *local);
+ *
+ *    Merge the recent events from all peers with the local events, which
+ *    are provided as the local JSON response. Return the merged response.
+ *
+ * NOTE:
+ *
+ *    The web API never waits for the peers. The responses from the peers
+ *    are kept in a small cache, and a merged response is built from the
+ *    local data and the cached peer responses. Each fan-in request also
+ *    causes the cached responses that are more than a few seconds old to
+ *    be refreshed in the background, using the echttp client: the next
+ *    request gets the refreshed data. The peers that never answered, or
+ *    only long ago, are ignored and the response is marked as partial.
+ *    A peer that did not answer within the latency budget (default 500 ms)
+ *    is queried again on the next fan-in request.
+ *
+ *    The recent events are always requested from the peers without any
+ *    "since" parameter, so that the same cached response serves all the
+ *    clients. The "since" limit is applied when merging.
+ *
+ *    Each list of records is sorted first, on the timestamp and then the
+ *    content of the record. The lists are then merged, selecting the next
+ *    record from the head of each list. Since the whole record is part of
+ *    the sort key, identical records end up next to each other and the
+ *    duplicates are removed by comparing each record with the previous one.
+ *    The event IDs are not compared, since each instance has its own.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+#include "echttp_libc.h"
+#include "houselog.h"
+
+#include "housesaga.h"
+#include "housesaga_fanin.h"
+#include "housesaga_finalize.h"
+#include "housesaga_storage.h"
+#include "housesaga_latency.h"
+
+#define FANIN_PEERS    16
+#define FANIN_EVENTS   1024
+#define FANIN_REPLIES  8   // Cached responses per peer.
+#define FANIN_REFRESH  2   // Seconds before a cached response is refreshed.
+#define FANIN_EXPIRE   60  // Seconds before a cached response is ignored.
+#define FANIN_UNUSED   300 // Seconds before an unused response is dropped.
+
+struct FaninReply {
+    char uri[256];    // Empty if this cache entry is not used.
+    int status;       // Of the last response, 0 if none.
+    char *body;       // Of the last successful response.
+    int length;
+    time_t received;  // Time of the last successful response.
+    time_t asked;     // Time of the last request.
+    long long sent;   // Pending request (see housesaga_latency_now()).
+    long long elapsed; // Microseconds.
+    time_t used;
+    int generation;   // Identifies the requests for the current URI.
+};
+
+struct FaninPeer {
+    char host[128];
+    char port[8];
+    struct FaninReply reply[FANIN_REPLIES];
+};
+
+static struct FaninPeer FaninPeers[FANIN_PEERS];
+static int FaninPeersCount = 0;
+static int FaninBudget = 500; // Milliseconds.
+
+// The peer responses for the current web request, and whether these
+// are recent enough to be used.
+static const struct FaninReply *FaninCollected[FANIN_PEERS];
+static int FaninUsable[FANIN_PEERS];
+
+int housesaga_fanin_requested (void) {
+    return (FaninPeersCount > 0) && (echttp_parameter_get ("fanin") != 0);
+}
+
+static void housesaga_fanin_clear (struct FaninReply *reply) {
+    int generation = reply->generation + 1;
+    if (reply->body) free (reply->body);
+    memset (reply, 0, sizeof(*reply));
+    reply->generation = generation & 0xffff;
+}
+
+/* The origin of a request identifies the peer, the cache entry and the
+ * URI, so that a late response for a URI that was dropped from the cache
+ * is ignored.
+ */
+static void *housesaga_fanin_origin (int peer, int index, int generation) {
+    return (void *)(intptr_t)
+        ((((generation << 8) + peer) * FANIN_REPLIES) + index + 1);
+}
+
+static void housesaga_fanin_response (void *origin,
+                                      int status, char *data, int length) {
+
+    if (status == 302) {
+        status = echttp_redirected("GET");
+        if (!status) {
+            echttp_submit (0, 0, housesaga_fanin_response, origin);
+            return;
+        }
+    }
+    int value = (int)(intptr_t)origin - 1;
+    int index = value % FANIN_REPLIES;
+    int peer = (value / FANIN_REPLIES) & 0xff;
+    int generation = value / (FANIN_REPLIES * 256);
+    if (peer >= FaninPeersCount) return;
+
+    struct FaninReply *reply = FaninPeers[peer].reply + index;
+    if (reply->generation != generation) return; // Dropped meanwhile.
+
+    reply->status = status;
+    if (reply->sent) reply->elapsed = housesaga_latency_now() - reply->sent;
+    reply->sent = 0;
+    if (status != 200) {
+        if (status > 0) { // The peer answered, but has no data.
+            if (reply->body) free (reply->body);
+            reply->body = 0;
+            reply->length = 0;
+        }
+        return;
+    }
+
+    reply->body = realloc (reply->body, length + 1);
+    memcpy (reply->body, data, length);
+    reply->body[length] = 0;
+    reply->length = length;
+    reply->received = time(0);
+}
+
+static void housesaga_fanin_request (int index, struct FaninReply *reply) {
+
+    struct FaninPeer *peer = FaninPeers + index;
+
+    char url[512];
+    snprintf (url, sizeof(url), "http://%s:%s%s",
+              peer->host, peer->port, reply->uri);
+
+    const char *error = echttp_client ("GET", url);
+    if (error) {
+        reply->status = 0;
+        reply->sent = 0;
+        houselog_trace (HOUSE_FAILURE, "FANIN", "%s: %s", url, error);
+        return;
+    }
+    reply->asked = time(0);
+    reply->sent = housesaga_latency_now();
+    echttp_submit (0, 0, housesaga_fanin_response,
+                   housesaga_fanin_origin (index, reply - peer->reply,
+                                           reply->generation));
+}
+
+/* Drop the cached responses that have not been used for a while.
+ */
+static void housesaga_fanin_background (time_t now) {
+
+    int i, j;
+    int used = 0;
+    for (i = 0; i < FaninPeersCount; ++i) {
+        for (j = 0; j < FANIN_REPLIES; ++j) {
+            struct FaninReply *reply = FaninPeers[i].reply + j;
+            if (!reply->uri[0]) continue;
+            if (reply->used + FANIN_UNUSED < now) {
+                housesaga_fanin_clear (reply);
+            } else {
+                used += 1;
+            }
+        }
+    }
+    if (used) housesaga_schedule (now + 60, housesaga_fanin_background);
+}
+
+/* Find the cached response for this URI, or else reuse the least recently
+ * used entry.
+ */
+static struct FaninReply *housesaga_fanin_reply (struct FaninPeer *peer,
+                                                 const char *uri) {
+    int i;
+    struct FaninReply *oldest = peer->reply;
+    for (i = 0; i < FANIN_REPLIES; ++i) {
+        struct FaninReply *reply = peer->reply + i;
+        if (!strcmp (reply->uri, uri)) return reply;
+        if (reply->used < oldest->used) oldest = reply;
+    }
+    housesaga_fanin_clear (oldest);
+    strtcpy (oldest->uri, uri, sizeof(oldest->uri));
+    return oldest;
+}
+
+/* Collect the cached responses of all peers to this request, and refresh
+ * the ones that are old in the background. Return the number of peers
+ * with a recent successful response.
+ */
+static int housesaga_fanin_collect (const char *uri) {
+
+    int i;
+    int responded = 0;
+    time_t now = time(0);
+    long long budget = FaninBudget * 1000LL;
+
+    for (i = 0; i < FaninPeersCount; ++i) {
+        struct FaninPeer *peer = FaninPeers + i;
+        struct FaninReply *reply = housesaga_fanin_reply (peer, uri);
+        reply->used = now;
+
+        if (reply->sent &&
+            (housesaga_latency_now() - reply->sent > budget)) {
+            reply->status = 0; // Too slow: ask again.
+            reply->sent = 0;
+        }
+        if ((!reply->sent) && (reply->asked + FANIN_REFRESH <= now))
+            housesaga_fanin_request (i, reply);
+
+        FaninCollected[i] = reply;
+        FaninUsable[i] = reply->body && (reply->received + FANIN_EXPIRE > now);
+        if (FaninUsable[i]) responded += 1;
+    }
+    housesaga_schedule (now + 60, housesaga_fanin_background);
+    return responded;
+}
+
+static void housesaga_fanin_peers (ParserContext context, int parent) {
+
+    int list = echttp_json_add_array (context, parent, "peers");
+    int i;
+    for (i = 0; i < FaninPeersCount; ++i) {
+        const struct FaninPeer *peer = FaninPeers + i;
+        const struct FaninReply *reply = FaninCollected[i];
+        int item = echttp_json_add_object (context, list, 0);
+        echttp_json_add_string (context, item, "host", peer->host);
+        echttp_json_add_string (context, item, "port", peer->port);
+        echttp_json_add_integer (context, item, "status", reply->status);
+        if (FaninUsable[i]) {
+            echttp_json_add_integer (context, item, "latency", reply->elapsed);
+            echttp_json_add_integer (context, item, "age",
+                                     (long long)(time(0) - reply->received));
+        }
+    }
+}
+
+// The merge of recent events.
+//
+#define FANIN_FIELDS 6 // category, object, action, description, host, app.
+
+struct FaninEvent {
+    long long timestamp; // Milliseconds.
+    long long id;
+    const char *field[FANIN_FIELDS];
+};
+
+struct FaninList {
+    struct FaninEvent *event;
+    int count;
+    int cursor;
+};
+
+static int housesaga_fanin_eventcmp (const struct FaninEvent *a,
+                                     const struct FaninEvent *b) {
+    // Most recent first, then sorted on the content.
+    if (a->timestamp > b->timestamp) return -1;
+    if (a->timestamp < b->timestamp) return 1;
+    int i;
+    for (i = 0; i < FANIN_FIELDS; ++i) {
+        int delta = strcmp (a->field[i], b->field[i]);
+        if (delta) return delta;
+    }
+    return 0;
+}
+
+static int housesaga_fanin_eventsort (const void *a, const void *b) {
+    return housesaga_fanin_eventcmp ((const struct FaninEvent *)a,
+                                     (const struct FaninEvent *)b);
+}
+
+/* Decode a JSON list of events (the GET /saga/log/events response).
+ * The tokens must remain available until the merge is complete.
+ */
+static void housesaga_fanin_eventlist (char *json, ParserToken **token,
+                                       struct FaninList *list) {
+
+    list->event = 0;
+    list->count = list->cursor = 0;
+    *token = 0;
+    if (!json) return;
+
+    int count = echttp_json_estimate (json);
+    *token = calloc (count, sizeof(ParserToken));
+    if (echttp_json_parse (json, *token, &count)) return;
+
+    ParserToken *t = *token;
+    int item = echttp_json_search (t, ".apps[0]");
+    if ((item < 0) || (t[item].type != PARSER_STRING)) return;
+
+    char path[128];
+    snprintf (path, sizeof(path), ".%s.events", t[item].value.string);
+    int events = echttp_json_search (t, path);
+    if ((events < 0) || (t[events].type != PARSER_ARRAY)) return;
+    if (t[events].length <= 0) return;
+
+    list->event = calloc (t[events].length, sizeof(struct FaninEvent));
+    int i;
+    for (i = 0; i < t[events].length; ++i) {
+        snprintf (path, sizeof(path), "[%d]", i);
+        int element = echttp_json_search (t + events, path);
+        if (element < 0) break;
+        const ParserToken *record = t + events + element;
+        if ((record->type != PARSER_ARRAY) || (record->length < 7)) continue;
+
+        struct FaninEvent *event = list->event + list->count;
+        int j;
+        for (j = 0; j <= FANIN_FIELDS + 1; ++j) {
+            snprintf (path, sizeof(path), "[%d]", j);
+            int field = echttp_json_search (record, path);
+            if (field < 0) break;
+            const ParserToken *value = record + field;
+            if (j == 0) {
+                if (value->type != PARSER_INTEGER) break;
+                event->timestamp = value->value.integer;
+            } else if (j <= FANIN_FIELDS) {
+                if (value->type != PARSER_STRING) break;
+                event->field[j-1] = value->value.string;
+            } else if (value->type == PARSER_INTEGER) {
+                event->id = value->value.integer;
+            }
+        }
+        if (j > FANIN_FIELDS) list->count += 1;
+    }
+    qsort (list->event, list->count, sizeof(struct FaninEvent),
+           housesaga_fanin_eventsort);
+}
+
+const char *housesaga_fanin_events (const char *local) {
+
+    static char *buffer = 0;
+    static int size = 0;
+
+    const char *since = echttp_parameter_get("since");
+    long long limit = since ? atoll(since) : 0;
+    int responded = housesaga_fanin_collect ("/saga/log/events");
+
+    // Decode the local events first (list 0), then each peer's. The JSON
+    // decoder modifies the text, so the cached responses are copied.
+    //
+    struct FaninList lists[FANIN_PEERS + 1];
+    ParserToken *tokens[FANIN_PEERS + 1];
+    char *copies[FANIN_PEERS + 1];
+    int i;
+    int total = 0;
+    copies[0] = strdup (local);
+    housesaga_fanin_eventlist (copies[0], tokens, lists);
+    total += lists[0].count;
+    for (i = 0; i < FaninPeersCount; ++i) {
+        const struct FaninReply *reply = FaninCollected[i];
+        copies[i+1] = FaninUsable[i] ? strdup (reply->body) : 0;
+        housesaga_fanin_eventlist (copies[i+1], tokens + i + 1, lists + i + 1);
+        total += lists[i+1].count;
+    }
+
+    // Reuse the local response's header items.
+    //
+    ParserToken *header = tokens[0];
+    const char *app = "saga";
+    long long latest = 0;
+    const char *proxy = "";
+    if (header) {
+        int item = echttp_json_search (header, ".apps[0]");
+        if ((item >= 0) && (header[item].type == PARSER_STRING))
+            app = header[item].value.string;
+        item = echttp_json_search (header, ".latest");
+        if ((item >= 0) && (header[item].type == PARSER_INTEGER))
+            latest = header[item].value.integer;
+        item = echttp_json_search (header, ".proxy");
+        if ((item >= 0) && (header[item].type == PARSER_STRING))
+            proxy = header[item].value.string;
+    }
+
+    int tokencount = 64 + FaninPeersCount * 8 + FANIN_EVENTS * 10;
+    ParserToken *token = calloc (tokencount, sizeof(ParserToken));
+    int poolsize = 4096 + FaninPeersCount * 256 + total * 1200;
+    char *pool = malloc (poolsize);
+    ParserContext context = echttp_json_start (token, tokencount,
+                                               pool, poolsize);
+
+    int root = echttp_json_add_object (context, 0, 0);
+    echttp_json_add_string (context, root, "host", housesaga_host());
+    echttp_json_add_string (context, root, "proxy", proxy);
+    int apps = echttp_json_add_array (context, root, "apps");
+    echttp_json_add_string (context, apps, 0, app);
+    echttp_json_add_integer (context, root, "timestamp", (long long)time(0));
+    echttp_json_add_integer (context, root, "latest", latest);
+    int top = echttp_json_add_object (context, root, app);
+    echttp_json_add_bool (context, top, "invert", 1);
+    echttp_json_add_integer (context, top, "latest", latest);
+    echttp_json_add_bool (context, top, "partial",
+                          responded < FaninPeersCount);
+    housesaga_fanin_peers (context, top);
+    int container = echttp_json_add_array (context, top, "events");
+
+    // Merge: pick the most recent event among the heads of all lists.
+    //
+    const struct FaninEvent *previous = 0;
+    int emitted = 0;
+    while (emitted < FANIN_EVENTS) {
+        struct FaninList *best = 0;
+        for (i = 0; i <= FaninPeersCount; ++i) {
+            struct FaninList *list = lists + i;
+            if (list->cursor >= list->count) continue;
+            if ((!best) ||
+                (housesaga_fanin_eventcmp (list->event + list->cursor,
+                                           best->event + best->cursor) < 0))
+                best = list;
+        }
+        if (!best) break;
+        const struct FaninEvent *event = best->event + (best->cursor++);
+        if (event->timestamp < limit) break; // All the others are older.
+        if (previous && (!housesaga_fanin_eventcmp (previous, event)))
+            continue; // Duplicate.
+        previous = event;
+
+        int item = echttp_json_add_array (context, container, 0);
+        echttp_json_add_integer (context, item, 0, event->timestamp);
+        int j;
+        for (j = 0; j < FANIN_FIELDS; ++j)
+            echttp_json_add_string (context, item, 0, event->field[j]);
+        echttp_json_add_integer (context, item, 0, event->id);
+        emitted += 1;
+    }
+
+    int needed = 4096 + FaninPeersCount * 256 + emitted * 1200;
+    if (needed > size) {
+        size = needed;
+        buffer = realloc (buffer, size);
+    }
+    const char *error = echttp_json_export (context, buffer, size);
+
+    for (i = 0; i <= FaninPeersCount; ++i) {
+        if (tokens[i]) free (tokens[i]);
+        if (lists[i].event) free (lists[i].event);
+        if (copies[i]) free (copies[i]);
+    }
+    free (token);
+    free (pool);
+
+    if (error) {
+        echttp_error (500, error);
+        return "";
+    }
+    echttp_content_type_json ();
+    return buffer;
+}
+
+// The merge of archive files.
+//
+struct FaninLine {
+    long long timestamp; // Milliseconds.
+    const char *text;
+};
+
+struct FaninFile {
+    struct FaninLine *line;
+    int count;
+    int cursor;
+};
+
+static long long housesaga_fanin_timestamp (const char *line) {
+    char *end;
+    long long seconds = strtoll (line, &end, 10);
+    long long milliseconds = 0;
+    if (*end == '.') milliseconds = atoi (end + 1);
+    return seconds * 1000 + milliseconds;
+}
+
+static int housesaga_fanin_linecmp (const struct FaninLine *a,
+                                    const struct FaninLine *b) {
+    if (a->timestamp < b->timestamp) return -1;
+    if (a->timestamp > b->timestamp) return 1;
+    return strcmp (a->text, b->text);
+}
+
+static int housesaga_fanin_linesort (const void *a, const void *b) {
+    return housesaga_fanin_linecmp ((const struct FaninLine *)a,
+                                    (const struct FaninLine *)b);
+}
+
+/* Split a CSV file into sorted records. The text is modified in place.
+ * If the file is known to be sorted by timestamp, only the records with
+ * the same timestamp are sorted. Return the header line, if any.
+ */
+static const char *housesaga_fanin_split (char *text, int sorted,
+                                          struct FaninFile *file) {
+
+    const char *header = 0;
+    int size = 0;
+
+    file->line = 0;
+    file->count = file->cursor = 0;
+    if (!text) return 0;
+
+    while (*text) {
+        char *eol = strchr (text, '\n');
+        if (eol) *eol = 0;
+        if (isdigit((unsigned char)(text[0]))) {
+            if (file->count >= size) {
+                size += 4096;
+                file->line = realloc (file->line, size * sizeof(file->line[0]));
+            }
+            file->line[file->count].timestamp = housesaga_fanin_timestamp (text);
+            file->line[file->count++].text = text;
+        } else if (text[0] && (!header) && (!file->count)) {
+            header = text;
+        }
+        if (!eol) break;
+        text = eol + 1;
+    }
+    if (!sorted) {
+        qsort (file->line, file->count, sizeof(file->line[0]),
+               housesaga_fanin_linesort);
+        return header;
+    }
+    int start = 0;
+    while (start < file->count) {
+        int end = start + 1;
+        while ((end < file->count) &&
+               (file->line[end].timestamp == file->line[start].timestamp))
+            end += 1;
+        if (end - start > 1)
+            qsort (file->line + start, end - start, sizeof(file->line[0]),
+                   housesaga_fanin_linesort);
+        start = end;
+    }
+    return header;
+}
+
+static char *housesaga_fanin_readfile (const char *path) {
+
+    FILE *f = fopen (path, "r");
+    if (!f) return 0;
+    fseek (f, 0, SEEK_END);
+    long length = ftell (f);
+    fseek (f, 0, SEEK_SET);
+    char *text = malloc (length + 1);
+    length = fread (text, 1, length, f);
+    text[length] = 0;
+    fclose (f);
+    return text;
+}
+
+static int housesaga_fanin_validfile (const char *name) {
+    if ((!name) || (!isalnum((unsigned char)(name[0])))) return 0;
+    const char *dot = strrchr (name, '.');
+    if ((!dot) || strcmp (dot, ".csv")) return 0;
+    for (; *name; ++name) {
+        if ((!isalnum((unsigned char)(*name))) &&
+            (*name != '-') && (*name != '.')) return 0;
+    }
+    return 1;
+}
+
+static char *WebMergedBuffer = 0;
+static int   WebMergedSize = 0;
+static int   WebMergedLength = 0;
+
+static void housesaga_fanin_output (const char *line) {
+
+    int length = strlen (line);
+    if (WebMergedLength + length + 2 > WebMergedSize) {
+        WebMergedSize += length + 65536;
+        WebMergedBuffer = realloc (WebMergedBuffer, WebMergedSize);
+    }
+    memcpy (WebMergedBuffer + WebMergedLength, line, length);
+    WebMergedLength += length;
+    WebMergedBuffer[WebMergedLength++] = '\n';
+    WebMergedBuffer[WebMergedLength] = 0;
+}
+
+static const char *housesaga_fanin_webmerged (const char *method,
+                                              const char *uri,
+                                              const char *data, int length) {
+
+    const char *year = echttp_parameter_get("year");
+    const char *month = echttp_parameter_get("month");
+    const char *day = echttp_parameter_get("day");
+    const char *name = echttp_parameter_get("file");
+    if ((!year) || (!month) || (!day)) {
+        echttp_error (400, "Missing date");
+        return "";
+    }
+    if (!housesaga_fanin_validfile (name)) {
+        echttp_error (400, "Invalid file name");
+        return "";
+    }
+    int y = atoi(year);
+    int m = atoi(month);
+    int d = atoi(day);
+
+    char path[1024];
+    snprintf (path, sizeof(path), "/saga/archive/%04d/%02d/%02d/%s",
+              y, m, d, name);
+    int responded = housesaga_fanin_collect (path);
+
+    housesaga_storage_flush (); // Make sure the local file is complete.
+    int len = housesaga_storage_daypath (path, sizeof(path), y, m, d);
+    snprintf (path + len, sizeof(path) - len, "/%s", name);
+    int sorted = housesaga_finalize_sorted (path);
+    char *local = housesaga_fanin_readfile (path);
+
+    // The split modifies the text, so the cached responses are copied.
+    //
+    struct FaninFile files[FANIN_PEERS + 1];
+    char *copies[FANIN_PEERS];
+    const char *header = housesaga_fanin_split (local, sorted, files);
+    int i;
+    for (i = 0; i < FaninPeersCount; ++i) {
+        const struct FaninReply *reply = FaninCollected[i];
+        copies[i] = FaninUsable[i] ? strdup (reply->body) : 0;
+        const char *peerheader =
+            housesaga_fanin_split (copies[i], 0, files + i + 1);
+        if (!header) header = peerheader;
+    }
+
+    WebMergedLength = 0;
+    if (header) housesaga_fanin_output (header);
+
+    const struct FaninLine *previous = 0;
+    for (;;) {
+        struct FaninFile *best = 0;
+        for (i = 0; i <= FaninPeersCount; ++i) {
+            struct FaninFile *file = files + i;
+            if (file->cursor >= file->count) continue;
+            if ((!best) ||
+                (housesaga_fanin_linecmp (file->line + file->cursor,
+                                          best->line + best->cursor) < 0))
+                best = file;
+        }
+        if (!best) break;
+        const struct FaninLine *line = best->line + (best->cursor++);
+        if (previous && (!housesaga_fanin_linecmp (previous, line)))
+            continue; // Duplicate.
+        previous = line;
+        housesaga_fanin_output (line->text);
+    }
+    if (!WebMergedLength) housesaga_fanin_output ("");
+
+    for (i = 0; i <= FaninPeersCount; ++i) {
+        if (files[i].line) free (files[i].line);
+    }
+    for (i = 0; i < FaninPeersCount; ++i) {
+        if (copies[i]) free (copies[i]);
+    }
+    if (local) free (local);
+
+    if (responded < FaninPeersCount)
+        echttp_attribute_set ("X-Partial", "true");
+    echttp_content_type_set ("text/csv");
+    return WebMergedBuffer;
+}
+
+static void housesaga_fanin_addpeer (const char *text, int length) {
+
+    if (FaninPeersCount >= FANIN_PEERS) return;
+    if ((length <= 0) || (length >= sizeof(FaninPeers[0].host))) return;
+
+    struct FaninPeer *peer = FaninPeers + FaninPeersCount;
+    memset (peer, 0, sizeof(*peer));
+    memcpy (peer->host, text, length);
+    peer->host[length] = 0;
+
+    char *port = strrchr (peer->host, ':');
+    if (port) {
+        *(port++) = 0;
+        strtcpy (peer->port, port, sizeof(peer->port));
+    } else {
+        strtcpy (peer->port, "80", sizeof(peer->port));
+    }
+    FaninPeersCount += 1;
+}
+
+void housesaga_fanin_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *peers = 0;
+    const char *budget = 0;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-peers=", argv[i], &peers)) continue;
+        if (echttp_option_match ("-fanin-budget=", argv[i], &budget)) continue;
+    }
+    if (budget) FaninBudget = atoi (budget);
+    if (FaninBudget <= 0) FaninBudget = 500;
+
+    while (peers && *peers) {
+        const char *comma = strchr (peers, ',');
+        int length = comma ? (int)(comma - peers) : (int)strlen(peers);
+        housesaga_fanin_addpeer (peers, length);
+        peers = comma ? comma + 1 : 0;
+    }
+
+    housesaga_latency_route ("/saga/merged", housesaga_fanin_webmerged);
+
+    // Alternate path for application-independent web pages.
+    // (The log files are stored at the same place for all applications.)
+    //
+    housesaga_latency_route ("/merged", housesaga_fanin_webmerged);
+}
+
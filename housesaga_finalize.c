@@ -0,0 +1,473 @@
+/* housesaga - A log consolidation and storage service.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesaga_finalize.c - Restore the chronological order of past log files.
+ *
+ * Records that arrive late are appended at the end of the log file, out
+ * of sequence. Once a day is over, this module rewrites each CSV log file
+ * of that day in chronological order. The file is made of sorted runs
+ * (each late batch starts a new run), so the rewrite is a merge of these
+ * runs. Records with the same timestamp stay in their original order.
+ * The merge result is written to a temporary file, which replaces the log
+ * file only if that file was not modified while it was being sorted.
+ *
+ * A sorted file is marked by a hidden file .NAME.sorted in the same day
+ * folder, which contains the size of the sorted file. The mark becomes
+ * obsolete if the file size changes, i.e. if more late records were
+ * appended, and the file is then sorted again.
+ *
+ * SYNOPSYS:
+ *
+ * void housesaga_finalize_initialize (int argc, const char **argv);
+ *
+ *    Initialize the environment required to sort the log files.
+ *
+ * int housesaga_finalize_sorted (const char *path);
+ *
+ *    Return true if the specified log file is known to be sorted, i.e.
+ *    a reader may search it by timestamp without sorting it first.
+ *
+ * void housesaga_finalize_mark (const char *path);
+ *
+ *    Mark the specified log file as sorted. This is used when the file
+ *    was written in chronological order by other means.
+ *
+ * void housesaga_finalize_background (time_t now);
+ *
+ *    Sort the log files of the past days that are not marked, one at
+ *    a time. Each file is sorted in steps, a limited number of records
+ *    at a time. This is a scheduled action that runs every second while
+ *    a file is being sorted or pending, every hour otherwise.
+ */
+
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+#include "houselog.h"
+
+#include "housesaga.h"
+#include "housesaga_finalize.h"
+#include "housesaga_storage.h"
+#include "housesaga_latency.h"
+
+static int LatencyFinalize = -1;
+
+#define FINALIZE_PENDING_MAX 256
+static char *FinalizePending[FINALIZE_PENDING_MAX];
+static int   FinalizePendingCount = 0;
+
+// One record: the first line of the record, plus any following line that
+// does not start with a timestamp (which should never happen).
+//
+struct FinalizeRecord {
+    long long timestamp; // Milliseconds.
+    const char *start;
+    size_t length;
+};
+
+static struct FinalizeRecord *FinalizeRecords = 0;
+static int FinalizeRecordsSize = 0;
+
+struct FinalizeRun {
+    int cursor;
+    int end;
+};
+
+static struct FinalizeRun *FinalizeRuns = 0;
+static int FinalizeRunsSize = 0;
+static int *FinalizeHeap = 0;
+static int  FinalizeHeapCount = 0;
+static int  FinalizeHeapSize = 0;
+
+static void housesaga_finalize_markpath (char *buffer, int size,
+                                         const char *path) {
+    const char *name = strrchr (path, '/');
+    if (name)
+        snprintf (buffer, size, "%.*s/.%s.sorted",
+                  (int)(name - path), path, name + 1);
+    else
+        snprintf (buffer, size, ".%s.sorted", path);
+}
+
+int housesaga_finalize_sorted (const char *path) {
+
+    char markpath[1024];
+    struct stat info;
+    long long size = -1;
+
+    if (stat (path, &info)) return 0;
+    housesaga_finalize_markpath (markpath, sizeof(markpath), path);
+    FILE *mark = fopen (markpath, "r");
+    if (!mark) return 0;
+    if (fscanf (mark, "%lld", &size) != 1) size = -1;
+    fclose (mark);
+    return (size == (long long)(info.st_size));
+}
+
+void housesaga_finalize_mark (const char *path) {
+
+    char markpath[1024];
+    struct stat info;
+
+    if (stat (path, &info)) return;
+    housesaga_finalize_markpath (markpath, sizeof(markpath), path);
+    FILE *mark = fopen (markpath, "w");
+    if (!mark) return;
+    fprintf (mark, "%lld\n", (long long)(info.st_size));
+    fclose (mark);
+}
+
+static long long housesaga_finalize_timestamp (const char *line) {
+    long long seconds = 0;
+    long long milliseconds = 0;
+    while (isdigit((unsigned char)(*line))) seconds = seconds * 10 + *(line++) - '0';
+    if (*line == '.') {
+        int digits;
+        for (digits = 0, ++line; digits < 3; ++digits) {
+            milliseconds *= 10;
+            if (isdigit((unsigned char)(*line))) milliseconds += *(line++) - '0';
+        }
+    }
+    return seconds * 1000 + milliseconds;
+}
+
+static int housesaga_finalize_less (int a, int b) {
+    const struct FinalizeRecord *ra = FinalizeRecords + FinalizeRuns[a].cursor;
+    const struct FinalizeRecord *rb = FinalizeRecords + FinalizeRuns[b].cursor;
+    if (ra->timestamp != rb->timestamp) return ra->timestamp < rb->timestamp;
+    return a < b; // Keep the arrival order of identical timestamps.
+}
+
+static void housesaga_finalize_sift (int i) {
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if ((left < FinalizeHeapCount) &&
+            housesaga_finalize_less (FinalizeHeap[left], FinalizeHeap[smallest]))
+            smallest = left;
+        if ((right < FinalizeHeapCount) &&
+            housesaga_finalize_less (FinalizeHeap[right], FinalizeHeap[smallest]))
+            smallest = right;
+        if (smallest == i) return;
+        int swap = FinalizeHeap[i];
+        FinalizeHeap[i] = FinalizeHeap[smallest];
+        FinalizeHeap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+// The file being sorted. The sort is split in steps, so that a large file
+// does not block the service: each step splits or writes a limited number
+// of records, and the next step is scheduled one second later.
+//
+#define FINALIZE_RECORDS_PER_TICK 65536
+
+#define FINALIZE_IDLE  0
+#define FINALIZE_SPLIT 1
+#define FINALIZE_MERGE 2
+
+static int FinalizeState = FINALIZE_IDLE;
+static char FinalizePath[1024];
+static char FinalizeTemp[1040];
+static struct stat FinalizeInfo;
+static const char *FinalizeData = 0;
+static size_t FinalizeSize = 0;
+static size_t FinalizeScanned = 0;
+static int FinalizeCount = 0;
+static int FinalizeRunCount = 0;
+static FILE *FinalizeOut = 0;
+
+static void housesaga_finalize_stop (void) {
+    if (FinalizeOut) {
+        fclose (FinalizeOut);
+        FinalizeOut = 0;
+        unlink (FinalizeTemp);
+    }
+    if (FinalizeData) munmap ((void *)FinalizeData, FinalizeSize);
+    FinalizeData = 0;
+    FinalizeSize = 0;
+    FinalizeState = FINALIZE_IDLE;
+}
+
+/* Return true if the file was not modified since the sort started.
+ */
+static int housesaga_finalize_unchanged (void) {
+
+    struct stat info;
+
+    housesaga_storage_flush (); // Late records may target this file.
+    if (stat (FinalizePath, &info)) return 0;
+    return (info.st_ino == FinalizeInfo.st_ino) &&
+           (info.st_size == FinalizeInfo.st_size) &&
+           (info.st_mtime == FinalizeInfo.st_mtime);
+}
+
+static void housesaga_finalize_start (const char *path) {
+
+    if (housesaga_finalize_sorted (path)) return;
+
+    int fd = open (path, O_RDONLY);
+    if (fd < 0) return;
+    if (fstat (fd, &FinalizeInfo) || (FinalizeInfo.st_size <= 0)) {
+        close (fd);
+        return;
+    }
+    FinalizeSize = (size_t)(FinalizeInfo.st_size);
+    FinalizeData = mmap (0, FinalizeSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (FinalizeData == MAP_FAILED) {
+        FinalizeData = 0;
+        FinalizeSize = 0;
+        return;
+    }
+    snprintf (FinalizePath, sizeof(FinalizePath), "%s", path);
+    FinalizeScanned = 0;
+    FinalizeCount = 0;
+    FinalizeRunCount = 0;
+    FinalizeState = FINALIZE_SPLIT;
+}
+
+/* Split the next part of the file content into records and sorted runs.
+ * Return true when the whole file was split.
+ */
+static int housesaga_finalize_split (void) {
+
+    int records = FinalizeCount;
+    int runcount = FinalizeRunCount;
+    int limit = records + FINALIZE_RECORDS_PER_TICK;
+    const char *cursor = FinalizeData + FinalizeScanned;
+    const char *end = FinalizeData + FinalizeSize;
+
+    while ((cursor < end) && (records < limit)) {
+        const char *eol = memchr (cursor, '\n', end - cursor);
+        const char *next = eol ? eol + 1 : end;
+
+        if (isdigit((unsigned char)(*cursor))) {
+            if (records >= FinalizeRecordsSize) {
+                FinalizeRecordsSize += 16384;
+                FinalizeRecords = realloc (FinalizeRecords,
+                        FinalizeRecordsSize * sizeof(struct FinalizeRecord));
+            }
+            struct FinalizeRecord *record = FinalizeRecords + records;
+            record->timestamp = housesaga_finalize_timestamp (cursor);
+            record->start = cursor;
+            record->length = next - cursor;
+
+            if ((records == 0) ||
+                (record->timestamp < record[-1].timestamp)) {
+                if (runcount >= FinalizeRunsSize) {
+                    FinalizeRunsSize += 256;
+                    FinalizeRuns = realloc (FinalizeRuns,
+                            FinalizeRunsSize * sizeof(struct FinalizeRun));
+                }
+                if (runcount > 0) FinalizeRuns[runcount-1].end = records;
+                FinalizeRuns[runcount].cursor = records;
+                runcount += 1;
+            }
+            records += 1;
+        } else if (records > 0) {
+            FinalizeRecords[records-1].length += next - cursor;
+        }
+        cursor = next;
+    }
+    if (runcount > 0) FinalizeRuns[runcount-1].end = records;
+
+    FinalizeScanned = cursor - FinalizeData;
+    FinalizeCount = records;
+    FinalizeRunCount = runcount;
+    return cursor >= end;
+}
+
+static void housesaga_finalize_write (FILE *out,
+                                      const struct FinalizeRecord *record) {
+    fwrite (record->start, 1, record->length, out);
+    if (record->start[record->length-1] != '\n') fputc ('\n', out);
+}
+
+/* Prepare the merge of all runs. The header is everything before the
+ * first record.
+ */
+static void housesaga_finalize_prepare (void) {
+
+    if (FinalizeRunCount <= 1) {
+        if (housesaga_finalize_unchanged ())
+            housesaga_finalize_mark (FinalizePath); // Already in order.
+        housesaga_finalize_stop ();
+        return;
+    }
+
+    snprintf (FinalizeTemp, sizeof(FinalizeTemp), "%s.sort", FinalizePath);
+    FinalizeOut = fopen (FinalizeTemp, "w");
+    if (!FinalizeOut) {
+        housesaga_finalize_stop ();
+        return;
+    }
+    fwrite (FinalizeData, 1, FinalizeRecords[0].start - FinalizeData,
+            FinalizeOut);
+
+    int i;
+    int runs = FinalizeRunCount;
+    if (runs > FinalizeHeapSize) {
+        FinalizeHeapSize = runs;
+        FinalizeHeap = realloc (FinalizeHeap, FinalizeHeapSize * sizeof(int));
+    }
+    for (i = 0; i < runs; ++i) FinalizeHeap[i] = i;
+    FinalizeHeapCount = runs;
+    for (i = runs / 2 - 1; i >= 0; --i) housesaga_finalize_sift (i);
+    FinalizeState = FINALIZE_MERGE;
+}
+
+/* Write the next records in chronological order. Return true when all
+ * records were written.
+ */
+static int housesaga_finalize_merge (void) {
+
+    int written;
+    for (written = 0; written < FINALIZE_RECORDS_PER_TICK; ++written) {
+        if (FinalizeHeapCount <= 0) return 1;
+        struct FinalizeRun *run = FinalizeRuns + FinalizeHeap[0];
+        housesaga_finalize_write (FinalizeOut, FinalizeRecords + run->cursor);
+        if (++(run->cursor) >= run->end) {
+            FinalizeHeap[0] = FinalizeHeap[--FinalizeHeapCount];
+        }
+        housesaga_finalize_sift (0);
+    }
+    return FinalizeHeapCount <= 0;
+}
+
+static void housesaga_finalize_complete (void) {
+
+    int error = ferror (FinalizeOut);
+    if (fclose (FinalizeOut)) error = 1;
+    FinalizeOut = 0;
+
+    if (!housesaga_finalize_unchanged ()) {
+        // Late records were appended while sorting: try again later.
+        unlink (FinalizeTemp);
+        housesaga_finalize_stop ();
+        return;
+    }
+    if (error || rename (FinalizeTemp, FinalizePath)) {
+        houselog_trace (HOUSE_FAILURE, "SORT", "cannot rewrite %s", FinalizePath);
+        unlink (FinalizeTemp);
+        housesaga_finalize_stop ();
+        return;
+    }
+    housesaga_finalize_mark (FinalizePath);
+    houselog_trace (HOUSE_INFO, "SORT", "sorted %s (%d records, %d runs)",
+                    FinalizePath, FinalizeCount, FinalizeRunCount);
+    housesaga_finalize_stop ();
+}
+
+/* Run the next step of the current sort.
+ */
+static void housesaga_finalize_step (void) {
+
+    switch (FinalizeState) {
+        case FINALIZE_SPLIT:
+            if (housesaga_finalize_split ()) housesaga_finalize_prepare ();
+            break;
+        case FINALIZE_MERGE:
+            if (housesaga_finalize_merge ()) housesaga_finalize_complete ();
+            break;
+    }
+}
+
+static int housesaga_finalize_iscsv (const char *name) {
+    if (name[0] == '.') return 0;
+    int length = strlen (name);
+    return (length > 4) && (!strcmp (name + length - 4, ".csv"));
+}
+
+static int FinalizeToday = 0;
+
+static void housesaga_finalize_visit (const char *path,
+                                      int year, int month, int day) {
+
+    int date = (year * 100 + month) * 100 + day;
+    if (date >= FinalizeToday) return; // Not closed yet.
+
+    DIR *dir = opendir (path);
+    if (!dir) return;
+
+    for (;;) {
+        struct dirent *p = readdir(dir);
+        if (!p) break;
+        if (!housesaga_finalize_iscsv (p->d_name)) continue;
+        if (FinalizePendingCount >= FINALIZE_PENDING_MAX) break;
+
+        char filepath[1024];
+        snprintf (filepath, sizeof(filepath), "%s/%s", path, p->d_name);
+        if (housesaga_finalize_sorted (filepath)) continue;
+        FinalizePending[FinalizePendingCount++] = strdup (filepath);
+    }
+    closedir (dir);
+}
+
+void housesaga_finalize_background (time_t now) {
+
+    static time_t LastScan = 0;
+
+    if ((FinalizeState != FINALIZE_IDLE) || (FinalizePendingCount > 0)) {
+        long long start = housesaga_latency_now ();
+        if (FinalizeState == FINALIZE_IDLE) {
+            char *filepath = FinalizePending[--FinalizePendingCount];
+            housesaga_storage_flush (); // Late records may target this file.
+            housesaga_finalize_start (filepath);
+            free (filepath);
+        }
+        housesaga_finalize_step ();
+        housesaga_latency_record (LatencyFinalize, start);
+        housesaga_schedule (now + 1, housesaga_finalize_background);
+        return;
+    }
+
+    if (now < LastScan + 3600) {
+        housesaga_schedule (LastScan + 3600, housesaga_finalize_background);
+        return;
+    }
+    LastScan = now;
+
+    struct tm local = *localtime (&now);
+    FinalizeToday = ((local.tm_year + 1900) * 100 + local.tm_mon + 1) * 100
+                    + local.tm_mday;
+    housesaga_storage_walk (housesaga_finalize_visit);
+    housesaga_schedule (FinalizePendingCount ? now + 1 : now + 3600,
+                        housesaga_finalize_background);
+}
+
+void housesaga_finalize_initialize (int argc, const char **argv) {
+    LatencyFinalize = housesaga_latency_register ("finalize:sort");
+}
+
@@ -0,0 +1,701 @@
+/* housesaga - A log consolidation and storage service.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesaga_import.c - Import historical records into the log files.
+ *
+ * This module loads large amounts of old records (e.g. when rebuilding
+ * a node, or when merging the logs of another node) directly into the
+ * daily log files, without going through the web API.
+ *
+ * SYNOPSYS:
+ *
+ * int housesaga_import_main (int argc, const char **argv);
+ *
+ *    Run the "housesaga import" command. The syntax is:
+ *
+ *       housesaga import [-log-path=PATH] [-type=event|sensor|trace]
+ *                        [-trace-split] [-chunk=MB] [FILE ..]
+ *
+ *    The records are read from the files listed, or from the standard
+ *    input if none. Return the process exit code.
+ *
+ * NOTE:
+ *
+ *    The input may mix two formats:
+ *    - CSV: the same format as the log files. The type of the records is
+ *      taken from the CSV header line, if it matches one of the HouseSaga
+ *      log types, or else from the -type option.
+ *    - NDJSON: the same format as the bulk ingestion web API, i.e. one
+ *      JSON object per line with the type, host, app and record items.
+ *
+ *    The records are first converted to the CSV log format and sorted by
+ *    log type and timestamp, using fixed size chunks (-chunk, default
+ *    64 MB) that are sorted in memory and then written to temporary run
+ *    files. The runs are then merged, and each day's records are merged
+ *    with the existing log file, which is sorted in memory first. The
+ *    duplicate records are removed. The result is written to a temporary
+ *    file, which then replaces the log file atomically.
+ *
+ *    The files written are marked as sorted. The trace indexes and the
+ *    digests are rebuilt automatically, since the log files were modified.
+ *    The import should not target the current day while HouseSaga is
+ *    running, since HouseSaga may be appending to the same file.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+
+#include "housesaga.h"
+#include "housesaga_import.h"
+#include "housesaga_parser.h"
+#include "housesaga_storage.h"
+#include "housesaga_finalize.h"
+
+#define IMPORT_TOKENS 64
+
+struct ImportType {
+    const char *key;     // As in the bulk ingestion type item.
+    const char *logtype; // As in the log file name.
+    const char *header;
+};
+
+static const struct ImportType ImportTypes[] = {
+    {"events", "event",
+     "TIMESTAMP,HOST,APP,CATEGORY,OBJECT,ACTION,DESCRIPTION"},
+    {"sensor", "sensor",
+     "TIMESTAMP,HOST,APP,LOCATION,NAME,VALUE,UNIT"},
+    {"traces", "trace",
+     "TIMESTAMP,HOST,APP,FILE,LINE,LEVEL,OBJECT,DESCRIPTION"},
+    {0, 0, 0}
+};
+
+static int ImportTraceSplit = 0;
+static const char *ImportFolder = "/var/lib/house/log";
+
+// The current chunk: "logtype\0line\0" strings, stored in one arena.
+//
+struct ImportLine {
+    long long timestamp; // Milliseconds.
+    const char *logtype;
+    const char *text;
+};
+
+static char *ImportArena = 0;
+static long  ImportArenaSize = 0;
+static long  ImportArenaUsed = 0;
+
+static struct ImportLine *ImportLines = 0;
+static int ImportLinesCount = 0;
+static int ImportLinesSize = 0;
+
+static int ImportRuns = 0;
+static long long ImportRead = 0;
+static long long ImportRejected = 0;
+
+static long long housesaga_import_timestamp (const char *line) {
+    char *end;
+    long long seconds = strtoll (line, &end, 10);
+    long long milliseconds = 0;
+    if (*end == '.') {
+        int digits;
+        for (digits = 0, ++end; digits < 3; ++digits) {
+            milliseconds *= 10;
+            if (isdigit((unsigned char)(*end))) milliseconds += *(end++) - '0';
+        }
+    }
+    return seconds * 1000 + milliseconds;
+}
+
+static int housesaga_import_compare (const struct ImportLine *a,
+                                     const struct ImportLine *b) {
+    int delta = strcmp (a->logtype, b->logtype);
+    if (delta) return delta;
+    if (a->timestamp < b->timestamp) return -1;
+    if (a->timestamp > b->timestamp) return 1;
+    return strcmp (a->text, b->text);
+}
+
+static int housesaga_import_sort (const void *a, const void *b) {
+    return housesaga_import_compare ((const struct ImportLine *)a,
+                                     (const struct ImportLine *)b);
+}
+
+static void housesaga_import_runpath (char *buffer, int size, int run) {
+    snprintf (buffer, size, "%s/.import-%d-%d", ImportFolder, (int)getpid(), run);
+}
+
+/* Sort the current chunk and write it as a new run file.
+ */
+static int housesaga_import_spill (void) {
+
+    if (ImportLinesCount <= 0) return 1;
+
+    qsort (ImportLines, ImportLinesCount, sizeof(ImportLines[0]),
+           housesaga_import_sort);
+
+    char path[1024];
+    housesaga_import_runpath (path, sizeof(path), ImportRuns);
+    FILE *run = fopen (path, "w");
+    if (!run) {
+        fprintf (stderr, "cannot create %s\n", path);
+        return 0;
+    }
+    int i;
+    for (i = 0; i < ImportLinesCount; ++i) {
+        fprintf (run, "%s\t%s\n", ImportLines[i].logtype, ImportLines[i].text);
+    }
+    fclose (run);
+    ImportRuns += 1;
+    ImportLinesCount = 0;
+    ImportArenaUsed = 0;
+    return 1;
+}
+
+static int housesaga_import_add (const char *logtype, const char *line) {
+
+    int typelength = strlen(logtype) + 1;
+    int length = strlen(line) + 1;
+
+    if (ImportArenaUsed + typelength + length > ImportArenaSize) {
+        if (!housesaga_import_spill ()) return 0;
+        if (typelength + length > ImportArenaSize) {
+            ImportRejected += 1; // Larger than a whole chunk.
+            return 1;
+        }
+    }
+    if (ImportLinesCount >= ImportLinesSize) {
+        ImportLinesSize += 65536;
+        ImportLines = realloc (ImportLines,
+                               ImportLinesSize * sizeof(ImportLines[0]));
+    }
+    char *copy = ImportArena + ImportArenaUsed;
+    memcpy (copy, logtype, typelength);
+    memcpy (copy + typelength, line, length);
+    ImportArenaUsed += typelength + length;
+
+    struct ImportLine *item = ImportLines + (ImportLinesCount++);
+    item->logtype = copy;
+    item->text = copy + typelength;
+    item->timestamp = housesaga_import_timestamp (item->text);
+    ImportRead += 1;
+    return 1;
+}
+
+/* Same file name rule as the trace module.
+ */
+static const char *housesaga_import_tracetype (char *buffer, int size,
+                                               const char *level) {
+    if (!ImportTraceSplit) return "trace";
+
+    int cursor = snprintf (buffer, size, "trace-");
+    while (*level && (*level != ',') && (cursor < size - 1)) {
+        if (isalnum((unsigned char)*level))
+            buffer[cursor++] = tolower((unsigned char)*level);
+        level += 1;
+    }
+    if (cursor <= 6) return "trace";
+    buffer[cursor] = 0;
+    return buffer;
+}
+
+/* Return the log type for a CSV record.
+ */
+static const char *housesaga_import_logtype (const struct ImportType *type,
+                                             const char *line,
+                                             char *buffer, int size) {
+    if (strcmp (type->logtype, "trace")) return type->logtype;
+
+    // The level is the 6th field, after fields that never contain a comma.
+    int field = 0;
+    for (; *line && (field < 5); ++line) {
+        if (*line == ',') field += 1;
+    }
+    return housesaga_import_tracetype (buffer, size, line);
+}
+
+static const char *housesaga_import_string (const ParserToken *token,
+                                            const char *path) {
+    int item = echttp_json_search (token, path);
+    if ((item < 0) || (token[item].type != PARSER_STRING)) return 0;
+    return token[item].value.string;
+}
+
+/* Convert one NDJSON record to the CSV log format.
+ */
+static int housesaga_import_json (char *line) {
+
+    ParserToken token[IMPORT_TOKENS];
+    int count = IMPORT_TOKENS;
+    if (echttp_json_parse (line, token, &count)) return 0;
+
+    const char *key = housesaga_import_string (token, ".type");
+    const char *host = housesaga_import_string (token, ".host");
+    const char *app = housesaga_import_string (token, ".app");
+    int item = echttp_json_search (token, ".record");
+    if ((!key) || (!host) || (!app) ||
+        (item < 0) || (token[item].type != PARSER_ARRAY)) return 0;
+
+    struct HouseSagaRecord record;
+    housesaga_parser_record (token + item, &record);
+    if (record.timestamp.tv_sec <= 0) return 0;
+    const char * const *text = record.text;
+
+    char csv[2048];
+    char buffer[32];
+    int length = snprintf (csv, sizeof(csv), "%lld.%03d,%s,%s,",
+                           (long long)(record.timestamp.tv_sec),
+                           (int)(record.timestamp.tv_usec / 1000), host, app);
+    const char *logtype;
+
+    if (!strcmp (key, "events")) {
+        if (!(text[1] && text[2] && text[3] && text[4])) return 0;
+        snprintf (csv + length, sizeof(csv) - length, "%s,%s,%s,\"%s\"",
+                  text[1], text[2], text[3], text[4]);
+        logtype = "event";
+    } else if (!strcmp (key, "sensor")) {
+        if (!(text[1] && text[2] && text[3] && text[4])) return 0;
+        snprintf (csv + length, sizeof(csv) - length, "%s,%s,%s,%s",
+                  text[1], text[2], text[3], text[4]);
+        logtype = "sensor";
+    } else if (!strcmp (key, "traces")) {
+        if (!(text[1] && text[3] && text[4] && text[5])) return 0;
+        snprintf (csv + length, sizeof(csv) - length, "%s,%d,%s,%s,\"%s\"",
+                  text[1], (int)(record.integer[2]), text[3], text[4], text[5]);
+        logtype = housesaga_import_tracetype (buffer, sizeof(buffer), text[3]);
+    } else {
+        return 0;
+    }
+    return housesaga_import_add (logtype, csv);
+}
+
+static const struct ImportType *housesaga_import_type (const char *name) {
+    int i;
+    for (i = 0; ImportTypes[i].key; ++i) {
+        if ((!strcmp (name, ImportTypes[i].key)) ||
+            (!strcmp (name, ImportTypes[i].logtype))) return ImportTypes + i;
+    }
+    return 0;
+}
+
+static const struct ImportType *housesaga_import_header (const char *line) {
+    int i;
+    for (i = 0; ImportTypes[i].key; ++i) {
+        if (!strcmp (line, ImportTypes[i].header)) return ImportTypes + i;
+    }
+    return 0;
+}
+
+static int housesaga_import_read (FILE *input, const struct ImportType *type) {
+
+    char *line = 0;
+    size_t size = 0;
+    ssize_t length;
+    char buffer[32];
+
+    while ((length = getline (&line, &size, input)) > 0) {
+        while ((length > 0) && isspace((unsigned char)(line[length-1])))
+            line[--length] = 0;
+        if (length <= 0) continue;
+
+        if (line[0] == '{') {
+            if (!housesaga_import_json (line)) ImportRejected += 1;
+        } else if (isdigit((unsigned char)(line[0]))) {
+            if (!type) {
+                ImportRejected += 1;
+                continue;
+            }
+            const char *logtype =
+                housesaga_import_logtype (type, line, buffer, sizeof(buffer));
+            if (!housesaga_import_add (logtype, line)) {
+                free (line);
+                return 0;
+            }
+        } else {
+            const struct ImportType *header = housesaga_import_header (line);
+            if (header) type = header; // Otherwise keep the -type option.
+        }
+    }
+    free (line);
+    return 1;
+}
+
+// The merge phase: read all runs in parallel, in order.
+//
+struct ImportRun {
+    FILE *file;
+    char *line;
+    size_t size;
+    struct ImportLine current;
+};
+
+static struct ImportRun *ImportRunList = 0;
+static int *ImportHeap = 0;
+static int  ImportHeapCount = 0;
+
+static int housesaga_import_next (struct ImportRun *run) {
+
+    ssize_t length = getline (&(run->line), &(run->size), run->file);
+    if (length <= 0) return 0;
+    if (run->line[length-1] == '\n') run->line[--length] = 0;
+    char *tab = strchr (run->line, '\t');
+    if (!tab) return 0;
+    *tab = 0;
+    run->current.logtype = run->line;
+    run->current.text = tab + 1;
+    run->current.timestamp = housesaga_import_timestamp (tab + 1);
+    return 1;
+}
+
+static int housesaga_import_less (int a, int b) {
+    return housesaga_import_compare (&(ImportRunList[a].current),
+                                     &(ImportRunList[b].current)) < 0;
+}
+
+static void housesaga_import_sift (int i) {
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if ((left < ImportHeapCount) &&
+            housesaga_import_less (ImportHeap[left], ImportHeap[smallest]))
+            smallest = left;
+        if ((right < ImportHeapCount) &&
+            housesaga_import_less (ImportHeap[right], ImportHeap[smallest]))
+            smallest = right;
+        if (smallest == i) return;
+        int swap = ImportHeap[i];
+        ImportHeap[i] = ImportHeap[smallest];
+        ImportHeap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+// The current output file: the imported records for one log type and
+// one day, merged with the existing records.
+//
+static char ImportLogtype[64] = {0};
+static int  ImportDate = 0;
+static int  ImportYear, ImportMonth, ImportDay;
+static FILE *ImportOutput = 0;
+static char ImportPath[1024];
+static char ImportTemp[1024];
+static char *ImportLast = 0;
+static size_t ImportLastSize = 0;
+
+static char *ImportExisting = 0;
+static struct ImportLine *ImportExistingLines = 0;
+static int ImportExistingCount = 0;
+static int ImportExistingCursor = 0;
+
+static long long ImportWritten = 0;
+static long long ImportDuplicates = 0;
+static int ImportFiles = 0;
+
+static void housesaga_import_write (const char *line) {
+    if (ImportLast && (!strcmp (ImportLast, line))) {
+        ImportDuplicates += 1;
+        return;
+    }
+    size_t length = strlen(line) + 1;
+    if (length > ImportLastSize) {
+        ImportLastSize = length + 256;
+        ImportLast = realloc (ImportLast, ImportLastSize);
+    }
+    memcpy (ImportLast, line, length);
+    fprintf (ImportOutput, "%s\n", line);
+    ImportWritten += 1;
+}
+
+/* Sort the lines that have the same timestamp. This is enough to order
+ * lines that were already sorted by timestamp.
+ */
+static void housesaga_import_sortgroups (struct ImportLine *lines, int count) {
+    int start = 0;
+    while (start < count) {
+        int end = start + 1;
+        while ((end < count) && (lines[end].timestamp == lines[start].timestamp))
+            end += 1;
+        if (end - start > 1)
+            qsort (lines + start, end - start, sizeof(lines[0]),
+                   housesaga_import_sort);
+        start = end;
+    }
+}
+
+/* Load and sort the existing log file. Return its header line, if any.
+ * A file marked as sorted is only sorted within identical timestamps.
+ */
+static const char *housesaga_import_load (const char *path) {
+
+    const char *header = 0;
+    int size = 0;
+    int sorted = housesaga_finalize_sorted (path);
+
+    ImportExisting = 0;
+    ImportExistingLines = 0;
+    ImportExistingCount = ImportExistingCursor = 0;
+
+    FILE *f = fopen (path, "r");
+    if (!f) return 0;
+    fseek (f, 0, SEEK_END);
+    long length = ftell (f);
+    fseek (f, 0, SEEK_SET);
+    ImportExisting = malloc (length + 1);
+    length = fread (ImportExisting, 1, length, f);
+    ImportExisting[length] = 0;
+    fclose (f);
+
+    char *text = ImportExisting;
+    while (*text) {
+        char *eol = strchr (text, '\n');
+        if (eol) *eol = 0;
+        if (isdigit((unsigned char)(text[0]))) {
+            if (ImportExistingCount >= size) {
+                size += 65536;
+                ImportExistingLines =
+                    realloc (ImportExistingLines,
+                             size * sizeof(ImportExistingLines[0]));
+            }
+            struct ImportLine *item = ImportExistingLines + ImportExistingCount++;
+            item->logtype = ImportLogtype;
+            item->text = text;
+            item->timestamp = housesaga_import_timestamp (text);
+        } else if (text[0] && (!header) && (!ImportExistingCount)) {
+            header = text;
+        }
+        if (!eol) break;
+        text = eol + 1;
+    }
+    if (sorted)
+        housesaga_import_sortgroups (ImportExistingLines, ImportExistingCount);
+    else
+        qsort (ImportExistingLines, ImportExistingCount,
+               sizeof(ImportExistingLines[0]), housesaga_import_sort);
+    return header;
+}
+
+static int housesaga_import_close (void) {
+
+    if (!ImportOutput) return 1;
+
+    while (ImportExistingCursor < ImportExistingCount) {
+        housesaga_import_write
+            (ImportExistingLines[ImportExistingCursor++].text);
+    }
+    int error = ferror (ImportOutput);
+    if (fclose (ImportOutput)) error = 1;
+    ImportOutput = 0;
+
+    if (ImportExisting) free (ImportExisting);
+    if (ImportExistingLines) free (ImportExistingLines);
+    ImportExisting = 0;
+    ImportExistingLines = 0;
+    ImportExistingCount = ImportExistingCursor = 0;
+
+    if (error || rename (ImportTemp, ImportPath)) {
+        fprintf (stderr, "cannot write %s\n", ImportPath);
+        unlink (ImportTemp);
+        return 0;
+    }
+    housesaga_finalize_mark (ImportPath);
+    ImportFiles += 1;
+    return 1;
+}
+
+static int housesaga_import_open (const struct ImportLine *line) {
+
+    time_t timestamp = (time_t)(line->timestamp / 1000);
+    struct tm local = *localtime (&timestamp);
+    ImportYear = local.tm_year + 1900;
+    ImportMonth = local.tm_mon + 1;
+    ImportDay = local.tm_mday;
+    ImportDate = (ImportYear * 100 + ImportMonth) * 100 + ImportDay;
+    snprintf (ImportLogtype, sizeof(ImportLogtype), "%s", line->logtype);
+
+    char path[1024];
+    mkdir (ImportFolder, 0777);
+    snprintf (path, sizeof(path), "%s/%04d", ImportFolder, ImportYear);
+    mkdir (path, 0777);
+    housesaga_storage_monthpath (path, sizeof(path), ImportYear, ImportMonth);
+    mkdir (path, 0777);
+    int length = housesaga_storage_daypath (path, sizeof(path),
+                                            ImportYear, ImportMonth, ImportDay);
+    mkdir (path, 0777);
+    snprintf (ImportPath, sizeof(ImportPath), "%.*s/%s.csv",
+              length, path, ImportLogtype);
+    snprintf (ImportTemp, sizeof(ImportTemp), "%.*s/.%s.csv.import",
+              length, path, ImportLogtype);
+
+    const char *header = housesaga_import_load (ImportPath);
+    if (!header) {
+        const struct ImportType *type = housesaga_import_type
+            (strncmp (ImportLogtype, "trace-", 6) ? ImportLogtype : "trace");
+        if (type) header = type->header;
+    }
+
+    ImportOutput = fopen (ImportTemp, "w");
+    if (!ImportOutput) {
+        fprintf (stderr, "cannot create %s\n", ImportTemp);
+        return 0;
+    }
+    if (header) fprintf (ImportOutput, "%s\n", header);
+    if (ImportLast) ImportLast[0] = 0;
+    return 1;
+}
+
+static int housesaga_import_merge (void) {
+
+    int i;
+    char path[1024];
+    int ok = 1;
+
+    ImportRunList = calloc (ImportRuns, sizeof(struct ImportRun));
+    ImportHeap = calloc (ImportRuns, sizeof(int));
+    ImportHeapCount = 0;
+
+    for (i = 0; i < ImportRuns; ++i) {
+        housesaga_import_runpath (path, sizeof(path), i);
+        ImportRunList[i].file = fopen (path, "r");
+        if (!ImportRunList[i].file) continue;
+        if (housesaga_import_next (ImportRunList + i))
+            ImportHeap[ImportHeapCount++] = i;
+    }
+    for (i = ImportHeapCount / 2 - 1; i >= 0; --i) housesaga_import_sift (i);
+
+    while (ok && (ImportHeapCount > 0)) {
+        struct ImportRun *run = ImportRunList + ImportHeap[0];
+        struct ImportLine *line = &(run->current);
+
+        time_t timestamp = (time_t)(line->timestamp / 1000);
+        struct tm local = *localtime (&timestamp);
+        int date = ((local.tm_year + 1900) * 100 + local.tm_mon + 1) * 100
+                   + local.tm_mday;
+
+        if ((date != ImportDate) || strcmp (line->logtype, ImportLogtype)) {
+            ok = housesaga_import_close ();
+            if (ok) ok = housesaga_import_open (line);
+            if (!ok) break;
+        }
+
+        // Write the existing records that come first.
+        while ((ImportExistingCursor < ImportExistingCount) &&
+               (housesaga_import_compare
+                    (ImportExistingLines + ImportExistingCursor, line) <= 0)) {
+            housesaga_import_write
+                (ImportExistingLines[ImportExistingCursor++].text);
+        }
+        housesaga_import_write (line->text);
+
+        if (housesaga_import_next (run)) {
+            housesaga_import_sift (0);
+        } else {
+            ImportHeap[0] = ImportHeap[--ImportHeapCount];
+            housesaga_import_sift (0);
+        }
+    }
+    if (ok) ok = housesaga_import_close ();
+
+    for (i = 0; i < ImportRuns; ++i) {
+        if (ImportRunList[i].file) fclose (ImportRunList[i].file);
+        if (ImportRunList[i].line) free (ImportRunList[i].line);
+        housesaga_import_runpath (path, sizeof(path), i);
+        unlink (path);
+    }
+    free (ImportRunList);
+    free (ImportHeap);
+    return ok;
+}
+
+int housesaga_import_main (int argc, const char **argv) {
+
+    int i;
+    const char *option;
+    const struct ImportType *type = 0;
+    long chunk = 64;
+    int files = 0;
+
+    housesaga_storage_configure (argc, argv);
+
+    for (i = 2; i < argc; ++i) {
+        if (echttp_option_match ("-log-path=", argv[i], &ImportFolder)) continue;
+        if (echttp_option_match ("-type=", argv[i], &option)) {
+            type = housesaga_import_type (option);
+            if (!type) {
+                fprintf (stderr, "invalid type %s\n", option);
+                return 1;
+            }
+            continue;
+        }
+        if (echttp_option_match ("-chunk=", argv[i], &option)) {
+            chunk = atol (option);
+            continue;
+        }
+        if (echttp_option_present ("-trace-split", argv[i])) {
+            ImportTraceSplit = 1;
+            continue;
+        }
+    }
+    if (chunk <= 0) chunk = 64;
+    ImportArenaSize = chunk * 1024 * 1024;
+    ImportArena = malloc (ImportArenaSize);
+    if (!ImportArena) {
+        fprintf (stderr, "cannot allocate %ld MB\n", chunk);
+        return 1;
+    }
+    mkdir (ImportFolder, 0777);
+
+    int ok = 1;
+    for (i = 2; ok && (i < argc); ++i) {
+        if (argv[i][0] == '-') continue;
+        FILE *input = fopen (argv[i], "r");
+        if (!input) {
+            fprintf (stderr, "cannot open %s\n", argv[i]);
+            ok = 0;
+            break;
+        }
+        ok = housesaga_import_read (input, type);
+        fclose (input);
+        files += 1;
+    }
+    if (ok && (!files)) ok = housesaga_import_read (stdin, type);
+    if (ok) ok = housesaga_import_spill ();
+    free (ImportArena);
+
+    if (ok) ok = housesaga_import_merge ();
+
+    printf ("%lld records read, %lld rejected, %lld duplicates removed, "
+            "%d files written (%lld records), %d runs\n",
+            ImportRead, ImportRejected, ImportDuplicates,
+            ImportFiles, ImportWritten, ImportRuns);
+    return ok ? 0 : 1;
+}
+
@@ -0,0 +1,735 @@
+/* housesaga - A log consolidation and storage service.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesaga_index.c - A full text index of the archived traces.
+ *
+ * This module builds a trigram index for each trace file of a past day,
+ * and uses these indexes to search for a text in the trace archive.
+ *
+ * The index covers the OBJECT and DESCRIPTION fields of each trace. The
+ * trace file is divided in blocks of consecutive lines. For each trigram
+ * (3 consecutive characters, case insensitive) found in the file, the
+ * index lists the blocks where this trigram appears. A search intersects
+ * the block lists of all the trigrams of the searched text, and then only
+ * reads the remaining candidate blocks from the trace file.
+ *
+ * The index for file trace.csv is stored as .trace.csv.tri in the same
+ * day folder (being a hidden file, it does not show in the daily list).
+ * It is built in the background, one file at a time, once the day is over.
+ * The trace file is read a few blocks per second, so that indexing a large
+ * file does not delay the web requests. The current day is not indexed:
+ * its trace file is scanned instead.
+ *
+ * The index file format is:
+ *  - a header: magic string, number of blocks, number of trigrams.
+ *  - the offset of each block in the trace file (64 bit).
+ *  - the trigram table, sorted by trigram: trigram value, index of
+ *    the first block number in the posting list, number of blocks.
+ *  - the posting list: block numbers (32 bit), sorted for each trigram.
+ *
+ * SYNOPSYS:
+ *
+ * void housesaga_index_initialize (int argc, const char **argv);
+ *
+ *    Initialize the environment required to build and search the index.
+ *
+ * void housesaga_index_background (time_t now);
+ *
+ *    Build the missing indexes, one at a time. This is a scheduled action
+ *    that runs every second while indexes are pending, every hour otherwise.
+ */
+
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+#include "houselog.h"
+
+#include "housesaga.h"
+#include "housesaga_index.h"
+#include "housesaga_storage.h"
+#include "housesaga_latency.h"
+
+#define INDEX_BLOCK_LINES 32
+#define INDEX_MAX_DAYS    400
+#define INDEX_MAX_RESULTS 1000
+
+#define INDEX_LINES_PER_TICK (256 * INDEX_BLOCK_LINES)
+
+static const char IndexMagic[8] = "SAGATRI2";
+
+struct IndexHeader {
+    char     magic[8];
+    uint32_t blocks;
+    uint32_t count;
+};
+
+struct IndexEntry {
+    uint32_t trigram;
+    uint32_t start;
+    uint32_t length;
+};
+
+struct IndexList {
+    uint32_t trigram;
+    uint32_t count; // 0 means an empty slot.
+    uint32_t size;
+    uint32_t *blocks;
+};
+
+#define INDEX_PENDING_MAX 256
+static char *IndexPending[INDEX_PENDING_MAX];
+static int   IndexPendingCount = 0;
+
+
+static int housesaga_index_istrace (const char *name) {
+    if (strncmp (name, "trace", 5)) return 0;
+    if ((name[5] != '.') && (name[5] != '-')) return 0;
+    const char *extension = strrchr (name, '.');
+    return (extension && (!strcmp (extension, ".csv")));
+}
+
+/* Build the path of the index for the specified trace file. Return 0
+ * if the path does not fit in the buffer.
+ */
+static int housesaga_index_path (char *buffer, int size,
+                                 const char *folder, const char *name) {
+    return (snprintf (buffer, size, "%s/.%s.tri", folder, name) < size);
+}
+
+/* Extract the OBJECT and DESCRIPTION fields from a trace CSV line.
+ * The line is modified (lower case, terminated fields).
+ */
+static int housesaga_index_fields (char *line,
+                                   char **object, char **description) {
+    int i;
+    char *cursor = line;
+    for (i = 0; i < 6; ++i) {
+        cursor = strchr (cursor, ',');
+        if (!cursor) return 0;
+        cursor += 1;
+    }
+    *object = cursor;
+    cursor = strchr (cursor, ',');
+    if (!cursor) return 0;
+    *(cursor++) = 0;
+    if (*cursor == '"') cursor += 1;
+    *description = cursor;
+
+    for (cursor = *object; *cursor; ++cursor) {
+        *cursor = tolower((unsigned char)(*cursor));
+    }
+    for (cursor = *description; *cursor; ++cursor) {
+        if (*cursor == '\n') {
+            *cursor = 0;
+            break;
+        }
+        *cursor = tolower((unsigned char)(*cursor));
+    }
+    int length = strlen (*description);
+    if ((length > 0) && ((*description)[length-1] == '"')) {
+        (*description)[length-1] = 0;
+    }
+    return 1;
+}
+
+static uint32_t housesaga_index_trigram (const char *text) {
+    return ((uint32_t)(unsigned char)text[0] << 16) +
+           ((uint32_t)(unsigned char)text[1] << 8) +
+            (uint32_t)(unsigned char)text[2];
+}
+
+/* The index builder.
+ *
+ * The posting list of each trigram is built as the file is read: since
+ * the blocks are read in order, each list is naturally sorted and
+ * a duplicate can only be the last block added. Only the trigrams need
+ * to be sorted once the whole file was read.
+ */
+static struct IndexList *IndexLists = 0;
+static uint32_t IndexListsSize = 0; // Must be a power of 2.
+static uint32_t IndexListsUsed = 0;
+
+static FILE     *IndexCsv = 0; // The file being indexed, if any.
+static struct stat IndexCsvInfo;
+static char      IndexCsvPath[1024];
+static char      IndexPath[1024];
+static uint64_t *IndexOffsets = 0;
+static uint32_t  IndexOffsetsSize = 0;
+static uint32_t  IndexBlocks = 0;
+static uint32_t  IndexLines = 0;
+static char     *IndexLine = 0;
+static size_t    IndexLineSize = 0;
+
+static struct IndexList *housesaga_index_list (uint32_t trigram) {
+
+    uint32_t slot = (trigram * 2654435761U) & (IndexListsSize - 1);
+    while (IndexLists[slot].count) {
+        if (IndexLists[slot].trigram == trigram) break;
+        slot = (slot + 1) & (IndexListsSize - 1);
+    }
+    return IndexLists + slot;
+}
+
+static void housesaga_index_grow (void) {
+
+    struct IndexList *old = IndexLists;
+    uint32_t oldsize = IndexListsSize;
+
+    IndexListsSize = oldsize ? oldsize * 2 : 65536;
+    IndexLists = calloc (IndexListsSize, sizeof(struct IndexList));
+
+    uint32_t i;
+    for (i = 0; i < oldsize; ++i) {
+        if (!old[i].count) continue;
+        *(housesaga_index_list (old[i].trigram)) = old[i];
+    }
+    if (old) free (old);
+}
+
+static void housesaga_index_add (uint32_t trigram, uint32_t block) {
+
+    if (IndexListsUsed >= IndexListsSize / 2) housesaga_index_grow ();
+
+    struct IndexList *list = housesaga_index_list (trigram);
+    if (!list->count) {
+        list->trigram = trigram;
+        IndexListsUsed += 1;
+    } else if (list->blocks[list->count-1] == block) {
+        return; // Already listed.
+    }
+    if (list->count >= list->size) {
+        list->size = list->size ? list->size * 2 : 4;
+        list->blocks = realloc (list->blocks, list->size * sizeof(uint32_t));
+    }
+    list->blocks[list->count++] = block;
+}
+
+static void housesaga_index_text (const char *text, uint32_t block) {
+    int length = strlen (text);
+    int i;
+    for (i = 0; i + 3 <= length; ++i) {
+        housesaga_index_add (housesaga_index_trigram (text + i), block);
+    }
+}
+
+static int housesaga_index_compare (const void *a, const void *b) {
+    const struct IndexList *la = (const struct IndexList *)a;
+    const struct IndexList *lb = (const struct IndexList *)b;
+    if (la->trigram != lb->trigram)
+        return (la->trigram < lb->trigram) ? -1 : 1;
+    return 0;
+}
+
+static void housesaga_index_reset (void) {
+
+    uint32_t i;
+    for (i = 0; i < IndexListsSize; ++i) {
+        if (IndexLists[i].blocks) free (IndexLists[i].blocks);
+    }
+    if (IndexLists) free (IndexLists);
+    IndexLists = 0;
+    IndexListsSize = IndexListsUsed = 0;
+
+    if (IndexOffsets) free (IndexOffsets);
+    IndexOffsets = 0;
+    IndexOffsetsSize = IndexBlocks = IndexLines = 0;
+
+    if (IndexCsv) fclose (IndexCsv);
+    IndexCsv = 0;
+}
+
+/* Start building the index of one trace file. Return 0 on failure.
+ */
+static int housesaga_index_start (const char *folder, const char *name) {
+
+    if (snprintf (IndexCsvPath, sizeof(IndexCsvPath),
+                  "%s/%s", folder, name) >= sizeof(IndexCsvPath)) return 0;
+    if (!housesaga_index_path (IndexPath, sizeof(IndexPath), folder, name))
+        return 0;
+
+    IndexCsv = fopen (IndexCsvPath, "r");
+    if (!IndexCsv) return 0;
+    if (fstat (fileno(IndexCsv), &IndexCsvInfo)) {
+        housesaga_index_reset ();
+        return 0;
+    }
+    return 1;
+}
+
+/* Write the index file, once the whole trace file was read.
+ */
+static void housesaga_index_write (void) {
+
+    char temppath[1040];
+    struct stat info;
+
+    // The trace file might have been replaced (see housesaga_finalize.c)
+    // or modified while it was being read: the index would not match.
+    //
+    if (stat (IndexCsvPath, &info) ||
+        (info.st_ino != IndexCsvInfo.st_ino) ||
+        (info.st_size != IndexCsvInfo.st_size) ||
+        (info.st_mtime != IndexCsvInfo.st_mtime)) return;
+
+    snprintf (temppath, sizeof(temppath), "%s.tmp", IndexPath);
+    FILE *out = fopen (temppath, "w");
+    if (!out) return;
+
+    // Move the lists to the beginning of the table, then sort them.
+    //
+    uint32_t i;
+    uint32_t count = 0;
+    for (i = 0; i < IndexListsSize; ++i) {
+        if (!IndexLists[i].count) continue;
+        if (i != count) {
+            IndexLists[count] = IndexLists[i];
+            IndexLists[i].count = IndexLists[i].size = 0;
+            IndexLists[i].blocks = 0;
+        }
+        count += 1;
+    }
+    qsort (IndexLists, count, sizeof(struct IndexList),
+           housesaga_index_compare);
+
+    struct IndexHeader header;
+    memcpy (header.magic, IndexMagic, sizeof(header.magic));
+    header.blocks = IndexBlocks;
+    header.count = count;
+    fwrite (&header, sizeof(header), 1, out);
+    if (IndexBlocks > 0)
+        fwrite (IndexOffsets, sizeof(uint64_t), IndexBlocks, out);
+
+    struct IndexEntry entry = {0, 0, 0};
+    for (i = 0; i < count; ++i) {
+        entry.trigram = IndexLists[i].trigram;
+        entry.length = IndexLists[i].count;
+        fwrite (&entry, sizeof(entry), 1, out);
+        entry.start += entry.length;
+    }
+    for (i = 0; i < count; ++i) {
+        fwrite (IndexLists[i].blocks,
+                sizeof(uint32_t), IndexLists[i].count, out);
+    }
+    int failed = ferror (out);
+    if (fclose (out)) failed = 1;
+
+    if (failed || rename (temppath, IndexPath)) {
+        unlink (temppath);
+        houselog_trace (HOUSE_FAILURE, "INDEX", "cannot create %s", IndexPath);
+        return;
+    }
+    houselog_trace (HOUSE_INFO, "INDEX", "indexed %s (%d lines, %d trigrams)",
+                    IndexCsvPath, IndexLines, header.count);
+}
+
+/* Read the next blocks of the trace file being indexed. Return 1 if
+ * there is more to read, 0 if the index was completed (or abandoned).
+ */
+static int housesaga_index_step (void) {
+
+    int n;
+    for (n = 0; n < INDEX_LINES_PER_TICK; ++n) {
+        off_t offset = ftello (IndexCsv);
+        if (getline (&IndexLine, &IndexLineSize, IndexCsv) < 0) {
+            housesaga_index_write ();
+            housesaga_index_reset ();
+            return 0;
+        }
+        if (!isdigit(IndexLine[0])) continue; // Header, or corrupted line.
+
+        if ((IndexLines % INDEX_BLOCK_LINES) == 0) {
+            if (IndexBlocks >= IndexOffsetsSize) {
+                IndexOffsetsSize += 1024;
+                IndexOffsets = realloc (IndexOffsets,
+                                        IndexOffsetsSize * sizeof(uint64_t));
+            }
+            IndexOffsets[IndexBlocks++] = (uint64_t)offset;
+        }
+        IndexLines += 1;
+
+        char *object;
+        char *description;
+        if (!housesaga_index_fields (IndexLine, &object, &description))
+            continue;
+        housesaga_index_text (object, IndexBlocks - 1);
+        housesaga_index_text (description, IndexBlocks - 1);
+    }
+    return 1;
+}
+
+/* Return true if the index of this trace file is missing or obsolete.
+ */
+static int housesaga_index_obsolete (const char *folder, const char *name) {
+
+    char path[1024];
+    struct stat csvinfo;
+    struct stat indexinfo;
+    char magic[sizeof(IndexMagic)];
+
+    if (snprintf (path, sizeof(path), "%s/%s", folder, name) >= sizeof(path))
+        return 0;
+    if (stat (path, &csvinfo)) return 0;
+    if (!housesaga_index_path (path, sizeof(path), folder, name)) return 0;
+    if (stat (path, &indexinfo)) return 1;
+    if (indexinfo.st_mtime < csvinfo.st_mtime) return 1;
+
+    // An index from an older format must be rebuilt.
+    int fd = open (path, O_RDONLY);
+    if (fd < 0) return 1;
+    int length = read (fd, magic, sizeof(magic));
+    close (fd);
+    return (length != sizeof(magic)) ||
+           memcmp (magic, IndexMagic, sizeof(magic));
+}
+
+static int IndexToday = 0;
+
+static void housesaga_index_visit (const char *path,
+                                   int year, int month, int day) {
+
+    int date = (year * 100 + month) * 100 + day;
+    if (date >= IndexToday) return; // Not closed yet.
+
+    DIR *dir = opendir (path);
+    if (!dir) return;
+
+    for (;;) {
+        struct dirent *p = readdir(dir);
+        if (!p) break;
+        if (!housesaga_index_istrace (p->d_name)) continue;
+        if (!housesaga_index_obsolete (path, p->d_name)) continue;
+        if (IndexPendingCount >= INDEX_PENDING_MAX) break;
+
+        char filepath[1024];
+        if (snprintf (filepath, sizeof(filepath),
+                      "%s/%s", path, p->d_name) >= sizeof(filepath)) continue;
+        IndexPending[IndexPendingCount++] = strdup (filepath);
+    }
+    closedir (dir);
+}
+
+void housesaga_index_background (time_t now) {
+
+    static time_t LastScan = 0;
+
+    if (IndexCsv) {
+        housesaga_index_step ();
+        housesaga_schedule (now + 1, housesaga_index_background);
+        return;
+    }
+
+    if (IndexPendingCount > 0) {
+        char *filepath = IndexPending[--IndexPendingCount];
+        char *name = strrchr (filepath, '/');
+        if (name) {
+            *(name++) = 0;
+            if (housesaga_index_start (filepath, name)) housesaga_index_step ();
+        }
+        free (filepath);
+        housesaga_schedule (now + 1, housesaga_index_background);
+        return;
+    }
+
+    if (now < LastScan + 3600) {
+        housesaga_schedule (LastScan + 3600, housesaga_index_background);
+        return;
+    }
+    LastScan = now;
+
+    struct tm local = *localtime (&now);
+    IndexToday = ((local.tm_year + 1900) * 100 + local.tm_mon + 1) * 100
+                 + local.tm_mday;
+    housesaga_storage_walk (housesaga_index_visit);
+    housesaga_schedule (IndexPendingCount ? now + 1 : now + 3600,
+                        housesaga_index_background);
+}
+
+/* The search engine.
+ */
+static char *WebSearchBuffer = 0;
+static int   WebSearchSize = 0;
+static int   WebSearchLength = 0;
+static int   WebSearchCount = 0;
+
+static void housesaga_index_output (const char *line) {
+
+    int length = strlen (line);
+    if (WebSearchLength + length + 2 > WebSearchSize) {
+        WebSearchSize += length + 65536;
+        WebSearchBuffer = realloc (WebSearchBuffer, WebSearchSize);
+    }
+    memcpy (WebSearchBuffer + WebSearchLength, line, length);
+    WebSearchLength += length;
+    if ((length == 0) || (line[length-1] != '\n'))
+        WebSearchBuffer[WebSearchLength++] = '\n';
+    WebSearchBuffer[WebSearchLength] = 0;
+    WebSearchCount += 1;
+}
+
+/* Check one line, output it if it matches. The search text must have
+ * been converted to lower case. Return 0 if the line is not a trace.
+ */
+static int housesaga_index_match (const char *line, const char *text) {
+
+    static char *copy = 0;
+    static size_t copysize = 0;
+    char *object;
+    char *description;
+
+    if (!isdigit(line[0])) return 0;
+    size_t length = strlen (line) + 1;
+    if (length > copysize) {
+        copysize = length + 1024;
+        copy = realloc (copy, copysize);
+    }
+    memcpy (copy, line, length);
+    if (!housesaga_index_fields (copy, &object, &description)) return 1;
+    if (strstr (object, text) || strstr (description, text)) {
+        housesaga_index_output (line);
+    }
+    return 1;
+}
+
+static void housesaga_index_scan (FILE *csv, off_t offset, int lines,
+                                  const char *text) {
+
+    static char *line = 0;
+    static size_t size = 0;
+
+    if (fseeko (csv, offset, SEEK_SET)) return;
+    while (WebSearchCount < INDEX_MAX_RESULTS) {
+        if (getline (&line, &size, csv) < 0) break;
+        if (housesaga_index_match (line, text)) {
+            if ((lines > 0) && (--lines <= 0)) break;
+        }
+    }
+}
+
+static const struct IndexEntry *housesaga_index_find
+                                    (const struct IndexEntry *table,
+                                     uint32_t count, uint32_t trigram) {
+    uint32_t low = 0;
+    uint32_t high = count;
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        if (table[middle].trigram == trigram) return table + middle;
+        if (table[middle].trigram < trigram) low = middle + 1;
+        else high = middle;
+    }
+    return 0;
+}
+
+/* Search one trace file, using its index if available. Return 0 if the
+ * index is not usable.
+ */
+static int housesaga_index_search (const char *folder, const char *name,
+                                   const char *text, FILE *csv) {
+
+    char path[1024];
+    int length = strlen (text);
+
+    if (length < 3) return 0;
+    if (housesaga_index_obsolete (folder, name)) return 0;
+
+    if (!housesaga_index_path (path, sizeof(path), folder, name)) return 0;
+    int fd = open (path, O_RDONLY);
+    if (fd < 0) return 0;
+
+    struct stat info;
+    if (fstat (fd, &info) || (info.st_size < sizeof(struct IndexHeader))) {
+        close (fd);
+        return 0;
+    }
+    void *base = mmap (0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (base == MAP_FAILED) return 0;
+
+    const struct IndexHeader *header = (const struct IndexHeader *)base;
+    const uint64_t *offsets = (const uint64_t *)(header + 1);
+    const struct IndexEntry *table =
+        (const struct IndexEntry *)(offsets + header->blocks);
+    const uint32_t *postings = (const uint32_t *)(table + header->count);
+
+    if (memcmp (header->magic, IndexMagic, sizeof(header->magic)) ||
+        ((const char *)postings > (const char *)base + info.st_size)) {
+        munmap (base, info.st_size);
+        return 0;
+    }
+
+    // Intersect the block lists of all the trigrams in the text.
+    //
+    uint32_t *candidates = 0;
+    int count = 0;
+    int i;
+    for (i = 0; i + 3 <= length; ++i) {
+        const struct IndexEntry *entry =
+            housesaga_index_find (table, header->count,
+                                  housesaga_index_trigram (text + i));
+        if (!entry) {
+            count = 0;
+            break;
+        }
+        const uint32_t *list = postings + entry->start;
+        if ((const char *)(list + entry->length) >
+                (const char *)base + info.st_size) {
+            count = 0;
+            break;
+        }
+        if (!candidates) {
+            candidates = malloc (entry->length * sizeof(uint32_t));
+            memcpy (candidates, list, entry->length * sizeof(uint32_t));
+            count = entry->length;
+            continue;
+        }
+        int j = 0;
+        int k = 0;
+        int kept = 0;
+        while ((j < count) && (k < entry->length)) {
+            if (candidates[j] < list[k]) j += 1;
+            else if (candidates[j] > list[k]) k += 1;
+            else {
+                candidates[kept++] = candidates[j];
+                j += 1;
+                k += 1;
+            }
+        }
+        count = kept;
+        if (count <= 0) break;
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (candidates[i] >= header->blocks) continue;
+        housesaga_index_scan (csv, (off_t)(offsets[candidates[i]]),
+                              INDEX_BLOCK_LINES, text);
+    }
+    if (candidates) free (candidates);
+    munmap (base, info.st_size);
+    return 1;
+}
+
+static void housesaga_index_day (int year, int month, int day,
+                                 const char *text) {
+
+    char folder[1024];
+    char path[1280];
+
+    housesaga_storage_daypath (folder, sizeof(folder), year, month, day);
+    DIR *dir = opendir (folder);
+    if (!dir) return;
+
+    for (;;) {
+        struct dirent *p = readdir(dir);
+        if (!p) break;
+        if (!housesaga_index_istrace (p->d_name)) continue;
+
+        snprintf (path, sizeof(path), "%s/%s", folder, p->d_name);
+        FILE *csv = fopen (path, "r");
+        if (!csv) continue;
+        if (!housesaga_index_search (folder, p->d_name, text, csv)) {
+            housesaga_index_scan (csv, 0, 0, text);
+        }
+        fclose (csv);
+        if (WebSearchCount >= INDEX_MAX_RESULTS) break;
+    }
+    closedir (dir);
+}
+
+static time_t housesaga_index_date (const char *text, time_t reference) {
+
+    struct tm local = *localtime (&reference);
+    if (text) {
+        int year, month, day;
+        if (sscanf (text, "%d-%d-%d", &year, &month, &day) != 3) return 0;
+        local.tm_year = year - 1900;
+        local.tm_mon = month - 1;
+        local.tm_mday = day;
+    }
+    // Use noon as the reference, to avoid daylight saving time issues.
+    local.tm_hour = 12;
+    local.tm_min = local.tm_sec = 0;
+    local.tm_isdst = -1;
+    return mktime (&local);
+}
+
+static const char *housesaga_index_websearch (const char *method,
+                                              const char *uri,
+                                              const char *data, int length) {
+
+    static char TraceHeader[] =
+        "TIMESTAMP,HOST,APP,FILE,LINE,LEVEL,OBJECT,DESCRIPTION";
+
+    const char *query = echttp_parameter_get("q");
+    if (!query || !query[0]) {
+        echttp_error (400, "Missing query");
+        return "";
+    }
+    time_t to = housesaga_index_date (echttp_parameter_get("to"), time(0));
+    time_t from = housesaga_index_date (echttp_parameter_get("from"), to);
+    if ((from <= 0) || (to <= 0) || (from > to)) {
+        echttp_error (400, "Invalid date range");
+        return "";
+    }
+
+    char text[256];
+    int i;
+    for (i = 0; query[i] && (i < sizeof(text) - 1); ++i) {
+        text[i] = tolower((unsigned char)(query[i]));
+    }
+    text[i] = 0;
+
+    WebSearchLength = WebSearchCount = 0;
+    housesaga_index_output (TraceHeader);
+    WebSearchCount = 0;
+
+    int days = 0;
+    time_t cursor;
+    for (cursor = from; cursor <= to; cursor += 24 * 60 * 60) {
+        if (++days > INDEX_MAX_DAYS) break;
+        struct tm local = *localtime (&cursor);
+        housesaga_index_day (local.tm_year + 1900, local.tm_mon + 1,
+                             local.tm_mday, text);
+        if (WebSearchCount >= INDEX_MAX_RESULTS) break;
+    }
+    echttp_content_type_set ("text/csv");
+    return WebSearchBuffer;
+}
+
+void housesaga_index_initialize (int argc, const char **argv) {
+
+    housesaga_latency_route ("/saga/trace/search", housesaga_index_websearch);
+
+    // Alternate path for application-independent web pages.
+    //
+    housesaga_latency_route ("/trace/search", housesaga_index_websearch);
+}
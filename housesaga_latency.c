@@ -0,0 +1,250 @@
+/* housesaga - A log consolidation and storage service.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesaga_latency.c - Measure the latency of HouseSaga operations.
+ *
+ * This module maintains latency histograms, one per measured operation.
+ * Durations are measured in microseconds using the monotonic clock, and
+ * accounted for in log-scaled buckets: each power of 2 is split into 16
+ * buckets, so that the error is less than 6.25% for any duration. This
+ * makes recording a duration cheap, while percentiles remain accurate.
+ *
+ * SYNOPSYS:
+ *
+ * void housesaga_latency_initialize (int argc, const char **argv);
+ *
+ *    Initialize the environment required to measure latencies.
+ *
+ * int housesaga_latency_register (const char *id);
+ *
+ *    Declare a new histogram and return its handle, or -1 if there is
+ *    no more room for new histograms.
+ *
+ * long long housesaga_latency_now (void);
+ *
+ *    Return the current time of the monotonic clock, in microseconds.
+ *
+ * void housesaga_latency_record (int handle, long long start);
+ *
+ *    Record the duration since the specified start time, as returned
+ *    by housesaga_latency_now().
+ *
+ * int housesaga_latency_route (const char *uri, echttp_callback *call);
+ *
+ *    Same as echttp_route_uri(), except that the duration of each call
+ *    is recorded in a histogram named after the URI.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+
+#include "housesaga.h"
+#include "housesaga_latency.h"
+
+#define LATENCY_SUBBITS 4
+#define LATENCY_SUBBUCKETS (1 << LATENCY_SUBBITS)
+#define LATENCY_EXPONENTS 40 // Up to 2^40 microseconds, i.e. 12 days.
+#define LATENCY_BUCKETS \
+            ((LATENCY_EXPONENTS - LATENCY_SUBBITS + 2) * LATENCY_SUBBUCKETS)
+
+struct LatencyHistogram {
+    const char *id;
+    long long count;
+    long long sum;
+    long long min;
+    long long max;
+    unsigned int buckets[LATENCY_BUCKETS];
+};
+
+#define LATENCY_MAX 64
+static struct LatencyHistogram LatencyValues[LATENCY_MAX];
+static int LatencyCount = 0;
+
+struct LatencyRoute {
+    const char *uri;
+    echttp_callback *call;
+    int handle;
+};
+
+static struct LatencyRoute LatencyRoutes[LATENCY_MAX];
+static int LatencyRouteCount = 0;
+
+
+int housesaga_latency_register (const char *id) {
+
+    int i;
+    for (i = 0; i < LatencyCount; ++i) {
+       if (!strcmp (id, LatencyValues[i].id)) return i;
+    }
+    if (LatencyCount >= LATENCY_MAX) return -1; // Full.
+    memset (LatencyValues + i, 0, sizeof(LatencyValues[i]));
+    LatencyValues[i].id = id;
+    LatencyCount += 1;
+    return i;
+}
+
+long long housesaga_latency_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return ((long long)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+static int housesaga_latency_bucket (long long value) {
+
+    if (value < 2 * LATENCY_SUBBUCKETS) return (int)value; // Exact.
+
+    int exponent = 63 - __builtin_clzll ((unsigned long long)value);
+    if (exponent > LATENCY_EXPONENTS) return LATENCY_BUCKETS - 1;
+
+    int sub = (int)(value >> (exponent - LATENCY_SUBBITS))
+                  & (LATENCY_SUBBUCKETS - 1);
+    return ((exponent - LATENCY_SUBBITS + 1) * LATENCY_SUBBUCKETS) + sub;
+}
+
+// Return the highest value that falls in the specified bucket.
+static long long housesaga_latency_value (int bucket) {
+
+    if (bucket < 2 * LATENCY_SUBBUCKETS) return bucket;
+
+    int exponent = (bucket / LATENCY_SUBBUCKETS) + LATENCY_SUBBITS - 1;
+    long long sub = LATENCY_SUBBUCKETS + (bucket % LATENCY_SUBBUCKETS);
+    return ((sub + 1) << (exponent - LATENCY_SUBBITS)) - 1;
+}
+
+void housesaga_latency_record (int handle, long long start) {
+
+    if ((handle < 0) || (handle >= LatencyCount)) return;
+
+    long long duration = housesaga_latency_now() - start;
+    if (duration < 0) duration = 0;
+
+    struct LatencyHistogram *histogram = LatencyValues + handle;
+    if ((!histogram->count) || (duration < histogram->min))
+        histogram->min = duration;
+    if (duration > histogram->max) histogram->max = duration;
+    histogram->count += 1;
+    histogram->sum += duration;
+    histogram->buckets[housesaga_latency_bucket(duration)] += 1;
+}
+
+static long long housesaga_latency_percentile
+                     (const struct LatencyHistogram *histogram, int permil) {
+
+    long long target = ((histogram->count * permil) + 999) / 1000;
+    long long seen = 0;
+    int i;
+    for (i = 0; i < LATENCY_BUCKETS; ++i) {
+        seen += histogram->buckets[i];
+        if (seen >= target) {
+            long long value = housesaga_latency_value (i);
+            return (value > histogram->max) ? histogram->max : value;
+        }
+    }
+    return histogram->max;
+}
+
+static const char *housesaga_latency_call (const char *method, const char *uri,
+                                           const char *data, int length) {
+    int i;
+    for (i = 0; i < LatencyRouteCount; ++i) {
+        if (!strcmp (uri, LatencyRoutes[i].uri)) break;
+    }
+    if (i >= LatencyRouteCount) {
+        echttp_error (404, "Not Found");
+        return "";
+    }
+    long long start = housesaga_latency_now();
+    const char *result = LatencyRoutes[i].call (method, uri, data, length);
+    housesaga_latency_record (LatencyRoutes[i].handle, start);
+    return result;
+}
+
+int housesaga_latency_route (const char *uri, echttp_callback *call) {
+
+    if (LatencyRouteCount >= LATENCY_MAX)
+        return echttp_route_uri (uri, call); // Not measured.
+
+    struct LatencyRoute *route = LatencyRoutes + (LatencyRouteCount++);
+    route->uri = uri;
+    route->call = call;
+    route->handle = housesaga_latency_register (uri);
+    return echttp_route_uri (uri, housesaga_latency_call);
+}
+
+static const char *housesaga_latency_status (const char *method,
+                                             const char *uri,
+                                             const char *data, int length) {
+
+    static char buffer[65537];
+    static ParserToken token[LATENCY_MAX * 12];
+    static char pool[65537];
+
+    ParserContext context = echttp_json_start (token, LATENCY_MAX * 12,
+                                               pool, sizeof(pool));
+
+    int root = echttp_json_add_object (context, 0, 0);
+    echttp_json_add_string (context, root, "host", housesaga_host());
+    echttp_json_add_integer (context, root, "timestamp", (long long)time(0));
+    int top = echttp_json_add_object (context, root, "saga");
+    int container = echttp_json_add_array (context, top, "latency");
+
+    int i;
+    for (i = 0; i < LatencyCount; ++i) {
+        const struct LatencyHistogram *histogram = LatencyValues + i;
+        if (!histogram->count) continue;
+
+        int item = echttp_json_add_object (context, container, 0);
+        echttp_json_add_string (context, item, "id", histogram->id);
+        echttp_json_add_integer (context, item, "count", histogram->count);
+        echttp_json_add_integer (context, item, "min", histogram->min);
+        echttp_json_add_integer (context, item, "mean",
+                                 histogram->sum / histogram->count);
+        echttp_json_add_integer (context, item, "p50",
+                                 housesaga_latency_percentile (histogram, 500));
+        echttp_json_add_integer (context, item, "p99",
+                                 housesaga_latency_percentile (histogram, 990));
+        echttp_json_add_integer (context, item, "p999",
+                                 housesaga_latency_percentile (histogram, 999));
+        echttp_json_add_integer (context, item, "max", histogram->max);
+    }
+
+    const char *error = echttp_json_export (context, buffer, sizeof(buffer));
+    if (error) {
+        echttp_error (500, error);
+        return "";
+    }
+    echttp_content_type_json ();
+    return buffer;
+}
+
+void housesaga_latency_initialize (int argc, const char **argv) {
+
+    echttp_route_uri ("/saga/log/latency", housesaga_latency_status);
+
+    // Alternate path for application-independent web pages.
+    // (The log files are stored at the same place for all applications.)
+    //
+    echttp_route_uri ("/log/latency", housesaga_latency_status);
+}
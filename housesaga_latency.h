@@ -0,0 +1,29 @@
+/* housesaga - A log consolidation and storage service.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesaga_latency.c - Measure the latency of HouseSaga operations.
+ */
+void housesaga_latency_initialize (int argc, const char **argv);
+
+int  housesaga_latency_register (const char *id);
+long long housesaga_latency_now (void);
+void housesaga_latency_record (int handle, long long start);
+
+int  housesaga_latency_route (const char *uri, echttp_callback *call);
@@ -0,0 +1,150 @@
+/* housesaga - A log consolidation and storage service.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesaga_live.c - Keep the live buffers in memory mapped files.
+ *
+ * The live buffers of events, sensor data and traces are stored in files
+ * that are mapped in memory, so that their content survives a restart of
+ * the service, including the records that were not yet saved to the log.
+ *
+ * Each file is named .NAME.live and is located at the root of the log
+ * storage. It starts with a header that describes the layout of the
+ * buffer (record size and number of records), followed by the records.
+ * A file with a different layout is reset, e.g. after an upgrade that
+ * changed the record structure.
+ *
+ * The header also contains a generation counter, which is incremented
+ * before and after each modification of a record: an odd value means
+ * that the service stopped while modifying that record, which is then
+ * discarded when the file is mapped again.
+ *
+ * If the file cannot be mapped, the buffer is allocated in memory and
+ * the service runs as before, without warm restart. This module does not
+ * generate traces, since it is used by the trace module itself.
+ *
+ * SYNOPSYS:
+ *
+ * void *housesaga_live_map (const char *name, int size, int depth,
+ *                           struct HouseSagaLive **header);
+ *
+ *    Map the live buffer for the specified log type. The buffer contains
+ *    depth records of the specified size. Return the address of the first
+ *    record. The records restored from a previous run are left as is.
+ *
+ * void housesaga_live_begin (struct HouseSagaLive *header, int index);
+ * void housesaga_live_end (struct HouseSagaLive *header);
+ *
+ *    Surround the modification of a record, so that a partially written
+ *    record is detected on restart.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+
+#include "housesaga.h"
+#include "housesaga_live.h"
+#include "housesaga_storage.h"
+
+static const char LiveMagic[8] = "SAGALIV1";
+
+static void housesaga_live_reset (struct HouseSagaLive *header,
+                                  int size, int depth) {
+    memset (header, 0, sizeof(*header) + ((size_t)size * depth));
+    memcpy (header->magic, LiveMagic, sizeof(header->magic));
+    header->size = size;
+    header->depth = depth;
+}
+
+void *housesaga_live_map (const char *name, int size, int depth,
+                          struct HouseSagaLive **header) {
+
+    char path[1024];
+    char filename[128];
+    size_t total = sizeof(struct HouseSagaLive) + ((size_t)size * depth);
+    struct HouseSagaLive *live = 0;
+
+    housesaga_storage_rootpath (path, sizeof(path), "");
+    mkdir (path, 0777); // In case this is the first run.
+
+    snprintf (filename, sizeof(filename), ".%s.live", name);
+    housesaga_storage_rootpath (path, sizeof(path), filename);
+
+    int fd = open (path, O_RDWR|O_CREAT, 0644);
+    if (fd >= 0) {
+        struct stat info;
+        if ((!fstat (fd, &info)) && (info.st_size != total)) {
+            if (ftruncate (fd, 0) || ftruncate (fd, total)) {
+                close (fd);
+                fd = -1;
+            }
+        }
+    }
+    if (fd >= 0) {
+        void *data = mmap (0, total, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        close (fd);
+        if (data != MAP_FAILED) live = (struct HouseSagaLive *)data;
+    }
+
+    if (!live) {
+        live = calloc (1, total);
+        housesaga_live_reset (live, size, depth);
+        *header = live;
+        return (void *)(live + 1);
+    }
+    if (memcmp (live->magic, LiveMagic, sizeof(live->magic)) ||
+        (live->size != size) || (live->depth != depth)) {
+        housesaga_live_reset (live, size, depth);
+    } else if (live->generation & 1) {
+        // The service stopped in the middle of a modification.
+        if (live->modified < depth) {
+            memset ((char *)(live + 1) + ((size_t)size * live->modified),
+                    0, size);
+        }
+        live->generation += 1;
+    }
+    live->persistent = 1;
+    *header = live;
+    return (void *)(live + 1);
+}
+
+void housesaga_live_begin (struct HouseSagaLive *header, int index) {
+    header->modified = index;
+    __sync_synchronize();
+    header->generation += 1;
+    __sync_synchronize();
+}
+
+void housesaga_live_end (struct HouseSagaLive *header) {
+    __sync_synchronize();
+    header->generation += 1;
+}
+
@@ -0,0 +1,37 @@
+/* housesaga - A log consolidation and storage service.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * housesaga_live.h - Keep the live buffers in memory mapped files.
+ */
+struct HouseSagaLive {
+    char     magic[8];
+    uint32_t size;       // Size of one record.
+    uint32_t depth;      // Number of records.
+    uint32_t generation; // Odd while a record is being modified.
+    uint32_t modified;   // The record being modified.
+    uint32_t persistent; // 0 if the buffer could not be mapped to a file.
+    uint32_t reserved;
+};
+
+void *housesaga_live_map (const char *name, int size, int depth,
+                          struct HouseSagaLive **header);
+
+void housesaga_live_begin (struct HouseSagaLive *header, int index);
+void housesaga_live_end (struct HouseSagaLive *header);
+
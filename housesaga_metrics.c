@@ -6,12 +6,12 @@
  * modify it under the terms of the GNU General Public License
  * as published by the Free Software Foundation; either version 2
  * of the License, or (at your option) any later version.
- * 
+ *
  * This program is distributed in the hope that it will be useful,
  * but WITHOUT ANY WARRANTY; without even the implied warranty of
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
- * 
+ *
  * You should have received a copy of the GNU General Public License
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor,
@@ -23,42 +23,1266 @@
  * This module is responsible for storing metrics objects to disk.
  * Metrics are JSON objects that are written as-is to disk.
  *
+ * The metrics objects are staged in memory and saved in batches, in
+ * chronological order, the same way as events. Each object is filed
+ * according to its own timestamp, so that a late metrics object goes
+ * to the day it belongs to. The timestamp is found using a light scan
+ * of the JSON text, so that an invalid object is still saved.
+ *
+ * This module also decodes the metrics into compact per-host daily
+ * columns, one column per metric, with one slot for each 5 minutes
+ * period. This is what the graphs web page needs, and is much smaller
+ * than the metrics log file. The metrics object format is:
+ *
+ *   {"host":...,"timestamp":...,"metrics":{<category>:{...}, ...}}
+ *
+ * Each category contains either metrics, or objects (e.g. disk volumes)
+ * that contain metrics. Each metric is an array of numbers (typically
+ * min, median, max) followed by the unit.
+ *
+ * The columns for the current day and the previous one are built as
+ * the metrics are received. The columns for older days are decoded from
+ * the metrics log file on demand, and the last one is kept in memory.
+ *
+ * When a day is closed, the columns for that day are reduced to hourly
+ * and daily rollups (sample count, min, average, max) that are appended
+ * to a per-month rollup file. This makes it possible to show weeks,
+ * months or years of metrics while reading only a few small files.
+ * Each line of the rollup file is:
+ *
+ *   date,host,category,object,name,unit,<daily>,<hour 0>..<hour 23>
+ *
+ * where each rollup is 4 fields: count,min,avg,max (all empty if there
+ * was no data for that hour).
+ *
  * SYNOPSYS:
  *
  * void housesaga_metrics_initialize (int argc, const char **argv);
  *
  *    Initialize the environment required to consolidate metrics logs.
+ *
+ * void housesaga_metrics_health (ParserContext context, int parent);
+ *
+ *    Add the state of the staging buffer to a JSON array, the same way
+ *    as the events module. The memory includes the decoded metrics.
+ *
+ * void housesaga_metrics_background (time_t now);
+ *
+ *    Save the staged metrics, and roll up the metrics of the days that
+ *    were closed. At startup, this
+ *    also rolls up the archived days that were never rolled up, one day
+ *    per call. This is a scheduled action: it runs when the oldest staged
+ *    metrics are due for saving, or when a day must be rolled up.
  */
 
+#include <sys/time.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
 
 #include "echttp.h"
+#include "echttp_json.h"
+#include "echttp_sorted.h"
+#include "echttp_libc.h"
 
 #include "housesaga.h"
 #include "housesaga_metrics.h"
 #include "housesaga_storage.h"
 #include "housesaga_traffic.h"
+#include "housesaga_latency.h"
+#include "housesaga_source.h"
+#include "housesaga_parser.h"
+
+#define METRICS_PERIOD 300
+#define METRICS_SLOTS  ((24 * 60 * 60) / METRICS_PERIOD)
+#define METRICS_VALUES 3
+
+#define METRICS_HOUR   ((60 * 60) / METRICS_PERIOD) // Slots per hour.
+
+#define METRICS_ROLLUP "metrics-rollup.csv"
+
+struct MetricsColumn {
+    char category[16];
+    char object[32];  // Empty if the metric is directly under the category.
+    char name[16];
+    char unit[8];
+    unsigned char count[METRICS_SLOTS]; // 0: no data for this slot.
+    float values[METRICS_SLOTS][METRICS_VALUES];
+    int samples[METRICS_SLOTS]; // Rollups only: 5 minutes periods merged.
+};
+
+struct MetricsHost {
+    char name[64];
+    int count;
+    int size;
+    struct MetricsColumn *columns;
+};
+
+struct MetricsDay {
+    int date;     // YYYYMMDD, 0 if not used.
+    time_t start; // Start of the day, local time.
+    int count;
+    int size;
+    struct MetricsHost *hosts;
+};
+
+#define METRICS_DAYS 3 // Today, yesterday and the last day loaded from disk.
+static struct MetricsDay MetricsDays[METRICS_DAYS];
+static struct MetricsDay *MetricsLoaded = MetricsDays + (METRICS_DAYS - 1);
+
+static int housesaga_metrics_read (struct MetricsDay *day);
+
+
+struct MetricsRecord {
+    time_t timestamp;
+    long long arrival; // Monotonic time, see housesaga_latency_now().
+    int unsaved;
+    char *data;
+};
+
+#define STAGING_DEPTH 256
+
+#define METRICS_SAVE_DELAY 6 // Time given to the sources to flush their data.
+
+static struct MetricsRecord MetricsStaging[STAGING_DEPTH];
+static int MetricsCursor = 0;
+
+static echttp_sorted_list MetricsChronology;
+static time_t MetricsLastSaved = 0;
+static time_t MetricsSaveLimit = 0;
+static time_t MetricsSaveNext = 0;  // Oldest unsaved metrics not yet due.
+
+static long MetricsForcedSaves = 0; // Buffer full: saved without delay.
+static long MetricsRewinds = 0;     // Late records, saved out of order.
+
+static int TrafficMetricsReceived = -1;
+static int TrafficMetricsRolledUp = -1;
+static int ParserMetrics = -1;
+static int LatencyMetricsResidency = -1;
+
+/* Find the value of the top level "timestamp" item without decoding the
+ * whole JSON object. Only the keys of the top level object are considered,
+ * so that a "timestamp" item nested in a metric, or in a string, is
+ * skipped. This must match the integer decoded as .timestamp by
+ * housesaga_metrics_apply(), otherwise the stored record and the graphs
+ * would disagree: return 0 if the value is not an integer.
+ */
+static time_t housesaga_metrics_timestamp (const char *data) {
+
+    const char *cursor = data;
+    int depth = 0;
+
+    for (; *cursor; ++cursor) {
+        switch (*cursor) {
+            case '{':
+            case '[':
+                depth += 1;
+                continue;
+            case '}':
+            case ']':
+                depth -= 1;
+                continue;
+            case '"':
+                break;
+            default:
+                continue;
+        }
+        // Skip the string, and check if this is the key we are looking for.
+        const char *start = ++cursor;
+        while (*cursor && (*cursor != '"')) {
+            if ((*cursor == '\\') && cursor[1]) cursor += 1;
+            cursor += 1;
+        }
+        if (!*cursor) return 0;
+        if ((depth != 1) || (cursor - start != 9) ||
+            strncmp (start, "timestamp", 9)) continue;
+
+        const char *value = cursor + 1;
+        while (isspace(*value)) value += 1;
+        if (*value != ':') continue; // A string value, not a key.
+        value += 1;
+        while (isspace(*value)) value += 1;
+        if (!isdigit(*value)) return 0;
+        char *end;
+        long long timestamp = strtoll (value, &end, 10);
+        if ((*end == '.') || (*end == 'e') || (*end == 'E')) return 0;
+        return (time_t)timestamp;
+    }
+    return 0;
+}
+
+static int housesaga_metrics_saveaction (void *data) {
+
+    struct MetricsRecord *cursor = MetricsStaging + (intptr_t) data;
+
+    if (cursor->unsaved) {
+        if (cursor->timestamp > MetricsSaveLimit) {
+            MetricsSaveNext = cursor->timestamp;
+            return 0;
+        }
+        housesaga_storage_save ("metrics.json", cursor->timestamp, 0,
+                                cursor->data);
+        housesaga_latency_record (LatencyMetricsResidency, cursor->arrival);
+        cursor->unsaved = 0;
+    }
+    return 1;
+}
+
+static void housesaga_metrics_save (int full) {
+
+    if (!MetricsChronology) return; // Nothing received yet.
+
+    time_t now = time(0);
+
+    // Delay saving recent metrics, as some sources might be late, same as
+    // for events. The consecutive metrics for the same day all go to the
+    // same open file.
+    //
+    MetricsSaveLimit = full ? now + 2 : now - METRICS_SAVE_DELAY;
+    MetricsSaveNext = 0;
+
+    if (MetricsLastSaved) {
+        echttp_sorted_ascending_from (MetricsChronology,
+                                      MetricsLastSaved * 1000,
+                                      housesaga_metrics_saveaction);
+    } else {
+        echttp_sorted_ascending (MetricsChronology,
+                                 housesaga_metrics_saveaction);
+    }
+    housesaga_storage_flush();
+    MetricsLastSaved = full ? now : MetricsSaveLimit;
+}
+
+static void housesaga_metrics_stage (time_t timestamp, const char *data) {
+
+    struct MetricsRecord *cursor = MetricsStaging + MetricsCursor;
+
+    if (!MetricsChronology) MetricsChronology = echttp_sorted_new();
+
+    cursor->timestamp = timestamp;
+    cursor->arrival = housesaga_latency_now();
+    cursor->data = strdup (data);
+    cursor->unsaved = 1;
+    housesaga_schedule (timestamp + METRICS_SAVE_DELAY,
+                        housesaga_metrics_background);
+    echttp_sorted_add (MetricsChronology, (unsigned long long)timestamp * 1000,
+                       (void *)((long)MetricsCursor));
+
+    if (timestamp < MetricsLastSaved) {
+        // A late metrics object: make sure it will be saved.
+        MetricsLastSaved = timestamp;
+        MetricsRewinds += 1;
+    }
+
+    MetricsCursor += 1;
+    if (MetricsCursor >= STAGING_DEPTH) MetricsCursor = 0;
+
+    cursor = MetricsStaging + MetricsCursor;
+    if (cursor->data) {
+        if (cursor->unsaved) {
+            housesaga_metrics_save(1); // Save before erased.
+            MetricsForcedSaves += 1;
+        }
+
+        echttp_sorted_remove (MetricsChronology,
+                              (unsigned long long)(cursor->timestamp) * 1000,
+                              (void *)((long)MetricsCursor));
+        free (cursor->data);
+        cursor->data = 0;
+    }
+}
+
+static void safecpy (char *d, const char *s, int size) {
+    if (s) strtcpy (d, s, size);
+    else d[0] = 0;
+}
+
+static int housesaga_metrics_date (time_t timestamp, time_t *start) {
+
+    struct tm local = *localtime (&timestamp);
+    int date = ((local.tm_year + 1900) * 100 + local.tm_mon + 1) * 100
+               + local.tm_mday;
+    if (start) {
+        local.tm_hour = local.tm_min = local.tm_sec = 0;
+        local.tm_isdst = -1;
+        *start = mktime (&local);
+    }
+    return date;
+}
+
+static void housesaga_metrics_clear (struct MetricsDay *day) {
+    int i;
+    for (i = 0; i < day->count; ++i) {
+        if (day->hosts[i].columns) free (day->hosts[i].columns);
+    }
+    if (day->hosts) free (day->hosts);
+    memset (day, 0, sizeof(*day));
+}
+
+/* Find the day structure for the current or previous day. Any day
+ * older than that is not kept (but a late metrics is still saved to disk).
+ */
+static struct MetricsDay *housesaga_metrics_live (time_t timestamp) {
+
+    time_t start;
+    int date = housesaga_metrics_date (timestamp, &start);
+
+    int i;
+    struct MetricsDay *oldest = 0;
+    for (i = 0; i < METRICS_DAYS - 1; ++i) {
+        if (MetricsDays[i].date == date) return MetricsDays + i;
+        if ((!oldest) || (MetricsDays[i].date < oldest->date))
+            oldest = MetricsDays + i;
+    }
+    if (oldest->date > date) return 0; // Too old.
+
+    housesaga_metrics_clear (oldest);
+    if (MetricsLoaded->date == date) housesaga_metrics_clear (MetricsLoaded);
+    oldest->date = date;
+    oldest->start = start;
+    housesaga_metrics_read (oldest); // Recover metrics saved before a restart.
+    return oldest;
+}
+
+static struct MetricsHost *housesaga_metrics_host (struct MetricsDay *day,
+                                                   const char *name) {
+    int i;
+    for (i = 0; i < day->count; ++i) {
+        if (!strcmp (day->hosts[i].name, name)) return day->hosts + i;
+    }
+    if (day->count >= day->size) {
+        day->size += 16;
+        day->hosts = realloc (day->hosts, day->size * sizeof(*(day->hosts)));
+    }
+    struct MetricsHost *host = day->hosts + (day->count++);
+    safecpy (host->name, name, sizeof(host->name));
+    host->count = host->size = 0;
+    host->columns = 0;
+    return host;
+}
+
+static struct MetricsColumn *housesaga_metrics_column
+                                 (struct MetricsHost *host,
+                                  const char *category,
+                                  const char *object,
+                                  const char *name) {
+    int i;
+    for (i = 0; i < host->count; ++i) {
+        struct MetricsColumn *column = host->columns + i;
+        if (strcmp (column->name, name)) continue;
+        if (strcmp (column->object, object)) continue;
+        if (strcmp (column->category, category)) continue;
+        return column;
+    }
+    if (host->count >= host->size) {
+        host->size += 16;
+        host->columns =
+            realloc (host->columns, host->size * sizeof(*(host->columns)));
+    }
+    struct MetricsColumn *column = host->columns + (host->count++);
+    memset (column, 0, sizeof(*column));
+    safecpy (column->category, category, sizeof(column->category));
+    safecpy (column->object, object, sizeof(column->object));
+    safecpy (column->name, name, sizeof(column->name));
+    return column;
+}
+
+/* Return the index of the token that follows the specified item,
+ * including all its children if any.
+ */
+static int housesaga_metrics_skip (const ParserToken *token, int item) {
+    int next = item + 1;
+    if ((token[item].type == PARSER_OBJECT) ||
+        (token[item].type == PARSER_ARRAY)) {
+        int i;
+        for (i = 0; i < token[item].length; ++i) {
+            next = housesaga_metrics_skip (token, next);
+        }
+    }
+    return next;
+}
+
+static void housesaga_metrics_value (struct MetricsHost *host, int slot,
+                                     const char *category,
+                                     const char *object,
+                                     const ParserToken *token, int item) {
+
+    if (token[item].type != PARSER_ARRAY) return;
+
+    struct MetricsColumn *column =
+        housesaga_metrics_column (host, category, object, token[item].key);
+
+    int i;
+    int count = 0;
+    int cursor = item + 1;
+    for (i = 0; i < token[item].length; ++i) {
+        const ParserToken *element = token + cursor;
+        switch (element->type) {
+            case PARSER_INTEGER:
+                if (count < METRICS_VALUES)
+                    column->values[slot][count++] = (float)(element->value.integer);
+                break;
+            case PARSER_REAL:
+                if (count < METRICS_VALUES)
+                    column->values[slot][count++] = (float)(element->value.real);
+                break;
+            case PARSER_STRING:
+                safecpy (column->unit, element->value.string, sizeof(column->unit));
+                break;
+        }
+        cursor = housesaga_metrics_skip (token, cursor);
+    }
+    column->count[slot] = count;
+}
+
+/* Decode one metrics object into the columns of the specified day.
+ */
+static void housesaga_metrics_decode (struct MetricsDay *day,
+                                      const ParserToken *token,
+                                      long long timestamp) {
+
+    int item = echttp_json_search (token, ".host");
+    if ((item < 0) || (token[item].type != PARSER_STRING)) return;
+    const char *hostname = token[item].value.string;
+    if (!hostname[0]) return;
+
+    int metrics = echttp_json_search (token, ".metrics");
+    if ((metrics < 0) || (token[metrics].type != PARSER_OBJECT)) return;
+
+    if (timestamp < day->start) return;
+    int slot = (int)((timestamp - day->start) / METRICS_PERIOD);
+    if (slot >= METRICS_SLOTS) return;
+
+    struct MetricsHost *host = housesaga_metrics_host (day, hostname);
+
+    int i;
+    int category = metrics + 1;
+    for (i = 0; i < token[metrics].length; ++i) {
+        if (token[category].type == PARSER_OBJECT) {
+            int j;
+            int child = category + 1;
+            for (j = 0; j < token[category].length; ++j) {
+                if (token[child].type == PARSER_OBJECT) {
+                    int k;
+                    int leaf = child + 1;
+                    for (k = 0; k < token[child].length; ++k) {
+                        housesaga_metrics_value (host, slot,
+                                                 token[category].key,
+                                                 token[child].key,
+                                                 token, leaf);
+                        leaf = housesaga_metrics_skip (token, leaf);
+                    }
+                } else {
+                    housesaga_metrics_value (host, slot,
+                                             token[category].key, "",
+                                             token, child);
+                }
+                child = housesaga_metrics_skip (token, child);
+            }
+        }
+        category = housesaga_metrics_skip (token, category);
+    }
+}
+
+struct MetricsParser {
+    ParserToken *token;
+    int allocated;
+};
+
+static const ParserToken *housesaga_metrics_parse (struct MetricsParser *parser,
+                                                   char *data,
+                                                   long long *timestamp) {
+
+    int count = echttp_json_estimate(data);
+    if (count > parser->allocated) {
+        if (parser->token) free (parser->token);
+        parser->allocated = count;
+        parser->token = calloc (count, sizeof(ParserToken));
+    }
+    const char *error = echttp_json_parse (data, parser->token, &count);
+    if (error) return 0;
+
+    int item = echttp_json_search (parser->token, ".timestamp");
+    if ((item < 0) || (parser->token[item].type != PARSER_INTEGER)) return 0;
+    *timestamp = parser->token[item].value.integer;
+    return parser->token;
+}
+
+/* Decode the metrics log file for the specified day, if any.
+ */
+static int housesaga_metrics_read (struct MetricsDay *day) {
+
+    static struct MetricsParser Parser;
+
+    char path[1024];
+    int length = housesaga_storage_daypath (path, sizeof(path),
+                                            day->date / 10000,
+                                            (day->date / 100) % 100,
+                                            day->date % 100);
+    snprintf (path+length, sizeof(path)-length, "/metrics.json");
+    FILE *file = fopen (path, "r");
+    if (!file) return 0;
+
+    char *line = 0;
+    size_t size = 0;
+    while (getline (&line, &size, file) > 0) {
+        long long timestamp;
+        const ParserToken *token =
+            housesaga_metrics_parse (&Parser, line, &timestamp);
+        if (token) housesaga_metrics_decode (day, token, timestamp);
+    }
+    if (line) free (line);
+    fclose (file);
+    return 1;
+}
+
+/* Decode an archived metrics log file.
+ */
+static struct MetricsDay *housesaga_metrics_load (int year, int month, int dd) {
+
+    int date = (year * 100 + month) * 100 + dd;
+    int i;
+    for (i = 0; i < METRICS_DAYS; ++i) {
+        if (MetricsDays[i].date == date) return MetricsDays + i;
+    }
+
+    struct MetricsDay *day = MetricsLoaded;
+    housesaga_metrics_clear (day);
+
+    struct tm local = {0};
+    local.tm_mday = dd;
+    local.tm_mon = month - 1;
+    local.tm_year = year - 1900;
+    local.tm_isdst = -1;
+    day->start = mktime (&local);
+    day->date = date;
+
+    if (!housesaga_metrics_read (day)) {
+        housesaga_metrics_clear (day);
+        return 0;
+    }
+    return day;
+}
+
+// Rollup of a range of 5 minutes periods.
+struct MetricsRollup {
+    int samples;
+    float min;
+    float avg;
+    float max;
+};
+
+static void housesaga_metrics_reduce (const struct MetricsColumn *column,
+                                      int first, int count,
+                                      struct MetricsRollup *rollup) {
+    int slot;
+    double sum = 0.0;
+
+    rollup->samples = 0;
+    for (slot = first; slot < first + count; ++slot) {
+        int n = column->count[slot];
+        if (!n) continue;
+        const float *values = column->values[slot];
+        float middle = (n == 2) ? (values[0] + values[1]) / 2 : values[n/2];
+        if ((!rollup->samples) || (values[0] < rollup->min))
+            rollup->min = values[0];
+        if ((!rollup->samples) || (values[n-1] > rollup->max))
+            rollup->max = values[n-1];
+        sum += middle;
+        rollup->samples += 1;
+    }
+    if (rollup->samples) rollup->avg = (float)(sum / rollup->samples);
+}
+
+static void housesaga_metrics_rollup_print (FILE *file,
+                                            const struct MetricsRollup *r) {
+    if (r->samples)
+        fprintf (file, ",%d,%g,%g,%g", r->samples, r->min, r->avg, r->max);
+    else
+        fprintf (file, ",,,,");
+}
+
+static FILE *housesaga_metrics_rollup_open (int date, const char *mode) {
+    char path[1024];
+    int length = housesaga_storage_monthpath (path, sizeof(path),
+                                              date / 10000,
+                                              (date / 100) % 100);
+    snprintf (path+length, sizeof(path)-length, "/" METRICS_ROLLUP);
+    return fopen (path, mode);
+}
+
+// The list of days already rolled up, for the last month checked.
+static int RollupMonth = 0; // YYYYMM
+static unsigned int RollupDays = 0; // One bit per day of the month.
+
+static int housesaga_metrics_rolledup (int date) {
+
+    if (date / 100 != RollupMonth) {
+        RollupMonth = date / 100;
+        RollupDays = 0;
+        FILE *file = housesaga_metrics_rollup_open (date, "r");
+        if (file) {
+            char line[2048];
+            while (fgets (line, sizeof(line), file)) {
+                int year, month, day;
+                if (sscanf (line, "%d-%d-%d,", &year, &month, &day) != 3)
+                    continue;
+                RollupDays |= (1u << day);
+            }
+            fclose (file);
+        }
+    }
+    return (RollupDays & (1u << (date % 100))) != 0;
+}
+
+static void housesaga_metrics_rollup (int date) {
+
+    if (housesaga_metrics_rolledup (date)) return;
+
+    int i;
+    struct MetricsDay *day = 0;
+    for (i = 0; i < METRICS_DAYS; ++i) {
+        if (MetricsDays[i].date == date) {
+            day = MetricsDays + i;
+            break;
+        }
+    }
+    if (!day) day = housesaga_metrics_load
+                        (date / 10000, (date / 100) % 100, date % 100);
+    if (!day) return;
+
+    FILE *file = housesaga_metrics_rollup_open (date, "a");
+    if (!file) return;
+
+    int h, c, hour;
+    for (h = 0; h < day->count; ++h) {
+        const struct MetricsHost *host = day->hosts + h;
+        if (strchr (host->name, ',')) continue;
+
+        for (c = 0; c < host->count; ++c) {
+            const struct MetricsColumn *column = host->columns + c;
+            if (strchr (column->category, ',') ||
+                strchr (column->object, ',') ||
+                strchr (column->name, ',') ||
+                strchr (column->unit, ',')) continue;
+
+            struct MetricsRollup rollup;
+            housesaga_metrics_reduce (column, 0, METRICS_SLOTS, &rollup);
+            if (!rollup.samples) continue;
+
+            fprintf (file, "%04d-%02d-%02d,%s,%s,%s,%s,%s",
+                     date / 10000, (date / 100) % 100, date % 100,
+                     host->name, column->category, column->object,
+                     column->name, column->unit);
+            housesaga_metrics_rollup_print (file, &rollup);
+            for (hour = 0; hour < 24; ++hour) {
+                housesaga_metrics_reduce
+                    (column, hour * METRICS_HOUR, METRICS_HOUR, &rollup);
+                housesaga_metrics_rollup_print (file, &rollup);
+            }
+            fprintf (file, "\n");
+        }
+    }
+    fclose (file);
+    RollupDays |= (1u << (date % 100));
+    housesaga_traffic_increment (TrafficMetricsRolledUp);
+}
+
+// The days waiting to be rolled up.
+static int *RollupPending = 0;
+static int  RollupPendingCount = 0;
+static int  RollupPendingSize = 0;
+
+static int RollupToday = 0;
+
+static void housesaga_metrics_pending (int date) {
+    if (RollupPendingCount >= RollupPendingSize) {
+        RollupPendingSize += 64;
+        RollupPending =
+            realloc (RollupPending, RollupPendingSize * sizeof(int));
+    }
+    RollupPending[RollupPendingCount++] = date;
+}
+
+static void housesaga_metrics_archived (const char *path,
+                                        int year, int month, int day) {
+    char filename[1024];
+    snprintf (filename, sizeof(filename), "%s/metrics.json", path);
+    FILE *file = fopen (filename, "r");
+    if (!file) return;
+    fclose (file);
+
+    int date = (year * 100 + month) * 100 + day;
+    if (date < RollupToday) housesaga_metrics_pending (date);
+}
+
+static char *WebMetricsBuffer = 0;
+static int   WebMetricsSize = 0;
+static int   WebMetricsLength = 0;
+
+static void housesaga_metrics_print (const char *format, ...) {
+
+    va_list ap;
+    for (;;) {
+        int room = WebMetricsSize - WebMetricsLength;
+        va_start (ap, format);
+        int wrote = vsnprintf (WebMetricsBuffer + WebMetricsLength,
+                               room, format, ap);
+        va_end (ap);
+        if (wrote < room) {
+            WebMetricsLength += wrote;
+            return;
+        }
+        WebMetricsSize += 65536 + wrote;
+        WebMetricsBuffer = realloc (WebMetricsBuffer, WebMetricsSize);
+    }
+}
+
+static int housesaga_metrics_compare (const void *a, const void *b) {
+    const struct MetricsColumn *ca = *((const struct MetricsColumn **)a);
+    const struct MetricsColumn *cb = *((const struct MetricsColumn **)b);
+    int result = strcmp (ca->category, cb->category);
+    if (result) return result;
+    return strcmp (ca->object, cb->object);
+}
+
+static void housesaga_metrics_column_export (const struct MetricsColumn *c,
+                                             int slot) {
+    int i;
+    housesaga_metrics_print ("\"%s\":[", c->name);
+    for (i = 0; i < c->count[slot]; ++i) {
+        housesaga_metrics_print ("%s%g", i?",":"", c->values[slot][i]);
+    }
+    housesaga_metrics_print (",\"%s\"]", c->unit);
+}
+
+/* Export the columns of one host in the same format as the original
+ * metrics: for each category, an array with one element per 5 minutes
+ * slot up to the last one with data, each element being null or an
+ * object with the metrics (or the objects with metrics) for that period.
+ */
+static void housesaga_metrics_export (const struct MetricsHost *host) {
+
+    int i;
+    int slot;
+    const struct MetricsColumn **sorted =
+        malloc (host->count * sizeof(struct MetricsColumn *));
+    for (i = 0; i < host->count; ++i) sorted[i] = host->columns + i;
+    qsort (sorted, host->count, sizeof(struct MetricsColumn *),
+           housesaga_metrics_compare);
+
+    // Stop at the last slot with data, like the original arrays do.
+    int end = 0;
+    for (i = 0; i < host->count; ++i) {
+        for (slot = METRICS_SLOTS - 1; slot >= end; --slot) {
+            if (sorted[i]->count[slot]) {
+                end = slot + 1;
+                break;
+            }
+        }
+    }
+
+    const char *sep = "";
+    int first = 0;
+    while (first < host->count) {
+        const char *category = sorted[first]->category;
+        int last;
+        for (last = first + 1; last < host->count; ++last) {
+            if (strcmp (sorted[last]->category, category)) break;
+        }
+        housesaga_metrics_print ("%s\"%s\":[", sep, category);
+        sep = ",";
+
+        for (slot = 0; slot < end; ++slot) {
+            const char *slotsep = slot ? "," : "";
+            const char *object = 0;
+            const char *itemsep = "{";
+            for (i = first; i < last; ++i) {
+                const struct MetricsColumn *c = sorted[i];
+                if (!c->count[slot]) continue;
+                if (c->object[0]) {
+                    if ((!object) || strcmp (object, c->object)) {
+                        housesaga_metrics_print ("%s%s%s\"%s\":{",
+                                                 slotsep, object?"}":"",
+                                                 itemsep, c->object);
+                        object = c->object;
+                        itemsep = ",";
+                        slotsep = "";
+                    } else {
+                        housesaga_metrics_print (",");
+                    }
+                } else {
+                    housesaga_metrics_print ("%s%s", slotsep, itemsep);
+                    itemsep = ",";
+                    slotsep = "";
+                }
+                housesaga_metrics_column_export (c, slot);
+            }
+            if (itemsep[0] == '{') {
+                housesaga_metrics_print ("%snull", slotsep);
+            } else {
+                housesaga_metrics_print ("%s}", object?"}":"");
+            }
+        }
+        housesaga_metrics_print ("]");
+        first = last;
+    }
+    free (sorted);
+}
+
+/* Complete the response with either the list of hosts, or the metrics
+ * for the requested host.
+ */
+static const char *housesaga_metrics_respond (const struct MetricsDay *metrics,
+                                              const char *hostname) {
+    int i;
+    if (!hostname) {
+        const char *sep = "";
+        housesaga_metrics_print (",\"hosts\":[");
+        for (i = 0; i < metrics->count; ++i) {
+            housesaga_metrics_print ("%s\"%s\"", sep, metrics->hosts[i].name);
+            sep = ",";
+        }
+        housesaga_metrics_print ("]}");
+    } else {
+        for (i = 0; i < metrics->count; ++i) {
+            if (!strcmp (metrics->hosts[i].name, hostname)) break;
+        }
+        if (i >= metrics->count) {
+            echttp_error (404, "Not Found");
+            return "";
+        }
+        housesaga_metrics_print (",\"metrics\":{");
+        housesaga_metrics_export (metrics->hosts + i);
+        housesaga_metrics_print ("}}");
+    }
+    echttp_content_type_json ();
+    return WebMetricsBuffer;
+}
+
+static const char *housesaga_metrics_webday (const char *method,
+                                             const char *uri,
+                                             const char *data, int length) {
+
+    const char *date = echttp_parameter_get("date");
+    const char *hostname = echttp_parameter_get("host");
+
+    int year, month, day;
+    if ((!date) || (sscanf (date, "%d-%d-%d", &year, &month, &day) != 3)) {
+        echttp_error (400, "Invalid date");
+        return "";
+    }
+    struct MetricsDay *metrics = housesaga_metrics_load (year, month, day);
+    if (!metrics) {
+        echttp_error (404, "Not Found");
+        return "";
+    }
+
+    WebMetricsLength = 0;
+    housesaga_metrics_print
+        ("{\"host\":\"%s\",\"timestamp\":%lld,\"date\":\"%04d-%02d-%02d\","
+             "\"start\":%lld,\"step\":%d,\"slots\":%d",
+         housesaga_host(), (long long)time(0), year, month, day,
+         (long long)(metrics->start), METRICS_PERIOD, METRICS_SLOTS);
+
+    return housesaga_metrics_respond (metrics, hostname);
+}
+
+static struct MetricsDay MetricsRange;
+
+// Days since January 1st, 1970 (proleptic Gregorian calendar).
+static long housesaga_metrics_days (int date) {
+    int year = date / 10000;
+    int month = (date / 100) % 100;
+    int day = date % 100;
+    if (month <= 2) year -= 1;
+    long era = (year >= 0 ? year : year - 399) / 400;
+    long yoe = year - era * 400;
+    long doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+static int housesaga_metrics_getdate (const char *text, int *date) {
+    int year, month, day;
+    if (!text) return 0;
+    if (sscanf (text, "%d-%d-%d", &year, &month, &day) != 3) return 0;
+    if ((month < 1) || (month > 12) || (day < 1) || (day > 31)) return 0;
+    *date = (year * 100 + month) * 100 + day;
+    return 1;
+}
+
+static void housesaga_metrics_accumulate (struct MetricsColumn *column,
+                                          int slot,
+                                          const struct MetricsRollup *r) {
+    if (!r->samples) return;
+
+    int total = column->samples[slot];
+    float *values = column->values[slot];
+    if (!column->count[slot]) {
+        values[0] = r->min;
+        values[1] = r->avg;
+        values[2] = r->max;
+        column->count[slot] = 3;
+    } else {
+        if (r->min < values[0]) values[0] = r->min;
+        if (r->max > values[2]) values[2] = r->max;
+        values[1] = ((values[1] * total) + (r->avg * r->samples))
+                        / (total + r->samples);
+    }
+    column->samples[slot] = total + r->samples;
+}
+
+static void housesaga_metrics_getrollup (char **fields,
+                                         struct MetricsRollup *rollup) {
+    rollup->samples = atoi (fields[0]);
+    if (rollup->samples <= 0) {
+        rollup->samples = 0;
+        return;
+    }
+    rollup->min = (float)atof (fields[1]);
+    rollup->avg = (float)atof (fields[2]);
+    rollup->max = (float)atof (fields[3]);
+}
+
+#define ROLLUP_FIELDS (6 + (4 * 25))
+
+static int housesaga_metrics_split (char *line, char **fields) {
+    int count = 0;
+    char *eol = strchr (line, '\n');
+    if (eol) *eol = 0;
+    fields[count++] = line;
+    while (count < ROLLUP_FIELDS) {
+        char *sep = strchr (line, ',');
+        if (!sep) break;
+        *sep = 0;
+        line = sep + 1;
+        fields[count++] = line;
+    }
+    return count;
+}
+
+/* Add the rollups found in the rollup files to the range. The days found
+ * are marked as seen, so that the live metrics are not counted twice.
+ */
+static void housesaga_metrics_range_file (int from, int to,
+                                          const char *hostname,
+                                          int perday, int divider,
+                                          char *seen) {
+    long first = housesaga_metrics_days (from);
+
+    int month;
+    for (month = from / 100; month <= to / 100;
+         month += ((month % 100) == 12) ? 89 : 1) {
+
+        FILE *file = housesaga_metrics_rollup_open (month * 100 + 1, "r");
+        if (!file) continue;
+
+        char *line = 0;
+        size_t size = 0;
+        while (getline (&line, &size, file) > 0) {
+            char *fields[ROLLUP_FIELDS];
+            int count = housesaga_metrics_split (line, fields);
+            if (count < 10) continue;
+
+            int date;
+            if (!housesaga_metrics_getdate (fields[0], &date)) continue;
+            if ((date < from) || (date > to)) continue;
+            if (hostname && strcmp (fields[1], hostname)) continue;
+
+            struct MetricsHost *host =
+                housesaga_metrics_host (&MetricsRange, fields[1]);
+            long index = housesaga_metrics_days (date) - first;
+            seen[index] = 1;
+            if (!hostname) continue; // Only the list of hosts is needed.
+
+            struct MetricsColumn *column =
+                housesaga_metrics_column (host, fields[2], fields[3], fields[4]);
+            safecpy (column->unit, fields[5], sizeof(column->unit));
+
+            struct MetricsRollup rollup;
+            if (perday == 1) {
+                housesaga_metrics_getrollup (fields + 6, &rollup);
+                housesaga_metrics_accumulate (column, index / divider, &rollup);
+            } else {
+                int hour;
+                for (hour = 0; hour < 24; ++hour) {
+                    int base = 10 + (4 * hour);
+                    if (base + 4 > count) break;
+                    housesaga_metrics_getrollup (fields + base, &rollup);
+                    housesaga_metrics_accumulate
+                        (column, (index * 24) + hour, &rollup);
+                }
+            }
+        }
+        if (line) free (line);
+        fclose (file);
+    }
+}
+
+/* Add the live metrics for the days that were not rolled up yet.
+ */
+static void housesaga_metrics_range_live (int from, int to,
+                                          const char *hostname,
+                                          int perday, int divider,
+                                          const char *seen) {
+    long first = housesaga_metrics_days (from);
+
+    int d, h, c, hour;
+    for (d = 0; d < METRICS_DAYS; ++d) {
+        const struct MetricsDay *day = MetricsDays + d;
+        if ((day->date < from) || (day->date > to)) continue;
+        long index = housesaga_metrics_days (day->date) - first;
+        if (seen[index]) continue; // Already rolled up.
+
+        for (h = 0; h < day->count; ++h) {
+            const struct MetricsHost *live = day->hosts + h;
+            if (hostname && strcmp (live->name, hostname)) continue;
+
+            struct MetricsHost *host =
+                housesaga_metrics_host (&MetricsRange, live->name);
+            if (!hostname) continue; // Only the list of hosts is needed.
+
+            for (c = 0; c < live->count; ++c) {
+                const struct MetricsColumn *source = live->columns + c;
+                struct MetricsColumn *column =
+                    housesaga_metrics_column (host, source->category,
+                                              source->object, source->name);
+                safecpy (column->unit, source->unit, sizeof(column->unit));
+
+                struct MetricsRollup rollup;
+                if (perday == 1) {
+                    housesaga_metrics_reduce (source, 0, METRICS_SLOTS, &rollup);
+                    housesaga_metrics_accumulate
+                        (column, index / divider, &rollup);
+                } else {
+                    for (hour = 0; hour < 24; ++hour) {
+                        housesaga_metrics_reduce (source, hour * METRICS_HOUR,
+                                                  METRICS_HOUR, &rollup);
+                        housesaga_metrics_accumulate
+                            (column, (index * 24) + hour, &rollup);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static const char *housesaga_metrics_webrange (const char *method,
+                                               const char *uri,
+                                               const char *data, int length) {
+
+    const char *hostname = echttp_parameter_get("host");
+    const char *resolution = echttp_parameter_get("resolution");
+
+    int from, to;
+    if ((!housesaga_metrics_getdate (echttp_parameter_get("from"), &from)) ||
+        (!housesaga_metrics_getdate (echttp_parameter_get("to"), &to)) ||
+        (to < from)) {
+        echttp_error (400, "Invalid date range");
+        return "";
+    }
+    int days = (int)(housesaga_metrics_days (to)
+                         - housesaga_metrics_days (from)) + 1;
+
+    // The resolution is one hour, one day or one week. By default, use
+    // the finest resolution that fits.
+    //
+    int perday = 24;
+    int divider = 1;
+    if (resolution) {
+        if (!strcmp (resolution, "day")) {
+            perday = 1;
+        } else if (!strcmp (resolution, "week")) {
+            perday = 1;
+            divider = 7;
+        } else if (strcmp (resolution, "hour")) {
+            echttp_error (400, "Invalid resolution");
+            return "";
+        }
+    } else if (days * 24 > METRICS_SLOTS) {
+        perday = 1;
+        if (days > METRICS_SLOTS) divider = 7;
+    }
+    int slots = ((days * perday) + divider - 1) / divider;
+    if (slots > METRICS_SLOTS) {
+        echttp_error (400, "Range too large for this resolution");
+        return "";
+    }
+
+    housesaga_metrics_clear (&MetricsRange);
+    char *seen = calloc (days, 1);
+    housesaga_metrics_range_file (from, to, hostname, perday, divider, seen);
+    housesaga_metrics_range_live (from, to, hostname, perday, divider, seen);
+    free (seen);
+
+    struct tm local = {0};
+    local.tm_mday = from % 100;
+    local.tm_mon = ((from / 100) % 100) - 1;
+    local.tm_year = (from / 10000) - 1900;
+    local.tm_isdst = -1;
+    time_t start = mktime (&local);
+
+    WebMetricsLength = 0;
+    housesaga_metrics_print
+        ("{\"host\":\"%s\",\"timestamp\":%lld,"
+             "\"from\":\"%04d-%02d-%02d\",\"to\":\"%04d-%02d-%02d\","
+             "\"start\":%lld,\"step\":%d,\"slots\":%d",
+         housesaga_host(), (long long)time(0),
+         from / 10000, (from / 100) % 100, from % 100,
+         to / 10000, (to / 100) % 100, to % 100,
+         (long long)start, (24 * 60 * 60 * divider) / perday, slots);
+
+    return housesaga_metrics_respond (&MetricsRange, hostname);
+}
+
+void housesaga_metrics_health (ParserContext context, int parent) {
+
+    int i, j;
+    int used = 0;
+    int unsaved = 0;
+    long long memory = sizeof(MetricsStaging);
+    for (i = 0; i < STAGING_DEPTH; ++i) {
+        if (!MetricsStaging[i].data) continue;
+        used += 1;
+        if (MetricsStaging[i].unsaved) unsaved += 1;
+        memory += strlen (MetricsStaging[i].data) + 1;
+    }
+    for (i = 0; i < METRICS_DAYS; ++i) {
+        memory += MetricsDays[i].size * sizeof(struct MetricsHost);
+        for (j = 0; j < MetricsDays[i].count; ++j) {
+            memory += MetricsDays[i].hosts[j].size * sizeof(struct MetricsColumn);
+        }
+    }
+    int item = echttp_json_add_object (context, parent, 0);
+    echttp_json_add_string (context, item, "name", "metrics");
+    echttp_json_add_integer (context, item, "depth", STAGING_DEPTH);
+    echttp_json_add_integer (context, item, "used", used);
+    echttp_json_add_integer (context, item, "unsaved", unsaved);
+    echttp_json_add_integer (context, item, "forced", MetricsForcedSaves);
+    echttp_json_add_integer (context, item, "rewinds", MetricsRewinds);
+    echttp_json_add_integer (context, item, "memory", memory);
+}
+
+void housesaga_metrics_background (time_t now) {
+
+    housesaga_metrics_save (0);
+    if (MetricsSaveNext)
+        housesaga_schedule (MetricsSaveNext + METRICS_SAVE_DELAY,
+                            housesaga_metrics_background);
+
+    time_t start;
+    int today = housesaga_metrics_date (now, &start);
+
+    if (!RollupToday) {
+        // Find all the archived days that were never rolled up. The days
+        // are rolled up in reverse order, most recent first.
+        RollupToday = today;
+        housesaga_storage_walk (housesaga_metrics_archived);
+        int i, j;
+        for (i = 1; i < RollupPendingCount; ++i) {
+            int date = RollupPending[i];
+            for (j = i; j > 0 && RollupPending[j-1] > date; --j)
+                RollupPending[j] = RollupPending[j-1];
+            RollupPending[j] = date;
+        }
+    } else if (today != RollupToday) {
+        // Give 10 minutes for late metrics to arrive before closing the day.
+        if (now >= start + 600) {
+            housesaga_metrics_pending (RollupToday);
+            RollupToday = today;
+        }
+    }
+    if (RollupPendingCount > 0) {
+        housesaga_metrics_rollup (RollupPending[--RollupPendingCount]);
+    }
+
+    // Come back for the next rollup, or else when the next day closes.
+    if (RollupPendingCount > 0) {
+        housesaga_schedule (now + 1, housesaga_metrics_background);
+    } else if (today != RollupToday) {
+        housesaga_schedule (start + 600, housesaga_metrics_background);
+    } else {
+        struct tm local = *localtime (&start);
+        local.tm_mday += 1;
+        local.tm_isdst = -1;
+        housesaga_schedule (mktime (&local) + 600,
+                            housesaga_metrics_background);
+    }
+}
+
+/* Account for the metrics source. A metrics report comes from one host
+ * and covers one application (if specified), at one point in time.
+ */
+static void housesaga_metrics_source (const ParserToken *token,
+                                      long long timestamp) {
+
+    int item = echttp_json_search (token, ".host");
+    if ((item < 0) || (token[item].type != PARSER_STRING)) return;
+    const char *host = token[item].value.string;
+
+    const char *app = "";
+    item = echttp_json_search (token, ".app");
+    if ((item >= 0) && (token[item].type == PARSER_STRING))
+        app = token[item].value.string;
+
+    int source = housesaga_source_batch (host, app, HOUSESAGA_SOURCE_METRICS);
+    struct timeval time = {(time_t)timestamp, 0};
+    housesaga_source_record (source, &time);
+}
+
+/* Decode the metrics for the graphs.
+ */
+static void housesaga_metrics_apply (const struct HouseSagaBatch *batch) {
+
+    const ParserToken *token = batch->token;
+    int item = echttp_json_search (token, ".timestamp");
+    if ((item < 0) || (token[item].type != PARSER_INTEGER)) return;
+    long long timestamp = token[item].value.integer;
+
+    housesaga_metrics_source (token, timestamp);
+
+    struct MetricsDay *day = housesaga_metrics_live ((time_t)timestamp);
+    if (day) housesaga_metrics_decode (day, token, timestamp);
+}
 
 static const char *housesaga_webmetrics (const char *method, const char *uri,
                                          const char *data, int length) {
 
     if (strcmp (method, "POST")) return ""; // Only POST is supported.
 
-    housesaga_storage_save ("metrics.json", time(0), 0, data);
-    housesaga_storage_flush ();
-    housesaga_traffic_increment ("MetricsReceived");
+    time_t timestamp = housesaga_metrics_timestamp (data);
+    if (timestamp <= 0) timestamp = time(0);
+    housesaga_metrics_stage (timestamp, data);
+    housesaga_traffic_increment (TrafficMetricsReceived);
 
+    // The metrics are always stored as JSON, whatever the Content-Type.
+    housesaga_parser_submit_format
+        (ParserMetrics, HOUSESAGA_PARSER_JSON, data, length);
     return "";
 }
 
 void housesaga_metrics_initialize (int argc, const char **argv) {
 
-    echttp_route_uri ("/saga/log/metrics", housesaga_webmetrics);
+    TrafficMetricsReceived = housesaga_traffic_register ("MetricsReceived");
+    TrafficMetricsRolledUp = housesaga_traffic_register ("MetricsRolledUp");
+    ParserMetrics = housesaga_parser_register
+                        ("parse:metrics", 0, housesaga_metrics_apply);
+    LatencyMetricsResidency = housesaga_latency_register ("residency:metrics");
+
+    housesaga_latency_route ("/saga/log/metrics", housesaga_webmetrics);
+    housesaga_latency_route ("/saga/metrics/day", housesaga_metrics_webday);
+    housesaga_latency_route ("/saga/metrics/range", housesaga_metrics_webrange);
 
     // Alternate path for application-independent web pages.
     // (The log files are stored at the same place for all applications.)
     //
-    echttp_route_uri ("/log/metrics", housesaga_webmetrics);
+    housesaga_latency_route ("/log/metrics", housesaga_webmetrics);
+    housesaga_latency_route ("/metrics/day", housesaga_metrics_webday);
+    housesaga_latency_route ("/metrics/range", housesaga_metrics_webrange);
 }
-
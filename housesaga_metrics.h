@@ -22,3 +22,5 @@
  */
 void housesaga_metrics_initialize (int argc, const char **argv);
 
+void housesaga_metrics_health (ParserContext context, int parent);
+void housesaga_metrics_background (time_t now);
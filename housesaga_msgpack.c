@@ -0,0 +1,308 @@
+/* housesaga - A log consolidation and storage service.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesaga_msgpack.c - Decode records encoded using MessagePack.
+ *
+ * This module decodes a MessagePack document straight into a batch
+ * of records, without building any intermediate tree.
+ *
+ * SYNOPSYS:
+ *
+ * const char *housesaga_msgpack_decode (struct HouseSagaBatch *batch,
+ *                                       const char *key, int length);
+ *
+ *    Decode the batch's buffer, which contains length bytes, and fill
+ *    the batch's host, app and records. The document must be a map with
+ *    (at least) the following items:
+ *      host: the name of the host that produced the records.
+ *      app:  the name of the application that produced the records.
+ *      <key>: an array of records, each an array with the same items
+ *            as in the JSON format (timestamp first, in milliseconds).
+ *    Unknown items are ignored. Return an error message, or 0 on success.
+ *    This allocates the batch's strings and records.
+ *
+ * NOTE:
+ *
+ *    The decoded strings are copied to a string pool, with a terminating
+ *    null character. Since each MessagePack string has a header of at
+ *    least one byte, the pool never needs more space than the document.
+ *
+ *    This function does not access any shared data, and is safe to call
+ *    from a parser thread.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "echttp_json.h"
+
+#include "housesaga_parser.h"
+#include "housesaga_msgpack.h"
+
+#define MSGPACK_DEPTH 16 // Limit the recursion when skipping items.
+
+struct MsgPackReader {
+    const unsigned char *cursor;
+    const unsigned char *end;
+    char *pool;
+    const char *error;
+};
+
+static int housesaga_msgpack_need (struct MsgPackReader *reader, size_t size) {
+    if ((size_t)(reader->end - reader->cursor) < size) {
+        if (!reader->error) reader->error = "truncated MessagePack data";
+        return 0;
+    }
+    return 1;
+}
+
+static unsigned long long housesaga_msgpack_big (struct MsgPackReader *reader,
+                                                 int size) {
+    unsigned long long value = 0;
+    if (!housesaga_msgpack_need (reader, size)) return 0;
+    while (size-- > 0) value = (value << 8) | *(reader->cursor++);
+    return value;
+}
+
+/* Return the number of items in a map or array. For a map, this
+ * is the number of key/value pairs. Return -1 if not the expected type.
+ */
+static long housesaga_msgpack_container (struct MsgPackReader *reader,
+                                         int map) {
+    if (!housesaga_msgpack_need (reader, 1)) return -1;
+    unsigned char code = *reader->cursor;
+    if (map) {
+        if ((code & 0xf0) == 0x80) { reader->cursor += 1; return code & 0x0f; }
+        if (code == 0xde) { reader->cursor += 1; return (long)housesaga_msgpack_big (reader, 2); }
+        if (code == 0xdf) { reader->cursor += 1; return (long)housesaga_msgpack_big (reader, 4); }
+    } else {
+        if ((code & 0xf0) == 0x90) { reader->cursor += 1; return code & 0x0f; }
+        if (code == 0xdc) { reader->cursor += 1; return (long)housesaga_msgpack_big (reader, 2); }
+        if (code == 0xdd) { reader->cursor += 1; return (long)housesaga_msgpack_big (reader, 4); }
+    }
+    return -1;
+}
+
+/* Return the length of a string, and leave the cursor on its first byte.
+ * Return -1 if this is not a string.
+ */
+static long housesaga_msgpack_strlen (struct MsgPackReader *reader) {
+    if (!housesaga_msgpack_need (reader, 1)) return -1;
+    unsigned char code = *reader->cursor;
+    long length = -1;
+    if ((code & 0xe0) == 0xa0) {
+        reader->cursor += 1;
+        length = code & 0x1f;
+    } else if (code == 0xd9) {
+        reader->cursor += 1;
+        length = (long)housesaga_msgpack_big (reader, 1);
+    } else if (code == 0xda) {
+        reader->cursor += 1;
+        length = (long)housesaga_msgpack_big (reader, 2);
+    } else if (code == 0xdb) {
+        reader->cursor += 1;
+        length = (long)housesaga_msgpack_big (reader, 4);
+    }
+    if ((length >= 0) && (!housesaga_msgpack_need (reader, length))) return -1;
+    return length;
+}
+
+static const char *housesaga_msgpack_string (struct MsgPackReader *reader) {
+    long length = housesaga_msgpack_strlen (reader);
+    if (length < 0) return 0;
+    char *s = reader->pool;
+    memcpy (s, reader->cursor, length);
+    s[length] = 0;
+    reader->pool += length + 1;
+    reader->cursor += length;
+    return s;
+}
+
+/* Compare a key with a string, without copying it. Consume the key.
+ */
+static int housesaga_msgpack_key (struct MsgPackReader *reader,
+                                  const char **key, long *length) {
+    *length = housesaga_msgpack_strlen (reader);
+    if (*length < 0) return 0;
+    *key = (const char *)reader->cursor;
+    reader->cursor += *length;
+    return 1;
+}
+
+static int housesaga_msgpack_is (const char *key, long length,
+                                 const char *name) {
+    return ((long)strlen(name) == length) && (!memcmp (key, name, length));
+}
+
+/* Decode an integer. Return 0 if the item is not an integer.
+ */
+static int housesaga_msgpack_integer (struct MsgPackReader *reader,
+                                      long long *value) {
+    if (!housesaga_msgpack_need (reader, 1)) return 0;
+    unsigned char code = *reader->cursor;
+    if (code <= 0x7f) { *value = code; reader->cursor += 1; return 1; }
+    if (code >= 0xe0) { *value = (signed char)code; reader->cursor += 1; return 1; }
+    int size;
+    int sign;
+    switch (code) {
+        case 0xcc: size = 1; sign = 0; break;
+        case 0xcd: size = 2; sign = 0; break;
+        case 0xce: size = 4; sign = 0; break;
+        case 0xcf: size = 8; sign = 0; break;
+        case 0xd0: size = 1; sign = 1; break;
+        case 0xd1: size = 2; sign = 1; break;
+        case 0xd2: size = 4; sign = 1; break;
+        case 0xd3: size = 8; sign = 1; break;
+        default: return 0;
+    }
+    reader->cursor += 1;
+    unsigned long long raw = housesaga_msgpack_big (reader, size);
+    if (sign && (size < 8) && (raw & (1ULL << (size * 8 - 1))))
+        raw |= ~0ULL << (size * 8); // Sign extension.
+    *value = (long long)raw;
+    return 1;
+}
+
+static void housesaga_msgpack_skip (struct MsgPackReader *reader, int depth) {
+
+    if (reader->error) return;
+    if (depth > MSGPACK_DEPTH) {
+        reader->error = "MessagePack data nested too deep";
+        return;
+    }
+    if (!housesaga_msgpack_need (reader, 1)) return;
+
+    long long integer;
+    if (housesaga_msgpack_integer (reader, &integer)) return;
+
+    long length = housesaga_msgpack_strlen (reader);
+    if (length >= 0) {
+        reader->cursor += length;
+        return;
+    }
+    if (reader->error) return;
+    long count = housesaga_msgpack_container (reader, 0);
+    if (count < 0) {
+        count = housesaga_msgpack_container (reader, 1);
+        if (count >= 0) count *= 2;
+    }
+    if (count >= 0) {
+        while ((count-- > 0) && (!reader->error))
+            housesaga_msgpack_skip (reader, depth + 1);
+        return;
+    }
+
+    unsigned char code = *(reader->cursor++);
+    switch (code) {
+        case 0xc0: case 0xc2: case 0xc3: return; // nil, false, true.
+        case 0xca: housesaga_msgpack_big (reader, 4); return; // float 32.
+        case 0xcb: housesaga_msgpack_big (reader, 8); return; // float 64.
+        case 0xc4: length = (long)housesaga_msgpack_big (reader, 1); break;
+        case 0xc5: length = (long)housesaga_msgpack_big (reader, 2); break;
+        case 0xc6: length = (long)housesaga_msgpack_big (reader, 4); break;
+        default:
+            reader->error = "unsupported MessagePack type";
+            return;
+    }
+    if (housesaga_msgpack_need (reader, length)) reader->cursor += length;
+}
+
+static void housesaga_msgpack_record (struct MsgPackReader *reader,
+                                      struct HouseSagaRecord *record) {
+
+    memset (record, 0, sizeof(*record));
+
+    long count = housesaga_msgpack_container (reader, 0);
+    if (count < 0) {
+        housesaga_msgpack_skip (reader, 1);
+        return;
+    }
+    long i;
+    for (i = 0; (i < count) && (!reader->error); ++i) {
+        if (i >= HOUSESAGA_PARSER_FIELDS) {
+            housesaga_msgpack_skip (reader, 2);
+            continue;
+        }
+        if (housesaga_msgpack_integer (reader, record->integer + i)) continue;
+        const char *text = housesaga_msgpack_string (reader);
+        if (text) {
+            record->text[i] = text;
+            continue;
+        }
+        housesaga_msgpack_skip (reader, 2);
+    }
+    // The timestamp is in milliseconds.
+    record->timestamp.tv_sec = record->integer[0] / 1000;
+    record->timestamp.tv_usec = (record->integer[0] % 1000) * 1000;
+}
+
+const char *housesaga_msgpack_decode (struct HouseSagaBatch *batch,
+                                      const char *key, int length) {
+
+    struct MsgPackReader reader;
+    reader.cursor = (const unsigned char *)batch->buffer;
+    reader.end = reader.cursor + length;
+    reader.error = 0;
+    reader.pool = batch->strings = malloc (length + 1);
+
+    long items = housesaga_msgpack_container (&reader, 1);
+    if (items < 0) return "MessagePack data is not a map";
+
+    while ((items-- > 0) && (!reader.error)) {
+        const char *name;
+        long size;
+        if (!housesaga_msgpack_key (&reader, &name, &size)) {
+            housesaga_msgpack_skip (&reader, 1); // Not a string key.
+            housesaga_msgpack_skip (&reader, 1);
+            continue;
+        }
+        if (housesaga_msgpack_is (name, size, "host")) {
+            batch->host = housesaga_msgpack_string (&reader);
+            if (!batch->host) housesaga_msgpack_skip (&reader, 1);
+        } else if (housesaga_msgpack_is (name, size, "app")) {
+            batch->app = housesaga_msgpack_string (&reader);
+            if (!batch->app) housesaga_msgpack_skip (&reader, 1);
+        } else if (key && housesaga_msgpack_is (name, size, key) &&
+                   (!batch->record)) {
+            long count = housesaga_msgpack_container (&reader, 0);
+            if (count < 0) {
+                housesaga_msgpack_skip (&reader, 1);
+                continue;
+            }
+            // Each record needs at least one byte: do not trust the count.
+            if (count > reader.end - reader.cursor)
+                count = reader.end - reader.cursor;
+            if (count <= 0) continue;
+            batch->record = calloc (count, sizeof(struct HouseSagaRecord));
+            while ((batch->count < count) && (!reader.error)) {
+                housesaga_msgpack_record
+                    (&reader, batch->record + batch->count);
+                if (!reader.error) batch->count += 1;
+            }
+        } else {
+            housesaga_msgpack_skip (&reader, 1);
+        }
+    }
+    return reader.error;
+}
+
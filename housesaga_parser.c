@@ -0,0 +1,462 @@
+/* housesaga - A log consolidation and storage service.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesaga_parser.c - Decode the data received from the sources.
+ *
+ * This module decodes the data posted by the sources into batches of
+ * records, optionally using a pool of parser threads for MessagePack.
+ *
+ * SYNOPSYS:
+ *
+ * void housesaga_parser_initialize (int argc, const char **argv);
+ *
+ *    Start the parser threads, if any were requested using the
+ *    -parsers=N option. The default is 0: all data is decoded inline.
+ *
+ * int housesaga_parser_register (const char *name, const char *key,
+ *                                housesaga_parser_apply *apply);
+ *
+ *    Declare a type of data and return its handle. The name is used for
+ *    the decoding latency histogram. If key is not null, the records are
+ *    extracted from the standard envelope, i.e. the array at
+ *    .<app>.<key>, where app is the first item of .apps. The apply
+ *    function is called with each decoded batch, always from the main
+ *    thread and in the order the data was submitted.
+ *
+ * void housesaga_parser_submit (int type, const char *data, int length);
+ *
+ *    Decode the data and apply the resulting batch. The data is copied,
+ *    so that it can be decoded later by a parser thread. The format of
+ *    the data, JSON or MessagePack, depends on the request's Content-Type.
+ *
+ * void housesaga_parser_submit_format (int type, int format,
+ *                                      const char *data, int length);
+ *
+ *    Same as above, for data that does not come from an HTTP request.
+ *    The format is either HOUSESAGA_PARSER_JSON or HOUSESAGA_PARSER_MSGPACK.
+ *
+ * int housesaga_parser_find (const char *key);
+ *
+ *    Return the type that was registered with this key, or -1.
+ *
+ * void housesaga_parser_record (const ParserToken *token,
+ *                               struct HouseSagaRecord *record);
+ *
+ *    Decode one record from its JSON array, i.e. the timestamp followed
+ *    by the record's fields.
+ *
+ * void housesaga_parser_deliver (const struct HouseSagaBatch *batch);
+ *
+ *    Apply a batch that was decoded by the caller. This is used when the
+ *    data is not in the standard envelope, e.g. for bulk ingestion. The
+ *    batches submitted earlier and still being decoded are applied first,
+ *    so that the order of reception is preserved.
+ *
+ * NOTE:
+ *
+ *    The parser threads only decode MessagePack data, using the decoder
+ *    in housesaga_msgpack.c, which only works on the batch it is given.
+ *    The JSON data is always decoded by the main thread, because the
+ *    echttp JSON decoder is an external library that does not document
+ *    itself as thread safe. Everything else, including the live buffers
+ *    and the storage, is only accessed from the main thread, which owns
+ *    it: the web API never needs any lock.
+ *
+ *    Each parser thread has its own input and output queues. These are
+ *    single producer, single consumer rings that do not need any lock.
+ *    The main thread submits the data to the threads in a round-robin
+ *    fashion and applies the results in the same order, so that the
+ *    batches are applied in the order they were received. A JSON batch
+ *    that arrives while other batches are still being decoded goes
+ *    through the same queues, already decoded, to keep that order. A
+ *    thread signals new results by writing to a pipe that is part of the
+ *    echttp main loop.
+ *
+ *    The parser threads must not call any other HouseSaga module, not
+ *    even to report a trace: these are not thread safe.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+#include "houselog.h"
+
+#include "housesaga.h"
+#include "housesaga_parser.h"
+#include "housesaga_msgpack.h"
+#include "housesaga_latency.h"
+
+struct ParserType {
+    const char *key;
+    housesaga_parser_apply *apply;
+    int latency;
+};
+
+#define PARSER_TYPES_MAX 8
+static struct ParserType ParserTypes[PARSER_TYPES_MAX];
+static int ParserTypesCount = 0;
+
+#define PARSER_QUEUE_DEPTH 64
+
+struct ParserQueue {
+    struct HouseSagaBatch *item[PARSER_QUEUE_DEPTH];
+    atomic_uint head; // Next item to consume.
+    atomic_uint tail; // Next item to produce.
+};
+
+struct ParserWorker {
+    pthread_t thread;
+    int wakeup[2];
+    struct ParserQueue input;
+    struct ParserQueue output;
+    long long submitted; // Only accessed by the main thread.
+    long long applied;   // Only accessed by the main thread.
+};
+
+#define PARSER_WORKERS_MAX 16
+static struct ParserWorker ParserWorkers[PARSER_WORKERS_MAX];
+static int ParserWorkersCount = 0;
+
+static int ParserDone[2] = {-1, -1}; // Parser threads to main thread.
+static int ParserSubmitNext = 0;
+static int ParserApplyNext = 0;
+
+int housesaga_parser_register (const char *name, const char *key,
+                               housesaga_parser_apply *apply) {
+
+    if (ParserTypesCount >= PARSER_TYPES_MAX) return -1;
+    struct ParserType *type = ParserTypes + ParserTypesCount;
+    type->key = key;
+    type->apply = apply;
+    type->latency = housesaga_latency_register (name);
+    return ParserTypesCount++;
+}
+
+static int housesaga_parser_push (struct ParserQueue *queue,
+                                  struct HouseSagaBatch *batch) {
+    unsigned int tail = atomic_load_explicit (&queue->tail,
+                                              memory_order_relaxed);
+    unsigned int head = atomic_load_explicit (&queue->head,
+                                              memory_order_acquire);
+    if (tail - head >= PARSER_QUEUE_DEPTH) return 0; // Full.
+    queue->item[tail % PARSER_QUEUE_DEPTH] = batch;
+    atomic_store_explicit (&queue->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+static struct HouseSagaBatch *housesaga_parser_pop (struct ParserQueue *queue) {
+    unsigned int head = atomic_load_explicit (&queue->head,
+                                              memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit (&queue->tail,
+                                              memory_order_acquire);
+    if (head == tail) return 0; // Empty.
+    struct HouseSagaBatch *batch = queue->item[head % PARSER_QUEUE_DEPTH];
+    atomic_store_explicit (&queue->head, head + 1, memory_order_release);
+    return batch;
+}
+
+int housesaga_parser_find (const char *key) {
+
+    int i;
+    for (i = 0; i < ParserTypesCount; ++i) {
+        if (ParserTypes[i].key && (!strcmp (key, ParserTypes[i].key)))
+            return i;
+    }
+    return -1;
+}
+
+void housesaga_parser_record (const ParserToken *token,
+                              struct HouseSagaRecord *record) {
+
+    char path[16];
+    int j;
+
+    memset (record, 0, sizeof(*record));
+    for (j = 0; j < HOUSESAGA_PARSER_FIELDS; ++j) {
+        snprintf (path, sizeof(path), "[%d]", j);
+        int field = echttp_json_search (token, path);
+        if (field < 0) continue;
+        if (token[field].type == PARSER_STRING) {
+            record->text[j] = token[field].value.string;
+        } else if (token[field].type == PARSER_INTEGER) {
+            record->integer[j] = token[field].value.integer;
+        }
+    }
+    // The timestamp is in milliseconds.
+    record->timestamp.tv_sec = record->integer[0] / 1000;
+    record->timestamp.tv_usec = (record->integer[0] % 1000) * 1000;
+}
+
+/* Decode the batch's data. This runs in a parser thread, if any, for
+ * MessagePack data only.
+ */
+static void housesaga_parser_decode (struct HouseSagaBatch *batch) {
+
+    if (batch->decoded) return;
+
+    long long start = housesaga_latency_now();
+    const char *key = ParserTypes[batch->type].key;
+
+    if (batch->format == HOUSESAGA_PARSER_MSGPACK) {
+        // Only the records in the standard envelope can be decoded.
+        if (key && (!housesaga_msgpack_decode (batch, key, batch->length)))
+            batch->valid = (batch->host && batch->app);
+        goto done;
+    }
+
+    int count = echttp_json_estimate (batch->buffer);
+    batch->token = calloc (count, sizeof(ParserToken));
+    const char *error = echttp_json_parse (batch->buffer, batch->token, &count);
+    if (error) goto done; // Ignore bad data from applications.
+    batch->tokens = count;
+    batch->valid = 1;
+
+    if (!key) goto done;
+
+    ParserToken *token = batch->token;
+    int item = echttp_json_search (token, ".host");
+    if ((item >= 0) && (token[item].type == PARSER_STRING))
+        batch->host = token[item].value.string;
+    item = echttp_json_search (token, ".apps[0]");
+    if ((item >= 0) && (token[item].type == PARSER_STRING))
+        batch->app = token[item].value.string;
+    if ((!batch->host) || (!batch->app)) goto done;
+
+    char path[128];
+    snprintf (path, sizeof(path), ".%s.%s", batch->app, key);
+    int list = echttp_json_search (token, path);
+    if ((list < 0) || (token[list].type != PARSER_ARRAY)) goto done;
+    if (token[list].length <= 0) goto done;
+
+    batch->record = calloc (token[list].length, sizeof(struct HouseSagaRecord));
+
+    int i;
+    for (i = 0; i < token[list].length; ++i) {
+        snprintf (path, sizeof(path), "[%d]", i);
+        int element = echttp_json_search (token+list, path);
+        if (element < 0) break;
+        housesaga_parser_record (token + list + element,
+                                 batch->record + batch->count);
+        batch->count += 1;
+    }
+
+done:
+    batch->duration = housesaga_latency_now() - start;
+}
+
+/* Return true if some batches were submitted to the parser threads
+ * and not applied yet.
+ */
+static int housesaga_parser_busy (void) {
+    int i;
+    for (i = 0; i < ParserWorkersCount; ++i) {
+        if (ParserWorkers[i].applied < ParserWorkers[i].submitted) return 1;
+    }
+    return 0;
+}
+
+static void housesaga_parser_apply_batch (struct HouseSagaBatch *batch) {
+
+    struct ParserType *type = ParserTypes + batch->type;
+
+    housesaga_latency_record (type->latency,
+                              housesaga_latency_now() - batch->duration);
+    if (batch->valid && ((!type->key) || batch->record))
+        type->apply (batch);
+
+    if (batch->record) free (batch->record);
+    if (batch->token) free (batch->token);
+    if (batch->strings) free (batch->strings);
+    free (batch->buffer);
+    free (batch);
+}
+
+/* Apply all the batches that were decoded, in the order they were
+ * submitted. Stop at the first batch that is not decoded yet.
+ */
+static void housesaga_parser_drain (void) {
+
+    for (;;) {
+        struct ParserWorker *worker = ParserWorkers + ParserApplyNext;
+        if (worker->applied >= worker->submitted) return;
+
+        struct HouseSagaBatch *batch = housesaga_parser_pop (&worker->output);
+        if (!batch) return;
+        worker->applied += 1;
+
+        housesaga_parser_apply_batch (batch);
+
+        if (++ParserApplyNext >= ParserWorkersCount) ParserApplyNext = 0;
+    }
+}
+
+static void housesaga_parser_listen (int fd, int mode) {
+
+    char signals[256];
+    while (read (fd, signals, sizeof(signals)) > 0) ;
+    housesaga_parser_drain ();
+}
+
+/* Wait until all the batches submitted have been applied.
+ */
+static void housesaga_parser_flush (void) {
+
+    int i;
+    for (i = 0; i < ParserWorkersCount; ++i) {
+        struct ParserWorker *worker = ParserWorkers + i;
+        while (worker->applied < worker->submitted) {
+            struct pollfd wait = {ParserDone[0], POLLIN, 0};
+            poll (&wait, 1, 100);
+            housesaga_parser_listen (ParserDone[0], 0);
+        }
+    }
+}
+
+void housesaga_parser_deliver (const struct HouseSagaBatch *batch) {
+
+    if ((batch->type < 0) || (batch->type >= ParserTypesCount)) return;
+    housesaga_parser_flush ();
+    ParserTypes[batch->type].apply (batch);
+}
+
+static void *housesaga_parser_thread (void *context) {
+
+    struct ParserWorker *worker = (struct ParserWorker *)context;
+
+    for (;;) {
+        char signal;
+        ssize_t length = read (worker->wakeup[0], &signal, 1);
+        if (length < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (length == 0) break;
+
+        struct HouseSagaBatch *batch = housesaga_parser_pop (&worker->input);
+        if (!batch) continue;
+
+        housesaga_parser_decode (batch);
+
+        // This never fails: the main thread limits the number of batches
+        // in flight for each thread to the depth of one queue.
+        housesaga_parser_push (&worker->output, batch);
+        if (write (ParserDone[1], "", 1) < 0) break;
+    }
+    return 0;
+}
+
+void housesaga_parser_submit_format (int type, int format,
+                                     const char *data, int length) {
+
+    if ((type < 0) || (type >= ParserTypesCount)) return;
+
+    struct HouseSagaBatch *batch = calloc (1, sizeof(struct HouseSagaBatch));
+    batch->type = type;
+    batch->format = format;
+    batch->length = length;
+    batch->buffer = malloc (length + 1);
+    memcpy (batch->buffer, data, length);
+    batch->buffer[length] = 0;
+
+    if ((ParserWorkersCount <= 0) || (format == HOUSESAGA_PARSER_JSON)) {
+        housesaga_parser_decode (batch);
+        batch->decoded = 1;
+        if (!housesaga_parser_busy ()) {
+            housesaga_parser_apply_batch (batch);
+            return;
+        }
+    }
+
+    struct ParserWorker *worker = ParserWorkers + ParserSubmitNext;
+
+    // Too many batches in flight for this thread: wait for some results.
+    while (worker->submitted - worker->applied >= PARSER_QUEUE_DEPTH) {
+        struct pollfd wait = {ParserDone[0], POLLIN, 0};
+        poll (&wait, 1, 100);
+        housesaga_parser_listen (ParserDone[0], 0);
+    }
+    housesaga_parser_push (&worker->input, batch);
+    worker->submitted += 1;
+    if (write (worker->wakeup[1], "", 1) < 0) {
+        houselog_trace (HOUSE_FAILURE, "PARSER", "cannot wake up thread %d",
+                        ParserSubmitNext);
+    }
+    if (++ParserSubmitNext >= ParserWorkersCount) ParserSubmitNext = 0;
+}
+
+void housesaga_parser_submit (int type, const char *data, int length) {
+
+    int format = HOUSESAGA_PARSER_JSON;
+    const char *content = echttp_attribute_get ("Content-Type");
+    if (content && ((!strncasecmp (content, "application/msgpack", 19)) ||
+                    (!strncasecmp (content, "application/x-msgpack", 21)))) {
+        format = HOUSESAGA_PARSER_MSGPACK;
+    }
+    housesaga_parser_submit_format (type, format, data, length);
+}
+
+void housesaga_parser_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *parsers = "0";
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-parsers=", argv[i], &parsers)) continue;
+    }
+    int count = atoi (parsers);
+    if (count <= 0) return;
+    if (count > PARSER_WORKERS_MAX) count = PARSER_WORKERS_MAX;
+
+    if (pipe (ParserDone) < 0) {
+        houselog_trace (HOUSE_FAILURE, "PARSER", "cannot create pipe");
+        return;
+    }
+    fcntl (ParserDone[0], F_SETFL, O_NONBLOCK);
+
+    for (i = 0; i < count; ++i) {
+        struct ParserWorker *worker = ParserWorkers + i;
+        if (pipe (worker->wakeup) < 0) break;
+        if (pthread_create (&(worker->thread), 0,
+                            housesaga_parser_thread, worker)) {
+            close (worker->wakeup[0]);
+            close (worker->wakeup[1]);
+            break;
+        }
+        ParserWorkersCount += 1;
+    }
+    if (ParserWorkersCount <= 0) return;
+
+    echttp_listen (ParserDone[0], 1, housesaga_parser_listen, 0);
+    houselog_trace (HOUSE_INFO, "PARSER", "%d parser threads started",
+                    ParserWorkersCount);
+}
+
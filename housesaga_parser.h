@@ -0,0 +1,63 @@
+/* housesaga - A log consolidation and storage service.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * housesaga_parser.h - Decode the data received from the sources.
+ */
+#define HOUSESAGA_PARSER_FIELDS 6
+
+#define HOUSESAGA_PARSER_JSON    0
+#define HOUSESAGA_PARSER_MSGPACK 1
+
+struct HouseSagaRecord {
+    struct timeval timestamp;                   // Item [0].
+    const char *text[HOUSESAGA_PARSER_FIELDS];  // Items [1] to [5], if string.
+    long long integer[HOUSESAGA_PARSER_FIELDS]; // Items [1] to [5], if integer.
+};
+
+struct HouseSagaBatch {
+    int type;
+    int format;
+    int length;
+    int valid;
+    int decoded;        // Decoded by the main thread.
+    char *buffer;       // Private copy of the data, modified by the parser.
+    char *strings;      // Decoded strings, when not decoded in place.
+    ParserToken *token; // The whole JSON document.
+    int tokens;
+    const char *host;
+    const char *app;
+    int count;
+    struct HouseSagaRecord *record;
+    long long duration; // Time spent decoding, in microseconds.
+};
+
+typedef void housesaga_parser_apply (const struct HouseSagaBatch *batch);
+
+void housesaga_parser_initialize (int argc, const char **argv);
+int  housesaga_parser_register (const char *name, const char *key,
+                                housesaga_parser_apply *apply);
+void housesaga_parser_submit (int type, const char *data, int length);
+void housesaga_parser_submit_format (int type, int format,
+                                     const char *data, int length);
+
+int  housesaga_parser_find (const char *key);
+void housesaga_parser_record (const ParserToken *token,
+                              struct HouseSagaRecord *record);
+void housesaga_parser_deliver (const struct HouseSagaBatch *batch);
+
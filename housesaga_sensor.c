@@ -40,6 +40,25 @@
  * source buffering and flush delays. This is why a sorted list storage is
  * used.
  *
+ * Many sources report the same value again and again. An optional deadband
+ * can be set (globally or per sensor name), so that a numeric value is
+ * ignored if it did not change by more than the configured tolerance since
+ * the last value recorded for the same sensor, i.e. the same series in
+ * the compressed history (host, app, location and name). The NAME in the
+ * option selects the tolerance by sensor name only, whatever the host,
+ * app or location. A value is always recorded if the previous one is
+ * older than the heartbeat period, so that a steady sensor still shows
+ * up in the logs:
+ *
+ *   -sensor-deadband=[NAME:]TOLERANCE[%]
+ *   -sensor-heartbeat=SECONDS
+ *
+ * The tolerance is absolute, or relative to the previous value if followed
+ * by '%'. This option may be repeated, one for each sensor name, plus
+ * a default (no name). The deadband does not apply to a sensor that has
+ * no history, for example when the history is full: such values are
+ * recorded, and counted as SensorUnbanded in the traffic statistics.
+ *
  * SYNOPSYS:
  *
  * void housesaga_sensor_initialize (int argc, const char **argv);
@@ -47,10 +66,17 @@
  *    Initialize the environment required to consolidate event logs. This
  *    must be the first function that the application calls.
  *
+ * void housesaga_sensor_health (ParserContext context, int parent);
+ *
+ *    Add the state of the live buffer to a JSON array: depth, number of
+ *    records used and not yet saved, number of saves forced because the
+ *    buffer was full, and number of late records saved out of order.
+ *
  * void housesaga_sensor_background (time_t now);
  *
- *    This function must be called a regular intervals for background
- *    processing, e.g. cleanup of expired resources, storage backup, etc.
+ *    Save the sensor data that is due. This is a scheduled action (see
+ *    housesaga_schedule()): it runs when the oldest unsaved record becomes
+ *    older than the save delay.
  */
 
 #include <unistd.h>
@@ -66,6 +92,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
+#include <math.h>
 
 #include "echttp.h"
 #include "echttp_json.h"
@@ -75,14 +102,21 @@
 
 #include "housesaga.h"
 #include "housesaga_sensor.h"
+#include "housesaga_series.h"
 #include "housesaga_storage.h"
+#include "housesaga_live.h"
 #include "housesaga_traffic.h"
+#include "housesaga_latency.h"
+#include "housesaga_source.h"
+#include "housesaga_parser.h"
+#include "housesaga_dedup.h"
 
 static const char  LogAppName[] = "saga";
 
 struct SensorRecord {
     struct timeval timestamp;
     long long id;
+    long long arrival; // Monotonic time, see housesaga_latency_now().
     int    unsaved;
     char   host[128];
     char   app[128];
@@ -94,17 +128,43 @@ struct SensorRecord {
 
 #define HISTORY_DEPTH 256
 
-static struct SensorRecord SensorHistory[HISTORY_DEPTH];
+#define SENSOR_SAVE_DELAY 6 // Time given to the sources to flush their data.
+
+static struct SensorRecord *SensorHistory = 0; // See housesaga_sensor_live().
+static struct HouseSagaLive *SensorLive = 0;
+static int SensorRestored = 0;
 static int SensorCursor = 0;
 static long long SensorLatestId = 0;
 
 static echttp_sorted_list SensorChronology;
 static time_t SensorLastSaved = 0;
 static time_t SensorSaveLimit = 0;
+static time_t SensorSaveNext = 0;  // Oldest unsaved record not yet due.
+
+static long SensorForcedSaves = 0; // Buffer full: saved without delay.
+static long SensorRewinds = 0;     // Late records, saved out of order.
+
+static int TrafficSensorReceived = -1;
+static int TrafficSensorSuppressed = -1;
+static int TrafficSensorDuplicate = -1;
+static int TrafficSensorUnbanded = -1;
+static int ParserSensor = -1;
+static int LatencySensorResidency = -1;
 
 static time_t WebFormatSinceSec = 0;
 static int WebFormatSinceUSec = 0;
 
+struct SensorDeadband {
+    const char *name; // 0 for the default.
+    double tolerance;
+    int relative;
+};
+
+#define DEADBAND_MAX 32
+static struct SensorDeadband SensorDeadbands[DEADBAND_MAX];
+static int SensorDeadbandCount = 0;
+static int SensorHeartbeat = 600;
+
 
 static void safecpy (char *d, const char *s, int size) {
     if (s) strtcpy (d, s, size);
@@ -115,6 +175,56 @@ static unsigned long long housesaga_timestamp2key (const struct timeval *t) {
     return t->tv_sec * 1000 + t->tv_usec / 1000;
 }
 
+// Only purely numeric values are kept in the compressed history.
+// (strtod() accepts "nan" and "inf", which cannot be exported in JSON.)
+//
+static int housesaga_sensor_numeric (const char *value, double *result) {
+    char *end;
+    if (!value[0]) return 0;
+    *result = strtod (value, &end);
+    return (*end == 0) && isfinite (*result);
+}
+
+/* Return true if this new value does not need to be recorded, because
+ * it is within the deadband of the last recorded value for this series.
+ * The deadband rule is selected by the sensor name only.
+ */
+static int housesaga_sensor_unchanged (int series, const char *name,
+                                       const struct timeval *timestamp,
+                                       double value) {
+
+    int i;
+    const struct SensorDeadband *deadband = 0;
+
+    for (i = 0; i < SensorDeadbandCount; ++i) {
+        if (!SensorDeadbands[i].name) {
+            if (!deadband) deadband = SensorDeadbands + i;
+        } else if (!strcmp (SensorDeadbands[i].name, name)) {
+            deadband = SensorDeadbands + i;
+            break;
+        }
+    }
+    if (!deadband) return 0; // No deadband for this sensor.
+
+    if (series < 0) {
+        housesaga_traffic_increment (TrafficSensorUnbanded);
+        return 0; // No history to compare with.
+    }
+    struct timeval latest;
+    double previous;
+    if (!housesaga_series_latest (series, &latest, &previous)) return 0;
+
+    if (timestamp->tv_sec >= latest.tv_sec + SensorHeartbeat) return 0;
+
+    double tolerance = deadband->tolerance;
+    if (deadband->relative) {
+        tolerance = tolerance * ((previous < 0) ? -previous : previous) / 100;
+    }
+    double delta = value - previous;
+    if (delta < 0) delta = -delta;
+    return (delta <= tolerance);
+}
+
 static int housesaga_saveaction (void *data) {
 
     static char SensorHeader[] =
@@ -125,7 +235,10 @@ static int housesaga_saveaction (void *data) {
     if (cursor->unsaved) {
         char buffer[1024];
 
-        if (cursor->timestamp.tv_sec > SensorSaveLimit) return 0;
+        if (cursor->timestamp.tv_sec > SensorSaveLimit) {
+            SensorSaveNext = cursor->timestamp.tv_sec;
+            return 0;
+        }
 
         snprintf (buffer, sizeof(buffer), "%lld.%03d,%s,%s,%s,%s,%s,%s",
                   (long long)(cursor->timestamp.tv_sec),
@@ -138,6 +251,7 @@ static int housesaga_saveaction (void *data) {
                   cursor->unit);
         housesaga_storage_save ("sensor", cursor->timestamp.tv_sec,
                                 SensorHeader, buffer);
+        housesaga_latency_record (LatencySensorResidency, cursor->arrival);
         cursor->unsaved = 0;
     }
     return 1;
@@ -154,7 +268,8 @@ static void housesaga_sensor_save (int full) {
     // This delay does not apply when the event buffer is full: in that
     // case, we must save events at all cost.
     //
-    SensorSaveLimit = full ? now + 2 : now - 6;
+    SensorSaveLimit = full ? now + 2 : now - SENSOR_SAVE_DELAY;
+    SensorSaveNext = 0;
 
     if (SensorLastSaved) {
         echttp_sorted_ascending_from (SensorChronology,
@@ -167,6 +282,57 @@ static void housesaga_sensor_save (int full) {
     SensorLastSaved = full ? now : SensorSaveLimit;
 }
 
+/* Free the slot at the cursor, where the next record will be stored.
+ */
+static void housesaga_sensor_release (void) {
+
+    struct SensorRecord *cursor = SensorHistory + SensorCursor;
+    if (cursor->timestamp.tv_sec) {
+        if (cursor->unsaved) {
+            housesaga_sensor_save(1); // Save before erased.
+            SensorForcedSaves += 1;
+        }
+
+        echttp_sorted_remove (SensorChronology,
+                              housesaga_timestamp2key (&(cursor->timestamp)),
+                              (void *)((long)SensorCursor));
+        cursor->timestamp.tv_sec = 0;
+    }
+}
+
+/* Map the live buffer and restore the records from the previous run.
+ * This is called on the first use, which may happen before this module
+ * is initialized.
+ */
+static void housesaga_sensor_live (void) {
+
+    int i;
+    int latest = -1;
+
+    SensorHistory = housesaga_live_map ("sensor", sizeof(struct SensorRecord),
+                                        HISTORY_DEPTH, &SensorLive);
+    if (!SensorChronology) SensorChronology = echttp_sorted_new();
+
+    for (i = 0; i < HISTORY_DEPTH; ++i) {
+        struct SensorRecord *cursor = SensorHistory + i;
+        if (!cursor->timestamp.tv_sec) continue;
+        cursor->arrival = housesaga_latency_now();
+        echttp_sorted_add (SensorChronology,
+                           housesaga_timestamp2key (&(cursor->timestamp)),
+                           (void *)((long)i));
+        if (cursor->id > SensorLatestId) {
+            SensorLatestId = cursor->id;
+            latest = i;
+        }
+        SensorRestored += 1;
+    }
+    if (latest < 0) return; // Nothing restored.
+
+    SensorCursor = latest + 1;
+    if (SensorCursor >= HISTORY_DEPTH) SensorCursor = 0;
+    housesaga_sensor_release ();
+}
+
 /* Record a new data record to the live buffer.
  */
 static void housesaga_sensor_new (const struct timeval *timestamp,
@@ -177,9 +343,31 @@ static void housesaga_sensor_new (const struct timeval *timestamp,
                                   const char *value,
                                   const char *unit) {
 
+    housesaga_dedup_key key =
+        housesaga_dedup_start ("sensor", timestamp, host, app);
+    key = housesaga_dedup_text (key, location);
+    key = housesaga_dedup_text (key, name);
+    key = housesaga_dedup_text (key, value);
+    key = housesaga_dedup_text (key, unit);
+    if (housesaga_dedup_seen (key)) {
+        housesaga_traffic_increment (TrafficSensorDuplicate);
+        return;
+    }
+
+    if (!SensorHistory) housesaga_sensor_live ();
+
     struct SensorRecord *cursor = SensorHistory + SensorCursor;
 
-    if (!SensorChronology) SensorChronology = echttp_sorted_new();
+    int series = -1;
+    double numeric;
+    int isnumeric = housesaga_sensor_numeric (value, &numeric);
+    if (isnumeric) {
+        series = housesaga_series_lookup (host, app, location, name, unit);
+        if (housesaga_sensor_unchanged (series, name, timestamp, numeric)) {
+            housesaga_traffic_increment (TrafficSensorSuppressed);
+            return;
+        }
+    }
 
     if (SensorLatestId == 0) {
         // Seed the latest sensor data ID based on the current time.
@@ -189,8 +377,10 @@ static void housesaga_sensor_new (const struct timeval *timestamp,
     }
     SensorLatestId += 1;
 
+    housesaga_live_begin (SensorLive, SensorCursor);
     cursor->timestamp = *timestamp;
     cursor->id = SensorLatestId;
+    cursor->arrival = housesaga_latency_now();
     safecpy (cursor->host, host, sizeof(cursor->host));
     safecpy (cursor->app, app, sizeof(cursor->app));
     safecpy (cursor->location, location, sizeof(cursor->location));
@@ -198,29 +388,27 @@ static void housesaga_sensor_new (const struct timeval *timestamp,
     safecpy (cursor->value, value, sizeof(cursor->value));
     safecpy (cursor->unit, unit, sizeof(cursor->unit));
     cursor->unsaved = 1;
+    housesaga_live_end (SensorLive);
+    housesaga_schedule (timestamp->tv_sec + SENSOR_SAVE_DELAY,
+                        housesaga_sensor_background);
 
     echttp_sorted_add (SensorChronology,
                        housesaga_timestamp2key (&(cursor->timestamp)),
                        (void *)((long)SensorCursor));
 
+    if (isnumeric) housesaga_series_add (series, timestamp, numeric);
+
     if (timestamp->tv_sec < SensorLastSaved) {
         // Hoops: we got a late data from a distant past. We need
         // to make sure it will be saved, even if out of order.
         SensorLastSaved = timestamp->tv_sec;
+        SensorRewinds += 1;
     }
 
     SensorCursor += 1;
     if (SensorCursor >= HISTORY_DEPTH) SensorCursor = 0;
 
-    cursor = SensorHistory + SensorCursor;
-    if (cursor->timestamp.tv_sec) {
-        if (cursor->unsaved) housesaga_sensor_save(1); // Save before erased.
-
-        echttp_sorted_remove (SensorChronology,
-                              housesaga_timestamp2key (&(cursor->timestamp)),
-                              (void *)((long)SensorCursor));
-        cursor->timestamp.tv_sec = 0;
-    }
+    housesaga_sensor_release ();
 }
 
 static int housesaga_sensor_getheader (char *buffer, int size, const char *from) {
@@ -330,74 +518,32 @@ static const char *housesaga_webget (void) {
 
 /* Decode a report of data from a source client.
  */
-static const char *housesaga_getjsonstring (ParserToken *parsed,
-                                            const char *path) {
-    int item = echttp_json_search(parsed, path);
-    if (item < 0) return 0;
-    if (parsed[item].type != PARSER_STRING) return 0;
-    return parsed[item].value.string;
-}
-
-static struct timeval housesaga_getjsontime (ParserToken *parsed,
-                                             const char *path) {
-    struct timeval result = {0, 0};
-    int item = echttp_json_search(parsed, path);
-    if (item < 0) return result;
-    if (parsed[item].type != PARSER_INTEGER) return result;
-    result.tv_sec = parsed[item].value.integer / 1000;
-    result.tv_usec = (parsed[item].value.integer % 1000) * 1000;
-    return result;
-}
-
-static const char *housesaga_webpost (const char *data, int length) {
-
-    static ParserToken *SensorParsed = 0;
-    static int   SensorTokenAllocated = 0;
-    static char *SensorBuffer = 0;
-
-    echttp_content_type_json ();
-
-    if (SensorBuffer) free (SensorBuffer);
-    SensorBuffer = strdup (data);
-
-    int count = echttp_json_estimate(data);
-    if (count > SensorTokenAllocated) {
-        if (SensorParsed) free (SensorParsed);
-        SensorTokenAllocated = count;
-        SensorParsed = calloc (count, sizeof(ParserToken));
-    }
-    const char *error = echttp_json_parse (SensorBuffer, SensorParsed, &count);
-    if (error) return ""; // Ignore bad data from applications.
-
-    // TBD: decode JSON, register events.
-    const char *host = housesaga_getjsonstring (SensorParsed, ".host");
-    const char *app = housesaga_getjsonstring (SensorParsed, ".apps[0]");
+static void housesaga_sensor_apply (const struct HouseSagaBatch *batch) {
 
-    char path[128];
-    snprintf (path, sizeof(path), ".%s.sensor", app);
-    int events = echttp_json_search(SensorParsed, path);
-    if (SensorParsed[events].type != PARSER_ARRAY) return "";
+    int source = housesaga_source_batch
+                     (batch->host, batch->app, HOUSESAGA_SOURCE_SENSOR);
 
     int i;
-    for (i = 0; i < SensorParsed[events].length; ++i) {
-        char path[128];
-        snprintf (path, sizeof(path), "[%d]", i);
-        int event = echttp_json_search(SensorParsed+events, path);
-        if (event < 0) return "";
-        event += events;
-        struct timeval timestamp = housesaga_getjsontime (SensorParsed+event, "[0]");
-        const char *location = housesaga_getjsonstring (SensorParsed+event, "[1]");
-        const char *name = housesaga_getjsonstring (SensorParsed+event, "[2]");
-        const char *value = housesaga_getjsonstring (SensorParsed+event, "[3]");
-        const char *unit = housesaga_getjsonstring (SensorParsed+event, "[4]");
-        if ((timestamp.tv_sec > 0) &&
-            host && app && location && name && value && unit) {
-            housesaga_sensor_new
-                (&timestamp, host, app, location, name, value, unit);
-            housesaga_traffic_increment ("SensorReceived");
+    for (i = 0; i < batch->count; ++i) {
+        const struct HouseSagaRecord *record = batch->record + i;
+        const char *location = record->text[1];
+        const char *name = record->text[2];
+        const char *value = record->text[3];
+        const char *unit = record->text[4];
+        if ((record->timestamp.tv_sec > 0) &&
+            location && name && value && unit) {
+            housesaga_sensor_new (&(record->timestamp), batch->host, batch->app,
+                                  location, name, value, unit);
+            housesaga_traffic_increment (TrafficSensorReceived);
+            housesaga_source_record (source, &(record->timestamp));
         }
     }
+}
+
+static const char *housesaga_webpost (const char *data, int length) {
 
+    echttp_content_type_json ();
+    housesaga_parser_submit (ParserSensor, data, length);
     return "";
 }
 
@@ -411,30 +557,97 @@ static const char *housesaga_websensor (const char *method, const char *uri,
     }
 }
 
+static void housesaga_sensor_deadband (const char *option) {
+
+    if (SensorDeadbandCount >= DEADBAND_MAX) return;
+    struct SensorDeadband *deadband = SensorDeadbands + SensorDeadbandCount;
+
+    const char *separator = strrchr (option, ':');
+    if (separator) {
+        deadband->name = strndup (option, separator - option);
+        option = separator + 1;
+    } else {
+        deadband->name = 0;
+    }
+    char *end;
+    deadband->tolerance = strtod (option, &end);
+    deadband->relative = (*end == '%');
+    if ((end == option) || (deadband->tolerance < 0)) {
+        houselog_trace (HOUSE_FAILURE, "DEADBAND", "invalid tolerance %s", option);
+        if (deadband->name) free ((char *)(deadband->name));
+        deadband->name = 0;
+        return;
+    }
+    SensorDeadbandCount += 1;
+}
+
 void housesaga_sensor_initialize (int argc, const char **argv) {
 
-    if (!SensorChronology) SensorChronology = echttp_sorted_new();
+    TrafficSensorReceived = housesaga_traffic_register ("SensorReceived");
+    TrafficSensorSuppressed = housesaga_traffic_register ("SensorSuppressed");
+    TrafficSensorDuplicate = housesaga_traffic_register ("SensorDuplicate");
+    TrafficSensorUnbanded = housesaga_traffic_register ("SensorUnbanded");
+    ParserSensor = housesaga_parser_register
+                       ("parse:sensor", "sensor", housesaga_sensor_apply);
+    LatencySensorResidency = housesaga_latency_register ("residency:sensor");
 
-    echttp_route_uri ("/saga/log/sensor/data", housesaga_websensor);
-    echttp_route_uri ("/saga/log/sensor/latest", housesaga_weblatest); // Deprecated
-    echttp_route_uri ("/saga/log/sensor/check", housesaga_weblatest); // Compatibility.
+    int i;
+    const char *option;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match("-sensor-deadband=", argv[i], &option)) {
+            housesaga_sensor_deadband (option);
+            continue;
+        }
+        if (echttp_option_match("-sensor-heartbeat=", argv[i], &option)) {
+            SensorHeartbeat = atoi(option);
+            continue;
+        }
+    }
+
+    if (!SensorHistory) housesaga_sensor_live ();
+
+    housesaga_latency_route ("/saga/log/sensor/data", housesaga_websensor);
+    housesaga_latency_route ("/saga/log/sensor/latest", housesaga_weblatest); // Deprecated
+    housesaga_latency_route ("/saga/log/sensor/check", housesaga_weblatest); // Compatibility.
 
     // Alternate paths for application-independent web pages.
     // (The log files are stored at the same place for all applications.)
     //
-    echttp_route_uri ("/log/sensor/data", housesaga_websensor);
-    echttp_route_uri ("/log/sensor/latest", housesaga_weblatest); // Deprecated
-    echttp_route_uri ("/log/sensor/check", housesaga_weblatest); // Compatibility.
+    housesaga_latency_route ("/log/sensor/data", housesaga_websensor);
+    housesaga_latency_route ("/log/sensor/latest", housesaga_weblatest); // Deprecated
+    housesaga_latency_route ("/log/sensor/check", housesaga_weblatest); // Compatibility.
 
     housesaga_sensor_background (time(0)); // Initial state.
 }
 
-void housesaga_sensor_background (time_t now) {
+void housesaga_sensor_health (ParserContext context, int parent) {
+
+    int i;
+    int used = 0;
+    int unsaved = 0;
+    for (i = 0; i < HISTORY_DEPTH; ++i) {
+        if (!SensorHistory[i].timestamp.tv_sec) continue;
+        used += 1;
+        if (SensorHistory[i].unsaved) unsaved += 1;
+    }
+    int item = echttp_json_add_object (context, parent, 0);
+    echttp_json_add_string (context, item, "name", "sensor");
+    echttp_json_add_integer (context, item, "depth", HISTORY_DEPTH);
+    echttp_json_add_integer (context, item, "used", used);
+    echttp_json_add_integer (context, item, "unsaved", unsaved);
+    echttp_json_add_integer (context, item, "forced", SensorForcedSaves);
+    echttp_json_add_integer (context, item, "rewinds", SensorRewinds);
+    echttp_json_add_integer (context, item, "restored", SensorRestored);
+    echttp_json_add_bool (context, item, "persistent", SensorLive->persistent);
+    echttp_json_add_integer (context, item, "memory", HISTORY_DEPTH * sizeof(struct SensorRecord));
+}
 
-    static time_t LastCall = 0;
-    if (now + 6 < LastCall) return;
-    LastCall = now;
+void housesaga_sensor_background (time_t now) {
 
     housesaga_sensor_save (0);
+    if (SensorSaveNext)
+        housesaga_schedule (SensorSaveNext + SENSOR_SAVE_DELAY,
+                            housesaga_sensor_background);
 }
 
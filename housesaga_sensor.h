@@ -23,5 +23,7 @@
 
 void housesaga_sensor_initialize (int argc, const char **argv);
 
+void housesaga_sensor_health (ParserContext context, int parent);
+
 void housesaga_sensor_background (time_t now);
 
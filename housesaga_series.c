@@ -0,0 +1,596 @@
+/* housesaga - A log consolidation and storage service.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesaga_series.c - A compressed in-memory history of sensor data.
+ *
+ * This module keeps a much longer history of numeric sensor values than
+ * the live sensor buffer does, so that charts can be drawn without reading
+ * the sensor archive files.
+ *
+ * Each sensor (host, app, location and name) is a series. The samples of
+ * a series are stored in fixed size blocks, using the encoding described
+ * in Facebook's Gorilla paper:
+ *  - the timestamp (in milliseconds) is encoded as a delta of delta,
+ *    using a variable number of bits,
+ *  - the value (a double) is encoded as the XOR with the previous value,
+ *    skipping the leading and trailing zero bits.
+ *
+ * A sensor that reports at a regular interval a value that rarely changes
+ * costs only a few bits per sample. Each block starts with an uncompressed
+ * sample, so that a range scan only decodes the blocks it needs.
+ *
+ * Old blocks are released once all their samples are older than the
+ * configured history depth (48 hours by default). A series is released
+ * with its last block.
+ *
+ * SYNOPSYS:
+ *
+ * void housesaga_series_initialize (int argc, const char **argv);
+ *
+ *    Initialize the environment required to store sensor history.
+ *
+ * int housesaga_series_lookup (const char *host, const char *app,
+ *                              const char *location, const char *name,
+ *                              const char *unit);
+ *
+ *    Return the index of the specified series, creating it if needed.
+ *    Return -1 if the series could not be created. The names are compared
+ *    up to the size they are stored with. The index is only valid until
+ *    the next call to housesaga_series_background().
+ *
+ * void housesaga_series_add (int series,
+ *                            const struct timeval *timestamp, double value);
+ *
+ *    Append one sample to the specified series.
+ *
+ * int housesaga_series_latest (int series,
+ *                              struct timeval *timestamp, double *value);
+ *
+ *    Retrieve the most recent sample added to the specified series.
+ *    Return 0 if there is no such sample.
+ *
+ * void housesaga_series_background (time_t now);
+ *
+ *    Release the blocks that have expired, and the series that have no
+ *    sample left. This is a scheduled action that runs every minute.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "echttp.h"
+#include "echttp_libc.h"
+#include "houselog.h"
+
+#include "housesaga.h"
+#include "housesaga_series.h"
+#include "housesaga_latency.h"
+
+#define SERIES_BLOCK_SIZE 512 // Bytes of encoded data per block.
+#define SERIES_BLOCK_BITS (SERIES_BLOCK_SIZE * 8)
+#define SERIES_MAX_SAMPLE_BITS 128 // Worst case size of one encoded sample.
+
+struct SeriesBlock {
+    struct SeriesBlock *next;
+    long long start;  // Timestamp of the first sample (not encoded.)
+    long long oldest;
+    long long newest;
+    int count;
+    int bits;
+    uint8_t data[SERIES_BLOCK_SIZE];
+};
+
+struct SeriesRecord {
+    char host[128];
+    char app[128];
+    char location[32];
+    char name[32];
+    char unit[16];
+
+    struct SeriesBlock *first;
+    struct SeriesBlock *last;
+
+    // The encoder state, which applies to the last block only.
+    long long timestamp;
+    long long delta;
+    uint64_t value;
+    int leading;
+    int trailing;
+};
+
+#define SERIES_MAX 256
+static struct SeriesRecord SeriesTable[SERIES_MAX];
+static int SeriesCount = 0;
+
+#define SERIES_HASH 509 // Prime, about twice the number of series.
+static short SeriesIndex[SERIES_HASH]; // Index + 1, 0 when empty.
+
+static long long SeriesDepth = 48 * 3600 * 1000LL; // In milliseconds.
+static int SeriesBlockCount = 0;
+
+
+static void safecpy (char *d, const char *s, int size) {
+    if (s) strtcpy (d, s, size);
+    else d[0] = 0;
+}
+
+// The names are stored truncated to the size of their field, so they are
+// hashed and compared only up to that size.
+//
+static unsigned int housesaga_series_hash (const char *s, int size,
+                                           unsigned int hash) {
+    while (*s && (--size > 0)) hash = (hash * 31) + (unsigned char)(*(s++));
+    return (hash * 31) + 1; // Separator between fields.
+}
+
+static int housesaga_series_match (const char *field, int size,
+                                   const char *value) {
+    return !strncmp (field, value, size - 1);
+}
+
+static void housesaga_series_reindex (void) {
+
+    int i;
+    memset (SeriesIndex, 0, sizeof(SeriesIndex));
+    for (i = 0; i < SeriesCount; ++i) {
+        struct SeriesRecord *s = SeriesTable + i;
+        unsigned int hash = housesaga_series_hash (s->host, sizeof(s->host), 0);
+        hash = housesaga_series_hash (s->app, sizeof(s->app), hash);
+        hash = housesaga_series_hash (s->location, sizeof(s->location), hash);
+        hash = housesaga_series_hash (s->name, sizeof(s->name), hash);
+        int slot;
+        for (slot = hash % SERIES_HASH; SeriesIndex[slot];
+             slot = (slot + 1) % SERIES_HASH) ;
+        SeriesIndex[slot] = i + 1;
+    }
+}
+
+static unsigned long long housesaga_timestamp2key (const struct timeval *t) {
+    return t->tv_sec * 1000 + t->tv_usec / 1000;
+}
+
+/* The bit-level encoder and decoder.
+ * Bits are stored most significant first.
+ */
+static void housesaga_series_write (struct SeriesBlock *block,
+                                    uint64_t value, int bits) {
+    while (bits > 0) {
+        int byte = block->bits / 8;
+        int room = 8 - (block->bits % 8);
+        int chunk = (bits < room) ? bits : room;
+        uint8_t part =
+            (uint8_t)((value >> (bits - chunk)) & ((1 << chunk) - 1));
+        block->data[byte] |= (uint8_t)(part << (room - chunk));
+        block->bits += chunk;
+        bits -= chunk;
+    }
+}
+
+struct SeriesReader {
+    const struct SeriesBlock *block;
+    int position;
+    long long timestamp;
+    long long delta;
+    uint64_t value;
+    int leading;
+    int trailing;
+    int remaining;
+};
+
+static uint64_t housesaga_series_read (struct SeriesReader *reader, int bits) {
+    uint64_t value = 0;
+    while (bits > 0) {
+        int byte = reader->position / 8;
+        int room = 8 - (reader->position % 8);
+        int chunk = (bits < room) ? bits : room;
+        uint8_t part = reader->block->data[byte] >> (room - chunk);
+        value = (value << chunk) | (part & ((1 << chunk) - 1));
+        reader->position += chunk;
+        bits -= chunk;
+    }
+    return value;
+}
+
+static int housesaga_series_leading (uint64_t x) {
+    int count = 0;
+    while (!(x & 0x8000000000000000ULL)) { count += 1; x <<= 1; }
+    return count;
+}
+
+static int housesaga_series_trailing (uint64_t x) {
+    int count = 0;
+    while (!(x & 1)) { count += 1; x >>= 1; }
+    return count;
+}
+
+static uint64_t housesaga_series_d2u (double value) {
+    uint64_t result;
+    memcpy (&result, &value, sizeof(result));
+    return result;
+}
+
+static double housesaga_series_u2d (uint64_t value) {
+    double result;
+    memcpy (&result, &value, sizeof(result));
+    return result;
+}
+
+static struct SeriesBlock *housesaga_series_newblock (struct SeriesRecord *s,
+                                                      long long timestamp,
+                                                      double value) {
+
+    struct SeriesBlock *block = calloc (1, sizeof(struct SeriesBlock));
+    if (!block) return 0;
+
+    block->start = block->oldest = block->newest = timestamp;
+    block->count = 1;
+    s->timestamp = timestamp;
+    s->delta = 0;
+    s->value = housesaga_series_d2u (value);
+    s->leading = s->trailing = -1; // No previous XOR window yet.
+    housesaga_series_write (block, s->value, 64);
+
+    if (s->last) s->last->next = block;
+    else s->first = block;
+    s->last = block;
+    SeriesBlockCount += 1;
+    return block;
+}
+
+int housesaga_series_lookup (const char *host, const char *app,
+                             const char *location, const char *name,
+                             const char *unit) {
+
+    struct SeriesRecord *s;
+    unsigned int hash = housesaga_series_hash (host, sizeof(s->host), 0);
+    hash = housesaga_series_hash (app, sizeof(s->app), hash);
+    hash = housesaga_series_hash (location, sizeof(s->location), hash);
+    hash = housesaga_series_hash (name, sizeof(s->name), hash) % SERIES_HASH;
+
+    int i;
+    for (i = hash; SeriesIndex[i]; i = (i + 1) % SERIES_HASH) {
+        s = SeriesTable + SeriesIndex[i] - 1;
+        if (!housesaga_series_match (s->name, sizeof(s->name), name)) continue;
+        if (!housesaga_series_match (s->location, sizeof(s->location), location))
+            continue;
+        if (!housesaga_series_match (s->host, sizeof(s->host), host)) continue;
+        if (!housesaga_series_match (s->app, sizeof(s->app), app)) continue;
+        return SeriesIndex[i] - 1;
+    }
+    if (SeriesCount >= SERIES_MAX) return -1; // Full.
+
+    s = SeriesTable + SeriesCount;
+    safecpy (s->host, host, sizeof(s->host));
+    safecpy (s->app, app, sizeof(s->app));
+    safecpy (s->location, location, sizeof(s->location));
+    safecpy (s->name, name, sizeof(s->name));
+    safecpy (s->unit, unit, sizeof(s->unit));
+    s->first = s->last = 0;
+
+    SeriesIndex[i] = ++SeriesCount;
+    return SeriesCount - 1;
+}
+
+void housesaga_series_add (int series,
+                           const struct timeval *timestamp, double value) {
+
+    if ((series < 0) || (series >= SeriesCount)) return;
+    struct SeriesRecord *s = SeriesTable + series;
+    struct SeriesBlock *block = s->last;
+
+    long long t = (long long)housesaga_timestamp2key (timestamp);
+    long long delta = t - s->timestamp;
+    long long dod = delta - s->delta;
+
+    // Start a new block when the current one is full or when the new
+    // timestamp cannot be encoded (a gap of more than 24 days..)
+    //
+    if ((!block) ||
+        (block->bits + SERIES_MAX_SAMPLE_BITS > SERIES_BLOCK_BITS) ||
+        (dod < INT32_MIN) || (dod > INT32_MAX)) {
+        housesaga_series_newblock (s, t, value);
+        return;
+    }
+
+    if (dod == 0) {
+        housesaga_series_write (block, 0, 1);
+    } else if ((dod >= -63) && (dod <= 64)) {
+        housesaga_series_write (block, 2, 2);
+        housesaga_series_write (block, (uint64_t)(dod + 63), 7);
+    } else if ((dod >= -255) && (dod <= 256)) {
+        housesaga_series_write (block, 6, 3);
+        housesaga_series_write (block, (uint64_t)(dod + 255), 9);
+    } else if ((dod >= -2047) && (dod <= 2048)) {
+        housesaga_series_write (block, 14, 4);
+        housesaga_series_write (block, (uint64_t)(dod + 2047), 12);
+    } else {
+        housesaga_series_write (block, 15, 4);
+        housesaga_series_write (block, (uint64_t)(uint32_t)(int32_t)dod, 32);
+    }
+    s->timestamp = t;
+    s->delta = delta;
+
+    uint64_t bits = housesaga_series_d2u (value);
+    uint64_t xor = bits ^ s->value;
+    if (xor == 0) {
+        housesaga_series_write (block, 0, 1);
+    } else {
+        int leading = housesaga_series_leading (xor);
+        int trailing = housesaga_series_trailing (xor);
+        if (leading > 31) leading = 31;
+
+        if ((s->leading >= 0) &&
+            (leading >= s->leading) && (trailing >= s->trailing)) {
+            // Reuse the previous window.
+            int meaningful = 64 - s->leading - s->trailing;
+            housesaga_series_write (block, 2, 2);
+            housesaga_series_write (block, xor >> s->trailing, meaningful);
+        } else {
+            int meaningful = 64 - leading - trailing;
+            housesaga_series_write (block, 3, 2);
+            housesaga_series_write (block, leading, 5);
+            housesaga_series_write (block, meaningful & 0x3f, 6); // 64 is 0.
+            housesaga_series_write (block, xor >> trailing, meaningful);
+            s->leading = leading;
+            s->trailing = trailing;
+        }
+    }
+    s->value = bits;
+
+    block->count += 1;
+    if (t < block->oldest) block->oldest = t;
+    if (t > block->newest) block->newest = t;
+}
+
+int housesaga_series_latest (int series,
+                             struct timeval *timestamp, double *value) {
+
+    if ((series < 0) || (series >= SeriesCount)) return 0;
+    struct SeriesRecord *s = SeriesTable + series;
+    if (!s->last) return 0;
+
+    timestamp->tv_sec = (time_t)(s->timestamp / 1000);
+    timestamp->tv_usec = (suseconds_t)((s->timestamp % 1000) * 1000);
+    *value = housesaga_series_u2d (s->value);
+    return 1;
+}
+
+/* Decode the next sample from a block. The first call must follow
+ * a call to housesaga_series_rewind().
+ */
+static void housesaga_series_rewind (struct SeriesReader *reader,
+                                     const struct SeriesBlock *block) {
+    reader->block = block;
+    reader->position = 0;
+    reader->remaining = block->count;
+    reader->timestamp = block->start;
+    reader->delta = 0;
+    reader->leading = reader->trailing = 0;
+}
+
+static int housesaga_series_next (struct SeriesReader *reader,
+                                  long long *timestamp, double *value) {
+
+    if (reader->remaining <= 0) return 0;
+
+    if (reader->position == 0) {
+        reader->value = housesaga_series_read (reader, 64);
+    } else {
+        long long dod;
+        if (housesaga_series_read (reader, 1) == 0) {
+            dod = 0;
+        } else if (housesaga_series_read (reader, 1) == 0) {
+            dod = (long long)housesaga_series_read (reader, 7) - 63;
+        } else if (housesaga_series_read (reader, 1) == 0) {
+            dod = (long long)housesaga_series_read (reader, 9) - 255;
+        } else if (housesaga_series_read (reader, 1) == 0) {
+            dod = (long long)housesaga_series_read (reader, 12) - 2047;
+        } else {
+            dod = (int32_t)(uint32_t)housesaga_series_read (reader, 32);
+        }
+        reader->delta += dod;
+        reader->timestamp += reader->delta;
+
+        if (housesaga_series_read (reader, 1)) {
+            if (housesaga_series_read (reader, 1)) {
+                reader->leading = (int)housesaga_series_read (reader, 5);
+                int meaningful = (int)housesaga_series_read (reader, 6);
+                if (meaningful == 0) meaningful = 64;
+                reader->trailing = 64 - reader->leading - meaningful;
+            }
+            int meaningful = 64 - reader->leading - reader->trailing;
+            reader->value ^=
+                housesaga_series_read (reader, meaningful) << reader->trailing;
+        }
+    }
+    reader->remaining -= 1;
+    *timestamp = reader->timestamp;
+    *value = housesaga_series_u2d (reader->value);
+    return 1;
+}
+
+static char *WebHistoryBuffer = 0;
+static int   WebHistorySize = 0;
+static int   WebHistoryLength = 0;
+
+static void housesaga_series_print (const char *format, ...) {
+
+    va_list ap;
+    for (;;) {
+        int room = WebHistorySize - WebHistoryLength;
+        va_start (ap, format);
+        int wrote = vsnprintf (WebHistoryBuffer + WebHistoryLength,
+                               room, format, ap);
+        va_end (ap);
+        if (wrote < room) {
+            WebHistoryLength += wrote;
+            return;
+        }
+        WebHistorySize += 65536 + wrote;
+        WebHistoryBuffer = realloc (WebHistoryBuffer, WebHistorySize);
+    }
+}
+
+static void housesaga_series_export (const struct SeriesRecord *s,
+                                     long long since, long long until) {
+
+    housesaga_series_print
+        ("{\"host\":\"%s\",\"app\":\"%s\",\"location\":\"%s\","
+             "\"name\":\"%s\",\"unit\":\"%s\",\"samples\":[",
+         s->host, s->app, s->location, s->name, s->unit);
+
+    const char *prefix = "";
+    const struct SeriesBlock *block;
+    for (block = s->first; block; block = block->next) {
+
+        if (block->newest < since) continue;
+        if (block->oldest > until) continue;
+
+        struct SeriesReader reader;
+        long long timestamp;
+        double value;
+
+        housesaga_series_rewind (&reader, block);
+        while (housesaga_series_next (&reader, &timestamp, &value)) {
+            if ((timestamp < since) || (timestamp > until)) continue;
+            housesaga_series_print ("%s[%lld,%.15g]", prefix, timestamp, value);
+            prefix = ",";
+        }
+    }
+    housesaga_series_print ("]}");
+}
+
+static const char *housesaga_series_webhistory (const char *method,
+                                                const char *uri,
+                                                const char *data, int length) {
+
+    const char *host = echttp_parameter_get("host");
+    const char *location = echttp_parameter_get("location");
+    const char *name = echttp_parameter_get("name");
+    const char *since = echttp_parameter_get("since");
+    const char *until = echttp_parameter_get("until");
+
+    long long sincevalue = since ? atoll(since) : 0;
+    long long untilvalue = until ? atoll(until) : INT64_MAX;
+
+    WebHistoryLength = 0;
+    housesaga_series_print
+        ("{\"host\":\"%s\",\"timestamp\":%lld,\"saga\":{",
+         housesaga_host(), (long long)time(0));
+
+    int i;
+    const char *prefix = "";
+
+    if (!location && !name) {
+        // List the available series, with their (compressed) size.
+        housesaga_series_print ("\"series\":[");
+        for (i = 0; i < SeriesCount; ++i) {
+            const struct SeriesRecord *s = SeriesTable + i;
+            const struct SeriesBlock *block;
+            int count = 0;
+            int bytes = 0;
+            for (block = s->first; block; block = block->next) {
+                count += block->count;
+                bytes += (block->bits + 7) / 8;
+            }
+            housesaga_series_print
+                ("%s{\"host\":\"%s\",\"app\":\"%s\",\"location\":\"%s\","
+                     "\"name\":\"%s\",\"unit\":\"%s\","
+                     "\"count\":%d,\"bytes\":%d}",
+                 prefix, s->host, s->app, s->location, s->name, s->unit,
+                 count, bytes);
+            prefix = ",";
+        }
+    } else {
+        housesaga_series_print ("\"history\":[");
+        for (i = 0; i < SeriesCount; ++i) {
+            const struct SeriesRecord *s = SeriesTable + i;
+            if (host && strcmp (host, s->host)) continue;
+            if (location && strcmp (location, s->location)) continue;
+            if (name && strcmp (name, s->name)) continue;
+            housesaga_series_print ("%s", prefix);
+            housesaga_series_export (s, sincevalue, untilvalue);
+            prefix = ",";
+        }
+    }
+    housesaga_series_print ("]}}");
+
+    echttp_content_type_json ();
+    return WebHistoryBuffer;
+}
+
+void housesaga_series_background (time_t now) {
+
+    housesaga_schedule (now + 60, housesaga_series_background);
+
+    long long limit = (now * 1000LL) - SeriesDepth;
+
+    int i;
+    for (i = 0; i < SeriesCount; ++i) {
+        struct SeriesRecord *s = SeriesTable + i;
+        while (s->first && (s->first->newest < limit)) {
+            struct SeriesBlock *expired = s->first;
+            s->first = expired->next;
+            if (!s->first) s->last = 0;
+            free (expired);
+            SeriesBlockCount -= 1;
+        }
+    }
+
+    // Forget the series that have no sample left.
+    //
+    int count = 0;
+    for (i = 0; i < SeriesCount; ++i) {
+        if (!SeriesTable[i].first) continue;
+        if (count != i) SeriesTable[count] = SeriesTable[i];
+        count += 1;
+    }
+    if (count < SeriesCount) {
+        SeriesCount = count;
+        housesaga_series_reindex ();
+    }
+}
+
+void housesaga_series_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *depth = 0;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match("-sensor-history=", argv[i], &depth)) continue;
+    }
+    if (depth) {
+        int hours = atoi(depth);
+        if (hours > 0) SeriesDepth = hours * 3600 * 1000LL;
+    }
+
+    housesaga_latency_route ("/saga/log/sensor/history", housesaga_series_webhistory);
+
+    // Alternate path for application-independent web pages.
+    //
+    housesaga_latency_route ("/log/sensor/history", housesaga_series_webhistory);
+}
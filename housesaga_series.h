@@ -0,0 +1,35 @@
+/* housesaga - A log consolidation and storage service.
+ *
+ * Copyright 2024, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesaga_series.c - A compressed in-memory history of sensor data.
+ */
+void housesaga_series_initialize (int argc, const char **argv);
+
+int  housesaga_series_lookup (const char *host, const char *app,
+                              const char *location, const char *name,
+                              const char *unit);
+
+void housesaga_series_add (int series,
+                           const struct timeval *timestamp, double value);
+
+int  housesaga_series_latest (int series,
+                              struct timeval *timestamp, double *value);
+
+void housesaga_series_background (time_t now);
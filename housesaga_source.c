@@ -0,0 +1,298 @@
+/* housesaga - A log consolidation and storage service.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesaga_source.c - Keep track of the sources of the log data.
+ *
+ * This module records which (host, app) pairs sent data, how much and
+ * how well their clock is synchronized with this server.
+ *
+ * SYNOPSYS:
+ *
+ * void housesaga_source_initialize (int argc, const char **argv);
+ *
+ *    Initialize the source table and register the web API.
+ *
+ * int housesaga_source_batch (const char *host, const char *app, int type);
+ *
+ *    Record the arrival of a new batch of records of the specified type
+ *    (see housesaga_source.h) and return the source's handle, to be used
+ *    with housesaga_source_record(). Return -1 if host or app is missing,
+ *    or if the table is full.
+ *
+ * void housesaga_source_record (int handle, const struct timeval *timestamp);
+ *
+ *    Record one record received in the current batch of this source. The
+ *    timestamp is the record's own time, compared with the batch arrival
+ *    time to calculate the source's clock skew.
+ *
+ * int housesaga_source_lookup (const char *host, const char *app);
+ *
+ *    Return the source's handle, creating the source if needed, without
+ *    recording any data. Return -1 if host or app is missing, or if the
+ *    table is full.
+ *
+ * void housesaga_source_sequence (int handle, unsigned long sequence);
+ *
+ *    Record the sequence number of a datagram received from this source.
+ *    A gap in the sequence is counted as lost datagrams. A sequence that
+ *    goes backward is assumed to be a restart of the source.
+ *
+ * NOTE:
+ *
+ *    The sources are stored in a hash table using open addressing, so that
+ *    the cost on the ingest path does not depend on the number of sources.
+ *    A source is never removed: the number of hosts and applications in
+ *    a home network is small and stable.
+ *
+ *    A record is late if it arrives after its time slot was saved, i.e.
+ *    more than SOURCE_LATE seconds after its own timestamp.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+#include "houselog.h"
+
+#include "housesaga.h"
+#include "housesaga_source.h"
+#include "housesaga_latency.h"
+
+#define SOURCE_LATE 6 // Same delay as used when saving the live buffers.
+
+#define SOURCE_SKEW_WEIGHT 16 // Exponential moving average of the skew.
+
+struct SagaSource {
+    char host[128];
+    char app[64];
+    time_t lastseen;
+    struct timeval arrival; // Arrival time of the current batch.
+    int type;               // Type of records in the current batch.
+    long long batches;
+    long long records;
+    long long late;
+    long long types[HOUSESAGA_SOURCE_TYPES];
+    long minute;   // The current minute period, i.e. time / 60.
+    long current;  // Records received during the current minute.
+    long previous; // Records received during the previous minute.
+    double skew;   // Average skew in milliseconds.
+    double maxskew;
+    unsigned long sequence; // Next sequence number expected.
+    long long datagrams;
+    long long lost;
+    long long restarts;
+};
+
+#define SOURCE_MAX 509 // A prime number, for a better hash distribution.
+static struct SagaSource SourceTable[SOURCE_MAX];
+static int SourceCount = 0;
+
+static const char *SourceTypeNames[HOUSESAGA_SOURCE_TYPES] = {
+    "events", "sensors", "traces", "metrics"
+};
+
+static unsigned int housesaga_source_hash (const char *s, unsigned int hash) {
+    while (*s) hash = (hash * 31) + *(s++);
+    return hash + 1; // Separator between the host and app names.
+}
+
+int housesaga_source_lookup (const char *host, const char *app) {
+
+    if ((!host) || (!host[0]) || (!app)) return -1;
+
+    unsigned int hash = housesaga_source_hash (app, housesaga_source_hash (host, 0));
+    int i = (int)(hash % SOURCE_MAX);
+    struct SagaSource *cursor;
+
+    for (;;) {
+        cursor = SourceTable + i;
+        if (!cursor->host[0]) break; // Not found.
+        if ((!strcmp (cursor->host, host)) && (!strcmp (cursor->app, app)))
+            break;
+        if (++i >= SOURCE_MAX) i = 0;
+    }
+
+    if (!cursor->host[0]) {
+        // Keep one slot empty, so that every search ends.
+        if (SourceCount >= SOURCE_MAX - 1) return -1;
+        if (strlen(host) >= sizeof(cursor->host)) return -1;
+        if (strlen(app) >= sizeof(cursor->app)) return -1;
+        memset (cursor, 0, sizeof(*cursor));
+        snprintf (cursor->host, sizeof(cursor->host), "%s", host);
+        snprintf (cursor->app, sizeof(cursor->app), "%s", app);
+        SourceCount += 1;
+    }
+    return i;
+}
+
+int housesaga_source_batch (const char *host, const char *app, int type) {
+
+    if ((type < 0) || (type >= HOUSESAGA_SOURCE_TYPES)) return -1;
+
+    int i = housesaga_source_lookup (host, app);
+    if (i < 0) return -1;
+    struct SagaSource *cursor = SourceTable + i;
+
+    gettimeofday (&(cursor->arrival), 0);
+    cursor->lastseen = cursor->arrival.tv_sec;
+    cursor->batches += 1;
+    cursor->type = type;
+    return i;
+}
+
+void housesaga_source_record (int handle, const struct timeval *timestamp) {
+
+    if ((handle < 0) || (handle >= SOURCE_MAX)) return;
+
+    struct SagaSource *cursor = SourceTable + handle;
+    if (!cursor->host[0]) return;
+
+    cursor->records += 1;
+    cursor->types[cursor->type] += 1;
+
+    long minute = (long)(cursor->arrival.tv_sec / 60);
+    if (minute != cursor->minute) {
+        cursor->previous = (minute == cursor->minute + 1) ? cursor->current : 0;
+        cursor->current = 0;
+        cursor->minute = minute;
+    }
+    cursor->current += 1;
+
+    double skew =
+        ((cursor->arrival.tv_sec - timestamp->tv_sec) * 1000.0) +
+        ((cursor->arrival.tv_usec - timestamp->tv_usec) / 1000.0);
+
+    if (cursor->records == 1) {
+        cursor->skew = cursor->maxskew = skew;
+    } else {
+        cursor->skew += (skew - cursor->skew) / SOURCE_SKEW_WEIGHT;
+        if (skew > cursor->maxskew) cursor->maxskew = skew;
+    }
+
+    if (skew > SOURCE_LATE * 1000.0) cursor->late += 1;
+}
+
+void housesaga_source_sequence (int handle, unsigned long sequence) {
+
+    if ((handle < 0) || (handle >= SOURCE_MAX)) return;
+
+    struct SagaSource *cursor = SourceTable + handle;
+    if (!cursor->host[0]) return;
+
+    if (cursor->datagrams > 0) {
+        if (sequence > cursor->sequence) {
+            cursor->lost += sequence - cursor->sequence;
+        } else if (sequence < cursor->sequence) {
+            cursor->restarts += 1;
+        }
+    }
+    cursor->datagrams += 1;
+    cursor->sequence = sequence + 1;
+}
+
+/* The rate is calculated on the last completed minute only.
+ */
+static double housesaga_source_rate (const struct SagaSource *cursor,
+                                     time_t now) {
+    long minute = (long)(now / 60);
+    if (minute == cursor->minute) return cursor->previous / 60.0;
+    if (minute == cursor->minute + 1) return cursor->current / 60.0;
+    return 0.0;
+}
+
+static const char *housesaga_source_status (const char *method,
+                                            const char *uri,
+                                            const char *data, int length) {
+
+    if (strcmp (method, "GET")) return ""; // Only GET is supported.
+
+    static char buffer[SOURCE_MAX * 384];
+    static ParserToken token[SOURCE_MAX * 20];
+    static char pool[SOURCE_MAX * 256];
+
+    time_t now = time(0);
+    ParserContext context = echttp_json_start (token, SOURCE_MAX * 20,
+                                               pool, sizeof(pool));
+
+    int root = echttp_json_add_object (context, 0, 0);
+    echttp_json_add_string (context, root, "host", housesaga_host());
+    echttp_json_add_integer (context, root, "timestamp", (long long)now);
+    int top = echttp_json_add_object (context, root, "saga");
+    int container = echttp_json_add_array (context, top, "sources");
+
+    int i, j;
+    for (i = 0; i < SOURCE_MAX; ++i) {
+        const struct SagaSource *cursor = SourceTable + i;
+        if (!cursor->host[0]) continue;
+
+        int item = echttp_json_add_object (context, container, 0);
+        echttp_json_add_string (context, item, "host", cursor->host);
+        echttp_json_add_string (context, item, "app", cursor->app);
+        echttp_json_add_integer (context, item, "lastseen",
+                                 (long long)cursor->lastseen);
+        echttp_json_add_real (context, item, "rate",
+                              housesaga_source_rate (cursor, now));
+        echttp_json_add_integer (context, item, "batches", cursor->batches);
+        echttp_json_add_integer (context, item, "records", cursor->records);
+        echttp_json_add_real (context, item, "batch",
+                              cursor->batches ?
+                                  cursor->records / (double)cursor->batches : 0.0);
+        echttp_json_add_real (context, item, "skew", cursor->skew);
+        echttp_json_add_real (context, item, "maxskew", cursor->maxskew);
+        echttp_json_add_integer (context, item, "late", cursor->late);
+        if (cursor->datagrams) {
+            echttp_json_add_integer (context, item, "datagrams",
+                                     cursor->datagrams);
+            echttp_json_add_integer (context, item, "lost", cursor->lost);
+            echttp_json_add_integer (context, item, "restarts",
+                                     cursor->restarts);
+        }
+        for (j = 0; j < HOUSESAGA_SOURCE_TYPES; ++j) {
+            if (cursor->types[j])
+                echttp_json_add_integer
+                    (context, item, SourceTypeNames[j], cursor->types[j]);
+        }
+    }
+
+    const char *error = echttp_json_export (context, buffer, sizeof(buffer));
+    if (error) {
+        echttp_error (500, error);
+        return "";
+    }
+    echttp_content_type_json ();
+    return buffer;
+}
+
+void housesaga_source_initialize (int argc, const char **argv) {
+
+    housesaga_latency_route ("/saga/log/sources", housesaga_source_status);
+
+    // Alternate path for application-independent web pages.
+    // (The log files are stored at the same place for all applications.)
+    //
+    housesaga_latency_route ("/log/sources", housesaga_source_status);
+}
+
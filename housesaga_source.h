@@ -0,0 +1,33 @@
+/* housesaga - A log consolidation and storage service.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * housesaga_source.h - Keep track of the sources of the log data.
+ */
+#define HOUSESAGA_SOURCE_EVENT   0
+#define HOUSESAGA_SOURCE_SENSOR  1
+#define HOUSESAGA_SOURCE_TRACE   2
+#define HOUSESAGA_SOURCE_METRICS 3
+#define HOUSESAGA_SOURCE_TYPES   4
+
+void housesaga_source_initialize (int argc, const char **argv);
+int  housesaga_source_batch (const char *host, const char *app, int type);
+void housesaga_source_record (int handle, const struct timeval *timestamp);
+int  housesaga_source_lookup (const char *host, const char *app);
+void housesaga_source_sequence (int handle, unsigned long sequence);
+
@@ -38,6 +38,49 @@
  *
  *    Initialize the storage environment based on command line arguments.
  *
+ * void housesaga_storage_configure (int argc, const char **argv);
+ *
+ *    Only decode the storage command line options, without registering
+ *    the web API. This must be called before any other module is
+ *    initialized, since the log storage also holds the live buffers.
+ *
+ * typedef void housesaga_storage_visitor (const char *path,
+ *                                         int year, int month, int day);
+ *
+ * void housesaga_storage_walk (housesaga_storage_visitor *visitor);
+ *
+ *    Call the visitor function for each day folder in the log storage.
+ *    The folders are not visited in any specific order.
+ *
+ * int housesaga_storage_daypath (char *buffer, int size,
+ *                                int year, int month, int day);
+ *
+ *    Build the path of the specified day folder. Return the path's length.
+ *
+ * int housesaga_storage_monthpath (char *buffer, int size,
+ *                                  int year, int month);
+ *
+ *    Build the path of the specified month folder. Return the path's length.
+ *
+ * int housesaga_storage_rootpath (char *buffer, int size, const char *name);
+ *
+ *    Build the path of a file located at the root of the log storage.
+ *    Return the path's length.
+ *
+ * void housesaga_storage_health (ParserContext context, int parent);
+ *
+ *    Add the I/O statistics for each log type to a JSON array: number of
+ *    files opened and closed, directories created, open errors, bytes
+ *    written and time spent writing and closing files (microseconds).
+ *
+ * void housesaga_storage_background (time_t now);
+ *
+ *    Apply the retention policy, if any: the log files of the types listed
+ *    in -retention=TYPE:DAYS options are deleted once they are older than
+ *    the specified number of days. This allows dropping low value logs
+ *    (e.g. debug traces) early, while keeping the rest of the archive.
+ *    This is a scheduled action that runs every hour.
+ *
  * RESTRICTION
  *
  * For the sake of simplicity, this module opens only one file at a time.
@@ -67,43 +110,111 @@
 #include <time.h>
 
 #include "echttp.h"
+#include "echttp_json.h"
 #include "echttp_static.h"
 #include "houselog.h"
 
 #include "housesaga.h"
 #include "housesaga_storage.h"
+#include "housesaga_latency.h"
+#include "housesaga_digest.h"
 
 static const char *LogStorageFolder = "/var/lib/house/log";
 
-static const char *LogStorageType = 0;
+static char LogStorageType[64] = "";
 static FILE *LogStorageFile = 0;
 static int LogStoragePeriod = 0;
 
+static int LatencyStorageSave = -1;
+static int LatencyStorageFlush = -1;
+
+struct LogStorageStat {
+    char logtype[64];
+    long opens;
+    long closes;
+    long mkdirs;
+    long errors;
+    long long bytes;
+    long long writetime; // Microseconds.
+    long long flushtime; // Microseconds.
+};
+
+#define STORAGE_STAT_MAX 32
+static struct LogStorageStat LogStorageStats[STORAGE_STAT_MAX];
+static int LogStorageStatCount = 0;
+static struct LogStorageStat *LogStorageCurrent = 0;
+
+static struct LogStorageStat *housesaga_storage_stat (const char *logtype) {
+    int i;
+    for (i = 0; i < LogStorageStatCount; ++i) {
+        if (!strcmp (LogStorageStats[i].logtype, logtype))
+            return LogStorageStats + i;
+    }
+    // The last entry accounts for all the log types that did not fit.
+    // Its name has parentheses, which log type names never contain.
+    //
+    if (LogStorageStatCount >= STORAGE_STAT_MAX - 1) {
+        struct LogStorageStat *other = LogStorageStats + STORAGE_STAT_MAX - 1;
+        if (!other->logtype[0]) {
+            snprintf (other->logtype, sizeof(other->logtype), "(other)");
+            LogStorageStatCount = STORAGE_STAT_MAX;
+        }
+        return other;
+    }
+
+    struct LogStorageStat *stat = LogStorageStats + (LogStorageStatCount++);
+    snprintf (stat->logtype, sizeof(stat->logtype), "%s", logtype);
+    return stat;
+}
+
+struct LogRetention {
+    const char *logtype;
+    int days;
+};
+
+#define RETENTION_MAX 16
+static struct LogRetention LogRetentions[RETENTION_MAX];
+static int LogRetentionCount = 0;
+
+static int housesaga_storage_filename (char *buffer, int size,
+                                       const char *logtype) {
+    if (strchr (logtype, '.')) {
+        return snprintf (buffer, size, "%s", logtype);
+    }
+    return snprintf (buffer, size, "%s.csv", logtype);
+}
+
 static FILE *housesaga_storage_open (const char *logtype,
                                      int year, int month, int day) {
 
     int cursor;
     char path[1024];
 
+    struct LogStorageStat *stat = housesaga_storage_stat (logtype);
+
     // Ignore all mkdir() errors: fopen() will fail anyway.
     //
-    mkdir (LogStorageFolder, 0777);
+    if (!mkdir (LogStorageFolder, 0777)) stat->mkdirs += 1;
 
     cursor = snprintf (path, sizeof(path), "%s/%04d", LogStorageFolder, year);
-    mkdir (path, 0777);
+    if (!mkdir (path, 0777)) stat->mkdirs += 1;
 
     cursor += snprintf (path+cursor, sizeof(path)-cursor, "/%02d", month);
-    mkdir (path, 0777);
+    if (!mkdir (path, 0777)) stat->mkdirs += 1;
 
     cursor += snprintf (path+cursor, sizeof(path)-cursor, "/%02d", day);
-    mkdir (path, 0777);
-
-    if (strchr (logtype, '.')) {
-        snprintf (path+cursor, sizeof(path)-cursor, "/%s", logtype);
+    if (!mkdir (path, 0777)) stat->mkdirs += 1;
+
+    path[cursor++] = '/';
+    housesaga_storage_filename (path+cursor, sizeof(path)-cursor, logtype);
+    FILE *file = fopen (path, "a");
+    if (file) {
+        stat->opens += 1;
+        LogStorageCurrent = stat;
     } else {
-        snprintf (path+cursor, sizeof(path)-cursor, "/%s.csv", logtype);
+        stat->errors += 1;
     }
-    return fopen (path, "a");
+    return file;
 }
 
 void housesaga_storage_save (const char *logtype, time_t timestamp,
@@ -115,34 +226,49 @@ void housesaga_storage_save (const char *logtype, time_t timestamp,
     int day = local.tm_mday;
     int period = (year * 100 + month) * 100 + day; // Make a unique number.
 
+    long long start = housesaga_latency_now();
+
     if (period != LogStoragePeriod) {
         housesaga_storage_flush ();
-    } else if (LogStorageType) {
+    } else if (LogStorageType[0]) {
         if (strcmp (logtype, LogStorageType)) { // Switched type?
             housesaga_storage_flush (); // Don't mix data types in the same file
         }
     }
     LogStoragePeriod = period;
-    LogStorageType = logtype;
+    snprintf (LogStorageType, sizeof(LogStorageType), "%s", logtype);
 
+    int written = 0;
     if (!LogStorageFile) {
         LogStorageFile = housesaga_storage_open (logtype, year, month, day);
         if (! LogStorageFile) return; // Hoops!
         if (header && (ftell (LogStorageFile) == 0)) {
-            fprintf (LogStorageFile, "%s\n", header);
+            written = fprintf (LogStorageFile, "%s\n", header);
         }
     }
-    fprintf (LogStorageFile, "%s\n", record);
+    written += fprintf (LogStorageFile, "%s\n", record);
+    LogStorageCurrent->bytes += written;
+    housesaga_digest_saved (logtype, year, month, day,
+                            timestamp, record, written);
+    LogStorageCurrent->writetime += housesaga_latency_now() - start;
+    housesaga_latency_record (LatencyStorageSave, start);
 }
 
 void housesaga_storage_flush (void) {
 
     if (LogStorageFile) {
+        long long start = housesaga_latency_now();
         fclose (LogStorageFile);
         LogStorageFile = 0;
+        housesaga_latency_record (LatencyStorageFlush, start);
+        if (LogStorageCurrent) {
+            LogStorageCurrent->closes += 1;
+            LogStorageCurrent->flushtime += housesaga_latency_now() - start;
+            LogStorageCurrent = 0;
+        }
     }
     LogStoragePeriod = 0;
-    LogStorageType = 0;
+    LogStorageType[0] = 0;
 }
 
 static const char *saga_storage_monthly (const char *method, const char *uri,
@@ -260,20 +386,172 @@ nospace:
     return "HTTP Error 413: Out of space, response too large";
 }
 
-void housesaga_storage_initialize (int argc, const char **argv) {
+static int housesaga_storage_number (const char *name, int digits) {
     int i;
+    for (i = 0; i < digits; ++i) {
+        if (!isdigit(name[i])) return 0;
+    }
+    if (name[digits]) return 0;
+    return atoi (name);
+}
+
+void housesaga_storage_walk (housesaga_storage_visitor *visitor) {
+
+    char path[1024];
+    DIR *years = opendir (LogStorageFolder);
+    if (!years) return;
+
+    for (;;) {
+        struct dirent *y = readdir(years);
+        if (!y) break;
+        int year = housesaga_storage_number (y->d_name, 4);
+        if (!year) continue;
+
+        int ycursor = snprintf (path, sizeof(path),
+                                "%s/%s", LogStorageFolder, y->d_name);
+        DIR *months = opendir (path);
+        if (!months) continue;
+
+        for (;;) {
+            struct dirent *m = readdir(months);
+            if (!m) break;
+            int month = housesaga_storage_number (m->d_name, 2);
+            if (!month) continue;
+
+            int mcursor = ycursor + snprintf (path+ycursor, sizeof(path)-ycursor,
+                                              "/%s", m->d_name);
+            DIR *days = opendir (path);
+            if (!days) continue;
+
+            for (;;) {
+                struct dirent *d = readdir(days);
+                if (!d) break;
+                int day = housesaga_storage_number (d->d_name, 2);
+                if (!day) continue;
+
+                snprintf (path+mcursor, sizeof(path)-mcursor, "/%s", d->d_name);
+                visitor (path, year, month, day);
+            }
+            closedir (days);
+        }
+        closedir (months);
+    }
+    closedir (years);
+}
+
+int housesaga_storage_daypath (char *buffer, int size,
+                               int year, int month, int day) {
+    return snprintf (buffer, size, "%s/%04d/%02d/%02d",
+                     LogStorageFolder, year, month, day);
+}
+
+int housesaga_storage_monthpath (char *buffer, int size, int year, int month) {
+    return snprintf (buffer, size, "%s/%04d/%02d",
+                     LogStorageFolder, year, month);
+}
+
+int housesaga_storage_rootpath (char *buffer, int size, const char *name) {
+    return snprintf (buffer, size, "%s/%s", LogStorageFolder, name);
+}
+
+/* Delete the files that have reached the end of their retention period
+ * in one day folder. The folder itself is removed if it became empty.
+ */
+static void housesaga_storage_expire (const char *path,
+                                      int year, int month, int day) {
+
+    int i;
+    char filepath[1024];
+    int cursor = snprintf (filepath, sizeof(filepath), "%s/", path);
+
+    // Use the end of that day as the reference.
+    struct tm local = {0};
+    local.tm_mday = day + 1;
+    local.tm_mon = month - 1;
+    local.tm_year = year - 1900;
+    local.tm_isdst = -1;
+    time_t end = mktime (&local);
+    if (end < 0) return;
+
+    time_t now = time(0);
+
+    for (i = 0; i < LogRetentionCount; ++i) {
+        if (end + (LogRetentions[i].days * 24 * 60 * 60) > now) continue;
+        housesaga_storage_filename (filepath+cursor, sizeof(filepath)-cursor,
+                                    LogRetentions[i].logtype);
+        if (unlink (filepath) == 0) {
+            houselog_trace (HOUSE_INFO, "RETENTION", "deleted %s", filepath);
+            char markpath[1100];
+            snprintf (markpath, sizeof(markpath), "%s/.%s.sorted",
+                      path, filepath+cursor);
+            unlink (markpath); // The "sorted" mark, if any.
+            snprintf (markpath, sizeof(markpath), "%s/.%s.tri",
+                      path, filepath+cursor);
+            unlink (markpath); // The trace index, if any.
+        }
+    }
+    rmdir (path); // Fails if not empty, which is the intent.
+}
+
+void housesaga_storage_background (time_t now) {
+
+    if (LogRetentionCount <= 0) return;
+    housesaga_schedule (now + 3600, housesaga_storage_background);
+
+    housesaga_storage_walk (housesaga_storage_expire);
+}
+
+void housesaga_storage_health (ParserContext context, int parent) {
+
+    int i;
+    for (i = 0; i < LogStorageStatCount; ++i) {
+        const struct LogStorageStat *stat = LogStorageStats + i;
+        int item = echttp_json_add_object (context, parent, 0);
+        echttp_json_add_string (context, item, "type", stat->logtype);
+        echttp_json_add_integer (context, item, "opens", stat->opens);
+        echttp_json_add_integer (context, item, "closes", stat->closes);
+        echttp_json_add_integer (context, item, "mkdirs", stat->mkdirs);
+        echttp_json_add_integer (context, item, "errors", stat->errors);
+        echttp_json_add_integer (context, item, "bytes", stat->bytes);
+        echttp_json_add_integer (context, item, "writetime", stat->writetime);
+        echttp_json_add_integer (context, item, "flushtime", stat->flushtime);
+    }
+}
+
+void housesaga_storage_configure (int argc, const char **argv) {
+    int i;
+    const char *retention;
+
     for (i = 1; i < argc; ++i) {
-        if (echttp_option_match("-log-path=", argv[i], &LogStorageFolder)) {
-            houselog_trace (HOUSE_INFO, "PATH", "Log stored in %s", LogStorageFolder);
+        if (echttp_option_match("-log-path=", argv[i], &LogStorageFolder)) continue;
+        if (echttp_option_match("-retention=", argv[i], &retention)) {
+            const char *separator = strchr (retention, ':');
+            if (!separator) continue;
+            if (LogRetentionCount >= RETENTION_MAX) continue;
+            LogRetentions[LogRetentionCount].logtype =
+                strndup (retention, separator - retention);
+            LogRetentions[LogRetentionCount].days = atoi(separator+1);
+            if (LogRetentions[LogRetentionCount].days > 0) {
+                LogRetentionCount += 1;
+            }
             continue;
         }
     }
-    echttp_route_uri ("/saga/monthly", saga_storage_monthly);
-    echttp_route_uri ("/saga/daily", saga_storage_daily);
+}
+
+void housesaga_storage_initialize (int argc, const char **argv) {
+
+    LatencyStorageSave = housesaga_latency_register ("storage:save");
+    LatencyStorageFlush = housesaga_latency_register ("storage:flush");
+
+    houselog_trace (HOUSE_INFO, "PATH", "Log stored in %s", LogStorageFolder);
+
+    housesaga_latency_route ("/saga/monthly", saga_storage_monthly);
+    housesaga_latency_route ("/saga/daily", saga_storage_daily);
     echttp_static_route ("/saga/archive", LogStorageFolder);
 
-    echttp_route_uri ("/monthly", saga_storage_monthly);
-    echttp_route_uri ("/daily", saga_storage_daily);
+    housesaga_latency_route ("/monthly", saga_storage_monthly);
+    housesaga_latency_route ("/daily", saga_storage_daily);
     echttp_static_route ("/archive", LogStorageFolder);
 }
 
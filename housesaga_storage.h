@@ -27,4 +27,20 @@ void housesaga_storage_save (const char *logtype, time_t timestamp,
 void housesaga_storage_flush (void);
 
 void housesaga_storage_initialize (int argc, const char **argv);
+void housesaga_storage_configure (int argc, const char **argv);
 
+typedef void housesaga_storage_visitor (const char *path,
+                                        int year, int month, int day);
+
+void housesaga_storage_walk (housesaga_storage_visitor *visitor);
+
+int housesaga_storage_daypath (char *buffer, int size,
+                               int year, int month, int day);
+
+int housesaga_storage_monthpath (char *buffer, int size, int year, int month);
+
+int housesaga_storage_rootpath (char *buffer, int size, const char *name);
+
+void housesaga_storage_health (ParserContext context, int parent);
+
+void housesaga_storage_background (time_t now);
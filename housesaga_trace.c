@@ -24,6 +24,36 @@
  *
  * Trace reports use a JSON format similar to the one used for events.
  *
+ * The latest traces are kept in memory, the same way as events. This
+ * also call the HouseSaga storage module when either of the conditions
+ * below is met:
+ *  - the buffer is full and the oldest item was not saved to storage.
+ *  - there is at least one unsaved item and last save was N seconds ago.
+ *
+ * This way a flood of traces costs a few batched writes instead of one
+ * file open and close per request, and the traces are stored in
+ * chronological order.
+ *
+ * A service stuck in an error loop may generate a flood of traces. Two
+ * mechanisms protect HouseSaga (and its storage) against such a flood:
+ *  - The traces received from each source (host, application and level)
+ *    can be limited by a token bucket. The rate limit is set using the
+ *    -trace-rate=[LEVEL:]N option (N traces per second, with a burst of
+ *    10 seconds worth of traces). N=0 means no limit, which is the
+ *    default: the rate limit only applies when this option is used.
+ *  - A sequence of identical traces from the same source is collapsed
+ *    into the first trace, followed by a "suppressed N identical traces"
+ *    summary every 10 seconds for as long as the repetition lasts.
+ * A summary is also recorded for the traces dropped because of the
+ * rate limit. The state of a source is forgotten once it has been idle
+ * for a few summary periods, when room is needed for a new source.
+ *
+ * By default all traces are stored in the same daily trace.csv file. The
+ * -trace-split option causes the traces to be stored in one file per
+ * level instead (trace-<level>.csv), so that rare errors can be found
+ * quickly and low value traces can be deleted early (see the -retention
+ * option in housesaga_storage.c).
+ *
  * This module also implement a clone of the houselog.c C API, so
  * that HouseSaga can records its own traces without going into
  * a vicious circle..
@@ -45,6 +75,19 @@
  *    HOUSE_INFO, HOUSE_WARNING, HOUSE_FAILURE.
  *
  * -- end of houselog.c clone --
+ *
+ * void housesaga_trace_health (ParserContext context, int parent);
+ *
+ *    Add the state of the live buffer to a JSON array: depth, number of
+ *    records used and not yet saved, number of saves forced because the
+ *    buffer was full, and number of late records saved out of order.
+ *
+ * void housesaga_trace_background (time_t now);
+ *
+ *    Save the traces that are due and record the summaries of suppressed
+ *    traces. This is a scheduled action (see housesaga_schedule()): it runs
+ *    when the oldest unsaved trace becomes older than the save delay, or
+ *    when a pending summary is due.
  */
 
 #include <unistd.h>
@@ -56,21 +99,227 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
 
 #include "echttp.h"
 #include "echttp_json.h"
+#include "echttp_sorted.h"
+#include "echttp_libc.h"
 #include "houselog.h"
 
 #include "housesaga.h"
 #include "housesaga_trace.h"
 #include "housesaga_storage.h"
+#include "housesaga_live.h"
 #include "housesaga_traffic.h"
+#include "housesaga_latency.h"
+#include "housesaga_source.h"
+#include "housesaga_parser.h"
+#include "housesaga_dedup.h"
+
+
+static const char  LogAppName[] = "saga";
+
+struct TraceRecord {
+    struct timeval timestamp;
+    long long id;
+    long long arrival; // Monotonic time, see housesaga_latency_now().
+    int    unsaved;
+    int    line;
+    char   host[128];
+    char   app[128];
+    char   file[64];
+    char   level[16];
+    char   object[32];
+    char   description[512];
+};
+
+#define HISTORY_DEPTH 256
+
+#define TRACE_SAVE_DELAY 6 // Time given to the sources to flush their data.
+
+static struct TraceRecord *TraceHistory = 0; // See housesaga_trace_live().
+static struct HouseSagaLive *TraceLive = 0;
+static int TraceRestored = 0;
+static int TraceCursor = 0;
+static long long TraceLatestId = 0;
+
+static echttp_sorted_list TraceChronology;
+static time_t TraceLastSaved = 0;
+static time_t TraceSaveLimit = 0;
+static time_t TraceSaveNext = 0;  // Oldest unsaved record not yet due.
+
+static long TraceForcedSaves = 0; // Buffer full: saved without delay.
+static long TraceRewinds = 0;     // Late records, saved out of order.
+
+static int TraceSplit = 0;
+static char TraceSaveType[32]; // The log type saved in the current pass.
+static int TraceSaveMore = 0;  // Other log types remain to be saved.
+
+static int TrafficTracesStored = -1;
+static int TrafficTracesIgnored = -1;
+static int TrafficTracesCollapsed = -1;
+static int TrafficTracesLimited = -1;
+static int TrafficTracesDuplicate = -1;
+static int ParserTraces = -1;
+static int LatencyTraceResidency = -1;
+
+
+static void safecpy (char *d, const char *s, int size) {
+    if (s) strtcpy (d, s, size);
+    else d[0] = 0;
+}
+
+static unsigned long long housesaga_timestamp2key (const struct timeval *t) {
+    return t->tv_sec * 1000 + t->tv_usec / 1000;
+}
+
+/* Build the log type (i.e. file name) for the specified level.
+ * The level name is reduced to lower case letters and digits, so that
+ * it is always a valid file name.
+ */
+static const char *housesaga_trace_logtype (char *buffer, int size,
+                                            const char *level) {
+    if (!TraceSplit) return "trace";
+
+    int cursor = snprintf (buffer, size, "trace-");
+    while (*level && (cursor < size - 1)) {
+        if (isalnum((unsigned char)*level))
+            buffer[cursor++] = tolower((unsigned char)*level);
+        level += 1;
+    }
+    if (cursor <= 6) return "trace";
+    buffer[cursor] = 0;
+    return buffer;
+}
+
+static int housesaga_saveaction (void *data) {
+
+    static char TraceHeader[] =
+        "TIMESTAMP,HOST,APP,FILE,LINE,LEVEL,OBJECT,DESCRIPTION";
 
+    struct TraceRecord *cursor = TraceHistory + (intptr_t) data;
 
-/* Record a new trace.
+    if (cursor->unsaved) {
+        char buffer[1080];
+        char logtype[32];
+
+        if (cursor->timestamp.tv_sec > TraceSaveLimit) {
+            TraceSaveNext = cursor->timestamp.tv_sec;
+            return 0;
+        }
+
+        // When the traces are split per level, save only one log type per
+        // pass, so that each file is opened only once.
+        //
+        const char *type =
+            housesaga_trace_logtype (logtype, sizeof(logtype), cursor->level);
+        if (!TraceSaveType[0]) {
+            snprintf (TraceSaveType, sizeof(TraceSaveType), "%s", type);
+        } else if (strcmp (type, TraceSaveType)) {
+            TraceSaveMore = 1;
+            return 1; // Left for another pass.
+        }
+
+        snprintf (buffer, sizeof(buffer), "%lld.%03d,%s,%s,%s,%d,%s,%s,\"%s\"",
+                  (long long)(cursor->timestamp.tv_sec),
+                  (int)(cursor->timestamp.tv_usec / 1000),
+                  cursor->host,
+                  cursor->app,
+                  cursor->file,
+                  cursor->line,
+                  cursor->level,
+                  cursor->object,
+                  cursor->description);
+        housesaga_storage_save (type, cursor->timestamp.tv_sec,
+                                TraceHeader, buffer);
+        housesaga_latency_record (LatencyTraceResidency, cursor->arrival);
+        cursor->unsaved = 0;
+    }
+    return 1;
+}
+
+static void housesaga_trace_save (int full) {
+
+    time_t now = time(0);
+
+    // Same logic as for events: delay storing recent traces, to give
+    // time for the sources to flush their own buffers, unless the trace
+    // buffer is full.
+    //
+    TraceSaveLimit = full ? now + 2 : now - TRACE_SAVE_DELAY;
+
+    do {
+        TraceSaveNext = 0;
+        TraceSaveType[0] = 0;
+        TraceSaveMore = 0;
+        if (TraceLastSaved) {
+            echttp_sorted_ascending_from (TraceChronology,
+                                          TraceLastSaved * 1000,
+                                          housesaga_saveaction);
+        } else {
+            echttp_sorted_ascending (TraceChronology, housesaga_saveaction);
+        }
+    } while (TraceSaveMore);
+    housesaga_storage_flush();
+    TraceLastSaved = full ? now : TraceSaveLimit;
+}
+
+/* Free the slot at the cursor, where the next record will be stored.
+ */
+static void housesaga_trace_release (void) {
+
+    struct TraceRecord *cursor = TraceHistory + TraceCursor;
+    if (cursor->timestamp.tv_sec) {
+        if (cursor->unsaved) {
+            housesaga_trace_save(1); // Save before erased.
+            TraceForcedSaves += 1;
+        }
+
+        echttp_sorted_remove (TraceChronology,
+                              housesaga_timestamp2key (&(cursor->timestamp)),
+                              (void *)((long)TraceCursor));
+        cursor->timestamp.tv_sec = 0;
+    }
+}
+
+/* Map the live buffer and restore the records from the previous run.
+ * This is called on the first use, which may happen before this module
+ * is initialized.
+ */
+static void housesaga_trace_live (void) {
+
+    int i;
+    int latest = -1;
+
+    TraceHistory = housesaga_live_map ("trace", sizeof(struct TraceRecord),
+                                       HISTORY_DEPTH, &TraceLive);
+    if (!TraceChronology) TraceChronology = echttp_sorted_new();
+
+    for (i = 0; i < HISTORY_DEPTH; ++i) {
+        struct TraceRecord *cursor = TraceHistory + i;
+        if (!cursor->timestamp.tv_sec) continue;
+        cursor->arrival = housesaga_latency_now();
+        echttp_sorted_add (TraceChronology,
+                           housesaga_timestamp2key (&(cursor->timestamp)),
+                           (void *)((long)i));
+        if (cursor->id > TraceLatestId) {
+            TraceLatestId = cursor->id;
+            latest = i;
+        }
+        TraceRestored += 1;
+    }
+    if (latest < 0) return; // Nothing restored.
+
+    TraceCursor = latest + 1;
+    if (TraceCursor >= HISTORY_DEPTH) TraceCursor = 0;
+    housesaga_trace_release ();
+}
+
+/* Record a new trace to the live buffer.
  * Such a trace might have been received from a client service,
  * or may be of a local  origin (see function houselog_trace() below).
  */
@@ -83,16 +332,377 @@ static void housesaga_trace_new (const struct timeval *timestamp,
                                  const char *object,
                                  const char *text) {
 
-    static char TraceHeader[] =
-        "TIMESTAMP,HOST,APP,FILE,LINE,LEVEL,OBJECT,DESCRIPTION";
+    if (!TraceHistory) housesaga_trace_live ();
+
+    struct TraceRecord *cursor = TraceHistory + TraceCursor;
+
+    if (TraceLatestId == 0) {
+        // Seed the latest trace ID based on the current time.
+        // This makes it random enough to make its value change after
+        // a restart.
+        TraceLatestId = (long long) (time(0) & 0xfffff);
+    }
+    TraceLatestId += 1;
+
+    housesaga_live_begin (TraceLive, TraceCursor);
+    cursor->timestamp = *timestamp;
+    cursor->id = TraceLatestId;
+    cursor->arrival = housesaga_latency_now();
+    cursor->line = line;
+    safecpy (cursor->host, host, sizeof(cursor->host));
+    safecpy (cursor->app, app, sizeof(cursor->app));
+    safecpy (cursor->file, file, sizeof(cursor->file));
+    safecpy (cursor->level, level, sizeof(cursor->level));
+    safecpy (cursor->object, object, sizeof(cursor->object));
+    safecpy (cursor->description, text, sizeof(cursor->description));
+    cursor->unsaved = 1;
+    housesaga_live_end (TraceLive);
+    housesaga_schedule (timestamp->tv_sec + TRACE_SAVE_DELAY,
+                        housesaga_trace_background);
+
+    echttp_sorted_add (TraceChronology,
+                       housesaga_timestamp2key (&(cursor->timestamp)),
+                       (void *)((long)TraceCursor));
+
+    if (timestamp->tv_sec < TraceLastSaved) {
+        // Hoops: we got a late trace from a distant past. We need
+        // to make sure it will be saved, even if out of order.
+        TraceLastSaved = timestamp->tv_sec;
+        TraceRewinds += 1;
+    }
+
+    TraceCursor += 1;
+    if (TraceCursor >= HISTORY_DEPTH) TraceCursor = 0;
+
+    housesaga_trace_release ();
+}
+
+/* The trace flood protection.
+ */
+struct TraceRate {
+    const char *level; // 0 for the default.
+    int rate;
+};
+
+#define TRACE_RATE_MAX 16
+static struct TraceRate TraceRates[TRACE_RATE_MAX] = {{0, 0}};
+static int TraceRateCount = 1;
+
+struct TraceSource {
+    char host[128];
+    char app[128];
+    char level[16];
+    time_t used;         // Time of the last trace from this source.
+    int rate;            // Traces per second, 0 means no limit.
+    double tokens;
+    time_t refilled;
+    int limited;         // Traces dropped since the last summary.
+    time_t firstlimited;
+    unsigned int signature; // Of the last trace accepted.
+    int repeated;        // Identical traces dropped since the last summary.
+    struct timeval firstrepeat;
+    struct timeval lastrepeat;
+    char file[64];
+    int line;
+    char object[32];
+    char text[512];
+};
+
+#define TRACE_SOURCE_MAX 251 // Prime.
+static struct TraceSource TraceSources[TRACE_SOURCE_MAX];
+static int TraceSourceCount = 0;
+static int TracePendingSummaries = 0;
+
+#define TRACE_SUMMARY_PERIOD 10
+#define TRACE_SOURCE_IDLE (3 * TRACE_SUMMARY_PERIOD)
+
+// The fields are saved truncated to the size of their buffer, so they are
+// hashed and compared only up to that size.
+//
+static unsigned int housesaga_trace_hash (const char *s, int size,
+                                          unsigned int hash) {
+    while (*s && (--size > 0)) hash = (hash * 31) + (unsigned char)(*(s++));
+    return (hash * 31) + 1; // Separator between fields.
+}
+
+static unsigned int housesaga_trace_sourcehash (const char *host,
+                                                const char *app,
+                                                const char *level) {
+    const struct TraceSource *source = TraceSources;
+    unsigned int hash = housesaga_trace_hash (host, sizeof(source->host), 0);
+    hash = housesaga_trace_hash (app, sizeof(source->app), hash);
+    hash = housesaga_trace_hash (level, sizeof(source->level), hash);
+    return hash % TRACE_SOURCE_MAX;
+}
+
+/* Forget the sources that have been idle for a while and have no summary
+ * pending. The remaining sources are moved back to their hash position.
+ * Return the number of sources forgotten.
+ */
+static int housesaga_trace_forget (time_t now) {
+
+    int i;
+    int kept = 0;
+    struct TraceSource *active =
+        malloc (TraceSourceCount * sizeof(struct TraceSource));
+    if (!active) return 0;
+
+    for (i = 0; i < TRACE_SOURCE_MAX; ++i) {
+        struct TraceSource *source = TraceSources + i;
+        if (!source->host[0]) continue;
+        if ((source->used + TRACE_SOURCE_IDLE < now) &&
+            (!source->repeated) && (!source->limited)) continue;
+        active[kept++] = *source;
+    }
+    int forgotten = TraceSourceCount - kept;
+    if (forgotten > 0) {
+        memset (TraceSources, 0, sizeof(TraceSources));
+        for (i = 0; i < kept; ++i) {
+            int slot = housesaga_trace_sourcehash
+                           (active[i].host, active[i].app, active[i].level);
+            while (TraceSources[slot].host[0])
+                slot = (slot + 1) % TRACE_SOURCE_MAX;
+            TraceSources[slot] = active[i];
+        }
+        TraceSourceCount = kept;
+    }
+    free (active);
+    return forgotten;
+}
+
+static int housesaga_trace_rate (const char *level) {
+    int i;
+    int rate = 0;
+    for (i = 0; i < TraceRateCount; ++i) {
+        if (!TraceRates[i].level) {
+            rate = TraceRates[i].rate;
+        } else if (!strcasecmp (TraceRates[i].level, level)) {
+            return TraceRates[i].rate;
+        }
+    }
+    return rate;
+}
+
+static struct TraceSource *housesaga_trace_source (const char *host,
+                                                   const char *app,
+                                                   const char *level) {
+
+    time_t now = time(0);
+    unsigned int hash = housesaga_trace_sourcehash (host, app, level);
+
+    int i;
+    for (i = hash; TraceSources[i].host[0]; i = (i + 1) % TRACE_SOURCE_MAX) {
+        struct TraceSource *source = TraceSources + i;
+        if (strncmp (source->level, level, sizeof(source->level) - 1)) continue;
+        if (strncmp (source->app, app, sizeof(source->app) - 1)) continue;
+        if (strncmp (source->host, host, sizeof(source->host) - 1)) continue;
+        source->used = now;
+        return source;
+    }
+    // Keep one slot empty to end the searches.
+    if (TraceSourceCount >= TRACE_SOURCE_MAX - 1) {
+        if (!housesaga_trace_forget (now)) return 0;
+        for (i = hash; TraceSources[i].host[0]; i = (i + 1) % TRACE_SOURCE_MAX) ;
+    }
+    TraceSourceCount += 1;
+
+    struct TraceSource *source = TraceSources + i;
+    safecpy (source->host, host, sizeof(source->host));
+    safecpy (source->app, app, sizeof(source->app));
+    safecpy (source->level, level, sizeof(source->level));
+    source->rate = housesaga_trace_rate (level);
+    source->tokens = source->rate * TRACE_SUMMARY_PERIOD;
+    source->refilled = now;
+    source->used = now;
+    source->limited = 0;
+    source->signature = 0;
+    source->repeated = 0;
+    return source;
+}
+
+static void housesaga_trace_repeats (struct TraceSource *source) {
+
+    char text[128];
+
+    if (!source->repeated) return;
 
-    char buffer[1080];
+    snprintf (text, sizeof(text),
+              "suppressed %d identical traces", source->repeated);
+    housesaga_trace_new (&(source->lastrepeat),
+                         source->host, source->app,
+                         source->file, source->line,
+                         source->level, source->object, text);
+    source->repeated = 0;
+    TracePendingSummaries -= 1;
+}
+
+static void housesaga_trace_limits (struct TraceSource *source, time_t now) {
+
+    char text[128];
+    struct timeval timestamp;
+
+    if (!source->limited) return;
+
+    snprintf (text, sizeof(text),
+              "suppressed %d traces (more than %d traces per second)",
+              source->limited, source->rate);
+    timestamp.tv_sec = now;
+    timestamp.tv_usec = 0;
+    housesaga_trace_new (&timestamp, source->host, source->app,
+                         "", 0, source->level, "RATE", text);
+    source->limited = 0;
+    TracePendingSummaries -= 1;
+}
 
-    snprintf (buffer, sizeof(buffer), "%lld.%03d,%s,%s,%s,%d,%s,%s,\"%s\"",
-              (long long)(timestamp->tv_sec), (int)(timestamp->tv_usec / 1000),
-              host, app, file, line, level, object, text);
+/* Return true if this trace is identical to the last trace accepted from
+ * the same source. The signature is only a quick filter: the fields are
+ * compared as saved, i.e. possibly truncated.
+ */
+static int housesaga_trace_same (const struct TraceSource *source,
+                                 unsigned int signature,
+                                 const char *file,
+                                 int line,
+                                 const char *object,
+                                 const char *text) {
 
-    housesaga_storage_save ("trace", timestamp->tv_sec, TraceHeader, buffer);
+    if (signature != source->signature) return 0;
+    if (line != source->line) return 0;
+    if (strncmp (source->file, file, sizeof(source->file) - 1)) return 0;
+    if (strncmp (source->object, object, sizeof(source->object) - 1)) return 0;
+    return !strncmp (source->text, text, sizeof(source->text) - 1);
+}
+
+/* Return true if this trace was already received. This is checked before
+ * the repeated traces are collapsed, since a trace that was sent twice
+ * is not a repetition.
+ */
+static int housesaga_trace_duplicate (const struct timeval *timestamp,
+                                      const char *host,
+                                      const char *app,
+                                      const char *file,
+                                      int line,
+                                      const char *level,
+                                      const char *object,
+                                      const char *text) {
+
+    housesaga_dedup_key key =
+        housesaga_dedup_start ("trace", timestamp, host, app);
+    key = housesaga_dedup_text (key, file);
+    key = housesaga_dedup_integer (key, line);
+    key = housesaga_dedup_text (key, level);
+    key = housesaga_dedup_text (key, object);
+    key = housesaga_dedup_text (key, text);
+    return housesaga_dedup_seen (key);
+}
+
+/* Return true if this trace should be stored. The traces rejected here
+ * will be accounted for in a summary trace.
+ */
+static int housesaga_trace_accept (const struct timeval *timestamp,
+                                   const char *host,
+                                   const char *app,
+                                   const char *file,
+                                   int line,
+                                   const char *level,
+                                   const char *object,
+                                   const char *text) {
+
+    if (!host[0]) return 1; // Empty host names are not tracked.
+
+    struct TraceSource *source = housesaga_trace_source (host, app, level);
+    if (!source) return 1; // Too many sources: no protection.
+
+    char number[16];
+    snprintf (number, sizeof(number), "%d", line);
+    unsigned int signature =
+        housesaga_trace_hash (file, sizeof(source->file), 0);
+    signature = housesaga_trace_hash (number, sizeof(number), signature);
+    signature = housesaga_trace_hash (object, sizeof(source->object), signature);
+    signature = housesaga_trace_hash (text, sizeof(source->text), signature);
+
+    int repeat = housesaga_trace_same (source, signature, file, line, object, text);
+
+    // A repetition that stopped for a whole period is reported again
+    // (the next occurrence is stored).
+    if (repeat && source->lastrepeat.tv_sec) {
+        if (timestamp->tv_sec >= source->lastrepeat.tv_sec + TRACE_SUMMARY_PERIOD)
+            repeat = 0;
+    }
+    if (repeat) {
+        if (!source->repeated) {
+            TracePendingSummaries += 1;
+            source->firstrepeat = *timestamp;
+            housesaga_schedule (timestamp->tv_sec + TRACE_SUMMARY_PERIOD,
+                                housesaga_trace_background);
+        }
+        source->repeated += 1;
+        source->lastrepeat = *timestamp;
+        housesaga_traffic_increment (TrafficTracesCollapsed);
+        return 0;
+    }
+    time_t now = time(0);
+    housesaga_trace_repeats (source);
+
+    if (source->rate > 0) {
+        if (now > source->refilled) {
+            source->tokens += (now - source->refilled) * source->rate;
+            if (source->tokens > source->rate * TRACE_SUMMARY_PERIOD)
+                source->tokens = source->rate * TRACE_SUMMARY_PERIOD;
+            source->refilled = now;
+        }
+        if (source->tokens < 1) {
+            if (!source->limited) {
+                source->firstlimited = now;
+                TracePendingSummaries += 1;
+                housesaga_schedule (now + TRACE_SUMMARY_PERIOD,
+                                    housesaga_trace_background);
+            }
+            source->limited += 1;
+            housesaga_traffic_increment (TrafficTracesLimited);
+            return 0;
+        }
+        source->tokens -= 1;
+    }
+
+    source->signature = signature;
+    safecpy (source->file, file, sizeof(source->file));
+    source->line = line;
+    safecpy (source->object, object, sizeof(source->object));
+    safecpy (source->text, text, sizeof(source->text));
+    source->lastrepeat.tv_sec = 0;
+    return 1;
+}
+
+/* Record the pending summaries that have been delayed long enough.
+ * Return the time when the next pending summary will be due, or 0 if none.
+ */
+static time_t housesaga_trace_summarize (time_t now) {
+
+    if (TracePendingSummaries <= 0) return 0;
+
+    time_t next = 0;
+    int i;
+    for (i = 0; i < TRACE_SOURCE_MAX; ++i) {
+        struct TraceSource *source = TraceSources + i;
+        if (source->repeated) {
+            // A summary every period for as long as the repetition lasts.
+            time_t due = source->firstrepeat.tv_sec + TRACE_SUMMARY_PERIOD;
+            if (due <= now) {
+                housesaga_trace_repeats (source);
+            } else if ((!next) || (due < next)) {
+                next = due;
+            }
+        }
+        if (source->limited) {
+            time_t due = source->firstlimited + TRACE_SUMMARY_PERIOD;
+            if (due <= now) {
+                housesaga_trace_limits (source, now);
+            } else if ((!next) || (due < next)) {
+                next = due;
+            }
+        }
+    }
+    return next;
 }
 
 /* Local clone for the houselog.c API.
@@ -115,7 +725,95 @@ void houselog_trace (const char *file, int line, const char *level,
 
     housesaga_trace_new (&timestamp, housesaga_host(), "saga",
                          file, line, level, object, text);
-    housesaga_storage_flush ();
+}
+
+static int housesaga_trace_getheader (char *buffer, int size) {
+
+    echttp_content_type_json ();
+    return snprintf (buffer, size,
+                    "{\"host\":\"%s\",\"proxy\":\"%s\",\"apps\":[\"%s\"],"
+                        "\"timestamp\":%lld,\"latest\":%lld,\"%s\":{\"invert\":true,\"latest\":%lld",
+                    housesaga_host(), housesaga_portal(), LogAppName,
+                    (long long)time(0), TraceLatestId,
+                    LogAppName, TraceLatestId);
+}
+
+static char WebFormatBuffer[128+HISTORY_DEPTH*(sizeof(struct TraceRecord)+32)] = {0};
+static int WebFormatLength = 0;
+static const char *WebFormatPrefix = "";
+static time_t WebFormatSinceSec = 0;
+static int WebFormatSinceUSec = 0;
+
+static int housesaga_webaction (void *data) {
+
+    int size = sizeof(WebFormatBuffer) - 4; // Need room to complete the JSON.
+
+    struct TraceRecord *cursor = TraceHistory + (intptr_t) data;
+
+    if (!(cursor->timestamp.tv_sec)) return 1;
+
+    // Stop when the time limit, if any, was reached.
+    //
+    if (cursor->timestamp.tv_sec <= WebFormatSinceSec) {
+        if (cursor->timestamp.tv_sec < WebFormatSinceSec) return 0;
+        if (cursor->timestamp.tv_usec < WebFormatSinceUSec) return 0;
+    }
+
+    int wrote = snprintf (WebFormatBuffer+WebFormatLength, size-WebFormatLength,
+                          "%s[%lld%03d,\"%s\",%d,\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",%lld]",
+                          WebFormatPrefix,
+                          (long long)(cursor->timestamp.tv_sec),
+                          (int)(cursor->timestamp.tv_usec/1000),
+                          cursor->file,
+                          cursor->line,
+                          cursor->level,
+                          cursor->object,
+                          cursor->description,
+                          cursor->host,
+                          cursor->app,
+                          cursor->id);
+    WebFormatPrefix = ",";
+
+    if (WebFormatLength + wrote >= size) {
+        WebFormatBuffer[WebFormatLength] = 0;
+        return 0;
+    }
+    WebFormatLength += wrote;
+    return 1;
+}
+
+static const char *housesaga_webget (void) {
+
+    const char *known = echttp_parameter_get("known");
+    if (known && (atoll (known) == TraceLatestId)) {
+        echttp_error (304, "Not Modified");
+        return "";
+    }
+
+    const char *since = echttp_parameter_get("since");
+
+    if (since) {
+        long long sincevalue = atoll(since);
+        WebFormatSinceSec = (time_t)(sincevalue / 1000);
+        WebFormatSinceUSec = (int)((sincevalue % 1000) * 1000);
+    } else {
+        WebFormatSinceSec = 0;
+        WebFormatSinceUSec = 0;
+    }
+
+    echttp_content_type_json ();
+
+    WebFormatLength = housesaga_trace_getheader (WebFormatBuffer,
+                                                sizeof(WebFormatBuffer));
+    WebFormatLength += snprintf (WebFormatBuffer+WebFormatLength,
+                                 sizeof(WebFormatBuffer)-WebFormatLength,
+                                 ",\"traces\":[");
+
+    WebFormatPrefix = "";
+    echttp_sorted_descending(TraceChronology, housesaga_webaction);
+    snprintf (WebFormatBuffer+WebFormatLength,
+              sizeof(WebFormatBuffer)-WebFormatLength, "]}}");
+    return WebFormatBuffer;
 }
 
 /* Decode a report of traces from a source client.
@@ -123,98 +821,137 @@ void houselog_trace (const char *file, int line, const char *level,
  * by these sources. Sharing the same format reduces the amount of
  * code on the source side.
  */
-static const char *housesaga_getjsonstring (ParserToken *parsed,
-                                            const char *path) {
-    int item = echttp_json_search(parsed, path);
-    if (item < 0) return 0;
-    if (parsed[item].type != PARSER_STRING) return 0;
-    return parsed[item].value.string;
-}
+static void housesaga_trace_apply (const struct HouseSagaBatch *batch) {
+
+    int source = housesaga_source_batch
+                     (batch->host, batch->app, HOUSESAGA_SOURCE_TRACE);
 
-static struct timeval housesaga_getjsontime (ParserToken *parsed,
-                                             const char *path) {
-    struct timeval result = {0, 0};
-    int item = echttp_json_search(parsed, path);
-    if (item < 0) return result;
-    if (parsed[item].type != PARSER_INTEGER) return result;
-    result.tv_sec = parsed[item].value.integer / 1000;
-    result.tv_usec = (parsed[item].value.integer % 1000) * 1000;
-    return result;
+    int i;
+    for (i = 0; i < batch->count; ++i) {
+        const struct HouseSagaRecord *record = batch->record + i;
+        const struct timeval *timestamp = &(record->timestamp);
+        const char *file = record->text[1];
+        int line = (int)(record->integer[2]);
+        const char *level = record->text[3];
+        const char *object = record->text[4];
+        const char *text = record->text[5];
+        if (timestamp->tv_sec && file && line && level && object && text) {
+            housesaga_source_record (source, timestamp);
+            if (!strcasecmp (level, "TEST")) { // Skip "TEST" traces.
+                housesaga_traffic_increment (TrafficTracesIgnored);
+            } else if (housesaga_trace_duplicate (timestamp,
+                                                  batch->host, batch->app,
+                                                  file, line, level,
+                                                  object, text)) {
+                housesaga_traffic_increment (TrafficTracesDuplicate);
+            } else if (housesaga_trace_accept (timestamp,
+                                               batch->host, batch->app,
+                                               file, line, level,
+                                               object, text)) {
+                housesaga_trace_new (timestamp, batch->host, batch->app,
+                                     file, line, level, object, text);
+                housesaga_traffic_increment (TrafficTracesStored);
+            }
+        }
+    }
 }
 
-static int housesaga_getjsonint (ParserToken *parsed, const char *path) {
-    int item = echttp_json_search(parsed, path);
-    if (item < 0) return 0;
-    if (parsed[item].type != PARSER_INTEGER) return 0;
-    return (int)(parsed[item].value.integer);;
+static const char *housesaga_webpost (const char *data, int length) {
+
+    echttp_content_type_json ();
+    housesaga_parser_submit (ParserTraces, data, length);
+    return "";
 }
 
 static const char *housesaga_webtraces (const char *method, const char *uri,
                                         const char *data, int length) {
 
-    static ParserToken *TraceParsed = 0;
-    static int   TraceTokenAllocated = 0;
-    static char *TraceBuffer = 0;
+    if (!strcmp (method, "GET")) {
+        return housesaga_webget ();
+    } else { // Assume POST, PUT or anything with data.
+        return housesaga_webpost (data, length);
+    }
+}
 
-    if (strcmp (method, "POST")) return ""; // Only POST is supported.
+static void housesaga_trace_ratelimit (const char *option) {
 
-    if (TraceBuffer) free (TraceBuffer);
-    TraceBuffer = strdup (data);
+    struct TraceRate *rate = TraceRates; // Default.
 
-    int count = echttp_json_estimate(data);
-    if (count > TraceTokenAllocated) {
-        if (TraceParsed) free (TraceParsed);
-        TraceTokenAllocated = count;
-        TraceParsed = calloc (count, sizeof(ParserToken));
+    const char *separator = strchr (option, ':');
+    if (separator) {
+        if (TraceRateCount >= TRACE_RATE_MAX) return;
+        rate = TraceRates + (TraceRateCount++);
+        rate->level = strndup (option, separator - option);
+        option = separator + 1;
     }
-    const char *error = echttp_json_parse (TraceBuffer, TraceParsed, &count);
-    if (error) return ""; // Ignore bad data from applications.
+    rate->rate = atoi(option);
+    if (rate->rate < 0) rate->rate = 0;
+}
 
-    // TBD: decode JSON, register traces.
-    const char *host = housesaga_getjsonstring (TraceParsed, ".host");
-    const char *app = housesaga_getjsonstring (TraceParsed, ".apps[0]");
-    if (!host || !app) return "";
+void housesaga_trace_initialize (int argc, const char **argv) {
 
-    char path[128];
-    snprintf (path, sizeof(path), ".%s.traces", app);
-    int traces = echttp_json_search(TraceParsed, path);
-    if (TraceParsed[traces].type != PARSER_ARRAY) return "";
+    TrafficTracesStored = housesaga_traffic_register ("TracesStored");
+    TrafficTracesIgnored = housesaga_traffic_register ("TracesIgnored");
+    TrafficTracesCollapsed = housesaga_traffic_register ("TracesCollapsed");
+    TrafficTracesLimited = housesaga_traffic_register ("TracesLimited");
+    TrafficTracesDuplicate = housesaga_traffic_register ("TracesDuplicate");
+    ParserTraces = housesaga_parser_register
+                       ("parse:trace", "traces", housesaga_trace_apply);
+    LatencyTraceResidency = housesaga_latency_register ("residency:trace");
 
     int i;
-    for (i = 0; i < TraceParsed[traces].length; ++i) {
-        char path[128];
-        snprintf (path, sizeof(path), "[%d]", i);
-        int trace = echttp_json_search(TraceParsed+traces, path);
-        if (trace < 0) break;
-        trace += traces;
-        struct timeval timestamp = housesaga_getjsontime (TraceParsed+trace, "[0]");
-        const char *file = housesaga_getjsonstring (TraceParsed+trace, "[1]");
-        int line = housesaga_getjsonint (TraceParsed+trace, "[2]");
-        const char *level = housesaga_getjsonstring (TraceParsed+trace, "[3]");
-        const char *object = housesaga_getjsonstring (TraceParsed+trace, "[4]");
-        const char *text = housesaga_getjsonstring (TraceParsed+trace, "[5]");
-        if (timestamp.tv_sec && file && line && level && object && text) {
-            if (strcasecmp (level, "TEST")) {
-                housesaga_trace_new (&timestamp, host, app,
-                                     file, line, level, object, text);
-                housesaga_traffic_increment ("TracesStored");
-            } else { // Skip "TEST" traces.
-                housesaga_traffic_increment ("TracesIgnored");
-            }
+    const char *option;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match("-trace-rate=", argv[i], &option)) {
+            housesaga_trace_ratelimit (option);
+            continue;
+        }
+        if (echttp_option_present("-trace-split", argv[i])) {
+            TraceSplit = 1;
+            continue;
         }
     }
-    housesaga_storage_flush ();
-
-    return "";
-}
 
-void housesaga_trace_initialize (int argc, const char **argv) {
+    if (!TraceHistory) housesaga_trace_live ();
 
-    echttp_route_uri ("/saga/log/traces", housesaga_webtraces);
+    housesaga_latency_route ("/saga/log/traces", housesaga_webtraces);
 
     // Alternate path for application-independent web pages.
     // (The log files are stored at the same place for all applications.)
     //
-    echttp_route_uri ("/log/traces", housesaga_webtraces);
+    housesaga_latency_route ("/log/traces", housesaga_webtraces);
 }
 
+void housesaga_trace_health (ParserContext context, int parent) {
+
+    int i;
+    int used = 0;
+    int unsaved = 0;
+    for (i = 0; i < HISTORY_DEPTH; ++i) {
+        if (!TraceHistory[i].timestamp.tv_sec) continue;
+        used += 1;
+        if (TraceHistory[i].unsaved) unsaved += 1;
+    }
+    int item = echttp_json_add_object (context, parent, 0);
+    echttp_json_add_string (context, item, "name", "trace");
+    echttp_json_add_integer (context, item, "depth", HISTORY_DEPTH);
+    echttp_json_add_integer (context, item, "used", used);
+    echttp_json_add_integer (context, item, "unsaved", unsaved);
+    echttp_json_add_integer (context, item, "forced", TraceForcedSaves);
+    echttp_json_add_integer (context, item, "rewinds", TraceRewinds);
+    echttp_json_add_integer (context, item, "restored", TraceRestored);
+    echttp_json_add_bool (context, item, "persistent", TraceLive->persistent);
+    echttp_json_add_integer (context, item, "memory", HISTORY_DEPTH * sizeof(struct TraceRecord) + sizeof(TraceSources));
+}
+
+void housesaga_trace_background (time_t now) {
+
+    time_t next = housesaga_trace_summarize (now);
+    if (next) housesaga_schedule (next, housesaga_trace_background);
+
+    housesaga_trace_save (0);
+    if (TraceSaveNext)
+        housesaga_schedule (TraceSaveNext + TRACE_SAVE_DELAY,
+                            housesaga_trace_background);
+}
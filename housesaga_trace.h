@@ -23,3 +23,6 @@
 
 void housesaga_trace_initialize (int argc, const char **argv);
 
+void housesaga_trace_health (ParserContext context, int parent);
+
+void housesaga_trace_background (time_t now);
@@ -27,20 +27,28 @@
  *
  * void housesaga_traffic_initialize (int argc, const char **argv);
  *
- *    Initialize the environment required to calculate traffic rates. This
- *    must be the first function that the application calls.
+ *    Initialize the environment required to calculate traffic rates.
  *
- * void housesaga_traffic_increment (const char *id);
+ * int housesaga_traffic_register (const char *id);
  *
- *    Record new traffic.
+ *    Declare a new traffic counter and return its handle. This is done
+ *    once, typically when the caller module is initialized. Return -1
+ *    if there is no more room for new counters.
+ *
+ * void housesaga_traffic_increment (int handle);
+ *
+ *    Record new traffic. This only updates the current buckets, based
+ *    on the time recorded by the last call to the background function.
  *
  * void housesaga_traffic_background (time_t now);
  *
- *    Periodic cleanup of the traffic rate data.
+ *    Advance the current time and cleanup the buckets that are reused.
  *
  * NOTE:
  *
- *    The rates represent 10 seconds of activity.
+ *    Each counter keeps a total since startup, plus 3 rings of buckets:
+ *    60 seconds, 60 minutes and 24 hours. The "value" reported is the
+ *    activity during the last 10 seconds, for compatibility.
  */
 
 #include <unistd.h>
@@ -62,52 +70,75 @@
 
 #include "housesaga.h"
 #include "housesaga_traffic.h"
+#include "housesaga_latency.h"
 
 #define SAGASTAT_PERIOD 10
+
+#define SAGASTAT_SECONDS 60
+#define SAGASTAT_MINUTES 60
+#define SAGASTAT_HOURS   24
+
 struct SagaStat {
     const char *id;
-    long values[SAGASTAT_PERIOD];
-    time_t cleanup;
+    long long total;
+    long seconds[SAGASTAT_SECONDS];
+    long minutes[SAGASTAT_MINUTES];
+    long hours[SAGASTAT_HOURS];
 };
 
 #define SAGASTAT_MAX 32
 static struct SagaStat SagaValues[SAGASTAT_MAX];
 static int SagaValuesCount = 0;
 
-void housesaga_traffic_cleanup (int i, time_t now) {
-
-    if (SagaValues[i].cleanup > now) return; // Not needed yet.
+// The current time and buckets, as of the last background call.
+static time_t SagaNow = 0;
+static int SagaSecond = 0;
+static int SagaMinute = 0;
+static int SagaHour = 0;
 
-    // Don't walk the array more than once.
-    if (SagaValues[i].cleanup < now - SAGASTAT_PERIOD)
-        SagaValues[i].cleanup = now - SAGASTAT_PERIOD;
+int housesaga_traffic_register (const char *id) {
 
-    for ( ; SagaValues[i].cleanup <= now; SagaValues[i].cleanup += 1) {
-        SagaValues[i].values[SagaValues[i].cleanup%SAGASTAT_PERIOD] = 0;
+    int i;
+    for (i = 0; i < SagaValuesCount; ++i) {
+       if (!strcasecmp (id, SagaValues[i].id)) return i;
     }
+    if (SagaValuesCount >= SAGASTAT_MAX) return -1; // Full.
+    memset (SagaValues + i, 0, sizeof(SagaValues[i]));
+    SagaValues[i].id = id;
+    SagaValuesCount += 1;
+    return i;
 }
 
-void housesaga_traffic_increment (const char *id) {
+void housesaga_traffic_increment (int handle) {
 
-    time_t now = time(0);
+    if ((handle < 0) || (handle >= SagaValuesCount)) return;
+
+    struct SagaStat *stat = SagaValues + handle;
+    stat->total += 1;
+    stat->seconds[SagaSecond] += 1;
+    stat->minutes[SagaMinute] += 1;
+    stat->hours[SagaHour] += 1;
+}
+
+static long housesaga_traffic_sum (const long *buckets, int size,
+                                   int current, int count) {
+    long total = 0;
     int i;
-    for (i = 0; i < SagaValuesCount; ++i) {
-       if (!strcasecmp (id, SagaValues[i].id)) {
-          housesaga_traffic_cleanup (i, now);
-          SagaValues[i].values[now%SAGASTAT_PERIOD] += 1;
-          return;
-       }
+    for (i = 0; i < count; ++i) {
+        total += buckets[(current + size - i) % size];
     }
-    // This is a new traffic item.
-    if (SagaValuesCount >= SAGASTAT_MAX) return; // Full.
-    SagaValuesCount += 1;
-    SagaValues[i].id = id;
-    int j;
-    for (j = 0; j < SAGASTAT_PERIOD; ++j) {
-       SagaValues[i].values[j] = 0;
+    return total;
+}
+
+static void housesaga_traffic_trend (ParserContext context, int parent,
+                                     const char *name, const long *buckets,
+                                     int size, int current) {
+    int array = echttp_json_add_array (context, parent, name);
+    int i;
+    for (i = size - 1; i >= 0; --i) { // Oldest first.
+        echttp_json_add_integer
+            (context, array, 0, buckets[(current + size - i) % size]);
     }
-    SagaValues[i].values[now%SAGASTAT_PERIOD] += 1;
-    SagaValues[i].cleanup = now + 1;
 }
 
 static const char *housesaga_traffic_status (const char *method,
@@ -116,11 +147,12 @@ static const char *housesaga_traffic_status (const char *method,
 
     if (strcmp (method, "GET")) return ""; // Only GET is supported.
 
-    static char buffer[65537];
-    ParserToken token[1024];
-    char pool[65537];
+    static char buffer[131072];
+    static ParserToken token[SAGASTAT_MAX * 160];
+    static char pool[65537];
 
-    ParserContext context = echttp_json_start (token, 1024, pool, sizeof(pool));
+    ParserContext context = echttp_json_start (token, SAGASTAT_MAX * 160,
+                                               pool, sizeof(pool));
 
     int root = echttp_json_add_object (context, 0, 0);
     echttp_json_add_string (context, root, "host", housesaga_host());
@@ -131,13 +163,36 @@ static const char *housesaga_traffic_status (const char *method,
     int i;
     for (i = 0; i < SagaValuesCount; ++i) {
         int item = echttp_json_add_object (context, container, 0);
-        echttp_json_add_string (context, item, "id", SagaValues[i].id);
-        int total = SagaValues[i].values[0];
-        int j;
-        for (j = 1; j < SAGASTAT_PERIOD; ++j) {
-            total += SagaValues[i].values[j];
-        }
-        echttp_json_add_integer (context, item, "value", total);
+        const struct SagaStat *stat = SagaValues + i;
+        echttp_json_add_string (context, item, "id", stat->id);
+        echttp_json_add_integer (context, item, "value",
+            housesaga_traffic_sum (stat->seconds, SAGASTAT_SECONDS,
+                                   SagaSecond, SAGASTAT_PERIOD));
+        echttp_json_add_integer (context, item, "total", stat->total);
+
+        // The rate is calculated on the completed seconds only.
+        long completed = housesaga_traffic_sum (stat->seconds, SAGASTAT_SECONDS,
+                                                SagaSecond + SAGASTAT_SECONDS - 1,
+                                                SAGASTAT_SECONDS - 1);
+        echttp_json_add_real (context, item, "rate",
+                              completed / (double)(SAGASTAT_SECONDS - 1));
+
+        echttp_json_add_integer (context, item, "minute",
+            housesaga_traffic_sum (stat->seconds, SAGASTAT_SECONDS,
+                                   SagaSecond, SAGASTAT_SECONDS));
+        echttp_json_add_integer (context, item, "hour",
+            housesaga_traffic_sum (stat->minutes, SAGASTAT_MINUTES,
+                                   SagaMinute, SAGASTAT_MINUTES));
+        echttp_json_add_integer (context, item, "day",
+            housesaga_traffic_sum (stat->hours, SAGASTAT_HOURS,
+                                   SagaHour, SAGASTAT_HOURS));
+
+        housesaga_traffic_trend (context, item, "seconds", stat->seconds,
+                                 SAGASTAT_SECONDS, SagaSecond);
+        housesaga_traffic_trend (context, item, "minutes", stat->minutes,
+                                 SAGASTAT_MINUTES, SagaMinute);
+        housesaga_traffic_trend (context, item, "hours", stat->hours,
+                                 SAGASTAT_HOURS, SagaHour);
     }
 
     const char *error = echttp_json_export (context, buffer, sizeof(buffer));
@@ -149,21 +204,57 @@ static const char *housesaga_traffic_status (const char *method,
     return buffer;
 }
 
-void housesaga_traffic_background (time_t now) {
+/* Clear the buckets between the previous and the current time period.
+ * This never walks a ring more than once, even after a long pause.
+ */
+static void housesaga_traffic_advance (int ring, long previous, long current) {
 
     int i;
-    for (i = 0; i < SagaValuesCount; ++i) {
-        housesaga_traffic_cleanup (i, now);
+    long period;
+    if (current - previous > 60) previous = current - 60;
+
+    for (period = previous + 1; period <= current; ++period) {
+        for (i = 0; i < SagaValuesCount; ++i) {
+            switch (ring) {
+                case 0:
+                    SagaValues[i].seconds[period % SAGASTAT_SECONDS] = 0;
+                    break;
+                case 1:
+                    SagaValues[i].minutes[period % SAGASTAT_MINUTES] = 0;
+                    break;
+                case 2:
+                    SagaValues[i].hours[period % SAGASTAT_HOURS] = 0;
+                    break;
+            }
+        }
     }
 }
 
+void housesaga_traffic_background (time_t now) {
+
+    if (now <= SagaNow) return;
+
+    housesaga_traffic_advance (0, (long)SagaNow, (long)now);
+    if (now / 60 != SagaNow / 60)
+        housesaga_traffic_advance (1, (long)(SagaNow / 60), (long)(now / 60));
+    if (now / 3600 != SagaNow / 3600)
+        housesaga_traffic_advance (2, (long)(SagaNow / 3600), (long)(now / 3600));
+
+    SagaNow = now;
+    SagaSecond = (int)(now % SAGASTAT_SECONDS);
+    SagaMinute = (int)((now / 60) % SAGASTAT_MINUTES);
+    SagaHour = (int)((now / 3600) % SAGASTAT_HOURS);
+}
+
 void housesaga_traffic_initialize (int argc, const char **argv) {
 
-    echttp_route_uri ("/saga/log/traffic", housesaga_traffic_status);
+    housesaga_traffic_background (time(0));
+
+    housesaga_latency_route ("/saga/log/traffic", housesaga_traffic_status);
 
     // Alternate path for application-independent web pages.
     // (The log files are stored at the same place for all applications.)
     //
-    echttp_route_uri ("/log/traffic", housesaga_traffic_status);
+    housesaga_latency_route ("/log/traffic", housesaga_traffic_status);
 }
 
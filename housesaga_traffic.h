@@ -20,6 +20,7 @@
  * housesaga_traffic.h - Provide data traffic information.
  */
 void housesaga_traffic_initialize (int argc, const char **argv);
-void housesaga_traffic_increment (const char *id);
+int  housesaga_traffic_register (const char *id);
+void housesaga_traffic_increment (int handle);
 void housesaga_traffic_background (time_t now);
 
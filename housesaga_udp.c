@@ -0,0 +1,266 @@
+/* housesaga - A log consolidation and storage service.
+ *
+ * Copyright 2019, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * housesaga_udp.c - Receive compact records over UDP.
+ *
+ * This module accepts events, sensor data and traces from small clients
+ * that cannot afford a HTTP request for each measurement.
+ *
+ * SYNOPSYS:
+ *
+ * void housesaga_udp_initialize (int argc, const char **argv);
+ *
+ *    Open the UDP socket if the -udp-port=N option is present. There is
+ *    no UDP socket by default.
+ *
+ * NOTE:
+ *
+ *    Each datagram is text, made of lines separated by a newline. Each
+ *    line is made of fields separated by a tab. The first line identifies
+ *    the source: host name, application name and datagram sequence
+ *    number. Each of the following lines is one record: the record type
+ *    ('E' for event, 'S' for sensor, 'T' for trace), the timestamp in
+ *    milliseconds and then the same fields as in the JSON record.
+ *
+ *    The sequence number is incremented by one for each datagram sent by
+ *    the source, and is used to count lost datagrams.
+ *
+ *    All the pending datagrams are received at once, using recvmmsg().
+ *    The consecutive records of the same type are applied as one batch.
+ *    The fields are decoded in place: the strings point to the receive
+ *    buffers, which are only reused on the next receive.
+ *
+ *    The batches are applied through housesaga_parser_deliver(), which
+ *    first applies the data posted earlier and still being decoded by the
+ *    parser threads: the UDP records are applied in the order they were
+ *    received, relative to the HTTP posts.
+ */
+
+#define _GNU_SOURCE // For recvmmsg().
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+#include "houselog.h"
+
+#include "housesaga.h"
+#include "housesaga_udp.h"
+#include "housesaga_parser.h"
+#include "housesaga_source.h"
+#include "housesaga_traffic.h"
+
+#define UDP_DATAGRAMS 64
+#define UDP_SIZE      2048 // Larger datagrams are truncated and rejected.
+#define UDP_RECORDS   64
+
+static int UdpSocket = -1;
+
+static char UdpBuffer[UDP_DATAGRAMS][UDP_SIZE];
+static struct iovec UdpVector[UDP_DATAGRAMS];
+static struct mmsghdr UdpMessage[UDP_DATAGRAMS];
+
+static struct HouseSagaRecord UdpRecords[UDP_RECORDS];
+static struct HouseSagaBatch  UdpBatch;
+
+static int UdpEvents = -1;
+static int UdpSensor = -1;
+static int UdpTraces = -1;
+
+static int TrafficUdpDatagrams = -1;
+static int TrafficUdpRecords = -1;
+static int TrafficUdpRejected = -1;
+
+static void housesaga_udp_flush (void) {
+    if (UdpBatch.count > 0) housesaga_parser_deliver (&UdpBatch);
+    UdpBatch.count = 0;
+}
+
+/* Split a line into tab-separated fields, in place.
+ * Return the number of fields found.
+ */
+static int housesaga_udp_split (char *line, char **field, int max) {
+
+    int count = 0;
+    while (count < max) {
+        field[count++] = line;
+        line = strchr (line, '\t');
+        if (!line) break;
+        *(line++) = 0;
+    }
+    return count;
+}
+
+static int housesaga_udp_type (const char *code) {
+    if (code[1]) return -1;
+    switch (code[0]) {
+        case 'E': return UdpEvents;
+        case 'S': return UdpSensor;
+        case 'T': return UdpTraces;
+    }
+    return -1;
+}
+
+static void housesaga_udp_record (char *line) {
+
+    char *field[HOUSESAGA_PARSER_FIELDS + 1];
+    int count = housesaga_udp_split (line, field, HOUSESAGA_PARSER_FIELDS + 1);
+
+    int type = (count >= 2) ? housesaga_udp_type (field[0]) : -1;
+    if (type < 0) {
+        housesaga_traffic_increment (TrafficUdpRejected);
+        return;
+    }
+    if ((UdpBatch.count > 0) && (type != UdpBatch.type)) housesaga_udp_flush ();
+    if (UdpBatch.count >= UDP_RECORDS) housesaga_udp_flush ();
+    UdpBatch.type = type;
+
+    // Same layout as a JSON record: the timestamp is item [0].
+    struct HouseSagaRecord *record = UdpRecords + UdpBatch.count;
+    memset (record, 0, sizeof(*record));
+    int i;
+    for (i = 1; i < count; ++i) {
+        char *end;
+        long long integer = strtoll (field[i], &end, 10);
+        if ((end != field[i]) && (*end == 0)) record->integer[i-1] = integer;
+        if (i > 1) record->text[i-1] = field[i];
+    }
+    record->timestamp.tv_sec = record->integer[0] / 1000;
+    record->timestamp.tv_usec = (record->integer[0] % 1000) * 1000;
+    UdpBatch.count += 1;
+
+    housesaga_traffic_increment (TrafficUdpRecords);
+}
+
+static void housesaga_udp_datagram (char *data, int length) {
+
+    if ((length <= 0) || (length >= UDP_SIZE)) {
+        housesaga_traffic_increment (TrafficUdpRejected);
+        return;
+    }
+    data[length] = 0;
+
+    char *next = strchr (data, '\n');
+    if (next) *(next++) = 0;
+
+    char *field[3];
+    if (housesaga_udp_split (data, field, 3) != 3) {
+        housesaga_traffic_increment (TrafficUdpRejected);
+        return;
+    }
+    char *end;
+    unsigned long sequence = strtoul (field[2], &end, 10);
+    if ((!field[0][0]) || (end == field[2]) || *end) {
+        housesaga_traffic_increment (TrafficUdpRejected);
+        return;
+    }
+    housesaga_traffic_increment (TrafficUdpDatagrams);
+    housesaga_source_sequence
+        (housesaga_source_lookup (field[0], field[1]), sequence);
+
+    UdpBatch.host = field[0];
+    UdpBatch.app = field[1];
+    UdpBatch.count = 0;
+
+    while (next) {
+        char *line = next;
+        next = strchr (line, '\n');
+        if (next) *(next++) = 0;
+        if (line[0]) housesaga_udp_record (line); // Ignore empty lines.
+    }
+    housesaga_udp_flush ();
+}
+
+static void housesaga_udp_receive (int fd, int mode) {
+
+    int i;
+    for (i = 0; i < UDP_DATAGRAMS; ++i) {
+        UdpVector[i].iov_base = UdpBuffer[i];
+        UdpVector[i].iov_len = UDP_SIZE;
+        memset (&(UdpMessage[i].msg_hdr), 0, sizeof(UdpMessage[i].msg_hdr));
+        UdpMessage[i].msg_hdr.msg_iov = UdpVector + i;
+        UdpMessage[i].msg_hdr.msg_iovlen = 1;
+    }
+    int count = recvmmsg (fd, UdpMessage, UDP_DATAGRAMS, MSG_DONTWAIT, 0);
+    if (count <= 0) return;
+
+    for (i = 0; i < count; ++i) {
+        if (UdpMessage[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            housesaga_traffic_increment (TrafficUdpRejected);
+            continue;
+        }
+        housesaga_udp_datagram (UdpBuffer[i], UdpMessage[i].msg_len);
+    }
+}
+
+void housesaga_udp_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *port = 0;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-udp-port=", argv[i], &port)) continue;
+    }
+    if (!port) return;
+
+    struct sockaddr_in address;
+    memset (&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(atoi(port));
+
+    UdpSocket = socket (AF_INET, SOCK_DGRAM, 0);
+    if (UdpSocket < 0) {
+        houselog_trace (HOUSE_FAILURE, "UDP",
+                        "cannot create socket: %s", strerror(errno));
+        return;
+    }
+    if (bind (UdpSocket, (struct sockaddr *)(&address), sizeof(address)) < 0) {
+        houselog_trace (HOUSE_FAILURE, "UDP",
+                        "cannot bind to port %s: %s", port, strerror(errno));
+        close (UdpSocket);
+        UdpSocket = -1;
+        return;
+    }
+    fcntl (UdpSocket, F_SETFL, O_NONBLOCK);
+
+    UdpEvents = housesaga_parser_find ("events");
+    UdpSensor = housesaga_parser_find ("sensor");
+    UdpTraces = housesaga_parser_find ("traces");
+    UdpBatch.record = UdpRecords;
+
+    TrafficUdpDatagrams = housesaga_traffic_register ("UdpDatagrams");
+    TrafficUdpRecords = housesaga_traffic_register ("UdpRecords");
+    TrafficUdpRejected = housesaga_traffic_register ("UdpRejected");
+
+    echttp_listen (UdpSocket, 1, housesaga_udp_receive, 0);
+    houselog_trace (HOUSE_INFO, "UDP", "listening on port %s", port);
+}
+